@@ -0,0 +1,263 @@
+/**
+ * allocgroup.c
+ *
+ * PURPOSE: To split the free space of the device into groups that can be
+ *          searched and changed independently, each behind its own lock.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "a5_allocgroup.h"
+#include "a5_freemap.h"
+#include "a5_extents.h"
+#include "a5_buddy.h"
+
+struct ALLOC_GROUP {
+    int first_block;
+    int block_count;
+    int free_count;
+    int rover;                //where the last claim ended, for next fit.
+    uint64_t *free_blocks;    //one bit per block of the group, set when the block is free.
+    ExtentTree *free_extents; //the same free space as merged runs, in device block numbers.
+    Buddy *buddy;             //the free clusters, numbered from the start of the group.
+    pthread_mutex_t lock;
+};
+
+static int inside(AllocGroup *group, int start, int blocks);
+
+AllocGroup *ag_create(int first_block, int block_count, int with_buddy)
+{
+    assert(first_block >= 0);
+    assert(block_count > 0);
+
+    AllocGroup *group = NULL;
+
+    if(first_block >= 0 && block_count > 0)
+    {
+        group = malloc(sizeof(AllocGroup));
+        if(NULL != group)
+        {
+            group->first_block = first_block;
+            group->block_count = block_count;
+            group->rover = first_block;
+            group->free_blocks = malloc(fm_word_count(block_count) * sizeof(uint64_t));
+            group->free_extents = et_create();
+            group->buddy = with_buddy ? buddy_create(block_count) : NULL;
+            pthread_mutex_init(&group->lock, NULL);
+
+            if(NULL == group->free_blocks || NULL == group->free_extents ||
+               (with_buddy && NULL == group->buddy) || ag_reset(group, first_block) != 0)
+            {
+                ag_destroy(group);
+                group = NULL;
+            }
+        }
+    }
+
+    return group;
+}
+
+void ag_destroy(AllocGroup *group)
+{
+    if(NULL != group)
+    {
+        free(group->free_blocks);
+        et_destroy(group->free_extents);
+        buddy_destroy(group->buddy);
+        pthread_mutex_destroy(&group->lock);
+        free(group);
+    }
+}
+
+void ag_lock(AllocGroup *group)
+{
+    assert(NULL != group);
+    pthread_mutex_lock(&group->lock);
+}
+
+void ag_unlock(AllocGroup *group)
+{
+    assert(NULL != group);
+    pthread_mutex_unlock(&group->lock);
+}
+
+int ag_first_block(AllocGroup *group)
+{
+    assert(NULL != group);
+    return group->first_block;
+}
+
+int ag_block_count(AllocGroup *group)
+{
+    assert(NULL != group);
+    return group->block_count;
+}
+
+int ag_free_count(AllocGroup *group)
+{
+    assert(NULL != group);
+    return group->free_count;
+}
+
+int ag_is_free(AllocGroup *group, int block)
+{
+    assert(NULL != group);
+    return fm_is_free(group->free_blocks, group->block_count, block - group->first_block);
+}
+
+int ag_claim(AllocGroup *group, int start, int blocks)
+{
+    assert(NULL != group);
+
+    int local = start - group->first_block;
+    int returned = 0;
+
+    if(!inside(group, start, blocks))
+    {
+        return -1;
+    }
+
+    //the extent tree checks that all of the run is free before anything is changed.
+    if(et_take(group->free_extents, start, blocks) != 0)
+    {
+        return -1;
+    }
+    fm_set_used(group->free_blocks, local, blocks);
+    if(NULL != group->buddy && buddy_take(group->buddy, local, blocks) != 0)
+    {
+        returned = -1;
+    }
+    group->free_count -= blocks;
+    group->rover = start + blocks;
+
+    return returned;
+}
+
+int ag_release(AllocGroup *group, int start, int blocks)
+{
+    assert(NULL != group);
+
+    int local = start - group->first_block;
+    int returned = 0;
+
+    if(!inside(group, start, blocks))
+    {
+        return -1;
+    }
+
+    fm_set_free(group->free_blocks, local, blocks);
+    if(et_add_free(group->free_extents, start, blocks) != 0)
+    {
+        returned = -1;
+    }
+    if(NULL != group->buddy)
+    {
+        buddy_release(group->buddy, local, blocks);
+    }
+    group->free_count += blocks;
+
+    return returned;
+}
+
+int ag_reset(AllocGroup *group, int used_until)
+{
+    assert(NULL != group);
+
+    int used = used_until - group->first_block;
+    int returned = 0;
+
+    if(used < 0)
+    {
+        used = 0;
+    }
+    if(used > group->block_count)
+    {
+        used = group->block_count;
+    }
+
+    fm_init(group->free_blocks, group->block_count);
+    fm_set_used(group->free_blocks, 0, used);
+
+    et_clear(group->free_extents);
+    if(et_add_free(group->free_extents, group->first_block + used, group->block_count - used) != 0)
+    {
+        returned = -1;
+    }
+    if(NULL != group->buddy)
+    {
+        buddy_clear(group->buddy);
+        buddy_release(group->buddy, used, group->block_count - used);
+    }
+    group->free_count = group->block_count - used;
+    group->rover = group->first_block + used;
+
+    return returned;
+}
+
+int ag_best_fit(AllocGroup *group, int blocks, int *start)
+{
+    assert(NULL != group);
+    return et_best_fit(group->free_extents, blocks, start);
+}
+
+int ag_first_fit(AllocGroup *group, int blocks, int from, int *start)
+{
+    assert(NULL != group);
+    return et_first_fit(group->free_extents, blocks, from, start);
+}
+
+int ag_next_fit(AllocGroup *group, int blocks, int *start)
+{
+    assert(NULL != group);
+
+    int length = et_first_fit(group->free_extents, blocks, group->rover, start);
+
+    //nothing after the rover, so wrap around to the start of the group.
+    if(0 == length)
+    {
+        length = et_first_fit(group->free_extents, blocks, group->first_block, start);
+    }
+    return length;
+}
+
+long long ag_search_steps(AllocGroup *group)
+{
+    assert(NULL != group);
+    return et_search_steps(group->free_extents);
+}
+
+int ag_largest(AllocGroup *group, int *start)
+{
+    assert(NULL != group);
+    return et_largest(group->free_extents, start);
+}
+
+int ag_largest_length(AllocGroup *group)
+{
+    assert(NULL != group);
+    return et_largest_length(group->free_extents);
+}
+
+int ag_buddy_find(AllocGroup *group, int order)
+{
+    assert(NULL != group);
+
+    int found = -1;
+
+    if(NULL != group->buddy)
+    {
+        found = buddy_find(group->buddy, order);
+    }
+    return found < 0 ? -1 : found + group->first_block;
+}
+
+//1 if the run [start, start+blocks) lies inside the group.
+static int inside(AllocGroup *group, int start, int blocks)
+{
+    return blocks >= 0 && start >= group->first_block &&
+           start + blocks <= group->first_block + group->block_count;
+}
@@ -0,0 +1,64 @@
+#ifndef _A5_ALLOCGROUP
+#define _A5_ALLOCGROUP
+
+// An allocation group is a stretch of the device with its own free space
+// bookkeeping (free map, extent tree and, for the buddy policy, a
+// buddy allocator) and its own lock, so threads placing files in different
+// groups never wait for each other. Blocks are numbered as on the whole
+// device. None of the functions below lock: the caller holds the group's
+// lock around them.
+
+typedef struct ALLOC_GROUP AllocGroup;
+
+// Create a group for the blocks [first_block, first_block+block_count), all
+// of them free. with_buddy also keeps the free space as buddy clusters.
+// Return NULL on error.
+AllocGroup *ag_create(int first_block, int block_count, int with_buddy);
+
+// Destroy the group, freeing all memory.
+void ag_destroy(AllocGroup *group);
+
+// Take / give back the group's lock.
+void ag_lock(AllocGroup *group);
+void ag_unlock(AllocGroup *group);
+
+// The first block of the group, the number of blocks in it and how many of
+// them are free.
+int ag_first_block(AllocGroup *group);
+int ag_block_count(AllocGroup *group);
+int ag_free_count(AllocGroup *group);
+
+// Return 1 if the block is in the group and free, 0 otherwise.
+int ag_is_free(AllocGroup *group, int block);
+
+// Mark the run [start, start+blocks) as used. The run must be free and inside
+// the group. Return 0 on success, -1 otherwise.
+int ag_claim(AllocGroup *group, int start, int blocks);
+
+// Give the run [start, start+blocks) back. Return 0 on success, -1 on error.
+int ag_release(AllocGroup *group, int start, int blocks);
+
+// Mark the blocks of the group before "used_until" as used and the rest as
+// free, all at once.
+int ag_reset(AllocGroup *group, int used_until);
+
+// Same as et_best_fit, et_first_fit and et_largest, inside the group.
+int ag_best_fit(AllocGroup *group, int blocks, int *start);
+int ag_first_fit(AllocGroup *group, int blocks, int from, int *start);
+int ag_largest(AllocGroup *group, int *start);
+
+// Same as et_largest_length, for the group.
+int ag_largest_length(AllocGroup *group);
+
+// First fit starting at the rover, the block right after the last claim,
+// wrapping around to the start of the group if nothing after it fits.
+int ag_next_fit(AllocGroup *group, int blocks, int *start);
+
+// Number of free runs looked at by the searches in this group so far.
+long long ag_search_steps(AllocGroup *group);
+
+// The start of the smallest free buddy cluster that holds 2^order blocks,
+// or -1 (also when the group has no buddy allocator).
+int ag_buddy_find(AllocGroup *group, int order);
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "a5_multimap.h"
+#include "a5_multimap_typed.h"
+
+// Times the generic multimap against the typed one on the same keys:
+// inserts (about 4 values a key) then lookups, with int keys and values.
+// Usage: bench_mm [number of inserts]
+
+DEFINE_MULTIMAP_ORDERED(IntMap, int, int, MM_COMPARE_NUMBERS, MM_COMPARE_NUMBERS)
+
+static int compare_ints(void *a, void *b) {
+  int *ia = a, *ib = b;
+  return *ia - *ib;
+}
+
+static int compare_values_num_part(void *a, void *b) {
+  Value *va = a, *vb = b;
+  return va->num - vb->num;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  int n = (argc > 1) ? atoi(argv[1]) : 200000;
+  int *keys = malloc(n * sizeof(int));
+  Multimap *mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part);
+  IntMap *im = IntMap_create(MM_NO_MAX_KEYS);
+  long found[2] = {0, 0};
+  double generic[2], typed[2], start;
+
+  if (n <= 0 || NULL == keys || NULL == mm || NULL == im) {
+    printf("Usage: %s [number of inserts > 0]\n", argv[0]);
+    return 1;
+  }
+  srand(1);
+  for (int i = 0; i < n; i++) {
+    keys[i] = rand() % (n / 4 + 1);
+  }
+
+  start = now();
+  for (int i = 0; i < n; i++) {
+    mm_insert_value(mm, &keys[i], i, "x");
+  }
+  generic[0] = now() - start;
+  start = now();
+  for (int i = 0; i < n; i++) {
+    IntMap_insert(im, keys[i], i);
+  }
+  typed[0] = now() - start;
+
+  // looked up backwards, so the order is not the one they went in.
+  start = now();
+  for (int i = n - 1; i >= 0; i--) {
+    found[0] += mm_count_values(mm, &keys[i]);
+  }
+  generic[1] = now() - start;
+  start = now();
+  for (int i = n - 1; i >= 0; i--) {
+    found[1] += IntMap_count_values(im, keys[i]);
+  }
+  typed[1] = now() - start;
+
+  printf("%d inserts, %d keys\n", n, mm_count_keys(mm));
+  printf("         %10s %10s %8s\n", "generic", "typed", "speedup");
+  printf("insert   %9.3fs %9.3fs %7.2fx\n", generic[0], typed[0], generic[0] / typed[0]);
+  printf("lookup   %9.3fs %9.3fs %7.2fx\n", generic[1], typed[1], generic[1] / typed[1]);
+  if (found[0] != found[1] || mm_count_keys(mm) != IntMap_count_keys(im)) {
+    printf("The maps don't agree!\n");
+    return 1;
+  }
+
+  mm_destroy(mm);
+  IntMap_destroy(im);
+  free(keys);
+  return 0;
+}
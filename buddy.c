@@ -0,0 +1,261 @@
+/**
+ * buddy.c
+ *
+ * PURPOSE: To place files in power-of-two clusters of blocks (the buddy system),
+ *          so that freed space coalesces right away instead of waiting for defrag.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "a5_buddy.h"
+
+#define NOT_FREE -1
+
+struct BUDDY {
+    int block_count;
+    int8_t *free_order;  //the order of the free cluster starting at a block, or NOT_FREE.
+    int *next;           //free lists, one per order, linked through the first block of each cluster.
+    int *prev;
+    int heads[BUDDY_MAX_ORDER + 1];
+};
+
+static void push_cluster(Buddy *buddy, int start, int order);
+static void remove_cluster(Buddy *buddy, int start);
+static void release_cluster(Buddy *buddy, int start, int order);
+static int largest_aligned_order(int start, int blocks);
+
+Buddy *buddy_create(int block_count)
+{
+    assert(block_count >= 0);
+    Buddy *buddy = NULL;
+
+    if(block_count >= 0)
+    {
+        buddy = malloc(sizeof(Buddy));
+        if(NULL != buddy)
+        {
+            buddy->block_count = block_count;
+            buddy->free_order = malloc(block_count * sizeof(int8_t) + 1);
+            buddy->next = malloc(block_count * sizeof(int) + 1);
+            buddy->prev = malloc(block_count * sizeof(int) + 1);
+
+            if(NULL == buddy->free_order || NULL == buddy->next || NULL == buddy->prev)
+            {
+                buddy_destroy(buddy);
+                buddy = NULL;
+            }
+            else
+            {
+                buddy_clear(buddy);
+                buddy_release(buddy, 0, block_count);
+            }
+        }
+    }
+
+    return buddy;
+}
+
+void buddy_destroy(Buddy *buddy)
+{
+    if(NULL != buddy)
+    {
+        free(buddy->free_order);
+        free(buddy->next);
+        free(buddy->prev);
+        free(buddy);
+    }
+}
+
+void buddy_clear(Buddy *buddy)
+{
+    assert(NULL != buddy);
+
+    for(int i=0; i < buddy->block_count; i++)
+    {
+        buddy->free_order[i] = NOT_FREE;
+    }
+    for(int k=0; k <= BUDDY_MAX_ORDER; k++)
+    {
+        buddy->heads[k] = -1;
+    }
+}
+
+void buddy_release(Buddy *buddy, int start, int blocks)
+{
+    assert(NULL != buddy);
+    assert(start >= 0 && start + blocks <= buddy->block_count);
+
+    int order;
+
+    //split the run into the largest aligned clusters it is made of.
+    while(blocks > 0)
+    {
+        order = largest_aligned_order(start, blocks);
+        release_cluster(buddy, start, order);
+        start += 1 << order;
+        blocks -= 1 << order;
+    }
+}
+
+int buddy_take(Buddy *buddy, int start, int blocks)
+{
+    assert(NULL != buddy);
+
+    int order, k, head, half;
+
+    while(blocks > 0)
+    {
+        order = largest_aligned_order(start, blocks);
+
+        //find the free cluster this piece lies in.
+        head = -1;
+        for(k=order; k <= BUDDY_MAX_ORDER && head < 0; k++)
+        {
+            int candidate = start & ~((1 << k) - 1);
+            if(candidate < buddy->block_count && buddy->free_order[candidate] == k)
+            {
+                head = candidate;
+            }
+        }
+        if(head < 0)
+        {
+            return -1;
+        }
+        k--;
+
+        //split it down, keeping the halves we don't need free.
+        remove_cluster(buddy, head);
+        while(k > order)
+        {
+            k--;
+            half = 1 << k;
+            if(start >= head + half)
+            {
+                push_cluster(buddy, head, k);
+                head += half;
+            }
+            else
+            {
+                push_cluster(buddy, head + half, k);
+            }
+        }
+        assert(head == start);
+
+        start += 1 << order;
+        blocks -= 1 << order;
+    }
+
+    return 0;
+}
+
+int buddy_find(Buddy *buddy, int order)
+{
+    assert(NULL != buddy);
+    assert(order >= 0);
+
+    for(int k=order; k <= BUDDY_MAX_ORDER; k++)
+    {
+        if(buddy->heads[k] >= 0)
+        {
+            //the first part of a bigger cluster is aligned for any smaller order.
+            return buddy->heads[k];
+        }
+    }
+    return -1;
+}
+
+int buddy_order_for(int blocks)
+{
+    int order = 0;
+
+    while(order < BUDDY_MAX_ORDER && (1 << order) < blocks)
+    {
+        order++;
+    }
+    return order;
+}
+
+int buddy_largest_order(Buddy *buddy)
+{
+    assert(NULL != buddy);
+
+    for(int k=BUDDY_MAX_ORDER; k >= 0; k--)
+    {
+        if(buddy->heads[k] >= 0)
+        {
+            return k;
+        }
+    }
+    return -1;
+}
+
+static void push_cluster(Buddy *buddy, int start, int order)
+{
+    buddy->free_order[start] = order;
+    buddy->prev[start] = -1;
+    buddy->next[start] = buddy->heads[order];
+    if(buddy->heads[order] >= 0)
+    {
+        buddy->prev[buddy->heads[order]] = start;
+    }
+    buddy->heads[order] = start;
+}
+
+static void remove_cluster(Buddy *buddy, int start)
+{
+    int order = buddy->free_order[start];
+    assert(order != NOT_FREE);
+
+    if(buddy->prev[start] >= 0)
+    {
+        buddy->next[buddy->prev[start]] = buddy->next[start];
+    }
+    else
+    {
+        buddy->heads[order] = buddy->next[start];
+    }
+    if(buddy->next[start] >= 0)
+    {
+        buddy->prev[buddy->next[start]] = buddy->prev[start];
+    }
+    buddy->free_order[start] = NOT_FREE;
+}
+
+//frees one aligned cluster, merging it with its buddy for as long as the buddy is free too.
+static void release_cluster(Buddy *buddy, int start, int order)
+{
+    int mate;
+
+    assert(start % (1 << order) == 0);
+
+    while(order < BUDDY_MAX_ORDER)
+    {
+        mate = start ^ (1 << order);
+        if(mate + (1 << order) > buddy->block_count || buddy->free_order[mate] != order)
+        {
+            break;
+        }
+        remove_cluster(buddy, mate);
+        if(mate < start)
+        {
+            start = mate;
+        }
+        order++;
+    }
+    push_cluster(buddy, start, order);
+}
+
+//the largest order k such that start is aligned to 2^k and 2^k <= blocks.
+static int largest_aligned_order(int start, int blocks)
+{
+    int order = 0;
+
+    while(order < BUDDY_MAX_ORDER && (start & (1 << order)) == 0 && (2 << order) <= blocks)
+    {
+        order++;
+    }
+    return order;
+}
@@ -0,0 +1,41 @@
+#ifndef _A5_BUDDY
+#define _A5_BUDDY
+
+// The buddy allocator keeps free space as power-of-two clusters of blocks,
+// each aligned to its own size. A cluster of 2^order blocks starting at "b"
+// has its buddy at b ^ 2^order; when both are free they are merged into one
+// cluster of the next order, so freeing coalesces in O(log n).
+
+#define BUDDY_MAX_ORDER 30
+
+typedef struct BUDDY Buddy;
+
+// Create a buddy allocator for block_count blocks, all of them free.
+// Return NULL on error.
+Buddy *buddy_create(int block_count);
+
+// Destroy the allocator, freeing all memory.
+void buddy_destroy(Buddy *buddy);
+
+// Mark every block as used (nothing free).
+void buddy_clear(Buddy *buddy);
+
+// Give the run [start, start+blocks) back, merging clusters with their buddies.
+void buddy_release(Buddy *buddy, int start, int blocks);
+
+// Take the run [start, start+blocks) out of the free clusters, splitting the
+// clusters it lies in. Return 0 on success, -1 if part of the run isn't free.
+int buddy_take(Buddy *buddy, int start, int blocks);
+
+// Find a free cluster that can hold 2^order blocks, using the smallest one
+// available. Return the first block of it (aligned to 2^order) without
+// taking it, or -1 if there is none.
+int buddy_find(Buddy *buddy, int order);
+
+// The smallest order whose cluster holds at least "blocks" blocks.
+int buddy_order_for(int blocks);
+
+// The order of the largest free cluster, or -1 if nothing is free.
+int buddy_largest_order(Buddy *buddy);
+
+#endif
@@ -0,0 +1,562 @@
+/**
+ * extents.c
+ *
+ * PURPOSE: To keep the free space of the device as a set of extents, stored
+ *          in two AVL trees that share their nodes: one ordered by the
+ *          starting block and one ordered by length. The tree by start also
+ *          keeps the longest extent under each node, for first fit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "a5_extents.h"
+
+//which of the two trees a link or height belongs to.
+#define BY_START 0
+#define BY_LENGTH 1
+
+typedef struct EXTENT_NODE {
+    int start;
+    int length;
+    struct EXTENT_NODE *left[2];
+    struct EXTENT_NODE *right[2];
+    int height[2];
+    int max_length; //the longest extent in this node's subtree of the tree by start.
+} ExtentNode;
+
+struct EXTENT_TREE {
+    ExtentNode *root[2];
+    int count;
+    long long search_steps;
+};
+
+static int compare_nodes(ExtentNode *a, ExtentNode *b, int t);
+static int height(ExtentNode *node, int t);
+static void update_height(ExtentNode *node, int t);
+static ExtentNode *rotate_left(ExtentNode *node, int t);
+static ExtentNode *rotate_right(ExtentNode *node, int t);
+static ExtentNode *rebalance(ExtentNode *node, int t);
+static ExtentNode *tree_insert(ExtentNode *root, ExtentNode *node, int t);
+static ExtentNode *tree_remove(ExtentNode *root, ExtentNode *node, int t);
+static ExtentNode *remove_min(ExtentNode *root, ExtentNode **min, int t);
+static void free_nodes(ExtentNode *root);
+static ExtentNode *new_node(int start, int length);
+static void link_node(ExtentTree *et, ExtentNode *node);
+static void unlink_node(ExtentTree *et, ExtentNode *node);
+static ExtentNode *find_at_or_before(ExtentTree *et, int block);
+static ExtentNode *find_at_or_after(ExtentTree *et, int block);
+static ExtentNode *first_fit(ExtentTree *et, ExtentNode *node, int blocks, int from);
+
+ExtentTree *et_create(void)
+{
+    ExtentTree *et = malloc(sizeof(ExtentTree));
+
+    if(NULL != et)
+    {
+        et->root[BY_START] = NULL;
+        et->root[BY_LENGTH] = NULL;
+        et->count = 0;
+        et->search_steps = 0;
+    }
+    return et;
+}
+
+void et_destroy(ExtentTree *et)
+{
+    if(NULL != et)
+    {
+        et_clear(et);
+        free(et);
+    }
+}
+
+void et_clear(ExtentTree *et)
+{
+    assert(NULL != et);
+
+    if(NULL != et)
+    {
+        //every node is in both trees, so walking one of them frees them all.
+        free_nodes(et->root[BY_START]);
+        et->root[BY_START] = NULL;
+        et->root[BY_LENGTH] = NULL;
+        et->count = 0;
+    }
+}
+
+int et_add_free(ExtentTree *et, int start, int blocks)
+{
+    assert(NULL != et);
+    assert(start >= 0);
+
+    if(NULL == et || start < 0)
+    {
+        return -1;
+    }
+    if(blocks <= 0)
+    {
+        return 0;
+    }
+
+    ExtentNode *before = find_at_or_before(et, start);
+    ExtentNode *after = find_at_or_after(et, start);
+    int end = start + blocks;
+
+    //the run must not overlap free space that is already there.
+    assert(NULL == before || before->start + before->length <= start);
+    assert(NULL == after || after->start >= end);
+
+    //merge with the neighbours: grow the extent before, or the one after, or make a new one.
+    if(NULL != before && before->start + before->length == start)
+    {
+        unlink_node(et, before);
+        before->length += blocks;
+        if(NULL != after && after->start == end)
+        {
+            unlink_node(et, after);
+            before->length += after->length;
+            free(after);
+        }
+        link_node(et, before);
+    }
+    else if(NULL != after && after->start == end)
+    {
+        unlink_node(et, after);
+        after->start = start;
+        after->length += blocks;
+        link_node(et, after);
+    }
+    else
+    {
+        ExtentNode *node = new_node(start, blocks);
+        if(NULL == node)
+        {
+            return -1;
+        }
+        link_node(et, node);
+    }
+
+    return 0;
+}
+
+int et_take(ExtentTree *et, int start, int blocks)
+{
+    assert(NULL != et);
+
+    if(NULL == et || start < 0)
+    {
+        return -1;
+    }
+    if(blocks <= 0)
+    {
+        return 0;
+    }
+
+    ExtentNode *node = find_at_or_before(et, start);
+    int end = start + blocks;
+
+    if(NULL == node || node->start + node->length < end)
+    {
+        //the run isn't inside a single extent.
+        return -1;
+    }
+
+    int node_end = node->start + node->length;
+    ExtentNode *tail = NULL;
+
+    //a run from the middle leaves a part behind it too, which needs a node of its own: make it
+    //first, so running out of memory leaves the extent as it was.
+    if(node->start < start && end < node_end)
+    {
+        tail = new_node(end, node_end - end);
+        if(NULL == tail)
+        {
+            return -1;
+        }
+    }
+
+    unlink_node(et, node);
+
+    if(node->start < start)
+    {
+        //keep the free part in front, and add the one behind if there is any.
+        node->length = start - node->start;
+        link_node(et, node);
+        if(NULL != tail)
+        {
+            link_node(et, tail);
+        }
+    }
+    else if(end < node_end)
+    {
+        node->start = end;
+        node->length = node_end - end;
+        link_node(et, node);
+    }
+    else
+    {
+        free(node);
+    }
+
+    return 0;
+}
+
+int et_best_fit(ExtentTree *et, int blocks, int *start)
+{
+    assert(NULL != et);
+    assert(NULL != start);
+
+    ExtentNode *curr = et->root[BY_LENGTH];
+    ExtentNode *best = NULL;
+
+    //lower bound on length: the leftmost node with length >= blocks.
+    while(NULL != curr)
+    {
+        et->search_steps++;
+        if(curr->length >= blocks)
+        {
+            best = curr;
+            curr = curr->left[BY_LENGTH];
+        }
+        else
+        {
+            curr = curr->right[BY_LENGTH];
+        }
+    }
+
+    if(NULL == best)
+    {
+        return 0;
+    }
+    *start = best->start;
+    return best->length;
+}
+
+int et_largest(ExtentTree *et, int *start)
+{
+    assert(NULL != et);
+    assert(NULL != start);
+
+    ExtentNode *curr = et->root[BY_LENGTH];
+    int length = 0;
+
+    if(NULL == curr)
+    {
+        return 0;
+    }
+    while(NULL != curr->right[BY_LENGTH])
+    {
+        curr = curr->right[BY_LENGTH];
+    }
+    length = curr->length;
+
+    //ties are ordered by start, so the first one of that length is the lowest.
+    et_best_fit(et, length, start);
+    return length;
+}
+
+int et_largest_length(ExtentTree *et)
+{
+    assert(NULL != et);
+
+    ExtentNode *root = et->root[BY_START];
+
+    return NULL == root ? 0 : root->max_length;
+}
+
+int et_first_fit(ExtentTree *et, int blocks, int from, int *start)
+{
+    assert(NULL != et);
+    assert(NULL != start);
+
+    ExtentNode *found = first_fit(et, et->root[BY_START], blocks, from);
+
+    if(NULL == found)
+    {
+        return 0;
+    }
+    *start = found->start;
+    return found->length;
+}
+
+int et_next(ExtentTree *et, int from, int *start)
+{
+    assert(NULL != et);
+    assert(NULL != start);
+
+    ExtentNode *node = find_at_or_after(et, from);
+
+    if(NULL == node)
+    {
+        return 0;
+    }
+    *start = node->start;
+    return node->length;
+}
+
+int et_count(ExtentTree *et)
+{
+    assert(NULL != et);
+    return et->count;
+}
+
+long long et_search_steps(ExtentTree *et)
+{
+    assert(NULL != et);
+    return et->search_steps;
+}
+
+//orders by start for BY_START, by length and then start for BY_LENGTH.
+static int compare_nodes(ExtentNode *a, ExtentNode *b, int t)
+{
+    if(t == BY_LENGTH && a->length != b->length)
+    {
+        return a->length < b->length ? -1 : 1;
+    }
+    if(a->start != b->start)
+    {
+        return a->start < b->start ? -1 : 1;
+    }
+    return 0;
+}
+
+static int height(ExtentNode *node, int t)
+{
+    return NULL == node ? 0 : node->height[t];
+}
+
+static void update_height(ExtentNode *node, int t)
+{
+    int l = height(node->left[t], t);
+    int r = height(node->right[t], t);
+    node->height[t] = 1 + (l > r ? l : r);
+
+    if(t == BY_START)
+    {
+        node->max_length = node->length;
+        if(NULL != node->left[t] && node->left[t]->max_length > node->max_length)
+        {
+            node->max_length = node->left[t]->max_length;
+        }
+        if(NULL != node->right[t] && node->right[t]->max_length > node->max_length)
+        {
+            node->max_length = node->right[t]->max_length;
+        }
+    }
+}
+
+static ExtentNode *rotate_left(ExtentNode *node, int t)
+{
+    ExtentNode *pivot = node->right[t];
+    node->right[t] = pivot->left[t];
+    pivot->left[t] = node;
+    update_height(node, t);
+    update_height(pivot, t);
+    return pivot;
+}
+
+static ExtentNode *rotate_right(ExtentNode *node, int t)
+{
+    ExtentNode *pivot = node->left[t];
+    node->left[t] = pivot->right[t];
+    pivot->right[t] = node;
+    update_height(node, t);
+    update_height(pivot, t);
+    return pivot;
+}
+
+static ExtentNode *rebalance(ExtentNode *node, int t)
+{
+    update_height(node, t);
+    int balance = height(node->left[t], t) - height(node->right[t], t);
+
+    if(balance > 1)
+    {
+        if(height(node->left[t]->left[t], t) < height(node->left[t]->right[t], t))
+        {
+            node->left[t] = rotate_left(node->left[t], t);
+        }
+        node = rotate_right(node, t);
+    }
+    else if(balance < -1)
+    {
+        if(height(node->right[t]->right[t], t) < height(node->right[t]->left[t], t))
+        {
+            node->right[t] = rotate_right(node->right[t], t);
+        }
+        node = rotate_left(node, t);
+    }
+    return node;
+}
+
+static ExtentNode *tree_insert(ExtentNode *root, ExtentNode *node, int t)
+{
+    if(NULL == root)
+    {
+        node->left[t] = NULL;
+        node->right[t] = NULL;
+        update_height(node, t);
+        return node;
+    }
+
+    if(compare_nodes(node, root, t) < 0)
+    {
+        root->left[t] = tree_insert(root->left[t], node, t);
+    }
+    else
+    {
+        assert(compare_nodes(node, root, t) > 0);
+        root->right[t] = tree_insert(root->right[t], node, t);
+    }
+    return rebalance(root, t);
+}
+
+static ExtentNode *remove_min(ExtentNode *root, ExtentNode **min, int t)
+{
+    if(NULL == root->left[t])
+    {
+        *min = root;
+        return root->right[t];
+    }
+    root->left[t] = remove_min(root->left[t], min, t);
+    return rebalance(root, t);
+}
+
+static ExtentNode *tree_remove(ExtentNode *root, ExtentNode *node, int t)
+{
+    assert(NULL != root);
+
+    int comp = compare_nodes(node, root, t);
+
+    if(comp < 0)
+    {
+        root->left[t] = tree_remove(root->left[t], node, t);
+    }
+    else if(comp > 0)
+    {
+        root->right[t] = tree_remove(root->right[t], node, t);
+    }
+    else
+    {
+        assert(root == node);
+        ExtentNode *min;
+
+        if(NULL == root->right[t])
+        {
+            return root->left[t];
+        }
+        //replace the node with the smallest node of its right subtree.
+        ExtentNode *right = remove_min(root->right[t], &min, t);
+        min->left[t] = root->left[t];
+        min->right[t] = right;
+        root = min;
+    }
+    return rebalance(root, t);
+}
+
+static void free_nodes(ExtentNode *root)
+{
+    if(NULL != root)
+    {
+        free_nodes(root->left[BY_START]);
+        free_nodes(root->right[BY_START]);
+        free(root);
+    }
+}
+
+static ExtentNode *new_node(int start, int length)
+{
+    ExtentNode *node = malloc(sizeof(ExtentNode));
+
+    if(NULL != node)
+    {
+        node->start = start;
+        node->length = length;
+    }
+    return node;
+}
+
+static void link_node(ExtentTree *et, ExtentNode *node)
+{
+    et->root[BY_START] = tree_insert(et->root[BY_START], node, BY_START);
+    et->root[BY_LENGTH] = tree_insert(et->root[BY_LENGTH], node, BY_LENGTH);
+    et->count++;
+}
+
+static void unlink_node(ExtentTree *et, ExtentNode *node)
+{
+    et->root[BY_START] = tree_remove(et->root[BY_START], node, BY_START);
+    et->root[BY_LENGTH] = tree_remove(et->root[BY_LENGTH], node, BY_LENGTH);
+    et->count--;
+}
+
+//the extent with the largest start <= block
+static ExtentNode *find_at_or_before(ExtentTree *et, int block)
+{
+    ExtentNode *curr = et->root[BY_START];
+    ExtentNode *found = NULL;
+
+    while(NULL != curr)
+    {
+        if(curr->start <= block)
+        {
+            found = curr;
+            curr = curr->right[BY_START];
+        }
+        else
+        {
+            curr = curr->left[BY_START];
+        }
+    }
+    return found;
+}
+
+//the extent with the smallest start >= block
+static ExtentNode *find_at_or_after(ExtentTree *et, int block)
+{
+    ExtentNode *curr = et->root[BY_START];
+    ExtentNode *found = NULL;
+
+    while(NULL != curr)
+    {
+        if(curr->start >= block)
+        {
+            found = curr;
+            curr = curr->left[BY_START];
+        }
+        else
+        {
+            curr = curr->right[BY_START];
+        }
+    }
+    return found;
+}
+
+//the lowest extent that starts at or after "from" and holds "blocks" blocks, skipping subtrees with nothing that long.
+static ExtentNode *first_fit(ExtentTree *et, ExtentNode *node, int blocks, int from)
+{
+    ExtentNode *found = NULL;
+
+    if(NULL == node || node->max_length < blocks)
+    {
+        return NULL;
+    }
+    et->search_steps++;
+
+    //everything on the left starts before this node, so it is only worth a look if this node is past "from".
+    if(node->start >= from)
+    {
+        found = first_fit(et, node->left[BY_START], blocks, from);
+        if(NULL == found && node->length >= blocks)
+        {
+            found = node;
+        }
+    }
+    if(NULL == found)
+    {
+        found = first_fit(et, node->right[BY_START], blocks, from);
+    }
+    return found;
+}
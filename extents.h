@@ -0,0 +1,58 @@
+#ifndef _A5_EXTENTS
+#define _A5_EXTENTS
+
+// The extent tree keeps the free space of the device as runs of free blocks
+// ("extents"). Every extent is indexed twice: by its starting block, to find
+// and merge neighbours, and by its length, to find the best fitting run.
+// Neighbouring extents are always merged, so no two extents ever touch.
+
+typedef struct EXTENT_TREE ExtentTree;
+
+// Create an empty tree (no free space). Return NULL on error.
+ExtentTree *et_create(void);
+
+// Destroy the tree, freeing all memory.
+void et_destroy(ExtentTree *et);
+
+// Remove every extent (no free space).
+void et_clear(ExtentTree *et);
+
+// Add the run [start, start+blocks) as free space, merging it with the
+// extents right before and after it.
+// Return 0 on success, -1 on error (out of memory).
+int et_add_free(ExtentTree *et, int start, int blocks);
+
+// Remove the run [start, start+blocks) from the free space. The run must lie
+// inside a single extent; whatever is left on either side stays free.
+// Return 0 on success, -1 if the run isn't free or we ran out of memory.
+int et_take(ExtentTree *et, int start, int blocks);
+
+// Find the smallest extent that holds at least "blocks" blocks (the lowest
+// one if there are ties). Copy its start into *start and return its length,
+// or return 0 if there is no extent that big.
+int et_best_fit(ExtentTree *et, int blocks, int *start);
+
+// Find the lowest extent that begins at or after "from" and holds at least
+// "blocks" blocks. Copy its start into *start and return its length, or
+// return 0 if there is none.
+int et_first_fit(ExtentTree *et, int blocks, int from, int *start);
+
+// Find the largest extent (the lowest one if there are ties). Copy its start
+// into *start and return its length, or return 0 if there is no free space.
+int et_largest(ExtentTree *et, int *start);
+
+// The length of the largest extent, read off the top of the tree instead of
+// searched for (so it isn't counted in the search steps), or 0.
+int et_largest_length(ExtentTree *et);
+
+// Find the first extent that begins at or after "from". Copy its start into
+// *start and return its length, or return 0 if there is none.
+int et_next(ExtentTree *et, int from, int *start);
+
+// Number of extents in the tree.
+int et_count(ExtentTree *et);
+
+// Number of extents looked at by all the best fit and first fit searches so far.
+long long et_search_steps(ExtentTree *et);
+
+#endif
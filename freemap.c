@@ -0,0 +1,255 @@
+/**
+ * freemap.c
+ *
+ * PURPOSE: To keep track of the free blocks of the device one bit per block,
+ *          and to search it a whole word (or four words with AVX2) at a time.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "a5_freemap.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+static uint64_t range_mask(int low, int high);
+static void set_range(uint64_t *words, int start, int blocks, int free);
+
+#ifdef __AVX2__
+//returns 1 if the four words starting at words are all zero (fully occupied).
+static int all_used_4(const uint64_t *words)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)words);
+    return _mm256_testz_si256(v, v);
+}
+
+//returns 1 if the four words starting at words are all ones (fully free).
+static int all_free_4(const uint64_t *words)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)words);
+    return _mm256_testc_si256(v, _mm256_set1_epi64x(-1));
+}
+#endif
+
+int fm_word_count(int block_count)
+{
+    assert(block_count >= 0);
+    return (block_count + FREEMAP_WORD_BITS - 1) / FREEMAP_WORD_BITS;
+}
+
+void fm_init(uint64_t *words, int block_count)
+{
+    assert(NULL != words);
+    int num_words = fm_word_count(block_count);
+
+    for(int i=0; i < num_words; i++)
+    {
+        words[i] = 0;
+    }
+    fm_set_free(words, 0, block_count);
+}
+
+void fm_set_free(uint64_t *words, int start, int blocks)
+{
+    set_range(words, start, blocks, 1);
+}
+
+void fm_set_used(uint64_t *words, int start, int blocks)
+{
+    set_range(words, start, blocks, 0);
+}
+
+int fm_is_free(const uint64_t *words, int block_count, int block)
+{
+    assert(NULL != words);
+
+    if(block < 0 || block >= block_count)
+    {
+        return 0;
+    }
+    return (words[block / FREEMAP_WORD_BITS] >> (block % FREEMAP_WORD_BITS)) & 1;
+}
+
+int fm_find_free(const uint64_t *words, int block_count, int from)
+{
+    if(NULL == words || block_count <= 0)
+    {
+        return -1;
+    }
+    if(from < 0)
+    {
+        from = 0;
+    }
+    if(from >= block_count)
+    {
+        return -1;
+    }
+
+    int num_words = fm_word_count(block_count);
+    int w = from / FREEMAP_WORD_BITS;
+    //ignore the bits before "from" in the first word.
+    uint64_t bits = words[w] & (~0ULL << (from % FREEMAP_WORD_BITS));
+
+    while(bits == 0)
+    {
+        w++;
+#ifdef __AVX2__
+        //skip fully occupied stretches four words at a time.
+        while(w + 4 <= num_words && all_used_4(words + w))
+        {
+            w += 4;
+        }
+#endif
+        if(w >= num_words)
+        {
+            return -1;
+        }
+        bits = words[w];
+    }
+
+    //the tail bits are always cleared, so this is never past block_count.
+    return w * FREEMAP_WORD_BITS + __builtin_ctzll(bits);
+}
+
+int fm_run_length(const uint64_t *words, int block_count, int start, int limit)
+{
+    assert(NULL != words);
+
+    if(start < 0 || start >= block_count || limit <= 0)
+    {
+        return 0;
+    }
+
+    int num_words = fm_word_count(block_count);
+    int w = start / FREEMAP_WORD_BITS;
+    int offset = start % FREEMAP_WORD_BITS;
+    //after the shift, the free bits of the run are at the bottom; invert to find where it stops.
+    uint64_t stops = ~(words[w] >> offset);
+    int length;
+
+    if(stops == 0)
+    {
+        length = FREEMAP_WORD_BITS;
+    }
+    else
+    {
+        length = __builtin_ctzll(stops);
+    }
+
+    //the run continues into the next word only if it reached the end of this one.
+    if(length == FREEMAP_WORD_BITS - offset)
+    {
+        w++;
+        while(length < limit && w < num_words)
+        {
+#ifdef __AVX2__
+            if(w + 4 <= num_words && all_free_4(words + w))
+            {
+                length += 4 * FREEMAP_WORD_BITS;
+                w += 4;
+                continue;
+            }
+#endif
+            if(words[w] == ~0ULL)
+            {
+                length += FREEMAP_WORD_BITS;
+                w++;
+            }
+            else
+            {
+                length += __builtin_ctzll(~words[w]);
+                break;
+            }
+        }
+    }
+
+    if(length > limit)
+    {
+        length = limit;
+    }
+    return length;
+}
+
+int fm_find_run(const uint64_t *words, int block_count, int blocks, int from)
+{
+    if(NULL == words)
+    {
+        return -1;
+    }
+    if(blocks < 1)
+    {
+        blocks = 1;
+    }
+
+    int pos = fm_find_free(words, block_count, from);
+    int length;
+
+    //every run is looked at once: a run too short is skipped as a whole.
+    while(pos >= 0)
+    {
+        length = fm_run_length(words, block_count, pos, blocks);
+        if(length >= blocks)
+        {
+            return pos;
+        }
+        pos = fm_find_free(words, block_count, pos + length);
+    }
+
+    return -1;
+}
+
+int fm_count_free(const uint64_t *words, int block_count)
+{
+    assert(NULL != words);
+
+    int num_words = fm_word_count(block_count);
+    int count = 0;
+
+    for(int i=0; i < num_words; i++)
+    {
+        count += __builtin_popcountll(words[i]);
+    }
+    return count;
+}
+
+//mask with the bits [low, high) set, 0 <= low < high <= 64
+static uint64_t range_mask(int low, int high)
+{
+    uint64_t mask = (high == FREEMAP_WORD_BITS) ? ~0ULL : ((1ULL << high) - 1);
+    return mask & (~0ULL << low);
+}
+
+static void set_range(uint64_t *words, int start, int blocks, int free)
+{
+    assert(NULL != words);
+    assert(start >= 0);
+
+    int end = start + blocks;
+    int w, low, high;
+    uint64_t mask;
+
+    while(start < end)
+    {
+        w = start / FREEMAP_WORD_BITS;
+        low = start % FREEMAP_WORD_BITS;
+        high = FREEMAP_WORD_BITS;
+        if(end - w * FREEMAP_WORD_BITS < FREEMAP_WORD_BITS)
+        {
+            high = end - w * FREEMAP_WORD_BITS;
+        }
+
+        mask = range_mask(low, high);
+        if(free)
+        {
+            words[w] |= mask;
+        }
+        else
+        {
+            words[w] &= ~mask;
+        }
+        start = w * FREEMAP_WORD_BITS + high;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef _A5_FREEMAP
+#define _A5_FREEMAP
+
+#include <stdint.h>
+
+// The free map keeps one bit per block packed into 64-bit words.
+// A set bit means the block is free, a cleared bit means it is occupied.
+// Bits past block_count in the last word are always kept cleared, so the
+// searches never report a block that doesn't exist.
+
+#define FREEMAP_WORD_BITS 64
+
+// Number of words needed to hold block_count bits.
+int fm_word_count(int block_count);
+
+// Mark every block as free.
+void fm_init(uint64_t *words, int block_count);
+
+// Mark "blocks" blocks starting at "start" as free / occupied.
+void fm_set_free(uint64_t *words, int start, int blocks);
+void fm_set_used(uint64_t *words, int start, int blocks);
+
+// Return 1 if the block is free, 0 otherwise (also 0 when out of range).
+int fm_is_free(const uint64_t *words, int block_count, int block);
+
+// Return the first free block at or after "from", or -1 if there is none.
+int fm_find_free(const uint64_t *words, int block_count, int from);
+
+// Return the length of the free run that begins at "start", counting at most
+// "limit" blocks. Zero means "start" is occupied.
+int fm_run_length(const uint64_t *words, int block_count, int start, int limit);
+
+// Return the first block at or after "from" that begins a run of at least
+// "blocks" free blocks, or -1 if there is no such run.
+int fm_find_run(const uint64_t *words, int block_count, int blocks, int from);
+
+// Count all free blocks.
+int fm_count_free(const uint64_t *words, int block_count);
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ * groupspace.c
+ *
+ * PURPOSE: To know how much free space each allocation group has, and the
+ *          device as a whole, without locking the groups to ask them.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "a5_groupspace.h"
+
+struct GROUP_SPACE {
+    int group_count;
+    int leaves;            //the groups rounded up to a power of two, the leaves of the trees.
+    int *runs;             //max tree of the longest free run of each group; node i has children 2i and 2i+1.
+    int *frees;            //max tree of the free blocks of each group, laid out the same way.
+    long long *steps;      //the search steps each group last reported.
+    long free_total;
+    long long steps_total;
+    pthread_mutex_t lock;
+};
+
+static void update_path(int *tree, int node);
+static int find_from(const int *tree, int leaves, int blocks, int from);
+
+GroupSpace *gs_create(int group_count)
+{
+    assert(group_count > 0);
+
+    GroupSpace *space = NULL;
+
+    if(group_count > 0)
+    {
+        space = malloc(sizeof(GroupSpace));
+        if(NULL != space)
+        {
+            space->group_count = group_count;
+            space->leaves = 1;
+            while(space->leaves < group_count)
+            {
+                space->leaves *= 2;
+            }
+            space->runs = calloc(2 * space->leaves, sizeof(int));
+            space->frees = calloc(2 * space->leaves, sizeof(int));
+            space->steps = calloc(group_count, sizeof(long long));
+            space->free_total = 0;
+            space->steps_total = 0;
+            pthread_mutex_init(&space->lock, NULL);
+
+            if(NULL == space->runs || NULL == space->frees || NULL == space->steps)
+            {
+                gs_destroy(space);
+                space = NULL;
+            }
+        }
+    }
+
+    return space;
+}
+
+void gs_destroy(GroupSpace *space)
+{
+    if(NULL != space)
+    {
+        free(space->runs);
+        free(space->frees);
+        free(space->steps);
+        pthread_mutex_destroy(&space->lock);
+        free(space);
+    }
+}
+
+void gs_update(GroupSpace *space, int group, int free_blocks, int largest_run, long long search_steps)
+{
+    assert(NULL != space);
+    assert(group >= 0 && group < space->group_count);
+
+    if(NULL != space && group >= 0 && group < space->group_count)
+    {
+        int leaf = space->leaves + group;
+
+        pthread_mutex_lock(&space->lock);
+        space->free_total += free_blocks - space->frees[leaf];
+        space->steps_total += search_steps - space->steps[group];
+        space->steps[group] = search_steps;
+        space->frees[leaf] = free_blocks;
+        space->runs[leaf] = largest_run;
+        update_path(space->frees, leaf);
+        update_path(space->runs, leaf);
+        pthread_mutex_unlock(&space->lock);
+    }
+}
+
+void gs_totals(GroupSpace *space, long *free_blocks, long *largest_run, long long *search_steps)
+{
+    assert(NULL != space);
+
+    if(NULL != space)
+    {
+        pthread_mutex_lock(&space->lock);
+        if(NULL != free_blocks)
+        {
+            *free_blocks = space->free_total;
+        }
+        if(NULL != largest_run)
+        {
+            *largest_run = space->runs[1];
+        }
+        if(NULL != search_steps)
+        {
+            *search_steps = space->steps_total;
+        }
+        pthread_mutex_unlock(&space->lock);
+    }
+}
+
+int gs_find_run(GroupSpace *space, int blocks, int from)
+{
+    assert(NULL != space);
+    int found = -1;
+
+    if(NULL != space && from < space->group_count)
+    {
+        pthread_mutex_lock(&space->lock);
+        found = find_from(space->runs, space->leaves, blocks, from);
+        pthread_mutex_unlock(&space->lock);
+    }
+    return found;
+}
+
+int gs_find_free(GroupSpace *space, int blocks, int from)
+{
+    assert(NULL != space);
+    int found = -1;
+
+    if(NULL != space && from < space->group_count)
+    {
+        pthread_mutex_lock(&space->lock);
+        found = find_from(space->frees, space->leaves, blocks, from);
+        pthread_mutex_unlock(&space->lock);
+    }
+    return found;
+}
+
+//brings the nodes above a leaf that changed up to date.
+static void update_path(int *tree, int node)
+{
+    for(node /= 2; node >= 1; node /= 2)
+    {
+        tree[node] = tree[2 * node] > tree[2 * node + 1] ? tree[2 * node] : tree[2 * node + 1];
+    }
+}
+
+//the first leaf at or after "from" holding at least "blocks", or -1. the leaves past the last group
+//hold 0, so they are never found.
+static int find_from(const int *tree, int leaves, int blocks, int from)
+{
+    int node;
+
+    if(blocks < 1)
+    {
+        blocks = 1;
+    }
+    if(from < 0)
+    {
+        from = 0;
+    }
+
+    node = leaves + from;
+    while(tree[node] < blocks)
+    {
+        //climb past the nodes that are right children, then look at the subtree just right of them.
+        while(node > 1 && (node & 1))
+        {
+            node /= 2;
+        }
+        if(node <= 1)
+        {
+            return -1;
+        }
+        node++;
+    }
+
+    //go down to the leftmost leaf of that subtree that holds enough.
+    while(node < leaves)
+    {
+        node = 2 * node;
+        if(tree[node] < blocks)
+        {
+            node++;
+        }
+    }
+    return node - leaves;
+}
@@ -0,0 +1,37 @@
+#ifndef _A5_GROUPSPACE
+#define _A5_GROUPSPACE
+
+// The group space index keeps, for every allocation group of the device, how
+// many blocks it has free, its longest free run and how many free runs its
+// searches looked at, as the groups last reported them. The totals for the
+// whole device are kept with them, and two max trees over the groups find
+// the next group with a run (or a number of free blocks) of a given size
+// without locking every group on the way. The index has a lock of its own,
+// taken by every function below, which never takes any other lock.
+
+typedef struct GROUP_SPACE GroupSpace;
+
+// Create an index for group_count groups, all of them with no free space.
+// Return NULL on error.
+GroupSpace *gs_create(int group_count);
+
+// Destroy the index, freeing all memory.
+void gs_destroy(GroupSpace *space);
+
+// Record what the group has now: its free blocks, its longest free run and
+// the free runs looked at by its searches so far.
+void gs_update(GroupSpace *space, int group, int free_blocks, int largest_run, long long search_steps);
+
+// Copy the totals of the device, all as of the same moment: the free blocks,
+// the longest free run of any group and the free runs looked at.
+void gs_totals(GroupSpace *space, long *free_blocks, long *largest_run, long long *search_steps);
+
+// The first group at or after "from" with a free run of at least "blocks"
+// blocks, or -1 if there is none.
+int gs_find_run(GroupSpace *space, int blocks, int from);
+
+// The first group at or after "from" with at least "blocks" free blocks, or
+// -1 if there is none.
+int gs_find_free(GroupSpace *space, int blocks, int from);
+
+#endif
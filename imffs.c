@@ -8,65 +8,142 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
 
 
 #include "Boolean.h"
 #include "a5_imffs.h"
 #include "a5_multimap.h"
+#include "a5_freemap.h"
+#include "a5_extents.h"
+#include "a5_buddy.h"
+#include "a5_allocgroup.h"
+#include "a5_groupspace.h"
+#include "a5_namehash.h"
+#include "a5_keyname.h"
+#include "a5_ownermap.h"
 
 const int BLOCK_BYTE_SIZE = 256;
 
+//the number of blocks in an allocation group, unless the device is created with a group count.
+#define GROUP_BLOCK_COUNT 32768
+//how many blocks of a stream are read before space is picked for them.
+#define STAGE_BLOCKS 256
+
 typedef struct IMFFS {
     uint8_t *device;
-    uint8_t *free_blocks;
+    AllocGroup **groups; //the free space, split in groups of group_blocks blocks with a lock each.
+    int group_count;
+    int group_blocks;
+    GroupSpace *space; //how much each group has free, as of its last change, so nothing locks every group to find out.
+    unsigned int next_group; //the group the next save without a hint starts in, round-robin.
+    pthread_rwlock_t layout_lock; //shared by saves while they place a file, taken alone by defrag which moves everything.
+    pthread_rwlock_t lock; //held while using the index, stats and usage; shared by the calls that only read them (dir, load, statfs...).
+    IMFFSAllocPolicy policy;
+    IMFFSAllocStats stats;
+    IMFFSStatfs usage; //kept up to date as files come and go, so statfs doesn't walk the index.
     int block_count;
     Multimap *index;
+    unsigned int stale_reads; //the reads of the index since its frozen layout went stale, counted under the read lock.
+    NameHash *names; //the keys of the index again, by case-folded name, so lookups don't walk the index.
+    OwnerMap *owners; //the file each block belongs to, kept up to date like the index.
 } Imffs;
 
 typedef struct KEYHOLDER
 {
-    char *file_name;
+    KeyName name; //short names are kept in here, and compare without reading the name.
     long file_byte_size;
+    uint32_t id; //the file's id in the owner map.
+    int blocks; //the blocks added to the file so far.
 }KeyHolder;
 
+//how far a load has got, for write_chunk.
+typedef struct LOAD_STATE
+{
+    FILE *out;
+    long bytes_left;
+}LoadState;
+
+//the file imffs_check is going through, for check_chunk.
+typedef struct CHECK_STATE
+{
+    IMFFSPtr fs;
+    KeyHolder *file;
+    int order; //the file's next block.
+    int problems;
+}CheckState;
+
 
 //comparison functions.
 static int compare_keys(void *a, void *b);
 static int compare_values_always_greater(void *a, void *b);
+static uint64_t key_fingerprint(void *key);
 
 //helper methods that are testable.
-int find_free_space(uint8_t *free_blocks, int block_count);
+int find_free_space(uint64_t *free_blocks, int block_count);
+int find_free_run(uint64_t *free_blocks, int block_count, int blocks);
 int get_block_number(int file_size); 
-void free_space(uint8_t *free_blocks, int blocks, int starting_block);  
+void free_space(uint64_t *free_blocks, int blocks, int starting_block);  
+void occupy_space(uint64_t *free_blocks, int blocks, int starting_block);
 
 //helper methods not testable.
-void rename_key_and_add_again(Multimap *mm, void *key, char *renamed_name);
-Boolean file_name_exists(Multimap *index , char *file); 
-int get_key__with_name(Multimap *mm, char *name, void **key); 
-void initialize_free_blocks(uint8_t *free_blocks, int block_count);
-void print_chunks_info(Multimap *mm, void *key, int size);
-IMFFSResult add_contents_to_device(FILE *source, IMFFSPtr fs, char *name);
+int rename_file_key(IMFFSPtr fs, void *key, char *renamed_name);
+Boolean file_name_exists(IMFFSPtr fs, char *file); 
+int get_key__with_name(IMFFSPtr fs, char *name, void **key); 
+void initialize_free_blocks(uint64_t *free_blocks, int block_count);
+void print_chunks_info(Multimap *mm, void *key);
+int print_dir_entry(void *key, int num_values, void *total_bytes);
+int print_chunk(const Value *chunk, void *chunk_number);
+int write_chunk(const Value *chunk, void *state);
+int release_chunk(const Value *chunk, void *fs);
+int check_chunk(const Value *chunk, void *state);
+IMFFSResult add_contents_to_device(FILE *source, IMFFSPtr fs, char *name, int group);
+IMFFSResult add_sized_contents_to_device(FILE *source, IMFFSPtr fs, char *name, long file_size, int group);
+int reserve_extents(IMFFSPtr fs, int blocks, Value *extents, int group, IMFFSAllocStats *stats);
+Boolean group_fits(IMFFSPtr fs, AllocGroup *group, int blocks);
+int reserve_in_group(IMFFSPtr fs, AllocGroup *group, int blocks, Value *extents, int num_extents);
+int reserve_runs(IMFFSPtr fs, AllocGroup *group, int blocks, Value *extents, int num_extents);
+int find_fit(IMFFSPtr fs, AllocGroup *group, int blocks, int *start);
+Boolean valid_policy(IMFFSAllocPolicy policy);
+int reserve_buddy_clusters(IMFFSPtr fs, AllocGroup *group, int blocks, Value *extents, int num_extents);
+int reserve_buddy_cluster(IMFFSPtr fs, AllocGroup *group, int order, Value *extents, int num_extents);
+void release_extents(IMFFSPtr fs, Value *extents, int num_extents);
+int sort_and_merge_extents(Value *extents, int num_extents);
+int place_batch(IMFFSPtr fs, int blocks, Value *extents, int num_extents, Value *batch, int group, IMFFSAllocStats *stats);
+Boolean extend_chunk(IMFFSPtr fs, int block, int blocks);
+int pick_group(IMFFSPtr fs, int hint);
+int group_of(IMFFSPtr fs, int block);
+void unlock_group(IMFFSPtr fs, int g);
+int next_group_with_space(IMFFSPtr fs, int group, int distance, int blocks, Boolean in_one_run);
+void add_alloc_stats(IMFFSAllocStats *to, IMFFSAllocStats *from);
+long long now_nanoseconds(void);
+void lock_index_for_reading(IMFFSPtr fs);
 void remove_values_and_key(Imffs *fs, void *key);
 void load_data_to_file(IMFFSPtr fs, void *key, FILE *out);
 
+//helper functions for the allocator, they pass blocks to the groups they belong to.
+IMFFSResult release_blocks(IMFFSPtr fs, int starting_block, int blocks);
+void add_chunk_to_file(IMFFSPtr fs, KeyHolder *key, int blocks, uint8_t *chunk_start);
+void count_new_file(IMFFSPtr fs, KeyHolder *key);
+int name_new_file(IMFFSPtr fs, KeyHolder *key, char *name);
+
 //helper functions for defrag
-IMFFSResult reconstruct_index(IMFFSPtr fs,KeyHolder **chunks_arr);
-int defrag_operation(IMFFSPtr fs, KeyHolder **chunks_arr, int size, int pos);
-int find_same_type_key(KeyHolder **chunks_arr, int start, int size, KeyHolder *key);
-int find_empty_space(KeyHolder **chunks_arr, int end);
-int find_key_to_be_moved(KeyHolder **chunks_arr, int starting, int size);
-void shift_chunks_array(IMFFSPtr fs, int from, int to, KeyHolder **chunks_arr);
-void move_file_within_device(IMFFSPtr fs, int index_to, int index_from,KeyHolder **chunks_arr);
-void fill_chunks_array(IMFFSPtr fs, KeyHolder **chunks_arr);
-void add_keys_to_chunks_array(KeyHolder **chunks_arr, void *key, int starting_block, int blocks);
-void initialize_defrag_pointers_to_null(KeyHolder **chunks_arr, int size);
+IMFFSResult reconstruct_index(IMFFSPtr fs,uint32_t *chunks_arr);
+int defrag_operation(IMFFSPtr fs, uint32_t *chunks_arr, int *order_arr, int size, int pos);
+int find_same_type_key(uint32_t *chunks_arr, int *order_arr, int start, int size, uint32_t key, int order);
+int find_empty_space(uint32_t *chunks_arr, int end);
+int find_key_to_be_moved(uint32_t *chunks_arr, int starting, int size);
+void shift_chunks_array(IMFFSPtr fs, int from, int to, uint32_t *chunks_arr, int *order_arr);
+void move_file_within_device(IMFFSPtr fs, int index_to, int index_from,uint32_t *chunks_arr, int *order_arr);
 
 
 
 static int compare_keys(void *a, void *b)
 {
   assert(NULL != a && NULL != b);
-  return strcasecmp(((KeyHolder*)a)->file_name, ((KeyHolder*)b)->file_name);
+  return kn_compare(&((KeyHolder*)a)->name, &((KeyHolder*)b)->name);
 }
 
 //make it greater so when you insert it adds, it at the end of the linked list.
@@ -77,54 +154,127 @@ static int compare_values_always_greater(void *a, void *b)
   return 1;
 }
 
+//the first 8 folded bytes of the name, which order keys like compare_keys, for the frozen index.
+static uint64_t key_fingerprint(void *key)
+{
+  assert(NULL != key);
+  return ((KeyHolder*)key)->name.prefix;
+}
+
 
 // this function will create the filesystem with the given number of blocks;
 // it will modify the fs parameter to point to the new file system or set it
 // to NULL if something went wrong (fs is a pointer to a pointer)
 IMFFSResult imffs_create(uint32_t block_count, IMFFSPtr *fs)
 {
-    assert((int) (block_count) > 0);
+    return imffs_create_with_policy(block_count, IMFFS_ALLOC_BEST_FIT, fs);
+}
+
+// same as imffs_create, but files are placed using the given policy.
+IMFFSResult imffs_create_with_policy(uint32_t block_count, IMFFSAllocPolicy policy, IMFFSPtr *fs)
+{
+    return imffs_create_with_groups(block_count, policy, 0, fs);
+}
+
+// same as imffs_create_with_policy, with the device split into group_count allocation groups.
+IMFFSResult imffs_create_with_groups(uint32_t block_count, IMFFSAllocPolicy policy, int group_count, IMFFSPtr *fs)
+{
+    assert(block_count > 0 && block_count <= IMFFS_MAX_BLOCKS);
     assert(fs != NULL);
+    assert(valid_policy(policy));
+    assert(group_count >= 0);
 
     IMFFSResult returned = IMFFS_OK;
 
-    if(NULL != fs && (int)(block_count) > 0)
+    if(NULL != fs && block_count > 0 && block_count <= IMFFS_MAX_BLOCKS && valid_policy(policy) && group_count >= 0)
     {
         *fs = malloc(sizeof(Imffs));
 
-        if(NULL != *fs && (int) block_count > 0)
+        if(NULL != *fs)
         {
-            (*fs)->device = malloc(BLOCK_BYTE_SIZE * (int)(block_count));
+            //without a group count, every group gets GROUP_BLOCK_COUNT blocks.
+            if(0 == group_count)
+            {
+                group_count = ((int)block_count + GROUP_BLOCK_COUNT - 1) / GROUP_BLOCK_COUNT;
+            }
+            if(group_count > (int)block_count)
+            {
+                group_count = (int)block_count;
+            }
+            (*fs)->group_blocks = ((int)block_count + group_count - 1) / group_count;
+            //rounding the group size up can leave the last groups empty, so don't make them.
+            (*fs)->group_count = ((int)block_count + (*fs)->group_blocks - 1) / (*fs)->group_blocks;
+            (*fs)->next_group = 0;
+            (*fs)->stale_reads = 0;
+
+            (*fs)->device = malloc((size_t)BLOCK_BYTE_SIZE * block_count);
+            (*fs)->groups = calloc((*fs)->group_count, sizeof(AllocGroup *));
+            (*fs)->space = gs_create((*fs)->group_count);
             (*fs)->block_count = (int)block_count;
-
-            if(NULL != (*fs)->device)
+            (*fs)->policy = policy;
+            (*fs)->stats.files_placed = 0;
+            (*fs)->stats.extents_created = 0;
+            (*fs)->stats.files_fragmented = 0;
+            (*fs)->stats.search_steps = 0;
+            (*fs)->stats.alloc_nanoseconds = 0;
+            (*fs)->usage.block_count = block_count;
+            (*fs)->usage.block_size = BLOCK_BYTE_SIZE;
+            (*fs)->usage.files = 0;
+            (*fs)->usage.used_bytes = 0;
+            (*fs)->usage.used_blocks = 0;
+            (*fs)->usage.free_blocks = (int)block_count;
+            (*fs)->usage.extents = 0;
+            (*fs)->usage.largest_free_run = (*fs)->group_blocks;
+            (*fs)->usage.groups = (*fs)->group_count;
+            (*fs)->index = mm_create((int)block_count, compare_keys, compare_values_always_greater);
+            (*fs)->names = nh_create();
+            (*fs)->owners = om_create((int)block_count);
+            pthread_rwlock_init(&(*fs)->lock, NULL);
+            pthread_rwlock_init(&(*fs)->layout_lock, NULL);
+
+            Boolean made = (NULL != (*fs)->device && NULL != (*fs)->groups && NULL != (*fs)->space && NULL != (*fs)->index && NULL != (*fs)->names && NULL != (*fs)->owners);
+
+            //names are looked up much more than files come and go, so the index keeps a frozen search layout.
+            if(made)
             {
-                (*fs)->free_blocks = malloc((int)block_count * sizeof(uint8_t));
+                mm_freeze((*fs)->index, key_fingerprint);
+            }
+            int first_block = 0;
 
-                if(NULL != (*fs)->free_blocks)
+            for(int i=0; made && i < (*fs)->group_count; i++)
+            {
+                //the last group gets what is left.
+                int blocks = (*fs)->group_blocks;
+                if(first_block + blocks > (int)block_count)
                 {
-                        initialize_free_blocks((*fs)->free_blocks,(int)block_count);
-                        (*fs)->index = mm_create((int)block_count, compare_keys, compare_values_always_greater);
-
-                        if(NULL == (*fs)->index)
-                        {
-                            free((*fs)->device);
-                            free((*fs)->free_blocks);
-                            free(*fs);
-                            *fs = NULL;
-                            returned = IMFFS_FATAL;
-                        }
+                    blocks = (int)block_count - first_block;
                 }
-                else
+                (*fs)->groups[i] = ag_create(first_block, blocks, policy == IMFFS_ALLOC_BUDDY);
+                made = (NULL != (*fs)->groups[i]);
+                if(made)
                 {
-                        free((*fs)->device);
-                        free(*fs);
-                        *fs = NULL;
-                        returned = IMFFS_FATAL;
+                    gs_update((*fs)->space, i, blocks, blocks, 0);
                 }
+                first_block += blocks;
             }
-            else
+
+            if(!made)
             {
+                if(NULL != (*fs)->index)
+                {
+                    mm_destroy((*fs)->index);
+                }
+                nh_destroy((*fs)->names);
+                om_destroy((*fs)->owners);
+                for(int i=0; NULL != (*fs)->groups && i < (*fs)->group_count; i++)
+                {
+                    ag_destroy((*fs)->groups[i]);
+                }
+                free((*fs)->groups);
+                gs_destroy((*fs)->space);
+                free((*fs)->device);
+                pthread_rwlock_destroy(&(*fs)->lock);
+                pthread_rwlock_destroy(&(*fs)->layout_lock);
                 free(*fs);
                 *fs = NULL;
                 returned = IMFFS_FATAL;
@@ -146,9 +296,14 @@ IMFFSResult imffs_create(uint32_t block_count, IMFFSPtr *fs)
 }
 
 
-
 // save diskfile imffsfile copy from your system to IMFFS
 IMFFSResult imffs_save(IMFFSPtr fs, char *diskfile, char *imffsfile)
+{
+    return imffs_save_in_group(fs, diskfile, imffsfile, -1);
+}
+
+// same as imffs_save, the file goes in the given allocation group first (round-robin when it's negative).
+IMFFSResult imffs_save_in_group(IMFFSPtr fs, char *diskfile, char *imffsfile, int group)
 {
     assert(NULL != fs);
     assert(NULL !=diskfile);
@@ -158,15 +313,28 @@ IMFFSResult imffs_save(IMFFSPtr fs, char *diskfile, char *imffsfile)
     
     if(NULL != fs && NULL != diskfile && NULL != imffsfile)
     {
+        pthread_rwlock_rdlock(&fs->lock);
+        Boolean exists = file_name_exists(fs,imffsfile);
+        pthread_rwlock_unlock(&fs->lock);
+
         //if the file name doesn't exist in imffs.
-        if(!file_name_exists(fs->index,imffsfile))
+        if(!exists)
         {
             FILE *source_file = fopen(diskfile,"r");
+            struct stat source_info;
 
             if(source_file != NULL)
             {
-                //add the contents.
-                returned = add_contents_to_device(source_file,fs,imffsfile);  
+                //if we know the size up front, reserve all of the space before copying anything.
+                //otherwise (pipes and such) the contents are added as they are read.
+                if(fstat(fileno(source_file),&source_info) == 0 && S_ISREG(source_info.st_mode))
+                {
+                    returned = add_sized_contents_to_device(source_file,fs,imffsfile,(long)source_info.st_size,group);
+                }
+                else
+                {
+                    returned = add_contents_to_device(source_file,fs,imffsfile,group);
+                }
                 fclose(source_file);
             }
             else
@@ -186,7 +354,7 @@ IMFFSResult imffs_save(IMFFSPtr fs, char *diskfile, char *imffsfile)
         returned = IMFFS_INVALID;
     }
     
-    assert(returned == IMFFS_ERROR || returned == IMFFS_OK || returned == IMFFS_INVALID);
+    assert(returned == IMFFS_ERROR || returned == IMFFS_OK || returned == IMFFS_INVALID || returned == IMFFS_FATAL);
 
     return returned;
 
@@ -203,15 +371,20 @@ IMFFSResult imffs_rename(IMFFSPtr fs, char *imffsold, char *imffsnew)
 
     if(NULL != fs && NULL != imffsold && NULL != imffsnew)
     {
+        pthread_rwlock_wrlock(&fs->lock);
+
         void *key;
 
         //get the key.
-        if(get_key__with_name(fs->index,imffsold,&key) == 0)
+        if(get_key__with_name(fs,imffsold,&key) == 0)
         {
             //if the new file name doesn't exist in the file already.
-            if(!file_name_exists(fs->index,imffsnew))
+            if(!file_name_exists(fs,imffsnew))
             {
-                rename_key_and_add_again(fs->index,key,imffsnew);
+                if(rename_file_key(fs,key,imffsnew) != 0)
+                {
+                    returned = IMFFS_FATAL;
+                }
             }
             else
             {
@@ -225,13 +398,15 @@ IMFFSResult imffs_rename(IMFFSPtr fs, char *imffsold, char *imffsnew)
             fprintf(stderr,"Error! file with the name \"%s\" is not found in imffs.\n",imffsold);
             returned  = IMFFS_ERROR;
         }
+
+        pthread_rwlock_unlock(&fs->lock);
     }
     else
     {
         returned = IMFFS_INVALID;
     }
 
-    assert(returned == IMFFS_OK || returned == IMFFS_INVALID || returned == IMFFS_ERROR);
+    assert(returned == IMFFS_OK || returned == IMFFS_INVALID || returned == IMFFS_ERROR || returned == IMFFS_FATAL);
 
     return returned;
 }
@@ -245,39 +420,93 @@ IMFFSResult imffs_dir(IMFFSPtr fs)
 
     if(NULL != fs)
     {
-        void *key;
+        pthread_rwlock_rdlock(&fs->lock);
+
         int total_bytes = 0;
-        if (mm_get_first_key(fs->index, &key) > 0) 
+        if (mm_count_keys(fs->index) > 0) 
         {
             printf("-----------------------------------------\n");
-            do
-            {
-                printf("File Name: %s\n",(((KeyHolder*)key)->file_name));
-                total_bytes += ((KeyHolder*)key)->file_byte_size;
+            mm_foreach(fs->index, print_dir_entry, &total_bytes);
+            printf("\n");
+        }
+        else
+        {
+            printf("No files saved in IMFFS\n");
+        }
 
-                printf("File Size: %lu bytes\n",((KeyHolder*)key)->file_byte_size);
-                //calculate the number of blocks the easy way.
-                printf("Blocks: %d\n",get_block_number(((KeyHolder*)key)->file_byte_size));
+        printf("Total bytes: %d\n",total_bytes);
 
-                printf("Chunks: %d\n",mm_count_values(fs->index,key));
-                printf("-----------------------------------------\n");
-            } while (mm_get_next_key(fs->index, &key) > 0);
+        pthread_rwlock_unlock(&fs->lock);
+    }
+    else
+    {
+        returned = IMFFS_INVALID;
+    }
+
+    assert(returned == IMFFS_OK || returned == IMFFS_INVALID);
+    return returned;
+}
+
+// dir pattern lists the files that match the pattern, walking only the part of the index that starts with its literal prefix
+IMFFSResult imffs_dir_matching(IMFFSPtr fs, char *pattern)
+{
+    IMFFSResult returned = IMFFS_OK;
+    assert(NULL != fs);
+    assert(NULL != pattern);
+
+    if(NULL != fs && NULL != pattern)
+    {
+        KeyHolder start;
+        //the literal part of the pattern, up to its first wildcard.
+        if(kn_set_length(&start.name, pattern, strcspn(pattern, "*?")) != 0)
+        {
+            return IMFFS_FATAL;
+        }
 
+        lock_index_for_reading(fs);
+
+        void *key;
+        MMCursor cursor;
+        int total_bytes = 0;
+        int matches = 0;
+        int more = mm_lower_bound(fs->index, &cursor, &start, &key);
+
+        //the names with the prefix are all together, from the first one on.
+        while(more > 0 && kn_has_prefix(&((KeyHolder*)key)->name, &start.name))
+        {
+            if(kn_glob(&((KeyHolder*)key)->name, pattern))
+            {
+                if(matches == 0)
+                {
+                    printf("-----------------------------------------\n");
+                }
+                print_dir_entry(key, mm_count_values(fs->index, key), &total_bytes);
+                matches++;
+            }
+            more = mm_cursor_next(fs->index, &cursor, &key);
+        }
+
+        if(matches > 0)
+        {
             printf("\n");
         }
         else
         {
-            printf("No files saved in IMFFS\n");
+            printf("No files matching \"%s\" in IMFFS\n",pattern);
         }
 
         printf("Total bytes: %d\n",total_bytes);
+
+        pthread_rwlock_unlock(&fs->lock);
+        kn_clear(&start.name);
     }
     else
     {
         returned = IMFFS_INVALID;
     }
 
-    assert(returned == IMFFS_OK || returned == IMFFS_INVALID);
+    assert(returned == IMFFS_OK || returned == IMFFS_INVALID || returned == IMFFS_FATAL);
+
     return returned;
 }
 
@@ -291,10 +520,12 @@ IMFFSResult imffs_load(IMFFSPtr fs, char *imffsfile, char *diskfile)
 
     if(NULL != fs && NULL != imffsfile && NULL != diskfile)
     {
+        lock_index_for_reading(fs);
+
         void *key;
 
         //if the key is found.
-        if(get_key__with_name(fs->index,imffsfile,&key) == 0)
+        if(get_key__with_name(fs,imffsfile,&key) == 0)
         {
             FILE *out;
             out = fopen(diskfile,"w");
@@ -315,6 +546,8 @@ IMFFSResult imffs_load(IMFFSPtr fs, char *imffsfile, char *diskfile)
             printf("File with the name \"%s\" does not exist in IMFFS.\n",imffsfile);
             returned = IMFFS_ERROR;
         }
+
+        pthread_rwlock_unlock(&fs->lock);
     }
     else
     {
@@ -335,10 +568,12 @@ IMFFSResult imffs_delete(IMFFSPtr fs, char *imffsfile)
 
     if(NULL != fs && NULL != imffsfile)
     {
+        pthread_rwlock_wrlock(&fs->lock);
+
         void *key;
 
         //if the key is found.
-        if(get_key__with_name(fs->index,imffsfile,&key) == 0)
+        if(get_key__with_name(fs,imffsfile,&key) == 0)
         {
             //removes the values and key from the multimap.
             remove_values_and_key(fs,key);
@@ -348,6 +583,8 @@ IMFFSResult imffs_delete(IMFFSPtr fs, char *imffsfile)
             fprintf(stderr,"Error! File with the name: \"%s\" does not exist.\n",imffsfile);
             returned = IMFFS_ERROR;
         }
+
+        pthread_rwlock_unlock(&fs->lock);
     }
     else
     {
@@ -368,16 +605,19 @@ IMFFSResult imffs_fulldir(IMFFSPtr fs)
 
     if(NULL != fs)
     {
+        pthread_rwlock_rdlock(&fs->lock);
+
         void *key;
+        MMCursor cursor;
         int num_chunks;
         int total_bytes = 0;
 
-        if (mm_get_first_key(fs->index, &key) > 0) 
+        if (mm_cursor_first(fs->index, &cursor, &key) > 0) 
         {
             printf("-------------------------------------\n");
             do
             {
-                printf("File Name:%s\n",(((KeyHolder*)key)->file_name));
+                printf("File Name:%s\n",kn_name(&((KeyHolder*)key)->name));
                 total_bytes += ((KeyHolder*)key)->file_byte_size;
 
                 printf("File Size: %lu bytes\n",((KeyHolder*)key)->file_byte_size);
@@ -387,10 +627,10 @@ IMFFSResult imffs_fulldir(IMFFSPtr fs)
                 printf("Total Blocks: %d\n",get_block_number(((KeyHolder*)key)->file_byte_size));
                 printf("Total Chunks: %d\n",num_chunks);
 
-                print_chunks_info(fs->index,key,num_chunks);
+                print_chunks_info(fs->index,key);
                 printf("-----------------------------------------\n");
 
-            } while (mm_get_next_key(fs->index, &key) > 0);
+            } while (mm_cursor_next(fs->index, &cursor, &key) > 0);
 
             printf("\n");
         }
@@ -400,6 +640,8 @@ IMFFSResult imffs_fulldir(IMFFSPtr fs)
         }
 
         printf("Total bytes: %d\n",total_bytes);
+
+        pthread_rwlock_unlock(&fs->lock);
     }
     else
     {
@@ -411,6 +653,185 @@ IMFFSResult imffs_fulldir(IMFFSPtr fs)
     return returned;
 }
 
+// statfs copies the usage counters of the device into stats, without walking the files.
+IMFFSResult imffs_statfs(IMFFSPtr fs, IMFFSStatfs *stats)
+{
+    assert(NULL != fs);
+    assert(NULL != stats);
+
+    IMFFSResult returned = IMFFS_OK;
+
+    if(NULL != fs && NULL != stats)
+    {
+        //the free space is kept by the space index as the groups change, and copied while the rest can't change.
+        pthread_rwlock_rdlock(&fs->lock);
+        *stats = fs->usage;
+        gs_totals(fs->space, &stats->free_blocks, &stats->largest_free_run, NULL);
+        pthread_rwlock_unlock(&fs->lock);
+
+        stats->used_blocks = fs->block_count - stats->free_blocks;
+    }
+    else
+    {
+        returned = IMFFS_INVALID;
+    }
+
+    return returned;
+}
+
+// copies the allocator counters of the device into stats
+IMFFSResult imffs_alloc_stats(IMFFSPtr fs, IMFFSAllocStats *stats)
+{
+    assert(NULL != fs);
+    assert(NULL != stats);
+
+    IMFFSResult returned = IMFFS_OK;
+
+    if(NULL != fs && NULL != stats)
+    {
+        long long search_steps;
+
+        //the searching is counted by the groups, and added up by the space index.
+        pthread_rwlock_rdlock(&fs->lock);
+        *stats = fs->stats;
+        gs_totals(fs->space, NULL, NULL, &search_steps);
+        pthread_rwlock_unlock(&fs->lock);
+
+        stats->search_steps += search_steps;
+    }
+    else
+    {
+        returned = IMFFS_INVALID;
+    }
+
+    return returned;
+}
+
+// block owner looks the block up in the owner map, without the index
+IMFFSResult imffs_block_owner(IMFFSPtr fs, uint32_t block, char *name, int name_size, int *order)
+{
+    assert(NULL != fs);
+    assert(NULL != name);
+    assert(name_size > 0);
+    assert(NULL != order);
+
+    IMFFSResult returned = IMFFS_OK;
+
+    if(NULL != fs && NULL != name && name_size > 0 && NULL != order)
+    {
+        pthread_rwlock_rdlock(&fs->lock);
+
+        if(block < (uint32_t)fs->block_count)
+        {
+            KeyHolder *key = om_file(fs->owners, om_owner(fs->owners, block));
+
+            if(NULL != key)
+            {
+                snprintf(name, name_size, "%s", kn_name(&key->name));
+                *order = om_order(fs->owners, block);
+            }
+            else
+            {
+                name[0] = '\0';
+                *order = -1;
+            }
+        }
+        else
+        {
+            returned = IMFFS_ERROR;
+        }
+
+        pthread_rwlock_unlock(&fs->lock);
+    }
+    else
+    {
+        returned = IMFFS_INVALID;
+    }
+
+    assert(returned == IMFFS_OK || returned == IMFFS_ERROR || returned == IMFFS_INVALID);
+
+    return returned;
+}
+
+// check goes through the index and then through every block, comparing them with the owner map
+IMFFSResult imffs_check(IMFFSPtr fs)
+{
+    assert(NULL != fs);
+
+    IMFFSResult returned = IMFFS_OK;
+
+    if(NULL != fs)
+    {
+        //saves hold the layout lock from taking their blocks until the blocks are in the index.
+        pthread_rwlock_wrlock(&fs->layout_lock);
+        pthread_rwlock_rdlock(&fs->lock);
+
+        void *key;
+        MMCursor cursor;
+        int problems = 0;
+        int owned = 0;
+        int more = mm_cursor_first(fs->index, &cursor, &key);
+
+        while(more > 0)
+        {
+            KeyHolder *file = key;
+            CheckState state = {fs, file, 0, 0};
+
+            if(om_file(fs->owners, file->id) != file)
+            {
+                fprintf(stderr, "\"%s\" doesn't have its id %u in the owner map\n", kn_name(&file->name), file->id);
+                problems++;
+            }
+            mm_for_each_value(fs->index, key, check_chunk, &state);
+            problems += state.problems;
+            if(state.order != file->blocks)
+            {
+                fprintf(stderr, "\"%s\" has %d blocks in the index but %d were added\n", kn_name(&file->name), state.order, file->blocks);
+                problems++;
+            }
+            owned += state.order;
+            more = mm_cursor_next(fs->index, &cursor, &key);
+        }
+
+        //a block is used exactly when a file has it.
+        for(int b=0; b < fs->block_count; b++)
+        {
+            Boolean has_owner = (om_owner(fs->owners, b) != 0) ? TRUE : FALSE;
+
+            if(has_owner)
+            {
+                owned--;
+            }
+            if(has_owner == (ag_is_free(fs->groups[group_of(fs, b)], b) ? TRUE : FALSE))
+            {
+                fprintf(stderr, "Block %d is %s but %s\n", b, has_owner ? "free" : "used", has_owner ? "a file has it" : "no file has it");
+                problems++;
+            }
+        }
+        if(owned != 0)
+        {
+            fprintf(stderr, "The owner map has %d more blocks than the index\n", -owned);
+            problems++;
+        }
+
+        pthread_rwlock_unlock(&fs->lock);
+        pthread_rwlock_unlock(&fs->layout_lock);
+
+        if(problems > 0)
+        {
+            returned = IMFFS_ERROR;
+        }
+    }
+    else
+    {
+        returned = IMFFS_INVALID;
+    }
+
+    assert(returned == IMFFS_OK || returned == IMFFS_ERROR || returned == IMFFS_INVALID);
+
+    return returned;
+}
+
 // quit will quit the program: clean up the data structures
 IMFFSResult imffs_destroy(IMFFSPtr fs)
 {
@@ -427,18 +848,28 @@ IMFFSResult imffs_destroy(IMFFSPtr fs)
                 //remove the key
                 mm_remove_key(fs->index,key);
                 //free the name
-                free(((KeyHolder*)key)->file_name);
+                kn_clear(&((KeyHolder*)key)->name);
                 //free the key struct as a whole
                 free((KeyHolder*)key); 
             } while (mm_get_next_key(fs->index, &key) > 0);
         }
 
-        //free the multimap
+        //free the multimap and the names pointing into it.
         mm_destroy(fs->index);
+        nh_destroy(fs->names);
+        om_destroy(fs->owners);
         //free the device
         free(fs->device);
-        //free the free blocks.
-        free(fs->free_blocks);
+        //free the allocation groups.
+        for(int i=0; i < fs->group_count; i++)
+        {
+            ag_destroy(fs->groups[i]);
+        }
+        free(fs->groups);
+        gs_destroy(fs->space);
+        pthread_rwlock_destroy(&fs->lock);
+        pthread_rwlock_destroy(&fs->layout_lock);
+        free(fs);
     }
     else
     {
@@ -458,13 +889,18 @@ IMFFSResult imffs_defrag(IMFFSPtr fs)
 
     if(NULL !=fs)
     {
-        //this array keeps track of where each chunk is for a key.(in order)
-        //allocate the array we use to defrag
-        KeyHolder **chunks_arr = malloc(fs->block_count * sizeof(KeyHolder *));
-        //initialize each pointers to null at first.
-        initialize_defrag_pointers_to_null(chunks_arr,fs->block_count);
-        //fill in the defrag array with the keys(in order).
-        fill_chunks_array(fs,chunks_arr);
+        //everything gets moved, so nothing else may look at the device meanwhile.
+        pthread_rwlock_wrlock(&fs->layout_lock);
+        pthread_rwlock_wrlock(&fs->lock);
+        for(int g=0; g < fs->group_count; g++)
+        {
+            ag_lock(fs->groups[g]);
+        }
+
+        //the owner map already says which file has each block and which of its blocks it is, in block order.
+        //defrag moves the blocks around in it as it moves them on the device.
+        uint32_t *chunks_arr = om_owners(fs->owners);
+        int *order_arr = om_orders(fs->owners);
 
         //get the number of keys in the multimap.
         int keys = mm_count_keys(fs->index);
@@ -476,14 +912,19 @@ IMFFSResult imffs_defrag(IMFFSPtr fs)
         {
             //num gets updated each time, it signfies the position in chunks_arr when the defragement file ends.
             //for each call one whole file gets defragemented, hence why  i < keys
-            num =  defrag_operation(fs,chunks_arr,fs->block_count,num);
+            num =  defrag_operation(fs,chunks_arr,order_arr,fs->block_count,num);
             i++;
         }
 
         //reconstruct the index, destroy the earlier one.
         returned = reconstruct_index(fs,chunks_arr); // can return fatal if we run out of malloc memory.
 
-        free(chunks_arr);
+        for(int g=0; g < fs->group_count; g++)
+        {
+            unlock_group(fs, g);
+        }
+        pthread_rwlock_unlock(&fs->lock);
+        pthread_rwlock_unlock(&fs->layout_lock);
     }
     else
     {
@@ -499,56 +940,54 @@ IMFFSResult imffs_defrag(IMFFSPtr fs)
  * PURPOSE: this defrags one file at a time.
  * INPUT PARAMETERS:
  *    chunkz_arr: the key array
+ *    order_arr: the position of each block within its file
  *    size: size of chunks_arr
  *    pos: the starting position of the fragmented datas in the file.
  */
 
-int defrag_operation(IMFFSPtr fs, KeyHolder **chunks_arr, int size, int pos)
+int defrag_operation(IMFFSPtr fs, uint32_t *chunks_arr, int *order_arr, int size, int pos)
 {
     //find the position of they key to be moved. using pos as starting position. 
     //for example at the start pos = 0, the the moved key will be at pos 0. 
     // but as we edit the chunks_arr for each loop call, position will be where the prior file ends(index).
     int moving_key_pos = find_key_to_be_moved(chunks_arr,pos,size); 
 
-    KeyHolder *key = chunks_arr[moving_key_pos];
+    uint32_t key = chunks_arr[moving_key_pos];
     //find an empty space before the moving_key_position.
     int empty_space = find_empty_space(chunks_arr, moving_key_pos);
-    //if its not the position we are in currently.
-    if(empty_space != moving_key_pos)
-    {
-        //move the file from the moving_key_pos to empty space. (it edits the device)
-        move_file_within_device(fs,empty_space,moving_key_pos,chunks_arr);
-    }
 
-    //now we find the key with the same type as the earlier move key.
-    //we are looking for its position
-    //this function gives us the position where the first key with the same type appears.
-    //we do this to preserve order.
-    int new_pos = find_same_type_key(chunks_arr, empty_space+1,size,key);
+    //a file's chunks are not always in block order on the device, so we look for its
+    //blocks in the order they belong to the file, starting from its first one.
+    int order = 0;
+    int new_pos = find_same_type_key(chunks_arr, order_arr, empty_space, size, key, order);
 
     //if there is new same type key left, we loop.
-    while(new_pos > 0)
+    while(new_pos >= 0)
     {
-        //if the space after the prior key is NULL(empty), move the file to that space.
-        if(chunks_arr[empty_space+1] == NULL)
+        if(new_pos != empty_space)
         {
-            //this swaps a single block at a time.
-            move_file_within_device(fs,empty_space+1,new_pos,chunks_arr);
-        }
-        else
-        {
-            //we need to do shifiting
-            shift_chunks_array(fs,empty_space+1,new_pos,chunks_arr);
+            //if the space is empty, move the file to that space.
+            if(chunks_arr[empty_space] == 0)
+            {
+                //this swaps a single block at a time.
+                move_file_within_device(fs,empty_space,new_pos,chunks_arr,order_arr);
+            }
+            else
+            {
+                //we need to do shifiting
+                shift_chunks_array(fs,empty_space,new_pos,chunks_arr,order_arr);
+            }
         }
-        //after shifting the new key, will in empty space+1 so we increment empty space.
+        //after shifting the new key, will in empty space so we increment empty space.
         empty_space++;
+        order++;
         //repeat the process until we have no more keys left.
-        new_pos =  find_same_type_key(chunks_arr,empty_space+1,size,key);
+        new_pos =  find_same_type_key(chunks_arr,order_arr,empty_space,size,key,order);
     }
     
     //returns the space that comes after where the last key value was stored.
     //so we can begin at that exact place when defrag is called again.
-    return empty_space+1;
+    return empty_space;
 }
 
 /**
@@ -558,13 +997,15 @@ int defrag_operation(IMFFSPtr fs, KeyHolder **chunks_arr, int size, int pos)
  *    index_from: where the file being move is located
  *     chunkz_arr: the array of the keys
  */
-void move_file_within_device(IMFFSPtr fs, int index_to, int index_from, KeyHolder **chunks_arr)
+void move_file_within_device(IMFFSPtr fs, int index_to, int index_from, uint32_t *chunks_arr, int *order_arr)
 {
    //copy the data
-   memcpy(fs->device +(index_to * BLOCK_BYTE_SIZE), fs->device+(index_from*BLOCK_BYTE_SIZE), BLOCK_BYTE_SIZE);
+   memcpy(fs->device +((size_t)index_to * BLOCK_BYTE_SIZE), fs->device+((size_t)index_from*BLOCK_BYTE_SIZE), BLOCK_BYTE_SIZE);
    //update the position in the chunk array.
    chunks_arr[index_to] = chunks_arr[index_from];
-   chunks_arr[index_from] = NULL;
+   order_arr[index_to] = order_arr[index_from];
+   chunks_arr[index_from] = 0;
+   order_arr[index_from] = -1;
 }
 
 /**
@@ -573,145 +1014,120 @@ void move_file_within_device(IMFFSPtr fs, int index_to, int index_from, KeyHolde
  *    from: where the shift begins
  *    to: where the shift ends
  */
-void shift_chunks_array(IMFFSPtr fs, int from, int to, KeyHolder **chunks_arr)
+void shift_chunks_array(IMFFSPtr fs, int from, int to, uint32_t *chunks_arr, int *order_arr)
 {
     //store one block in a temporary pointer.
     uint8_t *temp_file = malloc(BLOCK_BYTE_SIZE);
     //read in the temp file.
-    memcpy(temp_file, fs->device+(to*BLOCK_BYTE_SIZE), BLOCK_BYTE_SIZE);
+    memcpy(temp_file, fs->device+((size_t)to*BLOCK_BYTE_SIZE), BLOCK_BYTE_SIZE);
 
-    KeyHolder *tempKey = chunks_arr[to];
+    uint32_t tempKey = chunks_arr[to];
+    int tempOrder = order_arr[to];
     //shift the defrag array with the files.
     int move_to = to;
     //do the shifting operation
     for(int i=to-1; i >= from; i--)
     {
-        if(chunks_arr[i] != NULL)
+        if(chunks_arr[i] != 0)
         {
-            move_file_within_device(fs, move_to,i,chunks_arr);
+            move_file_within_device(fs, move_to,i,chunks_arr,order_arr);
             move_to = i;
         }
     }
 
     //finally copy back the data to the device.
-    memcpy(fs->device+(from*BLOCK_BYTE_SIZE),temp_file,BLOCK_BYTE_SIZE);
+    memcpy(fs->device+((size_t)from*BLOCK_BYTE_SIZE),temp_file,BLOCK_BYTE_SIZE);
     //and also update the defrag array position.
     chunks_arr[from] = tempKey;
+    order_arr[from] = tempOrder;
     free(temp_file);
 }
 
-void initialize_defrag_pointers_to_null(KeyHolder **chunks_arr, int size)
-{
-    for(int i=0; i < size; i++)
-    {
-        chunks_arr[i] = NULL;
-    }
-}
-
-
-//this fills in the defrag array with the memory address of the key pointers.
-void fill_chunks_array(IMFFSPtr fs, KeyHolder **chunks_arr)
-{
-    void *key;
-    Value *values;
-    int num_values;
-    int starting_block;
-
-    if (mm_get_first_key(fs->index, &key) > 0) 
-    {
-         do
-        {
-            num_values = mm_count_values(fs->index,key);
-            values = malloc(num_values * sizeof(Value));
-            mm_get_values(fs->index,key,values,num_values);
-
-            for(int i=0; i < num_values; i++)
-            {
-                //get the block where chunk starts at.
-                starting_block = (uint8_t*)(values[i].data) - (fs->device);
-                starting_block = starting_block/BLOCK_BYTE_SIZE; 
-                //and add the key to the defrag array using the starting_block and total number of blocks in that chunk.
-                add_keys_to_chunks_array(chunks_arr, key, starting_block, values[i].num);
-            }
-
-        } while (mm_get_next_key(fs->index, &key) > 0);
-    }
-}
-
-//this adds each chunk to chunk array.
-void add_keys_to_chunks_array(KeyHolder **chunks_arr, void *key, int starting_block, int blocks)
-{
-    for(int i=starting_block; i < starting_block+blocks; i++)
-    {
-        chunks_arr[i] = key;
-    }
-}
-
-
 /**
  * PURPOSE: Deletes the prior index, and reconstructs a new one for the degramented datas.
+ *          Every file is one chunk now, so the new index is loaded all at once with mm_bulk_load.
  */
-IMFFSResult reconstruct_index(IMFFSPtr fs,KeyHolder **chunks_arr)
+IMFFSResult reconstruct_index(IMFFSPtr fs,uint32_t *chunks_arr)
 {
     IMFFSResult returned = IMFFS_OK;
-    //we don't free the keys as they will be used again.
-    mm_destroy(fs->index);
-    //create new index.
-    fs->index = mm_create(fs->block_count,compare_keys, compare_values_always_greater); 
+    int max_files = mm_count_keys(fs->index);
+    MMEntry *entries = malloc(max_files * sizeof(MMEntry) + 1);
+    Value *chunks = malloc(max_files * sizeof(Value) + 1);
+    Multimap *index = NULL;
 
-    if(fs->index != NULL)
+    if(entries != NULL && chunks != NULL)
     {
         int i=0;
-        KeyHolder *key;
-        int blocks = 0;
         int starting;
         int total_blocks = 0; //used to occupy the free blocks array.
+        int num_files = 0;
 
-        while(chunks_arr[i] != NULL)
+        while(i < fs->block_count && chunks_arr[i] != 0)
         {
-            key = chunks_arr[i];
             starting = i;
 
             //since the data now packed in contiguous blocks, we can just count how many blocks there are
-            while(chunks_arr[i] == key)
+            while(i < fs->block_count && chunks_arr[i] == chunks_arr[starting])
             {
-                blocks++;
                 i++;
             }
-            //insert the key
-            mm_insert_value(fs->index,key,blocks,fs->device+(starting*BLOCK_BYTE_SIZE));
+            chunks[num_files].num = i - starting;
+            chunks[num_files].data = fs->device+((size_t)starting*BLOCK_BYTE_SIZE);
+            entries[num_files].key = om_file(fs->owners, chunks_arr[starting]);
+            entries[num_files].num_values = 1;
+            entries[num_files].values = &chunks[num_files];
+            num_files++;
             //increment total blocks.
-            total_blocks += blocks;
-            //make it 0, to count set of blocks for another key.
-            blocks = 0;
+            total_blocks += i - starting;
         }
 
-        //make the free blocks all free.
-        initialize_free_blocks(fs->free_blocks, fs->block_count);
-
-        //now since we know that all blocks are contiguous blocks. We can just occupy 0-blocks-1 index in free blocks tracker array.
-        for(int i=0; i < total_blocks; i++)
+        //the files are in block order, not name order, so they get sorted.
+        index = mm_bulk_load(fs->block_count, compare_keys, compare_values_always_greater, entries, num_files, 0);
+        if(index != NULL)
         {
-            fs->free_blocks[i] = 'N';
-        }
-    }
-    else
+            //we don't free the keys as they are used again, so fs->names still holds the right keys.
+            mm_destroy(fs->index);
+            fs->index = index;
+            mm_freeze(fs->index, key_fingerprint);
+            fs->stale_reads = 0;
+
+            //now since we know that all blocks are contiguous blocks, the groups are used up to total_blocks and free after it.
+            for(int g=0; g < fs->group_count; g++)
+            {
+                if(ag_reset(fs->groups[g], total_blocks) != 0)
+                {
+                    returned = IMFFS_FATAL;
+                }
+            }
+
+            //every file is one chunk now.
+            fs->usage.extents = num_files;
+        }
+        else
+        {
+            returned = IMFFS_FATAL;
+        }
+    }
+    else
     {
         returned = IMFFS_FATAL;
     }
 
+    free(entries);
+    free(chunks);
+
     return returned;
 }
 
 
-int find_same_type_key(KeyHolder **chunks_arr, int start, int size, KeyHolder *key)
+int find_same_type_key(uint32_t *chunks_arr, int *order_arr, int start, int size, uint32_t key, int order)
 {
     Boolean found = FALSE;
     int i = start;
-    //find a key with the same type of parameter key starting from position start.
+    //find the block "order" of the parameter key, starting from position start.
     while(!found && i < size)
     {
-        if(chunks_arr[i] != NULL && chunks_arr[i] == key)
+        if(chunks_arr[i] == key && order_arr[i] == order)
         {
             found = TRUE;
         }
@@ -728,14 +1144,14 @@ int find_same_type_key(KeyHolder **chunks_arr, int start, int size, KeyHolder *k
 }
 
 //find empty space in chunks_array
-int find_empty_space(KeyHolder **chunks_arr, int end)
+int find_empty_space(uint32_t *chunks_arr, int end)
 {
     Boolean found = FALSE;
     int i = 0;
 
     while(!found && i < end)
     {
-        if(chunks_arr[i] == NULL)
+        if(chunks_arr[i] == 0)
         {
             found = TRUE;
         }
@@ -754,14 +1170,14 @@ int find_empty_space(KeyHolder **chunks_arr, int end)
  *    starting: where the search should beging
  *    size: size of array
  */
-int find_key_to_be_moved(KeyHolder **chunks_arr, int starting, int size)
+int find_key_to_be_moved(uint32_t *chunks_arr, int starting, int size)
 {
     Boolean found =FALSE;
     int i=starting;
 
     while(!found && i < size)
     {
-        if(chunks_arr[i] != NULL)
+        if(chunks_arr[i] != 0)
         {
             found = TRUE;
         }
@@ -776,69 +1192,71 @@ int find_key_to_be_moved(KeyHolder **chunks_arr, int starting, int size)
 }
 
 
-void initialize_free_blocks(uint8_t *free_blocks, int block_count)
+void initialize_free_blocks(uint64_t *free_blocks, int block_count)
 {
-    //Y represents free
-    //N represents occupied
-    for(int i=0; i < block_count; i++)
-    {
-        free_blocks[i] = 'Y';
-    }
+    //a set bit represents free
+    //a cleared bit represents occupied
+    fm_init(free_blocks, block_count);
 }
 
 //this returns the position of the first free space found.
 //returns -1 on error
-int find_free_space(uint8_t *free_blocks, int block_count)
+int find_free_space(uint64_t *free_blocks, int block_count)
 {
     assert(NULL != free_blocks);
 
-    if(NULL != free_blocks)
-    {
-        for(int i=0; i < block_count; i++)
-        {
-            if(free_blocks[i] == 'Y')
-            {
-                return i;
-            }
-        }
-    }
-    return -1;
+    return fm_find_free(free_blocks, block_count, 0);
+}
+
+//this returns the position of the first run of at least "blocks" free blocks.
+//returns -1 if there is no such run.
+int find_free_run(uint64_t *free_blocks, int block_count, int blocks)
+{
+    assert(NULL != free_blocks);
+
+    return fm_find_run(free_blocks, block_count, blocks, 0);
 }
 
 
 //this finds a file with a name
-Boolean file_name_exists(Multimap *index , char *file)
+Boolean file_name_exists(IMFFSPtr fs, char *file)
 {
-    Boolean found = FALSE;
-    void *key;
+    return (NULL != nh_find(fs->names, file)) ? TRUE : FALSE;
+}
 
-     if (mm_get_first_key(index, &key) > 0) 
-    {
-        do
-        {
-            if(strcasecmp(((KeyHolder *)key)->file_name,file) == 0)
-            {
-                found = TRUE;
-            }
+//prints one file for dir, called by mm_foreach on each key.
+int print_dir_entry(void *key, int num_values, void *total_bytes)
+{
+    printf("File Name: %s\n",kn_name(&((KeyHolder*)key)->name));
+    *(int*)total_bytes += ((KeyHolder*)key)->file_byte_size;
 
-        } while (mm_get_next_key(index, &key) > 0 && !found);
-    }
+    printf("File Size: %lu bytes\n",((KeyHolder*)key)->file_byte_size);
+    //calculate the number of blocks the easy way.
+    printf("Blocks: %d\n",get_block_number(((KeyHolder*)key)->file_byte_size));
 
-    return found;
+    printf("Chunks: %d\n",num_values);
+    printf("-----------------------------------------\n");
+
+    return 0;
 }
 
-void print_chunks_info(Multimap *mm, void *key, int size)
+void print_chunks_info(Multimap *mm, void *key)
 {
-    Value values[size];
+    int chunk_number = 0;
 
-    mm_get_values(mm,key,values,size);
-    
-    for(int i=0; i < size; i++)
-    {
-        printf("Chunk: %d  ",i+1);
-        printf("Place: %p  ", values[i].data);
-        printf("Blocks used: %d\n",values[i].num);
-    }
+    //the chunks are read where they are, however many there are.
+    mm_for_each_value(mm,key,print_chunk,&chunk_number);
+}
+
+//prints one chunk for fulldir, called by mm_for_each_value.
+int print_chunk(const Value *chunk, void *chunk_number)
+{
+    (*(int*)chunk_number)++;
+    printf("Chunk: %d  ",*(int*)chunk_number);
+    printf("Place: %p  ", chunk->data);
+    printf("Blocks used: %d\n",chunk->num);
+
+    return 0;
 }
 
 //this uses an efficient algorithm to calculate the block_numbers
@@ -863,150 +1281,731 @@ int get_block_number(int file_size)
 }
 
 
-int get_key__with_name(Multimap *mm, char *name, void **key)
+int get_key__with_name(IMFFSPtr fs, char *name, void **key)
 {
-    int returned = 0;
-    Boolean found = FALSE;
+    *key = nh_find(fs->names, name);
+
+    return (NULL != *key) ? 0 : -1;
+}
 
-    if (mm_get_first_key(mm, &(*key)) > 0) 
-       {
-        do
+
+//this adds contents to the file, used in the IMFFS_SAVE function.
+//a stream is read STAGE_BLOCKS blocks at a time, and space is only picked once a batch is read (or the stream ends),
+//so the allocator can give the whole batch one run instead of taking the first free block for each block.
+IMFFSResult add_contents_to_device(FILE *source, IMFFSPtr fs, char *name, int group)
+{
+    assert(NULL != source);
+    assert(NULL != fs);
+    assert(NULL!=name);
+    IMFFSResult returned = IMFFS_OK;
+
+    if(NULL != source && NULL != fs && NULL != name)
+    {
+        uint8_t *stage = malloc(STAGE_BLOCKS * BLOCK_BYTE_SIZE);
+        Value *batch = malloc(STAGE_BLOCKS * sizeof(Value));
+        int capacity = STAGE_BLOCKS;
+        Value *extents = malloc(capacity * sizeof(Value)); //all the chunks of the file so far, in order.
+        int num_extents = 0;
+        int batch_extents;
+        long total_byte_size = 0;
+        long staged;
+        long offset;
+        long chunk_bytes;
+        int blocks;
+        IMFFSAllocStats placed = {0, 0, 0, 0, 0};
+
+        if(NULL == stage || NULL == batch || NULL == extents)
         {
-            if(strcasecmp(((KeyHolder*)(*key))->file_name,name) == 0)
+            returned = IMFFS_FATAL;
+        }
+        else
+        {
+            //every batch starts looking in the same group.
+            group = pick_group(fs, group);
+            pthread_rwlock_rdlock(&fs->layout_lock);
+
+            do
+            {
+                staged = fread(stage,1,STAGE_BLOCKS * BLOCK_BYTE_SIZE,source);
+
+                //an empty stream still gets a block, like an empty file does.
+                if(staged > 0 || num_extents == 0)
+                {
+                    blocks = get_block_number(staged);
+                    batch_extents = place_batch(fs, blocks, extents, num_extents, batch, group, &placed);
+
+                    if(batch_extents < 0)
+                    {
+                        fprintf(stderr,"Error! Not enough space to store the file: \"%s\"\n",name);
+                        returned = IMFFS_ERROR;
+                    }
+                    else
+                    {
+                        //copy the batch in, then add its chunks to the file, joining the first one to the last chunk if they touch.
+                        offset = 0;
+                        for(int i=0; i < batch_extents; i++)
+                        {
+                            chunk_bytes = (long)batch[i].num * BLOCK_BYTE_SIZE;
+                            if(chunk_bytes > staged - offset)
+                            {
+                                chunk_bytes = staged - offset;
+                            }
+                            memcpy(batch[i].data, stage + offset, chunk_bytes);
+                            offset += chunk_bytes;
+
+                            if(num_extents > 0 && (uint8_t*)extents[num_extents-1].data + (size_t)extents[num_extents-1].num * BLOCK_BYTE_SIZE == (uint8_t*)batch[i].data)
+                            {
+                                extents[num_extents-1].num += batch[i].num;
+                            }
+                            else
+                            {
+                                if(num_extents == capacity)
+                                {
+                                    Value *grown = realloc(extents, 2 * capacity * sizeof(Value));
+                                    if(NULL == grown)
+                                    {
+                                        //the chunk isn't recorded, so give it back here; the rest goes below.
+                                        release_extents(fs, &batch[i], batch_extents - i);
+                                        returned = IMFFS_FATAL;
+                                        break;
+                                    }
+                                    extents = grown;
+                                    capacity *= 2;
+                                }
+                                extents[num_extents] = batch[i];
+                                num_extents++;
+                            }
+                        }
+                        total_byte_size += staged;
+                    }
+                }
+            } while(returned == IMFFS_OK && staged == STAGE_BLOCKS * BLOCK_BYTE_SIZE);
+
+            //the counters are for the whole file, not for each batch.
+            placed.files_placed = 1;
+            placed.extents_created = num_extents;
+            placed.files_fragmented = (num_extents > 1) ? 1 : 0;
+
+            pthread_rwlock_wrlock(&fs->lock);
+            add_alloc_stats(&fs->stats, &placed);
+
+            //someone may have saved a file with the same name since we looked.
+            if(returned == IMFFS_OK && file_name_exists(fs,name))
             {
-                found = TRUE;
+                fprintf(stderr,"Error! File with the name \"%s\" already exists in IMFFS.\n",name);
+                returned = IMFFS_ERROR;
             }
-        } while (!found && mm_get_next_key(mm, &(*key)) > 0);
-    }
 
-    if(!found)
+            if(returned == IMFFS_OK)
+            {
+                KeyHolder *key = malloc(sizeof(KeyHolder));
+                if(NULL != key && name_new_file(fs,key,name) == 0)
+                {
+                    for(int i=0; i < num_extents; i++)
+                    {
+                        add_chunk_to_file(fs,key,extents[i].num,extents[i].data);
+                    }
+                    key->file_byte_size = total_byte_size;
+                    count_new_file(fs,key);
+                }
+                else
+                {
+                    free(key);
+                    returned = IMFFS_FATAL;
+                }
+            }
+
+            if(returned != IMFFS_OK)
+            {
+                //if we get here the file is not fully read (or can't be named), so give its space back.
+                release_extents(fs, extents, num_extents);
+            }
+
+            pthread_rwlock_unlock(&fs->lock);
+            pthread_rwlock_unlock(&fs->layout_lock);
+        }
+
+        free(stage);
+        free(batch);
+        free(extents);
+    }
+    else
     {
-        returned = -1;
+        returned = IMFFS_INVALID;
     }
+    
+    assert(returned == IMFFS_OK || returned == IMFFS_ERROR || returned == IMFFS_INVALID || returned == IMFFS_FATAL);
 
     return returned;
 }
 
+/**
+ * PURPOSE: this reserves space for one batch of a stream. The batch goes right after the last chunk of the
+ *          file if those blocks are free, otherwise wherever the policy of the device puts it.
+ * INPUT PARAMETERS:
+ * blocks: the number of blocks in the batch
+ * extents, num_extents: the chunks of the file so far
+ * batch: filled in with the chunks of the batch, in block order. It must have room for "blocks" values.
+ * RETURNS: the number of chunks in batch, or -1 if there is not enough space.
+ */
+int place_batch(IMFFSPtr fs, int blocks, Value *extents, int num_extents, Value *batch, int group, IMFFSAllocStats *stats)
+{
+    int end;
+    int batch_extents;
+    long long started = now_nanoseconds();
 
-//this adds contents to the file, used in the IMFFS_SAVE function.
-IMFFSResult add_contents_to_device(FILE *source, IMFFSPtr fs, char *name)
+    if(num_extents > 0)
+    {
+        end = ((uint8_t*)extents[num_extents-1].data - fs->device) / BLOCK_BYTE_SIZE + extents[num_extents-1].num;
+        if(extend_chunk(fs, end, blocks))
+        {
+            batch[0].num = blocks;
+            batch[0].data = fs->device + ((size_t)end * BLOCK_BYTE_SIZE);
+            stats->alloc_nanoseconds += now_nanoseconds() - started;
+            return 1;
+        }
+    }
+
+    //reserve_extents times itself.
+    batch_extents = reserve_extents(fs, blocks, batch, group, stats);
+    return batch_extents;
+}
+
+/**
+ * PURPOSE: this reserves space for a file of a known size, using the policy of the device.
+ *          The file goes in one group if a group can hold it, starting with the chosen one;
+ *          otherwise it spills over from the chosen group into the ones after it.
+ *          Nothing is kept if the space isn't there.
+ * INPUT PARAMETERS:
+ * blocks: the number of blocks needed
+ * extents: filled in with the reserved chunks in block order, it must have room for "blocks" values.
+ * group: the group to start in, or -1 for the next one round-robin.
+ * stats: the allocator counters to add this reservation to.
+ * RETURNS: the number of extents reserved, or -1 if there is not enough space.
+ */
+int reserve_extents(IMFFSPtr fs, int blocks, Value *extents, int group, IMFFSAllocStats *stats)
+{
+    assert(NULL != fs);
+    assert(NULL != extents);
+    assert(NULL != stats);
+    assert(blocks > 0);
+
+    int num_extents = 0;
+    int reserved = 0;
+    int taken;
+    int g;
+    AllocGroup *candidate;
+    Boolean in_one_run = (fs->policy != IMFFS_ALLOC_BUDDY);
+    long long started = now_nanoseconds();
+
+    group = pick_group(fs, group);
+
+    //only the groups the space index says can take the file are locked, and checked again once they are.
+    for(int i = next_group_with_space(fs, group, 0, blocks, in_one_run); i < fs->group_count && reserved == 0;
+        i = next_group_with_space(fs, group, i + 1, blocks, in_one_run))
+    {
+        g = (group + i) % fs->group_count;
+        candidate = fs->groups[g];
+        ag_lock(candidate);
+        if(group_fits(fs, candidate, blocks))
+        {
+            num_extents = reserve_in_group(fs, candidate, blocks, extents, 0);
+            reserved = blocks;
+        }
+        unlock_group(fs, g);
+    }
+
+    for(int i = next_group_with_space(fs, group, 0, 1, FALSE); i < fs->group_count && reserved < blocks;
+        i = next_group_with_space(fs, group, i + 1, 1, FALSE))
+    {
+        g = (group + i) % fs->group_count;
+        candidate = fs->groups[g];
+        ag_lock(candidate);
+        taken = ag_free_count(candidate);
+        if(taken > blocks - reserved)
+        {
+            taken = blocks - reserved;
+        }
+        if(taken > 0)
+        {
+            num_extents = reserve_in_group(fs, candidate, taken, extents, num_extents);
+            reserved += taken;
+        }
+        unlock_group(fs, g);
+    }
+
+    if(reserved < blocks)
+    {
+        //the device doesn't have the room, so give back what we took.
+        release_extents(fs, extents, num_extents);
+        num_extents = -1;
+    }
+    else
+    {
+        //keep the chunks in block order and join the ones that touch.
+        num_extents = sort_and_merge_extents(extents, num_extents);
+
+        stats->files_placed++;
+        stats->extents_created += num_extents;
+        if(num_extents > 1)
+        {
+            stats->files_fragmented++;
+        }
+    }
+
+    stats->alloc_nanoseconds += now_nanoseconds() - started;
+    return num_extents;
+}
+
+//this tells if a group can take a whole file: in one free run, or in its free clusters for the buddy system.
+//the group's lock is held.
+Boolean group_fits(IMFFSPtr fs, AllocGroup *group, int blocks)
+{
+    int start;
+
+    if(fs->policy == IMFFS_ALLOC_BUDDY)
+    {
+        return ag_free_count(group) >= blocks;
+    }
+    return find_fit(fs, group, blocks, &start) > 0;
+}
+
+//this reserves "blocks" blocks in a group that has that many free, adding them to extents after num_extents.
+//the group's lock is held. returns the number of extents now in the array.
+int reserve_in_group(IMFFSPtr fs, AllocGroup *group, int blocks, Value *extents, int num_extents)
+{
+    assert(ag_free_count(group) >= blocks);
+
+    if(fs->policy == IMFFS_ALLOC_BUDDY)
+    {
+        num_extents = reserve_buddy_clusters(fs, group, blocks, extents, num_extents);
+    }
+    else
+    {
+        num_extents = reserve_runs(fs, group, blocks, extents, num_extents);
+    }
+    return num_extents;
+}
+
+//the blocks go in the free run the policy picks if there is one, otherwise they are spread over the largest runs.
+int reserve_runs(IMFFSPtr fs, AllocGroup *group, int blocks, Value *extents, int num_extents)
+{
+    int start;
+    int length;
+
+    while(blocks > 0)
+    {
+        length = find_fit(fs, group, blocks, &start);
+        if(length == 0)
+        {
+            //no run is big enough for the rest, so take the biggest one there is.
+            length = ag_largest(group, &start);
+            assert(length > 0);
+        }
+        if(length > blocks)
+        {
+            length = blocks;
+        }
+
+        ag_claim(group, start, length);
+        extents[num_extents].num = length;
+        extents[num_extents].data = fs->device + ((size_t)start * BLOCK_BYTE_SIZE);
+        num_extents++;
+        blocks -= length;
+    }
+
+    return num_extents;
+}
+
+//the blocks are split into power-of-two clusters (one for each bit of the count), largest first.
+int reserve_buddy_clusters(IMFFSPtr fs, AllocGroup *group, int blocks, Value *extents, int num_extents)
+{
+    for(int order=BUDDY_MAX_ORDER; order >= 0; order--)
+    {
+        if(blocks & (1 << order))
+        {
+            num_extents = reserve_buddy_cluster(fs, group, order, extents, num_extents);
+        }
+    }
+
+    return num_extents;
+}
+
+//reserves one cluster of 2^order blocks, or two of half the size if no cluster is that big.
+int reserve_buddy_cluster(IMFFSPtr fs, AllocGroup *group, int order, Value *extents, int num_extents)
+{
+    int start = ag_buddy_find(group, order);
+
+    if(start >= 0)
+    {
+        ag_claim(group, start, 1 << order);
+        extents[num_extents].num = 1 << order;
+        extents[num_extents].data = fs->device + ((size_t)start * BLOCK_BYTE_SIZE);
+        num_extents++;
+    }
+    else
+    {
+        //there are enough free blocks (we checked), so a single block always fits.
+        assert(order > 0);
+        num_extents = reserve_buddy_cluster(fs, group, order - 1, extents, num_extents);
+        num_extents = reserve_buddy_cluster(fs, group, order - 1, extents, num_extents);
+    }
+
+    return num_extents;
+}
+
+//this finds a free run in the group that holds "blocks" blocks, the one the policy of the device picks.
+//returns the length of that run (0 if there is none) and copies its start into start.
+int find_fit(IMFFSPtr fs, AllocGroup *group, int blocks, int *start)
+{
+    int length = 0;
+
+    switch(fs->policy)
+    {
+        case IMFFS_ALLOC_FIRST_FIT:
+            length = ag_first_fit(group, blocks, ag_first_block(group), start);
+            break;
+        case IMFFS_ALLOC_NEXT_FIT:
+            length = ag_next_fit(group, blocks, start);
+            break;
+        case IMFFS_ALLOC_WORST_FIT:
+            length = ag_largest(group, start);
+            if(length < blocks)
+            {
+                length = 0;
+            }
+            break;
+        default:
+            length = ag_best_fit(group, blocks, start);
+            break;
+    }
+
+    return length;
+}
+
+//the policies a device can be created with.
+Boolean valid_policy(IMFFSAllocPolicy policy)
+{
+    return policy == IMFFS_ALLOC_BEST_FIT || policy == IMFFS_ALLOC_BUDDY || policy == IMFFS_ALLOC_FIRST_FIT ||
+           policy == IMFFS_ALLOC_NEXT_FIT || policy == IMFFS_ALLOC_WORST_FIT;
+}
+
+//this gives reserved extents back to their groups.
+void release_extents(IMFFSPtr fs, Value *extents, int num_extents)
+{
+    int starting_block;
+
+    for(int i=0; i < num_extents; i++)
+    {
+        starting_block = ((uint8_t*)extents[i].data - fs->device) / BLOCK_BYTE_SIZE;
+        release_blocks(fs, starting_block, extents[i].num);
+    }
+}
+
+//sorts the extents by where they are on the device, and joins the ones that follow each other.
+//returns the number of extents left.
+int sort_and_merge_extents(Value *extents, int num_extents)
+{
+    Value temp;
+    int j;
+    int merged = 0;
+
+    for(int i=1; i < num_extents; i++)
+    {
+        temp = extents[i];
+        j = i - 1;
+        while(j >= 0 && (uint8_t*)extents[j].data > (uint8_t*)temp.data)
+        {
+            extents[j+1] = extents[j];
+            j--;
+        }
+        extents[j+1] = temp;
+    }
+
+    for(int i=0; i < num_extents; i++)
+    {
+        if(merged > 0 && (uint8_t*)extents[merged-1].data + ((size_t)extents[merged-1].num * BLOCK_BYTE_SIZE) == (uint8_t*)extents[i].data)
+        {
+            extents[merged-1].num += extents[i].num;
+        }
+        else
+        {
+            extents[merged] = extents[i];
+            merged++;
+        }
+    }
+
+    return merged;
+}
+
+//this claims the blocks right after a chunk, so the chunk can grow. returns FALSE if they aren't all free.
+Boolean extend_chunk(IMFFSPtr fs, int block, int blocks)
+{
+    Boolean claimed = FALSE;
+    AllocGroup *group;
+
+    //the run has to be inside one group, so it can be claimed under one lock.
+    if(block + blocks <= fs->block_count && group_of(fs, block) == group_of(fs, block + blocks - 1))
+    {
+        group = fs->groups[group_of(fs, block)];
+        ag_lock(group);
+        if(ag_claim(group, block, blocks) == 0)
+        {
+            claimed = TRUE;
+        }
+        unlock_group(fs, group_of(fs, block));
+    }
+
+    return claimed;
+}
+
+//the group a save starts in: the hint if there is one, otherwise the next one round-robin.
+int pick_group(IMFFSPtr fs, int hint)
+{
+    if(hint >= 0)
+    {
+        return hint % fs->group_count;
+    }
+    return __atomic_fetch_add(&fs->next_group, 1, __ATOMIC_RELAXED) % fs->group_count;
+}
+
+//the group a block belongs to.
+int group_of(IMFFSPtr fs, int block)
+{
+    return block / fs->group_blocks;
+}
+
+//gives a group's lock back, once the space index has what the group has free now. every change to a
+//group ends with this, so the index is right for any group nobody holds.
+void unlock_group(IMFFSPtr fs, int g)
+{
+    AllocGroup *group = fs->groups[g];
+
+    gs_update(fs->space, g, ag_free_count(group), ag_largest_length(group), ag_search_steps(group));
+    ag_unlock(group);
+}
+
+//going round the groups from "group", how far along the next group at least "distance" along is that
+//the space index says has a free run of "blocks" blocks (or, without in_one_run, that many free blocks).
+//returns group_count once it is back at "group" without finding one.
+int next_group_with_space(IMFFSPtr fs, int group, int distance, int blocks, Boolean in_one_run)
+{
+    int from = (group + distance) % fs->group_count;
+    int found;
+
+    if(distance >= fs->group_count)
+    {
+        return fs->group_count;
+    }
+
+    found = in_one_run ? gs_find_run(fs->space, blocks, from) : gs_find_free(fs->space, blocks, from);
+    if(found < 0 && from >= group)
+    {
+        //nothing up to the last group, so carry on from the first one.
+        found = in_one_run ? gs_find_run(fs->space, blocks, 0) : gs_find_free(fs->space, blocks, 0);
+    }
+
+    //a group before "from" in the order we go round in means we have been all the way round.
+    if(found < 0 || (found - group + fs->group_count) % fs->group_count < distance)
+    {
+        return fs->group_count;
+    }
+    return (found - group + fs->group_count) % fs->group_count;
+}
+
+//takes the lock for reading. once files came or went since the index was last frozen, lookups
+//search the keys as usual, and the index is only frozen again (which needs the lock for writing and
+//goes through every file) after there have been more of those reads than files, so a read that
+//follows a save doesn't pay for the whole layout. a save getting in between only means waiting longer.
+void lock_index_for_reading(IMFFSPtr fs)
+{
+    pthread_rwlock_rdlock(&fs->lock);
+    if(mm_frozen(fs->index) == 0 && __atomic_add_fetch(&fs->stale_reads, 1, __ATOMIC_RELAXED) > (unsigned int)fs->usage.files)
+    {
+        pthread_rwlock_unlock(&fs->lock);
+        pthread_rwlock_wrlock(&fs->lock);
+        //another reader may have frozen it while this one waited.
+        if(mm_frozen(fs->index) == 0)
+        {
+            mm_freeze(fs->index, key_fingerprint);
+            fs->stale_reads = 0;
+        }
+        pthread_rwlock_unlock(&fs->lock);
+        pthread_rwlock_rdlock(&fs->lock);
+    }
+}
+
+//adds the counters of one save to the device's counters.
+void add_alloc_stats(IMFFSAllocStats *to, IMFFSAllocStats *from)
+{
+    to->files_placed += from->files_placed;
+    to->extents_created += from->extents_created;
+    to->files_fragmented += from->files_fragmented;
+    to->search_steps += from->search_steps;
+    to->alloc_nanoseconds += from->alloc_nanoseconds;
+}
+
+//a monotonic clock reading, for timing the allocator.
+long long now_nanoseconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+//this adds contents of a file whose size is known, used in the IMFFS_SAVE function.
+//all the space is reserved before the data is copied, so a file that doesn't fit is never copied.
+//the data is copied without holding any lock; only adding the file to the index locks it.
+IMFFSResult add_sized_contents_to_device(FILE *source, IMFFSPtr fs, char *name, long file_size, int group)
 {
     assert(NULL != source);
     assert(NULL != fs);
-    assert(NULL!=name);
+    assert(NULL != name);
+    assert(file_size >= 0);
     IMFFSResult returned = IMFFS_OK;
 
-    if(NULL != source && NULL != fs && NULL != name)
+    if(NULL != source && NULL != fs && NULL != name && file_size >= 0)
     {
-        int space = find_free_space(fs->free_blocks, fs->block_count);
+        int blocks = get_block_number(file_size);
+        Value *extents = malloc(blocks * sizeof(Value));
+        KeyHolder *key = malloc(sizeof(KeyHolder));
 
-        if(space == -1)
+        if(NULL == extents || NULL == key)
         {
-            fprintf(stderr,"Error! No more space to store the file: \"%s\" in imffs\n",name);
+            free(extents);
+            free(key);
+            returned = IMFFS_FATAL;
         }
         else
         {
-            //malloc key and allocate the file name.
-            KeyHolder *key = malloc(sizeof(KeyHolder));
-            key->file_name = strdup(name);
+            IMFFSAllocStats placed = {0, 0, 0, 0, 0};
 
+            //defrag must not move things around while our blocks aren't in the index yet.
+            pthread_rwlock_rdlock(&fs->layout_lock);
 
-            int starting_point = BLOCK_BYTE_SIZE * space;
-            int chunks_start = starting_point;
-            int block_number = 0;
-            long total_byte_size = 0;
-            Boolean done = FALSE;
+            int num_extents = reserve_extents(fs, blocks, extents, group, &placed);
 
-
-            while(!done)
+            if(num_extents < 0)
             {
-                //if there is enough space.
-                total_byte_size += fread((fs->device)+starting_point,1,BLOCK_BYTE_SIZE,source);
+                fprintf(stderr,"Error! Not enough space to store the file: \"%s\"\n",name);
+                free(key);
+                returned = IMFFS_ERROR;
 
-                //increment the byte size.
-                block_number++;
-                fs->free_blocks[space] = 'N';
+                pthread_rwlock_wrlock(&fs->lock);
+                add_alloc_stats(&fs->stats, &placed);
+                pthread_rwlock_unlock(&fs->lock);
+            }
+            else
+            {
+                long total_byte_size = 0;
+                long chunk_bytes;
 
-                //if we are done.
-                if(feof(source))
+                for(int i=0; i < num_extents; i++)
                 {
-                    done = TRUE;
-                    mm_insert_value(fs->index,key,block_number,(fs->device)+chunks_start);
+                    //the last chunk may be only partly used.
+                    chunk_bytes = (long)extents[i].num * BLOCK_BYTE_SIZE;
+                    if(chunk_bytes > file_size - total_byte_size)
+                    {
+                        chunk_bytes = file_size - total_byte_size;
+                    }
+                    total_byte_size += fread(extents[i].data,1,chunk_bytes,source);
                 }
 
+                pthread_rwlock_wrlock(&fs->lock);
+                add_alloc_stats(&fs->stats, &placed);
+
+                //someone may have saved a file with the same name while we were copying.
+                if(file_name_exists(fs,name))
+                {
+                    fprintf(stderr,"Error! File with the name \"%s\" already exists in IMFFS.\n",name);
+                    release_extents(fs, extents, num_extents);
+                    free(key);
+                    returned = IMFFS_ERROR;
+                }
                 else
                 {
-                    //if the space next is free
-                    if(fs->free_blocks[space+1] == 'Y')
+                    if(name_new_file(fs,key,name) == 0)
                     {
-                        space++;
-                        starting_point = BLOCK_BYTE_SIZE * space;
+                        for(int i=0; i < num_extents; i++)
+                        {
+                            add_chunk_to_file(fs,key,extents[i].num,extents[i].data);
+                        }
+
+                        //if the file got shorter since we looked at its size, the size is what was actually read.
+                        key->file_byte_size = total_byte_size;
+                        count_new_file(fs,key);
                     }
                     else
                     {
-                        //if we get here it means its fragmeneted
-                        //insert the current chunk.
-                        mm_insert_value(fs->index,key,block_number,(fs->device)+chunks_start);
-                        //find a free space
-                        space = find_free_space(fs->free_blocks,fs->block_count);
-                        //if no space left we are done.
-                        if(space == -1)
-                        {
-                            done = TRUE;
-                        }
-                        else
-                        {
-                            starting_point = BLOCK_BYTE_SIZE *space;
-                            block_number = 0;
-                            chunks_start = starting_point;
-                        }
+                        release_extents(fs, extents, num_extents);
+                        free(key);
+                        returned = IMFFS_FATAL;
                     }
                 }
+                pthread_rwlock_unlock(&fs->lock);
             }
-            key->file_byte_size = total_byte_size;
 
-            //if we get here and the file is not fully read, we have to remove it.
-            if(!feof(source))
-            {
-                fprintf(stderr,"Error! Not enough space to store the file: \"%s\"\n",name);
-                imffs_delete(fs,key->file_name);
-                returned = IMFFS_ERROR;
-            }
+            pthread_rwlock_unlock(&fs->layout_lock);
+            free(extents);
         }
     }
     else
     {
         returned = IMFFS_INVALID;
     }
-    
-    assert(returned == IMFFS_OK || returned == IMFFS_ERROR || returned == IMFFS_INVALID);
+
+    assert(returned == IMFFS_OK || returned == IMFFS_ERROR || returned == IMFFS_INVALID || returned == IMFFS_FATAL);
 
     return returned;
 }
 
 /**
- * PURPOSE: this removes a key, renames it, and adds it again.
+ * PURPOSE: this gives a file a new name by swapping its key for a new one with mm_rekey,
+ *          so the chunks stay where they are in the index instead of being copied and added again.
  * INPUT PARAMETERS:
  * renamed_name:the new name
- * key: the key to be edited
+ * key: the key to be renamed, it is freed and the new key takes its place.
+ * returns 0 on success, -1 if memory runs out (the file is then left as it was).
  */
 
-void rename_key_and_add_again(Multimap *mm, void *key, char *renamed_name)
+int rename_file_key(IMFFSPtr fs, void *key, char *renamed_name)
 {
-     int values_num = mm_count_values(mm,key);
-     Value value[values_num];
-     mm_get_values(mm,key,value,values_num);
-     mm_remove_key(mm,key);
+    KeyHolder *old_key = key;
+    KeyHolder *renamed = malloc(sizeof(KeyHolder));
 
-    //free the earlier name first.
-    free(((KeyHolder*)key)->file_name);
-
-    ((KeyHolder*)key)->file_name = strdup(renamed_name);
-    //adds the keys and values again.
-    for(int i=0; i < values_num; i++)
+    //make the new key and name it first, so running out of memory leaves the file as it was.
+    if(NULL == renamed)
+    {
+        return -1;
+    }
+    *renamed = *old_key;
+    if(kn_set(&renamed->name,renamed_name) != 0)
+    {
+        free(renamed);
+        return -1;
+    }
+    if(nh_insert(fs->names,&renamed->name,renamed) != 0)
     {
-        mm_insert_value(mm,key,value[i].num,value[i].data);
+        kn_clear(&renamed->name);
+        free(renamed);
+        return -1;
     }
+    if(mm_rekey(fs->index,old_key,renamed) < 0)
+    {
+        nh_remove(fs->names,&renamed->name);
+        kn_clear(&renamed->name);
+        free(renamed);
+        return -1;
+    }
+
+    //nothing points at the old key anymore once its name and id are moved over.
+    nh_remove(fs->names,&old_key->name);
+    om_replace_file(fs->owners,renamed->id,renamed);
+    kn_clear(&old_key->name);
+    free(old_key);
+
+    return 0;
 }
 
 /**
@@ -1015,13 +2014,97 @@ void rename_key_and_add_again(Multimap *mm, void *key, char *renamed_name)
   * starting_block: where the freeing should start
   * blocks: the number of spaces to be freed.
  */
-void free_space(uint8_t *free_blocks, int blocks, int starting_block)
+void free_space(uint64_t *free_blocks, int blocks, int starting_block)
+{
+    fm_set_free(free_blocks, starting_block, blocks);
+}
+
+/**
+ * PURPOSE: this marks space as occupied in the free_blocks array.
+ * INPUT PARAMETERS:
+  * starting_block: where the occupying should start
+  * blocks: the number of spaces to be occupied.
+ */
+void occupy_space(uint64_t *free_blocks, int blocks, int starting_block)
+{
+    fm_set_used(free_blocks, starting_block, blocks);
+}
+
+/**
+ * PURPOSE: this gives blocks of the device back to their groups, merging them with the free runs around them.
+ *          After a defrag a chunk can run over into the next group, so it is given back group by group.
+ * INPUT PARAMETERS:
+ * starting_block: the first block given back
+ * blocks: the number of blocks given back.
+ */
+IMFFSResult release_blocks(IMFFSPtr fs, int starting_block, int blocks)
+{
+    assert(NULL != fs);
+    IMFFSResult returned = IMFFS_OK;
+    AllocGroup *group;
+    int end = starting_block + blocks;
+    int piece;
+
+    while(starting_block < end)
+    {
+        group = fs->groups[group_of(fs, starting_block)];
+        piece = ag_first_block(group) + ag_block_count(group) - starting_block;
+        if(piece > end - starting_block)
+        {
+            piece = end - starting_block;
+        }
+
+        ag_lock(group);
+        if(ag_release(group, starting_block, piece) != 0)
+        {
+            returned = IMFFS_FATAL;
+        }
+        unlock_group(fs, group_of(fs, starting_block));
+
+        starting_block += piece;
+    }
+
+    return returned;
+}
+
+//this adds one chunk to a file's entry in the index, and gives its blocks to the file in the owner map.
+void add_chunk_to_file(IMFFSPtr fs, KeyHolder *key, int blocks, uint8_t *chunk_start)
+{
+    mm_insert_value(fs->index,key,blocks,chunk_start);
+    om_set(fs->owners, (chunk_start - fs->device) / BLOCK_BYTE_SIZE, blocks, key->id, key->blocks);
+    key->blocks += blocks;
+    fs->usage.extents++;
+}
+
+//this names a new file and gives it an id, before its chunks are added.
+//returns 0 on success, -1 if memory runs out (then the key has no name or id).
+int name_new_file(IMFFSPtr fs, KeyHolder *key, char *name)
 {
- 
-    for(int i=starting_block; i < starting_block+blocks; i++)
+    key->blocks = 0;
+    if(kn_set(&key->name,name) != 0)
     {
-        free_blocks[i] = 'Y';
+        return -1;
     }
+
+    key->id = om_add_file(fs->owners,key);
+    if(key->id != 0 && nh_insert(fs->names,&key->name,key) == 0)
+    {
+        return 0;
+    }
+
+    if(key->id != 0)
+    {
+        om_remove_file(fs->owners,key->id);
+    }
+    kn_clear(&key->name);
+    return -1;
+}
+
+//this counts a file once all of it is on the device, file_byte_size has to be set.
+void count_new_file(IMFFSPtr fs, KeyHolder *key)
+{
+    fs->usage.files++;
+    fs->usage.used_bytes += key->file_byte_size;
 }
 
 /**
@@ -1031,61 +2114,74 @@ void free_space(uint8_t *free_blocks, int blocks, int starting_block)
 void remove_values_and_key(Imffs *fs, void *key)
 {
 
-     int num_values = mm_count_values(fs->index,key);
-
-     Value values[num_values];
-     mm_get_values(fs->index,key,values,num_values);
-
-     int starting_block;
-     for(int i=0; i < num_values; i++)
-     {
-        //calculate the starting block
-         starting_block = (uint8_t*)(values[i].data) - (fs->device);
-         starting_block = starting_block/BLOCK_BYTE_SIZE;
-
-         //free the spaces in the free space list, so we can save new file there.
-         free_space(fs->free_blocks,values[i].num,starting_block);
-     } 
+     //the chunks are released where they are in the index, then the key goes.
+     int num_values = mm_for_each_value(fs->index,key,release_chunk,fs);
 
      mm_remove_key(fs->index,key);
+     om_remove_file(fs->owners,((KeyHolder*)key)->id);
+     nh_remove(fs->names,&((KeyHolder*)key)->name);
+
+     fs->usage.files--;
+     fs->usage.used_bytes -= ((KeyHolder*)key)->file_byte_size;
+     fs->usage.extents -= num_values;
 
      //free the key name and key variable.
-     free(((KeyHolder*)key)->file_name);
+     kn_clear(&((KeyHolder*)key)->name);
      free(key);
 }
 
 //this loads data, used in the load function.
 void load_data_to_file(IMFFSPtr fs, void *key, FILE *out)
 {
-    //get the number of chunks and initialize the value array
-    int num_values = mm_count_values(fs->index,key);
-    Value *values = malloc(num_values * sizeof(Value));
+    LoadState state = {out, ((KeyHolder*)key)->file_byte_size};
 
-    //get the chunks from the multimap.
-    mm_get_values(fs->index,key,values,num_values);
+    //the chunks are written straight from where the index has them.
+    mm_for_each_value(fs->index,key,write_chunk,&state);
+}
 
+//writes one chunk of a load, called by mm_for_each_value.
+int write_chunk(const Value *chunk, void *state)
+{
+    LoadState *load = state;
+    long num_elements = (long)chunk->num * BLOCK_BYTE_SIZE;
 
-    int total_byte_read = 0;
-    int num_elements = 0;
+    //the last block of a file is only used in part.
+    if(load->bytes_left < num_elements)
+    {
+        num_elements = load->bytes_left;
+    }
+    load->bytes_left -= fwrite(chunk->data,1,num_elements,load->out);
 
-    KeyHolder *read_key = key;
+    return 0;
+}
 
-    for(int i=0; i < num_values; i++)
+//frees one chunk of a deleted file, called by mm_for_each_value.
+int release_chunk(const Value *chunk, void *fs)
+{
+    int starting_block = ((uint8_t*)chunk->data - ((IMFFSPtr)fs)->device) / BLOCK_BYTE_SIZE;
+
+    //free the spaces in the free space list, so we can save new file there.
+    release_blocks(fs,starting_block,chunk->num);
+    om_clear(((IMFFSPtr)fs)->owners,starting_block,chunk->num);
+
+    return 0;
+}
+
+//checks one chunk of a file against the owner map, called by mm_for_each_value.
+int check_chunk(const Value *chunk, void *state)
+{
+    CheckState *check = state;
+    int starting_block = ((uint8_t*)chunk->data - check->fs->device) / BLOCK_BYTE_SIZE;
+
+    for(int b=starting_block; b < starting_block + chunk->num; b++)
     {
-        //if the bytes left to read is more than the chunk's total byte. read the entire chunk.
-        if((read_key->file_byte_size - total_byte_read) > (values[i].num * BLOCK_BYTE_SIZE))
+        if(om_owner(check->fs->owners, b) != check->file->id || om_order(check->fs->owners, b) != check->order)
         {
-            num_elements = values[i].num * BLOCK_BYTE_SIZE;
+            fprintf(stderr, "Block %d is block %d of \"%s\" in the index, but not in the owner map\n", b, check->order, kn_name(&check->file->name));
+            check->problems++;
         }
-        else
-        {
-            //this means we have used a block but part of it only.
-            num_elements = read_key->file_byte_size - total_byte_read;
-        }
-        
-        total_byte_read += fwrite(values[i].data,1,num_elements,out);
+        check->order++;
     }
 
-    //free the values.
-    free(values);
+    return 0;
 }
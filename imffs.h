@@ -21,14 +21,67 @@ typedef enum {
   IMFFS_NOT_IMPLEMENTED = 4
 } IMFFSResult;
 
-// this function will create the filesystem with the given number of blocks;
+// Policies for choosing where on the device a file's blocks go.
+//  IMFFS_ALLOC_BEST_FIT puts a file in the smallest free run that holds it (the default);
+//  IMFFS_ALLOC_BUDDY puts files in power-of-two clusters of blocks, which are merged again as soon as they are freed;
+//  IMFFS_ALLOC_FIRST_FIT puts a file in the lowest free run that holds it;
+//  IMFFS_ALLOC_NEXT_FIT is first fit starting right after the last file placed, wrapping around at the end;
+//  IMFFS_ALLOC_WORST_FIT puts a file in the largest free run, leaving the biggest leftover.
+// When no free run holds a file, every policy but the buddy one spreads it over the largest runs there are.
+typedef enum {
+  IMFFS_ALLOC_BEST_FIT = 0,
+  IMFFS_ALLOC_BUDDY = 1,
+  IMFFS_ALLOC_FIRST_FIT = 2,
+  IMFFS_ALLOC_NEXT_FIT = 3,
+  IMFFS_ALLOC_WORST_FIT = 4
+} IMFFSAllocPolicy;
+
+// Counters kept by the allocator, to compare the policies.
+typedef struct {
+  long files_placed;          // files that were given space
+  long extents_created;       // chunks handed out to those files
+  long files_fragmented;      // files that got more than one chunk
+  long long search_steps;     // free runs looked at while searching for space
+  long long alloc_nanoseconds; // time spent choosing and reserving blocks
+} IMFFSAllocStats;
+
+// Usage figures of a device, as reported by imffs_statfs.
+typedef struct {
+  uint32_t block_count;      // blocks on the device
+  int block_size;            // bytes per block
+  long files;                // files saved
+  long long used_bytes;      // bytes in those files
+  long used_blocks;          // blocks taken by files
+  long free_blocks;          // blocks still free
+  long extents;              // chunks the files are stored in
+  long largest_free_run;     // the longest run of free blocks in one allocation group, i.e. the biggest file that fits in one chunk
+  int groups;                // allocation groups the device is split in
+} IMFFSStatfs;
+
+// The most blocks a device can have. Blocks are numbered with an int, and this leaves room for the sums
+// of block numbers and counts made while splitting the device into groups.
+#define IMFFS_MAX_BLOCKS (INT32_MAX / 2)
+
+// this function will create the filesystem with the given number of blocks (1 to IMFFS_MAX_BLOCKS);
 // it will modify the fs parameter to point to the new file system or set it
 // to NULL if something went wrong (fs is a pointer to a pointer)
 IMFFSResult imffs_create(uint32_t block_count, IMFFSPtr *fs);
 
+// same as imffs_create, but files are placed using the given policy
+IMFFSResult imffs_create_with_policy(uint32_t block_count, IMFFSAllocPolicy policy, IMFFSPtr *fs);
+
+// same as imffs_create_with_policy, but the device is split into group_count allocation groups, each with its own
+// free space and lock, so threads saving into different groups don't wait for each other; 0 picks one group for
+// every 32768 blocks. All functions can be called from several threads at once.
+IMFFSResult imffs_create_with_groups(uint32_t block_count, IMFFSAllocPolicy policy, int group_count, IMFFSPtr *fs);
+
 // save diskfile imffsfile copy from your system to IMFFS
 IMFFSResult imffs_save(IMFFSPtr fs, char *diskfile, char *imffsfile);
 
+// same as imffs_save, the file is placed in allocation group "group" and only spills over into other groups
+// when that one is full; a negative group picks the groups round-robin (which is what imffs_save does)
+IMFFSResult imffs_save_in_group(IMFFSPtr fs, char *diskfile, char *imffsfile, int group);
+
 // load imffsfile diskfile copy from IMFFS to your system
 IMFFSResult imffs_load(IMFFSPtr fs, char *imffsfile, char *diskfile);
 
@@ -41,12 +94,30 @@ IMFFSResult imffs_rename(IMFFSPtr fs, char *imffsold, char *imffsnew);
 // dir will list all of the files and the number of bytes they occupy
 IMFFSResult imffs_dir(IMFFSPtr fs);
 
+// dir pattern is like dir, but only lists the files whose names match the pattern, ignoring case: * stands for any characters and ? for one.
+// The part before the first wildcard is looked up in the index, so only the files starting with it are looked at.
+IMFFSResult imffs_dir_matching(IMFFSPtr fs, char *pattern);
+
 // fulldir is like "dir" except it shows a the files and details about all of the chunks they are stored in (where, and how big)
 IMFFSResult imffs_fulldir(IMFFSPtr fs);
 
 // defrag will defragment the filesystem: if you haven't implemented it, have it print "feature not implemented" and return IMFFS_NOT_IMPLEMENTED
 IMFFSResult imffs_defrag(IMFFSPtr fs);
 
+// statfs copies the usage figures of the device into the struct pointed to by stats; it doesn't walk the files
+IMFFSResult imffs_statfs(IMFFSPtr fs, IMFFSStatfs *stats);
+
+// stats copies the allocator counters into the struct pointed to by stats
+IMFFSResult imffs_alloc_stats(IMFFSPtr fs, IMFFSAllocStats *stats);
+
+// block owner copies the name of the file that has the block into name (at most name_size bytes, with the NUL) and which of the file's blocks it is into order.
+// A block that no file has gets an empty name and -1; a block that doesn't exist gives IMFFS_ERROR. It doesn't look at the index.
+IMFFSResult imffs_block_owner(IMFFSPtr fs, uint32_t block, char *name, int name_size, int *order);
+
+// check makes sure the index, the block owners and the free space agree: the blocks of every chunk belong to its file, in order, and are used,
+// and every other block is free. Each problem is printed; returns IMFFS_ERROR if there were any.
+IMFFSResult imffs_check(IMFFSPtr fs);
+
 // quit will quit the program: clean up the data structures
 IMFFSResult imffs_destroy(IMFFSPtr fs);
 
@@ -2,7 +2,16 @@
 #define _A5_IMMFS_HELPERS
 
 #include "a5_multimap.h"
-int find_free_space(uint8_t *free_blocks, int block_count);
+#include "a5_freemap.h"
+#include "a5_extents.h"
+#include "a5_buddy.h"
+#include "a5_groupspace.h"
+#include "a5_namehash.h"
+#include "a5_keyname.h"
+#include "a5_ownermap.h"
+int find_free_space(uint64_t *free_blocks, int block_count);
+int find_free_run(uint64_t *free_blocks, int block_count, int blocks);
 int get_block_number(int file_size); 
-void free_space(uint8_t *free_blocks, int blocks, int starting_block);  
+void free_space(uint64_t *free_blocks, int blocks, int starting_block);  
+void occupy_space(uint64_t *free_blocks, int blocks, int starting_block);
 #endif
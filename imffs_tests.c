@@ -1,6 +1,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <signal.h>
 
 #include "a5_tests.h"
 #include "a5_multimap.h"
@@ -10,16 +15,34 @@
 
 
 
+//builds a free map out of a string of 'Y' (free) and 'N' (occupied) characters.
+static void make_map(uint64_t *map, char *pattern)
+{
+    int count = strlen(pattern);
+    for(int i=0; i < fm_word_count(count); i++)
+    {
+        map[i] = 0;
+    }
+    for(int i=0; i < count; i++)
+    {
+        if(pattern[i] == 'Y')
+        {
+            free_space(map,1,i);
+        }
+    }
+}
+
 void testTypical()
 {
     printf("\n........Testing typical cases.......\n");
-    uint8_t chars[] = {'N','N','Y','N','Y'};
+    uint64_t chars[1];
+    make_map(chars,"NNYNY");
 
     //testing the free space function
     VERIFY_INT(2, find_free_space(chars,5));
-    chars[2]  = 'N';
+    occupy_space(chars,1,2);
     VERIFY_INT(4, find_free_space(chars,5));
-    chars[4] = 'N';
+    occupy_space(chars,1,4);
     VERIFY_INT(-1, find_free_space(chars,5));
 
     VERIFY_INT(1,get_block_number(0));
@@ -29,48 +52,79 @@ void testTypical()
     VERIFY_INT(40,get_block_number(10000));
     VERIFY_INT(1,get_block_number(34));
 
-    uint8_t free_space_arr[] = {'N','N','N'};
+    uint64_t free_space_arr[1];
+    make_map(free_space_arr,"NNN");
     free_space(free_space_arr,3,0);
-    VERIFY_INT(1, free_space_arr[0] == 'Y');
-    VERIFY_INT(1, free_space_arr[1] == 'Y');
-    VERIFY_INT(1, free_space_arr[2] == 'Y');
+    VERIFY_INT(1, fm_is_free(free_space_arr,3,0));
+    VERIFY_INT(1, fm_is_free(free_space_arr,3,1));
+    VERIFY_INT(1, fm_is_free(free_space_arr,3,2));
     
-    uint8_t free_space_arr2[] = {'N','N','N','N','N','N','N','N'};
+    uint64_t free_space_arr2[1];
+    make_map(free_space_arr2,"NNNNNNNN");
     free_space(free_space_arr2,3,2);
-    VERIFY_INT(1, free_space_arr2[0] == 'N');
-    VERIFY_INT(1, free_space_arr2[1] == 'N');
-    VERIFY_INT(1, free_space_arr2[2] == 'Y');
-    VERIFY_INT(1, free_space_arr2[3] == 'Y');
-    VERIFY_INT(1, free_space_arr2[4] == 'Y');
-    VERIFY_INT(1, free_space_arr2[5] == 'N');
-    VERIFY_INT(1, free_space_arr2[6] == 'N');
-  
+    VERIFY_INT(0, fm_is_free(free_space_arr2,8,0));
+    VERIFY_INT(0, fm_is_free(free_space_arr2,8,1));
+    VERIFY_INT(1, fm_is_free(free_space_arr2,8,2));
+    VERIFY_INT(1, fm_is_free(free_space_arr2,8,3));
+    VERIFY_INT(1, fm_is_free(free_space_arr2,8,4));
+    VERIFY_INT(0, fm_is_free(free_space_arr2,8,5));
+    VERIFY_INT(0, fm_is_free(free_space_arr2,8,6));
+
+    //testing the free run function
+    uint64_t runs[1];
+    make_map(runs,"YNYYNYYYYN");
+    VERIFY_INT(0, find_free_run(runs,10,1));
+    VERIFY_INT(2, find_free_run(runs,10,2));
+    VERIFY_INT(5, find_free_run(runs,10,3));
+    VERIFY_INT(5, find_free_run(runs,10,4));
+    VERIFY_INT(-1, find_free_run(runs,10,5));
+    VERIFY_INT(4, fm_run_length(runs,10,5,100));
+    VERIFY_INT(7, fm_count_free(runs,10));
 }
 
 void test_edge_cases()
 {
     printf("\n.......Testing Edge Cases........\n");
-    uint8_t emptyarr[] = {};
+    uint64_t emptyarr[1] = {0};
     VERIFY_INT(-1,find_free_space(emptyarr,0));
-    emptyarr[0] = 'Y';
+    free_space(emptyarr,1,0);
     VERIFY_INT(0,find_free_space(emptyarr,1));
 
     VERIFY_INT(1,get_block_number(0));
     VERIFY_INT(3907,get_block_number(1000000));
 
-    uint8_t free_space_arr2[] = {'Y','Y','Y'};
+    uint64_t free_space_arr2[1];
+    make_map(free_space_arr2,"YYY");
     free_space(free_space_arr2,0,3);
-    VERIFY_INT(1, free_space_arr2[0] == 'Y');
-    VERIFY_INT(1, free_space_arr2[1] == 'Y');
-    VERIFY_INT(1, free_space_arr2[2] == 'Y');
+    VERIFY_INT(1, fm_is_free(free_space_arr2,3,0));
+    VERIFY_INT(1, fm_is_free(free_space_arr2,3,1));
+    VERIFY_INT(1, fm_is_free(free_space_arr2,3,2));
 
     // Test free_space with an array containing 'N's
-    uint8_t free_space_arr3[] = {'N', 'N', 'N'};
+    uint64_t free_space_arr3[1];
+    make_map(free_space_arr3,"NNN");
     free_space(free_space_arr3, 0, 3);
-    VERIFY_INT(1, free_space_arr3[0] == 'N');
-    VERIFY_INT(1, free_space_arr3[1] == 'N');
-    VERIFY_INT(1, free_space_arr3[2] == 'N');
-    
+    VERIFY_INT(0, fm_is_free(free_space_arr3,3,0));
+    VERIFY_INT(0, fm_is_free(free_space_arr3,3,1));
+    VERIFY_INT(0, fm_is_free(free_space_arr3,3,2));
+
+    // Runs and searches that cross word boundaries.
+    uint64_t big[4];
+    fm_init(big,200);
+    occupy_space(big,150,0);
+    VERIFY_INT(150,find_free_space(big,200));
+    VERIFY_INT(50,fm_count_free(big,200));
+    VERIFY_INT(150,find_free_run(big,200,50));
+    VERIFY_INT(-1,find_free_run(big,200,51));
+    occupy_space(big,1,199);
+    VERIFY_INT(49,fm_run_length(big,200,150,1000));
+    free_space(big,70,60);
+    VERIFY_INT(60,find_free_run(big,200,70));
+    VERIFY_INT(-1,find_free_run(big,200,71));
+    free_space(big,20,130);
+    VERIFY_INT(60,find_free_run(big,200,139));
+    VERIFY_INT(139,fm_run_length(big,200,60,1000));
+    VERIFY_INT(0,fm_is_free(big,200,200));
 }
 
 void test_invalid_cases()
@@ -78,11 +132,13 @@ void test_invalid_cases()
     printf("\n.......Testing invalid Cases........\n");
     VERIFY_INT(-1,get_block_number(-1));
     VERIFY_INT(-1,find_free_space(NULL,13));
-    uint8_t chars[] = {'N'};
+    uint64_t chars[] = {0};
     VERIFY_INT(-1,find_free_space(chars,-2));
+    VERIFY_INT(-1,find_free_run(NULL,13,2));
     IMFFSPtr ptr;
     VERIFY_INT(1,imffs_create(-1,&ptr)== IMFFS_INVALID);
     VERIFY_INT(1,imffs_create(1,NULL) == IMFFS_INVALID);
+    VERIFY_INT(1,imffs_create(IMFFS_MAX_BLOCKS + 1u,&ptr) == IMFFS_INVALID);
 
     VERIFY_INT(1,imffs_save(ptr,NULL,"hello") == IMFFS_INVALID);
     VERIFY_INT(1,imffs_save(ptr,"hello",NULL) == IMFFS_INVALID);
@@ -100,9 +156,19 @@ void test_invalid_cases()
     VERIFY_INT(1,imffs_rename(NULL, "op", "lol") == IMFFS_INVALID);
 
     VERIFY_INT(1,imffs_dir(NULL) == IMFFS_INVALID);
+    VERIFY_INT(1,imffs_dir_matching(NULL, "*") == IMFFS_INVALID);
+    VERIFY_INT(1,imffs_dir_matching(ptr, NULL) == IMFFS_INVALID);
 
     VERIFY_INT(1,imffs_fulldir(NULL) == IMFFS_INVALID);
 
+    char name[8];
+    int order;
+    VERIFY_INT(1,imffs_block_owner(NULL, 0, name, sizeof(name), &order) == IMFFS_INVALID);
+    VERIFY_INT(1,imffs_block_owner(ptr, 0, NULL, sizeof(name), &order) == IMFFS_INVALID);
+    VERIFY_INT(1,imffs_block_owner(ptr, 0, name, 0, &order) == IMFFS_INVALID);
+    VERIFY_INT(1,imffs_block_owner(ptr, 0, name, sizeof(name), NULL) == IMFFS_INVALID);
+    VERIFY_INT(1,imffs_check(NULL) == IMFFS_INVALID);
+
     VERIFY_INT(1,imffs_defrag(NULL) == IMFFS_INVALID);
 
     VERIFY_INT(1,imffs_destroy(NULL) == IMFFS_INVALID);
@@ -112,29 +178,827 @@ void test_invalid_cases()
 void test_special_cases()
 {
     printf("\n.......Testing special Cases........\n");
-    uint8_t no_space[] = {'N','N','N'};
+    uint64_t no_space[1];
+    make_map(no_space,"NNN");
     VERIFY_INT(-1,find_free_space(no_space,3));
 
     free_space(no_space,0,3);
-    VERIFY_INT(1,no_space[0] == 'N');
-    VERIFY_INT(1,no_space[1] == 'N');
-    VERIFY_INT(1,no_space[2] == 'N');
+    VERIFY_INT(0,fm_is_free(no_space,3,0));
+    VERIFY_INT(0,fm_is_free(no_space,3,1));
+    VERIFY_INT(0,fm_is_free(no_space,3,2));
 
-    uint8_t free_space_size_3[] = {'N', 'N', 'N'};
+    uint64_t free_space_size_3[1];
+    make_map(free_space_size_3,"NNN");
     free_space(free_space_size_3, 2, 0);
-    VERIFY_INT(1, free_space_size_3[0] == 'Y');
-    VERIFY_INT(1, free_space_size_3[1] == 'Y');
-    VERIFY_INT(1, free_space_size_3[2] == 'N');
+    VERIFY_INT(1, fm_is_free(free_space_size_3,3,0));
+    VERIFY_INT(1, fm_is_free(free_space_size_3,3,1));
+    VERIFY_INT(0, fm_is_free(free_space_size_3,3,2));
 
      // Test free_space with an array of size 1
-    uint8_t free_space_size_1[] = {'N'};
+    uint64_t free_space_size_1[1];
+    make_map(free_space_size_1,"N");
     free_space(free_space_size_1, 0,0);
-    VERIFY_INT(1, free_space_size_1[0] == 'N');
+    VERIFY_INT(0, fm_is_free(free_space_size_1,1,0));
     free_space(free_space_size_1, 1,0);
-    VERIFY_INT(1, free_space_size_1[0] == 'Y');
+    VERIFY_INT(1, fm_is_free(free_space_size_1,1,0));
+
+}
+
+
+void test_extents()
+{
+    printf("\n.......Testing the free extents........\n");
+    ExtentTree *et;
+    int start = -1;
+
+    VERIFY_NOT_NULL(et = et_create());
+    VERIFY_INT(0, et_best_fit(et,1,&start));
+    VERIFY_INT(0, et_add_free(et,0,100));
+    VERIFY_INT(1, et_count(et));
+
+    //carve out a few files, leaving holes of 10, 5 and 20 blocks.
+    VERIFY_INT(0, et_take(et,0,10));
+    VERIFY_INT(0, et_take(et,20,5));
+    VERIFY_INT(0, et_take(et,30,50));
+    VERIFY_INT(3, et_count(et));
+    VERIFY_INT(-1, et_take(et,5,1));
+    VERIFY_INT(-1, et_take(et,18,4));
+
+    VERIFY_INT(5, et_best_fit(et,3,&start));
+    VERIFY_INT(25, start);
+    VERIFY_INT(10, et_best_fit(et,6,&start));
+    VERIFY_INT(10, start);
+    VERIFY_INT(20, et_best_fit(et,11,&start));
+    VERIFY_INT(80, start);
+    VERIFY_INT(0, et_best_fit(et,21,&start));
+    VERIFY_INT(20, et_largest(et,&start));
+    VERIFY_INT(80, start);
+    VERIFY_INT(5, et_next(et,11,&start));
+    VERIFY_INT(25, start);
+    VERIFY_INT(10, et_first_fit(et,3,0,&start));
+    VERIFY_INT(10, start);
+    VERIFY_INT(5, et_first_fit(et,3,11,&start));
+    VERIFY_INT(25, start);
+    VERIFY_INT(20, et_first_fit(et,6,11,&start));
+    VERIFY_INT(80, start);
+    VERIFY_INT(0, et_first_fit(et,21,0,&start));
+
+    //freeing the block between two holes merges all three into one.
+    VERIFY_INT(0, et_add_free(et,20,5));
+    VERIFY_INT(2, et_count(et));
+    VERIFY_INT(20, et_best_fit(et,12,&start));
+    VERIFY_INT(10, start);
+    VERIFY_INT(0, et_add_free(et,30,50));
+    VERIFY_INT(1, et_count(et));
+    VERIFY_INT(90, et_largest(et,&start));
+    VERIFY_INT(10, start);
+
+    //ties go to the lowest extent.
+    VERIFY_INT(0, et_take(et,50,10));
+    VERIFY_INT(0, et_take(et,65,25));
+    VERIFY_INT(5, et_best_fit(et,5,&start));
+    VERIFY_INT(60, start);
+    VERIFY_INT(0, et_take(et,10,35));
+    VERIFY_INT(5, et_best_fit(et,5,&start));
+    VERIFY_INT(45, start);
+
+    et_clear(et);
+    VERIFY_INT(0, et_count(et));
+    VERIFY_INT(0, et_largest(et,&start));
+    et_destroy(et);
+}
+
+void test_buddy()
+{
+    printf("\n.......Testing the buddy allocator........\n");
+    Buddy *buddy;
+
+    VERIFY_INT(0, buddy_order_for(1));
+    VERIFY_INT(1, buddy_order_for(2));
+    VERIFY_INT(2, buddy_order_for(3));
+    VERIFY_INT(4, buddy_order_for(16));
+    VERIFY_INT(5, buddy_order_for(17));
+
+    //24 blocks are a cluster of 16 and a cluster of 8.
+    VERIFY_NOT_NULL(buddy = buddy_create(24));
+    VERIFY_INT(4, buddy_largest_order(buddy));
+    VERIFY_INT(16, buddy_find(buddy,3));
+    VERIFY_INT(0, buddy_find(buddy,4));
+    VERIFY_INT(-1, buddy_find(buddy,5));
+
+    //taking one block splits the 8 cluster into 4, 2 and 1.
+    VERIFY_INT(0, buddy_take(buddy,16,1));
+    VERIFY_INT(-1, buddy_take(buddy,16,1));
+    VERIFY_INT(17, buddy_find(buddy,0));
+    VERIFY_INT(18, buddy_find(buddy,1));
+    VERIFY_INT(20, buddy_find(buddy,2));
+    VERIFY_INT(0, buddy_find(buddy,3));
+
+    //freeing it merges everything back.
+    buddy_release(buddy,16,1);
+    VERIFY_INT(16, buddy_find(buddy,3));
+
+    //a run that isn't aligned is taken and given back piece by piece.
+    VERIFY_INT(0, buddy_take(buddy,3,10));
+    VERIFY_INT(3, buddy_largest_order(buddy));
+    VERIFY_INT(-1, buddy_take(buddy,12,2));
+    buddy_release(buddy,3,10);
+    VERIFY_INT(4, buddy_largest_order(buddy));
+    VERIFY_INT(0, buddy_find(buddy,4));
+
+    buddy_clear(buddy);
+    VERIFY_INT(-1, buddy_largest_order(buddy));
+    VERIFY_INT(-1, buddy_find(buddy,0));
+    buddy_destroy(buddy);
+}
+
+void test_group_space()
+{
+    printf("\n.......Testing the group space index........\n");
+    GroupSpace *space;
+    long free_blocks;
+    long largest;
+    long long steps;
+
+    VERIFY_NOT_NULL(space = gs_create(5));
+    VERIFY_INT(-1, gs_find_free(space,1,0));
+    gs_totals(space,&free_blocks,&largest,&steps);
+    VERIFY_INT(0, free_blocks);
+    VERIFY_INT(0, largest);
+
+    gs_update(space,0,10,10,1);
+    gs_update(space,1,6,2,3);
+    gs_update(space,3,20,12,5);
+    gs_totals(space,&free_blocks,&largest,&steps);
+    VERIFY_INT(36, free_blocks);
+    VERIFY_INT(12, largest);
+    VERIFY_INT(9, steps);
+
+    //the first group from "from" on with a run, or free blocks, that big.
+    VERIFY_INT(0, gs_find_run(space,10,0));
+    VERIFY_INT(3, gs_find_run(space,10,1));
+    VERIFY_INT(-1, gs_find_run(space,13,0));
+    VERIFY_INT(-1, gs_find_run(space,1,4));
+    VERIFY_INT(1, gs_find_free(space,6,1));
+    VERIFY_INT(3, gs_find_free(space,11,0));
+    VERIFY_INT(-1, gs_find_free(space,1,5));
+
+    //a group that fills up drops out, and the totals follow it.
+    gs_update(space,3,0,0,8);
+    gs_update(space,4,1,1,0);
+    gs_totals(space,&free_blocks,&largest,&steps);
+    VERIFY_INT(17, free_blocks);
+    VERIFY_INT(10, largest);
+    VERIFY_INT(12, steps);
+    VERIFY_INT(4, gs_find_free(space,1,2));
+    VERIFY_INT(-1, gs_find_run(space,3,1));
+    gs_destroy(space);
+}
+
+void test_statfs()
+{
+    printf("\n.......Testing the usage counters........\n");
+    IMFFSPtr fs = NULL;
+    IMFFSStatfs usage;
+    char *disk_name = "a5_statfs_test.tmp";
+    char data[1000];
+    FILE *out;
+
+    memset(data, 'x', sizeof(data));
+    out = fopen(disk_name, "wb");
+    VERIFY_NOT_NULL(out);
+    if(NULL == out)
+    {
+        return;
+    }
+    fwrite(data, 1, sizeof(data), out);
+    fclose(out);
+
+    VERIFY_INT(IMFFS_OK, imffs_create(10, &fs));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(10, usage.block_count);
+    VERIFY_INT(10, usage.free_blocks);
+    VERIFY_INT(10, usage.largest_free_run);
+    VERIFY_INT(0, usage.files);
+
+    //1000 bytes take 4 blocks.
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "one"));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "two"));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(2, usage.files);
+    VERIFY_INT(2000, usage.used_bytes);
+    VERIFY_INT(8, usage.used_blocks);
+    VERIFY_INT(2, usage.free_blocks);
+    VERIFY_INT(2, usage.extents);
+    VERIFY_INT(2, usage.largest_free_run);
+
+    //deleting the first file leaves two runs of free space.
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "one"));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(1, usage.files);
+    VERIFY_INT(1000, usage.used_bytes);
+    VERIFY_INT(6, usage.free_blocks);
+    VERIFY_INT(1, usage.extents);
+    VERIFY_INT(4, usage.largest_free_run);
+
+    //defrag puts all the free space together.
+    VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(6, usage.free_blocks);
+    VERIFY_INT(6, usage.largest_free_run);
+
+    imffs_destroy(fs);
+    remove(disk_name);
+}
+
+typedef struct {
+    IMFFSPtr fs;
+    char *disk_name;
+    int group;
+    int failed;
+} SaveJob;
+
+//saves 8 copies of a file into one allocation group.
+void *save_in_group(void *arg)
+{
+    SaveJob *job = arg;
+    char name[32];
+
+    for(int i=0; i < 8; i++)
+    {
+        sprintf(name, "g%d_%d", job->group, i);
+        if(IMFFS_OK != imffs_save_in_group(job->fs, job->disk_name, name, job->group))
+        {
+            job->failed++;
+        }
+    }
+    return NULL;
+}
+
+void test_groups()
+{
+    printf("\n.......Testing the allocation groups........\n");
+    IMFFSPtr fs = NULL;
+    IMFFSStatfs usage;
+    char *disk_name = "a5_groups_test.tmp";
+    char *loaded_name = "a5_groups_test_loaded.tmp";
+    char data[1000];
+    char loaded[1000];
+    pthread_t threads[4];
+    SaveJob jobs[4];
+    FILE *file;
+
+    for(int i=0; i < (int)sizeof(data); i++)
+    {
+        data[i] = (char)i;
+    }
+    file = fopen(disk_name, "wb");
+    VERIFY_NOT_NULL(file);
+    if(NULL == file)
+    {
+        return;
+    }
+    fwrite(data, 1, sizeof(data), file);
+    fclose(file);
+
+    //four groups of 10 blocks, a 1000 byte file takes 4 of them.
+    VERIFY_INT(IMFFS_OK, imffs_create_with_groups(40, IMFFS_ALLOC_BEST_FIT, 4, &fs));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(4, usage.groups);
+    VERIFY_INT(10, usage.largest_free_run);
+
+    //two files fit in group 1, the third one goes to a group with a run that holds it.
+    VERIFY_INT(IMFFS_OK, imffs_save_in_group(fs, disk_name, "one", 1));
+    VERIFY_INT(IMFFS_OK, imffs_save_in_group(fs, disk_name, "two", 1));
+    VERIFY_INT(IMFFS_OK, imffs_save_in_group(fs, disk_name, "three", 1));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(12, usage.used_blocks);
+    VERIFY_INT(3, usage.extents);
+    VERIFY_INT(10, usage.largest_free_run);
+
+    //a file bigger than any group spills over from one group into the next ones (group 4 wraps around to 0).
+    imffs_destroy(fs);
+    VERIFY_INT(IMFFS_OK, imffs_create_with_groups(10, IMFFS_ALLOC_BEST_FIT, 5, &fs));
+    VERIFY_INT(IMFFS_OK, imffs_save_in_group(fs, disk_name, "spread", 4));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(4, usage.used_blocks);
+    VERIFY_INT(2, usage.extents);
+    VERIFY_INT(IMFFS_OK, imffs_load(fs, "spread", loaded_name));
+    file = fopen(loaded_name, "rb");
+    VERIFY_NOT_NULL(file);
+    if(NULL != file)
+    {
+        VERIFY_INT(sizeof(loaded), fread(loaded, 1, sizeof(loaded), file));
+        VERIFY_INT(0, memcmp(data, loaded, sizeof(data)));
+        fclose(file);
+    }
+    imffs_destroy(fs);
+
+    //four threads fill four groups at the same time.
+    VERIFY_INT(IMFFS_OK, imffs_create_with_groups(4 * 32, IMFFS_ALLOC_BEST_FIT, 4, &fs));
+    for(int i=0; i < 4; i++)
+    {
+        jobs[i].fs = fs;
+        jobs[i].disk_name = disk_name;
+        jobs[i].group = i;
+        jobs[i].failed = 0;
+        pthread_create(&threads[i], NULL, save_in_group, &jobs[i]);
+    }
+    for(int i=0; i < 4; i++)
+    {
+        pthread_join(threads[i], NULL);
+        VERIFY_INT(0, jobs[i].failed);
+    }
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(32, usage.files);
+    VERIFY_INT(0, usage.free_blocks);
+    VERIFY_INT(32, usage.extents);
+    VERIFY_INT(IMFFS_OK, imffs_check(fs));
+
+    //the device is full now.
+    VERIFY_INT(IMFFS_ERROR, imffs_save(fs, disk_name, "full"));
+    VERIFY_INT(IMFFS_OK, imffs_load(fs, "g2_7", loaded_name));
+    file = fopen(loaded_name, "rb");
+    VERIFY_NOT_NULL(file);
+    if(NULL != file)
+    {
+        VERIFY_INT(sizeof(loaded), fread(loaded, 1, sizeof(loaded), file));
+        VERIFY_INT(0, memcmp(data, loaded, sizeof(data)));
+        fclose(file);
+    }
+
+    imffs_destroy(fs);
+    remove(disk_name);
+    remove(loaded_name);
+}
+
+//writes a file of "size" bytes for the tests to save.
+void write_test_file(char *disk_name, int size)
+{
+    FILE *out = fopen(disk_name, "wb");
+
+    VERIFY_NOT_NULL(out);
+    if(NULL != out)
+    {
+        for(int i=0; i < size; i++)
+        {
+            fputc(i % 251, out);
+        }
+        fclose(out);
+    }
+}
+
+void test_policies()
+{
+    printf("\n.......Testing the placement policies........\n");
+    IMFFSAllocPolicy policies[] = {IMFFS_ALLOC_FIRST_FIT, IMFFS_ALLOC_BEST_FIT, IMFFS_ALLOC_NEXT_FIT, IMFFS_ALLOC_WORST_FIT};
+    //where the small file lands shows in the largest run left: the first hole or the tail.
+    int largest_left[] = {8, 8, 6, 6};
+    char *big_name = "a5_policies_big.tmp";
+    char *small_name = "a5_policies_small.tmp";
+    char *huge_name = "a5_policies_huge.tmp";
+    IMFFSPtr fs = NULL;
+    IMFFSStatfs usage;
+    IMFFSAllocStats stats;
+
+    write_test_file(big_name, 1000);
+    write_test_file(small_name, 500);
+    write_test_file(huge_name, 2100);
+
+    for(int i=0; i < 4; i++)
+    {
+        //three 4 block files, then the first one is deleted: free runs of 4 at 0 and 8 at 12.
+        VERIFY_INT(IMFFS_OK, imffs_create_with_policy(20, policies[i], &fs));
+        VERIFY_INT(IMFFS_OK, imffs_save(fs, big_name, "a"));
+        VERIFY_INT(IMFFS_OK, imffs_save(fs, big_name, "b"));
+        VERIFY_INT(IMFFS_OK, imffs_save(fs, big_name, "c"));
+        VERIFY_INT(IMFFS_OK, imffs_delete(fs, "a"));
+
+        VERIFY_INT(IMFFS_OK, imffs_save(fs, small_name, "d"));
+        VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+        VERIFY_INT(largest_left[i], usage.largest_free_run);
+
+        //a file of 9 blocks is bigger than any run, so it is spread over the two that are left.
+        VERIFY_INT(IMFFS_OK, imffs_save(fs, huge_name, "e"));
+        VERIFY_INT(IMFFS_OK, imffs_alloc_stats(fs, &stats));
+        VERIFY_INT(5, stats.files_placed);
+        VERIFY_INT(1, stats.files_fragmented);
+        VERIFY_INT(6, stats.extents_created);
+        VERIFY_INT(IMFFS_OK, imffs_check(fs));
+        imffs_destroy(fs);
+    }
+
+    #ifdef NDEBUG
+    VERIFY_INT(IMFFS_INVALID, imffs_create_with_policy(20, (IMFFSAllocPolicy)5, &fs));
+    #endif
+    remove(big_name);
+    remove(small_name);
+    remove(huge_name);
+}
+
+typedef struct {
+    char *fifo_name;
+    int size;
+} StreamJob;
+
+//writes a file into a fifo, so imffs_save sees a stream of unknown size.
+void *write_stream(void *arg)
+{
+    StreamJob *job = arg;
+    FILE *out = fopen(job->fifo_name, "wb");
+
+    if(NULL != out)
+    {
+        for(int i=0; i < job->size; i++)
+        {
+            fputc(i % 251, out);
+        }
+        fclose(out);
+    }
+    return NULL;
+}
+
+//saves a stream of "size" bytes under the name imffsfile.
+IMFFSResult save_stream(IMFFSPtr fs, char *fifo_name, int size, char *imffsfile)
+{
+    StreamJob job = {fifo_name, size};
+    pthread_t writer;
+    IMFFSResult result;
+
+    pthread_create(&writer, NULL, write_stream, &job);
+    result = imffs_save(fs, fifo_name, imffsfile);
+    pthread_join(writer, NULL);
+    return result;
+}
 
+void test_streamed_saves()
+{
+    printf("\n.......Testing streamed saves........\n");
+    char *fifo_name = "a5_stream_test.fifo";
+    char *disk_name = "a5_stream_test.tmp";
+    IMFFSPtr fs = NULL;
+    IMFFSStatfs usage;
+
+    //a save that runs out of space stops reading, the writer shouldn't be killed for it.
+    signal(SIGPIPE, SIG_IGN);
+    remove(fifo_name);
+    VERIFY_INT(0, mkfifo(fifo_name, 0600));
+    write_test_file(disk_name, 300);
+
+    //holes of 2 blocks at 0, 4 and 8, and free space from 12 on.
+    VERIFY_INT(IMFFS_OK, imffs_create(600, &fs));
+    for(int i=0; i < 6; i++)
+    {
+        char name[8];
+        sprintf(name, "f%d", i);
+        VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, name));
+    }
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "f0"));
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "f2"));
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "f4"));
+
+    //the stream is placed a batch at a time, so it doesn't go into the holes block by block.
+    VERIFY_INT(IMFFS_OK, save_stream(fs, fifo_name, 5000, "small"));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(4, usage.extents);
+    VERIFY_INT(5900, usage.used_bytes);
+
+    //a stream longer than a batch grows its chunk when the blocks after it are free.
+    VERIFY_INT(IMFFS_OK, save_stream(fs, fifo_name, 300 * 256 + 10, "big"));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(5, usage.extents);
+    VERIFY_INT(5900 + 300 * 256 + 10, usage.used_bytes);
+
+    //an empty stream takes one block, and one that doesn't fit takes nothing.
+    VERIFY_INT(IMFFS_OK, save_stream(fs, fifo_name, 0, "empty"));
+    VERIFY_INT(IMFFS_ERROR, save_stream(fs, fifo_name, 600 * 256, "too big"));
+    VERIFY_INT(IMFFS_OK, imffs_statfs(fs, &usage));
+    VERIFY_INT(6, usage.files);
+    VERIFY_INT(6 + 20 + 301 + 1, usage.used_blocks);
+    VERIFY_INT(IMFFS_OK, imffs_check(fs));
+
+    imffs_destroy(fs);
+    remove(fifo_name);
+    remove(disk_name);
 }
 
+void test_name_hash()
+{
+    printf("\n.......Testing the name hash........\n");
+    NameHash *names;
+    KeyName hello, other;
+    static KeyName buffer[100];
+    char name[16];
+    int keys[100];
+    int found = 0;
+
+    kn_set(&hello, "Hello.txt");
+    kn_set(&other, "HELLO.TXT");
+    VERIFY_NOT_NULL(names = nh_create());
+    VERIFY_INT(0, nh_insert(names, &hello, &keys[0]));
+    VERIFY_INT(1, nh_count(names));
+    VERIFY_INT(1, nh_find(names, "hello.TXT") == &keys[0]);
+    VERIFY_INT(1, nh_find(names, "hello") == NULL);
+    VERIFY_INT(1, nh_find(names, "hello.TXU") == NULL);
+    VERIFY_INT(0, nh_remove(names, &other));
+    VERIFY_INT(-1, nh_remove(names, &hello));
+    VERIFY_INT(0, nh_count(names));
+    VERIFY_INT(1, nh_find(names, "Hello.txt") == NULL);
+    kn_clear(&hello);
+    kn_clear(&other);
+
+    //enough names to grow the table a few times, then remove every other one.
+    for(int i=0; i < 100; i++)
+    {
+        sprintf(name, "file%d", i);
+        kn_set(&buffer[i], name);
+        nh_insert(names, &buffer[i], &keys[i]);
+    }
+    VERIFY_INT(100, nh_count(names));
+    for(int i=0; i < 100; i += 2)
+    {
+        nh_remove(names, &buffer[i]);
+    }
+    VERIFY_INT(50, nh_count(names));
+    for(int i=0; i < 100; i++)
+    {
+        sprintf(name, "FILE%d", i);
+        if(nh_find(names, name) == ((i % 2) ? &keys[i] : NULL))
+        {
+            found++;
+        }
+        kn_clear(&buffer[i]);
+    }
+    VERIFY_INT(100, found);
+    nh_destroy(names);
+
+    //the file system finds files through it, in any case, after renames, deletes and defrag.
+    IMFFSPtr fs = NULL;
+    char *disk_name = "a5_names_test.tmp";
+
+    write_test_file(disk_name, 300);
+    VERIFY_INT(IMFFS_OK, imffs_create(20, &fs));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "One.txt"));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "two.txt"));
+    VERIFY_INT(IMFFS_ERROR, imffs_save(fs, disk_name, "ONE.TXT"));
+    VERIFY_INT(IMFFS_OK, imffs_rename(fs, "one.TXT", "three.txt"));
+    VERIFY_INT(IMFFS_ERROR, imffs_rename(fs, "One.txt", "four.txt"));
+    VERIFY_INT(IMFFS_ERROR, imffs_rename(fs, "Three.txt", "TWO.txt"));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "one.txt"));
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "TWO.TXT"));
+    VERIFY_INT(IMFFS_ERROR, imffs_delete(fs, "two.txt"));
+    VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+    VERIFY_INT(IMFFS_OK, imffs_load(fs, "THREE.txt", disk_name));
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "three.txt"));
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "One.txt"));
+
+    imffs_destroy(fs);
+    remove(disk_name);
+}
+
+static int sign(int n)
+{
+    return (n > 0) - (n < 0);
+}
+
+void test_key_name()
+{
+    printf("\n.......Testing the key names........\n");
+    char *names[] = {"", "a", "A", "ab", "abc", "abcdefg", "ABCDEFGH", "abcdefgh", "abcdefghi",
+                     "abcdefgHIj", "abcdefghij", "b", "zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz",
+                     "ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ", "file_with_a_long_name_number_1.txt",
+                     "FILE_with_a_long_name_number_2.txt", "file_with_a_long_name_number_1.txT", "[x]", "_x", "\xe9t\xe9"};
+    int count = sizeof(names) / sizeof(names[0]);
+    KeyName keys[count];
+    int agree = 0;
+    int equal = 0;
+
+    for(int i=0; i < count; i++)
+    {
+        kn_set(&keys[i], names[i]);
+    }
+    VERIFY_INT(0, strcmp("abcdefgHIj", kn_name(&keys[9])));
+    VERIFY_INT(0, strcmp("abcdefghij", kn_folded(&keys[9])));
+    VERIFY_INT(1, NULL == keys[9].heap);
+    VERIFY_INT(0, strcmp("file_with_a_long_name_number_2.txt", kn_folded(&keys[15])));
+    VERIFY_INT(1, NULL != keys[15].heap);
+
+    //the order and equality must be the same as strcasecmp's.
+    for(int i=0; i < count; i++)
+    {
+        for(int j=0; j < count; j++)
+        {
+            if(sign(kn_compare(&keys[i], &keys[j])) == sign(strcasecmp(names[i], names[j])))
+            {
+                agree++;
+            }
+            if(kn_equal(&keys[i], &keys[j]) == (strcasecmp(names[i], names[j]) == 0))
+            {
+                equal++;
+            }
+        }
+    }
+    VERIFY_INT(count * count, agree);
+    VERIFY_INT(count * count, equal);
+
+    //a key name can be moved, and set again after it is cleared.
+    KeyName moved = keys[15];
+    VERIFY_INT(0, strcmp("FILE_with_a_long_name_number_2.txt", kn_name(&moved)));
+    kn_clear(&moved);
+    VERIFY_INT(0, kn_set(&moved, "short"));
+    VERIFY_INT(0, strcmp("short", kn_name(&moved)));
+    kn_clear(&moved);
+
+    //a name can also be the front of a longer string, short or long.
+    VERIFY_INT(0, kn_set_length(&moved, "Report*.TXT", 6));
+    VERIFY_INT(0, strcmp("Report", kn_name(&moved)));
+    VERIFY_INT(0, strcmp("report", kn_folded(&moved)));
+    VERIFY_INT(1, kn_hash("REPORT") == moved.hash);
+    kn_clear(&moved);
+    VERIFY_INT(0, kn_set_length(&moved, "A_Name_Long_Enough_For_The_Heap?x", 32));
+    VERIFY_INT(0, strcmp("A_Name_Long_Enough_For_The_Heap?", kn_name(&moved)));
+    VERIFY_INT(0, strcmp("a_name_long_enough_for_the_heap?", kn_folded(&moved)));
+    kn_clear(&moved);
+    for(int i=0; i < count; i++)
+    {
+        if(i != 15)
+        {
+            kn_clear(&keys[i]);
+        }
+    }
+
+    //the compare in blocks of 16 must stop at the first difference, wherever it is.
+    char one[80], two[80];
+    agree = 0;
+    for(int i=0; i < 70; i++)
+    {
+        memset(one, 'q', sizeof(one));
+        memset(two, 'Q', sizeof(two));
+        two[i] = 'a';
+        if(sign(kn_casecmp(one, two, 70)) == sign(strncasecmp(one, two, 70)) && 0 == kn_casecmp(one, two, i))
+        {
+            agree++;
+        }
+    }
+    VERIFY_INT(70, agree);
+
+    //prefixes and patterns, without case.
+    KeyName prefix;
+    kn_set(&moved, "Logs/2026-10-15.TXT");
+    kn_set(&prefix, "logs/2026-");
+    VERIFY_INT(1, kn_has_prefix(&moved, &prefix));
+    VERIFY_INT(0, kn_has_prefix(&prefix, &moved));
+    VERIFY_INT(1, kn_glob(&moved, "logs/2026-10-*"));
+    VERIFY_INT(1, kn_glob(&moved, "*.txt"));
+    VERIFY_INT(1, kn_glob(&moved, "*"));
+    VERIFY_INT(1, kn_glob(&moved, "LOGS/20?6-?0-1?.*"));
+    VERIFY_INT(1, kn_glob(&moved, "l*2026*15*t"));
+    VERIFY_INT(0, kn_glob(&moved, "logs/2026-11-*"));
+    VERIFY_INT(0, kn_glob(&moved, "*.tx"));
+    VERIFY_INT(0, kn_glob(&moved, "logs/2026-10-15.txt?"));
+    VERIFY_INT(0, kn_glob(&moved, ""));
+    kn_clear(&moved);
+    kn_clear(&prefix);
+
+    //the file system keeps long names whole, through renames and defrag.
+    IMFFSPtr fs = NULL;
+    char *disk_name = "a5_keyname_test.tmp";
+    char *long_name = "a_file_name_that_is_much_too_long_to_fit_in_place.txt";
+
+    write_test_file(disk_name, 300);
+    VERIFY_INT(IMFFS_OK, imffs_create(20, &fs));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "short.txt"));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, long_name));
+    VERIFY_INT(IMFFS_ERROR, imffs_save(fs, disk_name, "A_FILE_NAME_THAT_IS_MUCH_TOO_LONG_TO_FIT_IN_PLACE.TXT"));
+    VERIFY_INT(IMFFS_OK, imffs_rename(fs, "short.txt", "another_file_name_that_is_much_too_long.txt"));
+    VERIFY_INT(IMFFS_OK, imffs_rename(fs, long_name, "tiny"));
+    VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+    VERIFY_INT(IMFFS_OK, imffs_load(fs, "ANOTHER_file_name_that_is_much_too_long.txt", disk_name));
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "TINY"));
+
+    //listing by pattern, with and without a prefix to seek to.
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "logs/2026-10-01"));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "logs/2026-11-01"));
+    VERIFY_INT(IMFFS_OK, imffs_dir_matching(fs, "LOGS/2026-10-*"));
+    VERIFY_INT(IMFFS_OK, imffs_dir_matching(fs, "*-01"));
+    VERIFY_INT(IMFFS_OK, imffs_dir_matching(fs, "zzz*"));
+
+    imffs_destroy(fs);
+    remove(disk_name);
+}
+
+void test_owner_map()
+{
+    printf("\n.......Testing the owner map........\n");
+    OwnerMap *owners;
+    int files[40];
+    uint32_t ids[40];
+    int right = 0;
+
+    VERIFY_NOT_NULL(owners = om_create(100));
+    VERIFY_INT(0, om_owner(owners, 5));
+    VERIFY_INT(-1, om_order(owners, 5));
+    VERIFY_INT(-1, om_order(owners, 100));
+
+    //more ids than fit at first.
+    for(int i=0; i < 40; i++)
+    {
+        ids[i] = om_add_file(owners, &files[i]);
+        if(ids[i] == (uint32_t)i + 1 && om_file(owners, ids[i]) == &files[i])
+        {
+            right++;
+        }
+    }
+    VERIFY_INT(40, right);
+
+    om_set(owners, 10, 5, ids[3], 2);
+    VERIFY_INT(ids[3], om_owner(owners, 10));
+    VERIFY_INT(ids[3], om_owner(owners, 14));
+    VERIFY_INT(0, om_owner(owners, 15));
+    VERIFY_INT(2, om_order(owners, 10));
+    VERIFY_INT(6, om_order(owners, 14));
+    om_clear(owners, 10, 5);
+    VERIFY_INT(0, om_owner(owners, 12));
+    VERIFY_INT(-1, om_order(owners, 12));
+
+    //ids given back are handed out again.
+    om_remove_file(owners, ids[3]);
+    VERIFY_INT(1, om_file(owners, ids[3]) == NULL);
+    VERIFY_INT(ids[3], om_add_file(owners, &files[0]));
+    om_destroy(owners);
+
+    //the file system keeps it up to date through saves, deletes and defrag.
+    IMFFSPtr fs = NULL;
+    char *disk_name = "a5_owners_test.tmp";
+    char name[16];
+    int order;
+    int orders = 0;
+
+    VERIFY_INT(IMFFS_OK, imffs_create_with_policy(10, IMFFS_ALLOC_FIRST_FIT, &fs));
+    write_test_file(disk_name, 300);
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "a"));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "b"));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "c"));
+    VERIFY_INT(IMFFS_OK, imffs_check(fs));
+    VERIFY_INT(IMFFS_OK, imffs_block_owner(fs, 1, name, sizeof(name), &order));
+    VERIFY_STR("a", name);
+    VERIFY_INT(1, order);
+    VERIFY_INT(IMFFS_OK, imffs_block_owner(fs, 8, name, sizeof(name), &order));
+    VERIFY_STR("", name);
+    VERIFY_INT(-1, order);
+    VERIFY_INT(IMFFS_ERROR, imffs_block_owner(fs, 10, name, sizeof(name), &order));
+
+    //with b and d gone, a 4 block file has to go in two pieces.
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "d"));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "e"));
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "b"));
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "d"));
+    VERIFY_INT(IMFFS_OK, imffs_check(fs));
+    write_test_file(disk_name, 1000);
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "big"));
+    VERIFY_INT(IMFFS_OK, imffs_check(fs));
+    for(int b=0; b < 10; b++)
+    {
+        imffs_block_owner(fs, b, name, sizeof(name), &order);
+        if(strcmp(name, "big") == 0)
+        {
+            orders |= 1 << order;
+        }
+    }
+    VERIFY_INT(15, orders);
+    VERIFY_INT(IMFFS_OK, imffs_block_owner(fs, 4, name, sizeof(name), &order));
+    VERIFY_STR("c", name);
+
+    //a renamed file keeps its blocks, now under the new name.
+    VERIFY_INT(IMFFS_OK, imffs_rename(fs, "c", "cc"));
+    VERIFY_INT(IMFFS_OK, imffs_check(fs));
+    VERIFY_INT(IMFFS_OK, imffs_block_owner(fs, 4, name, sizeof(name), &order));
+    VERIFY_STR("cc", name);
+
+    //after defrag every file is in one piece, in order.
+    VERIFY_INT(IMFFS_OK, imffs_defrag(fs));
+    VERIFY_INT(IMFFS_OK, imffs_check(fs));
+    right = 0;
+    char last[16] = "";
+    int last_order = -1;
+    for(int b=0; b < 10; b++)
+    {
+        imffs_block_owner(fs, b, name, sizeof(name), &order);
+        if(name[0] != '\0' && order == (strcmp(name, last) == 0 ? last_order + 1 : 0))
+        {
+            right++;
+        }
+        strcpy(last, name);
+        last_order = order;
+    }
+    VERIFY_INT(10, right);
+    VERIFY_INT(IMFFS_OK, imffs_delete(fs, "big"));
+    VERIFY_INT(IMFFS_OK, imffs_save(fs, disk_name, "again"));
+    VERIFY_INT(IMFFS_OK, imffs_check(fs));
+
+    imffs_destroy(fs);
+    remove(disk_name);
+}
 
 int main()
 {
@@ -144,6 +1008,16 @@ int main()
      test_invalid_cases();
     #endif
     test_special_cases();
+    test_extents();
+    test_buddy();
+    test_group_space();
+    test_statfs();
+    test_groups();
+    test_policies();
+    test_streamed_saves();
+    test_name_hash();
+    test_key_name();
+    test_owner_map();
     if (0 == Tests_Failed)
     {
         printf("\nAll %d tests passed.\n", Tests_Passed);
@@ -0,0 +1,254 @@
+/**
+ * keyname.c
+ *
+ * PURPOSE: To keep file names ready for comparing without case, so most
+ *          comparisons are decided by one number instead of the names.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "a5_keyname.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define PREFIX_BYTES 8
+
+static unsigned char fold_byte(unsigned char c);
+
+#ifdef __SSE2__
+//the 16 bytes with A-Z turned to lower case (bytes over 127 are negative, so never in range).
+static __m128i fold_16(__m128i bytes)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(bytes, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+int kn_set(KeyName *kn, const char *name)
+{
+    assert(NULL != name);
+    return kn_set_length(kn, name, strlen(name));
+}
+
+int kn_set_length(KeyName *kn, const char *name, int length)
+{
+    assert(NULL != kn);
+    assert(NULL != name);
+    assert(length >= 0);
+
+    char *copy = kn->buf;
+    char *folded;
+
+    kn->heap = NULL;
+    kn->length = 0;
+    kn->prefix = 0;
+    kn->hash = 0;
+    kn->buf[0] = '\0';
+
+    //the name and its lower case copy, each with a NUL.
+    if(2 * (length + 1) > KEYNAME_INLINE)
+    {
+        copy = malloc(2 * (length + 1));
+        if(NULL == copy)
+        {
+            return -1;
+        }
+        kn->heap = copy;
+    }
+    folded = copy + length + 1;
+
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    for(int i=0; i < length; i++)
+    {
+        folded[i] = fold_byte(name[i]);
+    }
+    folded[length] = '\0';
+
+    kn->hash = kn_hash(folded);
+
+    //short names are padded with zeros, which sort before any character.
+    for(int i=0; i < PREFIX_BYTES; i++)
+    {
+        kn->prefix <<= 8;
+        if(i < length)
+        {
+            kn->prefix |= (unsigned char)folded[i];
+        }
+    }
+    kn->length = length;
+
+    return 0;
+}
+
+//FNV-1a on the lower case name.
+uint64_t kn_hash(const char *name)
+{
+    assert(NULL != name);
+
+    uint64_t hash = 14695981039346656037ULL;
+
+    for(; *name != '\0'; name++)
+    {
+        hash ^= fold_byte((unsigned char)*name);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void kn_clear(KeyName *kn)
+{
+    assert(NULL != kn);
+
+    free(kn->heap);
+    kn->heap = NULL;
+    kn->length = 0;
+    kn->prefix = 0;
+    kn->hash = 0;
+    kn->buf[0] = '\0';
+}
+
+const char *kn_name(const KeyName *kn)
+{
+    assert(NULL != kn);
+    return (NULL != kn->heap) ? kn->heap : kn->buf;
+}
+
+const char *kn_folded(const KeyName *kn)
+{
+    assert(NULL != kn);
+    return kn_name(kn) + kn->length + 1;
+}
+
+int kn_compare(const KeyName *a, const KeyName *b)
+{
+    assert(NULL != a);
+    assert(NULL != b);
+
+    int shorter;
+    int result;
+
+    if(a == b)
+    {
+        return 0;
+    }
+    if(a->prefix != b->prefix)
+    {
+        return (a->prefix < b->prefix) ? -1 : 1;
+    }
+
+    //the first 8 bytes are the same, so a name that ends there is the smaller one.
+    shorter = (a->length < b->length) ? a->length : b->length;
+    if(shorter > PREFIX_BYTES)
+    {
+        result = memcmp(kn_folded(a) + PREFIX_BYTES, kn_folded(b) + PREFIX_BYTES, shorter - PREFIX_BYTES);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+    return a->length - b->length;
+}
+
+int kn_equal(const KeyName *a, const KeyName *b)
+{
+    assert(NULL != a);
+    assert(NULL != b);
+
+    return a->hash == b->hash && a->length == b->length && a->prefix == b->prefix &&
+           memcmp(kn_folded(a), kn_folded(b), a->length) == 0;
+}
+
+int kn_has_prefix(const KeyName *kn, const KeyName *prefix)
+{
+    assert(NULL != kn);
+    assert(NULL != prefix);
+
+    return kn->length >= prefix->length && memcmp(kn_folded(kn), kn_folded(prefix), prefix->length) == 0;
+}
+
+int kn_glob(const KeyName *kn, const char *pattern)
+{
+    assert(NULL != kn);
+    assert(NULL != pattern);
+
+    const unsigned char *name = (const unsigned char *)kn_folded(kn);
+    const unsigned char *pat = (const unsigned char *)pattern;
+    //where to go back to when what follows the last * stops matching.
+    const unsigned char *star = NULL;
+    const unsigned char *retry = NULL;
+
+    while(*name != '\0')
+    {
+        if(*pat == '*')
+        {
+            star = ++pat;
+            retry = name;
+        }
+        else if(*pat == '?' || (*pat != '\0' && fold_byte(*pat) == *name))
+        {
+            pat++;
+            name++;
+        }
+        else if(NULL != star)
+        {
+            //let the * take one more character.
+            pat = star;
+            name = ++retry;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    while(*pat == '*')
+    {
+        pat++;
+    }
+    return *pat == '\0';
+}
+
+int kn_casecmp(const char *a, const char *b, int length)
+{
+    assert(NULL != a || length == 0);
+    assert(NULL != b || length == 0);
+
+    const unsigned char *s1 = (const unsigned char *)a;
+    const unsigned char *s2 = (const unsigned char *)b;
+    int i = 0;
+
+#ifdef __SSE2__
+    for(; i + 16 <= length; i += 16)
+    {
+        __m128i x = fold_16(_mm_loadu_si128((const __m128i *)(s1 + i)));
+        __m128i y = fold_16(_mm_loadu_si128((const __m128i *)(s2 + i)));
+        int differ = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+
+        if(differ != 0)
+        {
+            i += __builtin_ctz(differ);
+            return fold_byte(s1[i]) - fold_byte(s2[i]);
+        }
+    }
+#endif
+    for(; i < length; i++)
+    {
+        if(fold_byte(s1[i]) != fold_byte(s2[i]))
+        {
+            return fold_byte(s1[i]) - fold_byte(s2[i]);
+        }
+    }
+    return 0;
+}
+
+//tolower for the C locale, which is what strcasecmp used here.
+static unsigned char fold_byte(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
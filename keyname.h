@@ -0,0 +1,61 @@
+#ifndef _A5_KEYNAME
+#define _A5_KEYNAME
+
+#include <stdint.h>
+
+// A key name is a file name kept ready for comparing without case. Next to
+// the name it keeps a lower case copy, its length, a 64-bit hash of it, and
+// its first 8 lower case bytes as a big-endian number, so comparing two
+// prefixes orders them like the names. Most names differ in those 8 bytes,
+// and then the names themselves are never read.
+// Names that fit (with their lower case copy) in KEYNAME_INLINE bytes are
+// stored in the struct; longer ones take one allocation for both copies.
+// Nothing points into the struct, so it can be copied or moved freely.
+
+#define KEYNAME_INLINE 32
+
+typedef struct KEY_NAME {
+    uint64_t prefix;
+    uint64_t hash;
+    int length;
+    char *heap; //both copies of a long name, NULL for short ones.
+    char buf[KEYNAME_INLINE];
+} KeyName;
+
+// Set kn (which holds no name, or was cleared) to a copy of name.
+// Return 0 on success, -1 if memory runs out (kn then holds no name).
+int kn_set(KeyName *kn, const char *name);
+
+// Same as kn_set, with the first "length" bytes of name (which doesn't have to
+// end there) as the name.
+int kn_set_length(KeyName *kn, const char *name, int length);
+
+// Free the name (but not kn itself).
+void kn_clear(KeyName *kn);
+
+// The name as it was given, and its lower case copy.
+const char *kn_name(const KeyName *kn);
+const char *kn_folded(const KeyName *kn);
+
+// The hash kn_set keeps for a name, worked out from a plain string.
+uint64_t kn_hash(const char *name);
+
+// Compare like strcasecmp: less than, equal to or greater than 0.
+int kn_compare(const KeyName *a, const KeyName *b);
+
+// Return 1 if the names are the same ignoring case, 0 otherwise.
+int kn_equal(const KeyName *a, const KeyName *b);
+
+// Return 1 if the name starts with the prefix's name, ignoring case.
+int kn_has_prefix(const KeyName *kn, const KeyName *prefix);
+
+// Return 1 if the name matches the pattern ignoring case, where * stands for
+// any characters and ? for any one character.
+int kn_glob(const KeyName *kn, const char *pattern);
+
+// Compare the first "length" bytes of a and b ignoring case (NULs are not
+// special), 16 bytes at a time where SSE2 is there. Like strncasecmp, the
+// sign of the result gives the order.
+int kn_casecmp(const char *a, const char *b, int length);
+
+#endif
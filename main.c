@@ -45,7 +45,7 @@ int handle_result(IMFFSResult result, char *action) {
   return modified_result;
 }
 
-int interactive_imffs(uint32_t block_count) {
+int interactive_imffs(uint32_t block_count, IMFFSAllocPolicy policy, int group_count) {
   int result = 0, len, help;
   IMFFSPtr fs = NULL;
   char command[MAX_COMMAND], ch, *token, *token2;
@@ -53,7 +53,7 @@ int interactive_imffs(uint32_t block_count) {
   while (!result) {
     if (NULL == fs) {
       // printf("Creating a file system with %u blocks.\n", block_count);
-      result = HANDLE_RESULT(imffs_create(block_count, &fs)); // &fs passed a pointer to the struct.
+      result = HANDLE_RESULT(imffs_create_with_groups(block_count, policy, group_count, &fs)); // &fs passed a pointer to the struct.
       if (NULL == fs) {
         result = -1;
       }
@@ -113,10 +113,13 @@ int interactive_imffs(uint32_t block_count) {
               result = HANDLE_RESULT(imffs_rename(fs, token, token2));
             }
           } else if (0 == strcasecmp("dir", token)) {
-            if (NULL != strtok(NULL, "")) {
+            token = strtok(NULL, WHITESPACE);
+            if (NULL != token && NULL != strtok(NULL, "")) {
               help = 1;
-            } else {
+            } else if (NULL == token) {
               result = HANDLE_RESULT(imffs_dir(fs));
+            } else {
+              result = HANDLE_RESULT(imffs_dir_matching(fs, token));
             }
           } else if (0 == strcasecmp("fulldir", token)) {
             if (NULL != strtok(NULL, "")) {
@@ -130,6 +133,43 @@ int interactive_imffs(uint32_t block_count) {
             } else {
               result = HANDLE_RESULT(imffs_defrag(fs));
             }
+          } else if (0 == strcasecmp("df", token)) {
+            if (NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              IMFFSStatfs usage;
+              result = HANDLE_RESULT(imffs_statfs(fs, &usage));
+              if (0 == result) {
+                printf("Blocks: %u total, %ld used, %ld free (%d bytes each)\n", usage.block_count, usage.used_blocks, usage.free_blocks, usage.block_size);
+                printf("Files: %ld in %ld chunks, %lld bytes\n", usage.files, usage.extents, usage.used_bytes);
+                printf("Largest free run: %ld blocks\n", usage.largest_free_run);
+                printf("Allocation groups: %d\n", usage.groups);
+              }
+            }
+          } else if (0 == strcasecmp("stats", token)) {
+            if (NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              IMFFSAllocStats stats;
+              result = HANDLE_RESULT(imffs_alloc_stats(fs, &stats));
+              if (0 == result) {
+                printf("Files placed: %ld\n", stats.files_placed);
+                printf("Extents created: %ld\n", stats.extents_created);
+                printf("Extents per file: %.2f\n", stats.files_placed > 0 ? (double)stats.extents_created / stats.files_placed : 0.0);
+                printf("Fragmented files: %ld\n", stats.files_fragmented);
+                printf("Free runs searched: %lld (%.2f per file)\n", stats.search_steps, stats.files_placed > 0 ? (double)stats.search_steps / stats.files_placed : 0.0);
+                printf("Allocation time: %lld ns\n", stats.alloc_nanoseconds);
+              }
+            }
+          } else if (0 == strcasecmp("check", token)) {
+            if (NULL != strtok(NULL, "")) {
+              help = 1;
+            } else {
+              result = HANDLE_RESULT(imffs_check(fs));
+              if (0 == result) {
+                printf("No problems found.\n");
+              }
+            }
           } else if (0 == strcasecmp("help", token)) {
             help = 1;
           } else if (0 == strcasecmp("quit", token)) {
@@ -151,8 +191,12 @@ int interactive_imffs(uint32_t block_count) {
             printf("delete imffsfile: remove the IMFFS file from the system, allowing the blocks to be used for other files\n");
             printf("rename imffsold imffsnew: rename the IMFFS file from imffsold to imffsnew, keeping all of the data intact\n");
             printf("dir: will list all of the files and the number of bytes they occupy\n");
+            printf("dir pattern: lists only the files matching the pattern, where * is any characters and ? is one (e.g. dir logs/2026-10-*)\n");
             printf("fulldir: is like \"dir\" except it shows a the files and details about all of the chunks they are stored in (where, and how big)\n");
             printf("defrag: is described below\n");
+            printf("df: shows how much of the device is used and free\n");
+            printf("stats: shows how many files and chunks the allocator has placed, and how long it took\n");
+            printf("check: makes sure the index, the block owners and the free space agree\n");
             printf("help: lists the commands\n");
             printf("quit: will quit the program\n\n");
           }
@@ -176,20 +220,47 @@ int main(int argc, char *argv[]) {
   int opt;
 
   uint32_t block_count = DEFAULT_BLOCK_COUNT;
+  IMFFSAllocPolicy policy = IMFFS_ALLOC_BEST_FIT;
+  int group_count = 0;
   long converted;
   char *end_p;
 
-  while ((0 == result) && (opt = getopt(argc, argv, "b:h")) != -1) {
+  while ((0 == result) && (opt = getopt(argc, argv, "b:a:g:h")) != -1) {
     switch (opt) {
     case 'b':
       converted = strtol(optarg, &end_p, 10);
-      if (end_p == optarg || converted < 1 || converted > UINT32_MAX) {
-        fprintf(stderr, "Number of blocks must be between 1 and %u\n", UINT32_MAX);
+      if (end_p == optarg || converted < 1 || converted > IMFFS_MAX_BLOCKS) {
+        fprintf(stderr, "Number of blocks must be between 1 and %d\n", IMFFS_MAX_BLOCKS);
         block_count = DEFAULT_BLOCK_COUNT;
       } else {
         block_count = (uint32_t)converted;
       }
       break;
+    case 'a':
+      if (0 == strcasecmp("bestfit", optarg)) {
+        policy = IMFFS_ALLOC_BEST_FIT;
+      } else if (0 == strcasecmp("buddy", optarg)) {
+        policy = IMFFS_ALLOC_BUDDY;
+      } else if (0 == strcasecmp("firstfit", optarg)) {
+        policy = IMFFS_ALLOC_FIRST_FIT;
+      } else if (0 == strcasecmp("nextfit", optarg)) {
+        policy = IMFFS_ALLOC_NEXT_FIT;
+      } else if (0 == strcasecmp("worstfit", optarg)) {
+        policy = IMFFS_ALLOC_WORST_FIT;
+      } else {
+        fprintf(stderr, "Allocation policy must be one of: bestfit, buddy, firstfit, nextfit, worstfit\n");
+        result = -1;
+      }
+      break;
+    case 'g':
+      converted = strtol(optarg, &end_p, 10);
+      if (end_p == optarg || converted < 1 || converted > INT32_MAX) {
+        fprintf(stderr, "Number of allocation groups must be at least 1\n");
+        result = -1;
+      } else {
+        group_count = (int)converted;
+      }
+      break;
     case 'h':
       result = -1;
       break;
@@ -200,9 +271,9 @@ int main(int argc, char *argv[]) {
   }
   
   if (result < 0 || argc > optind) {
-    fprintf(stderr, "Usage: %s [-b block_count]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-b block_count] [-a bestfit|buddy|firstfit|nextfit|worstfit] [-g group_count]\n", argv[0]);
   } else {
-    result = interactive_imffs(block_count);
+    result = interactive_imffs(block_count, policy, group_count);
   }
   
   return result;
@@ -10,33 +10,57 @@
 #include <assert.h>
 
 #include "a5_multimap.h"
+#include "a5_valuelist.h"
 
-typedef struct VALUE_NODE {
-  Value value;
-  struct VALUE_NODE *next;
-} ValueNode;
+// the room for keys a multimap starts with, it doubles when full and halves when a quarter full.
+#define FIRST_CAPACITY 16
 
+// A removed key leaves a tombstone: a slot with no values that keeps the key
+// of the closest key before it, so the slots stay in order for binary search
+// and nothing has to be shifted. The keys before the first live one and after
+// the last are not kept at all: the slots in use are [first, end).
+// The tombstones are compacted away in one pass once there are too many.
 typedef struct KEY_AND_VALUES {
   void *key;
-  int num_values;
-  ValueNode *head;
+  ValueList values; // empty for a tombstone
 } KeyAndValues;
 
 struct MULTIMAP 
 {
   int num_keys;
   int max_keys;
+  int capacity; // the number of slots there is room for in the keys array
   KeyAndValues *keys;
+  int first; // the first slot in use, always a key when there are any
+  int end; // the slot after the last one in use
+  int num_dead; // the tombstones in [first, end)
   Compare compare_keys;
   Compare compare_values;
-  // NEW: traversal position, for the get_keys functions
+  ValuePool *pool; // where the value nodes come from
+  // the frozen search layout (see mm_freeze): the fingerprints of the keys,
+  // and their slots, in Eytzinger order from 1. NULL until mm_freeze.
+  MMFingerprint fingerprint;
+  uint64_t *prints;
+  int *print_slots;
+  int num_prints;
+  int frozen; // whether the layout matches the keys
+  // NEW: traversal position, for the get_keys functions: the slot to look
+  // for the next key from, or -1
   int trav_pos;
 };
 
 // Helper functions
-static int find_key_pos(Multimap *mm, void *key, KeyAndValues *keys, int num_keys);
-static int insert_key_alphabetically(Multimap *mm, KeyAndValues *keys, int keys_length, void *key);
-static int insert_value_by_num(Multimap *mm, KeyAndValues *key, ValueNode *node);
+static int find_key_pos(Multimap *mm, void *key);
+static int lower_bound_pos(Multimap *mm, void *key);
+static int lower_bound_between(Multimap *mm, void *key, int start, int end);
+static int print_lower_bound(Multimap *mm, uint64_t print);
+static int fill_prints(Multimap *mm, int slot, int k);
+static int next_live(Multimap *mm, int slot);
+static int add_slot(Multimap *mm, void *key);
+static void take_slot(Multimap *mm, int pos);
+static void drop_run(Multimap *mm, int pos, int run_end);
+static int compact(Multimap *mm, int capacity);
+static int resize_keys(Multimap *mm, int capacity);
 
 // This gets rid of the warning about an unused function when assertions are off.
 // It wouldn't be a problem if your function isn't "static" (which it doesn't have to be).
@@ -47,32 +71,35 @@ static int validate_multimap(Multimap *mm)
   assert(NULL != mm->keys);
   assert(mm->max_keys >= 0);
   assert(mm->num_keys >= 0 && mm->num_keys <= mm->max_keys);
+  assert(mm->first >= 0 && mm->first <= mm->end && mm->end <= mm->capacity);
+  assert(mm->end - mm->first == mm->num_keys + mm->num_dead);
+  assert(mm->capacity >= FIRST_CAPACITY);
   // NEW
-  assert(mm->trav_pos >= -1 && mm->trav_pos <= mm->max_keys);
+  assert(mm->trav_pos >= -1 && mm->trav_pos <= mm->capacity);
   
   // Those were the easy/efficient ones, here is the tricky part to check the entire structure
-  ValueNode *curr, *prev;
-  int count;
-  for (int i = 0; i < mm->num_keys; i++) {
-    assert(mm->keys[i].num_values > 0); // can't have a key with no values
-    assert(NULL != mm->keys[i].head);
-    if (i > 0) {
-      // ordering and duplication
-      assert(mm->compare_keys(mm->keys[i-1].key, mm->keys[i].key) < 0);
+  int live = 0;
+  for (int i = mm->first; i < mm->end; i++) {
+    if (mm->keys[i].values.num_values > 0) {
+      live++;
+      if (live > 1) {
+        // ordering and duplication
+        assert(mm->compare_keys(mm->keys[i-1].key, mm->keys[i].key) < 0);
+      }
+    } else {
+      // a tombstone, with the key before it
+      assert(i > mm->first && i < mm->end - 1);
+      assert(mm->keys[i].key == mm->keys[i-1].key);
     }
-    
-    count = 0;
-    curr = mm->keys[i].head;
-    prev = NULL;
-
-    while (NULL != curr) 
-    {
-      count++;
-      prev = curr;
-      curr = curr->next;
+    assert(vl_validate(&mm->keys[i].values));
+  }
+  assert(live == mm->num_keys);
+  if (mm->frozen) {
+    assert(mm->num_prints == mm->num_keys);
+    for (int k = 1; k <= mm->num_prints; k++) {
+      assert(mm->keys[mm->print_slots[k]].values.num_values > 0);
+      assert(mm->fingerprint(mm->keys[mm->print_slots[k]].key) == mm->prints[k]);
     }
-
-    assert(count == mm->keys[i].num_values);
   }
   
   return 1; // always return TRUE
@@ -89,13 +116,25 @@ Multimap *mm_create(int max_keys, Compare compare_keys, Compare compare_values)
   if (max_keys >= 0 && NULL != compare_keys && NULL != compare_values) {
     mm = malloc(sizeof(Multimap));
     if (NULL != mm) {
-      mm->keys = malloc(max_keys * sizeof(KeyAndValues));
-      if (NULL == mm->keys) {
+      mm->keys = malloc(FIRST_CAPACITY * sizeof(KeyAndValues));
+      mm->pool = vp_create();
+      if (NULL == mm->keys || NULL == mm->pool) {
+        free(mm->keys);
+        vp_destroy(mm->pool);
         free(mm);
         mm = NULL;
       } else {
         mm->max_keys = max_keys;
+        mm->capacity = FIRST_CAPACITY;
         mm->num_keys = 0;
+        mm->first = 0;
+        mm->end = 0;
+        mm->num_dead = 0;
+        mm->fingerprint = NULL;
+        mm->prints = NULL;
+        mm->print_slots = NULL;
+        mm->num_prints = 0;
+        mm->frozen = 0;
         mm->compare_keys = compare_keys;
         mm->compare_values = compare_values;
         // NEW
@@ -107,6 +146,56 @@ Multimap *mm_create(int max_keys, Compare compare_keys, Compare compare_values)
   return mm;
 }
 
+Multimap *mm_bulk_load(int max_keys, Compare compare_keys, Compare compare_values,
+                       MMEntry entries[], int num_entries, int sorted)
+{
+  assert(num_entries >= 0);
+  assert(NULL != entries || 0 == num_entries);
+
+  Multimap *mm = NULL;
+  int num_keys = 0;
+  int valid = (num_entries >= 0 && (NULL != entries || 0 == num_entries));
+
+  for (int i = 0; valid && i < num_entries; i++) {
+    // can't have a key with no values
+    valid = (NULL != entries[i].key && entries[i].num_values > 0 && NULL != entries[i].values);
+  }
+  if (valid && !sorted) {
+    valid = (mm_sort_entries(entries, num_entries, compare_keys) == 0);
+  }
+  for (int i = 0; valid && i < num_entries; i++) {
+    if (0 == i || compare_keys(entries[i-1].key, entries[i].key) != 0) {
+      num_keys++;
+    }
+  }
+  if (valid && num_keys <= max_keys) {
+    mm = mm_create(max_keys, compare_keys, compare_values);
+  }
+
+  // the keys are in order already, so they go straight into the array
+  if (NULL != mm && num_keys > mm->capacity && resize_keys(mm, num_keys) != 0) {
+    mm_destroy(mm);
+    mm = NULL;
+  }
+  if (NULL != mm) {
+    for (int i = 0; i < num_entries; i++) {
+      if (0 == i || compare_keys(entries[i-1].key, entries[i].key) != 0) {
+        mm->keys[mm->num_keys].key = entries[i].key;
+        vl_init(&mm->keys[mm->num_keys].values);
+        mm->num_keys++;
+        mm->end++;
+      }
+      if (vl_insert_entry(&mm->keys[mm->num_keys - 1].values, mm->pool, compare_values, &entries[i]) != 0) {
+        mm_destroy(mm);
+        return NULL;
+      }
+    }
+    assert(validate_multimap(mm));
+  }
+
+  return mm;
+}
+
 int mm_insert_value(Multimap *mm, void *key, int value_num, void *value_data)
 {
   assert(validate_multimap(mm));
@@ -115,33 +204,20 @@ int mm_insert_value(Multimap *mm, void *key, int value_num, void *value_data)
   
   int result = -1;
   int pos;
-  ValueNode *node;
+  Value value;
   if (NULL != mm && NULL != key && NULL != value_data) {
-    pos = find_key_pos(mm,key,mm->keys, mm->num_keys);
+    pos = find_key_pos(mm, key);
     if (pos < 0 && mm->num_keys < mm->max_keys) {
-
-      pos = insert_key_alphabetically(mm,mm->keys, mm->num_keys, key);
-      assert(pos >= 0 && pos < mm->max_keys);
-      mm->num_keys++;
-      
-      // NEW
-      if (pos < mm->trav_pos && mm->trav_pos < mm->max_keys)
-      {
-        mm->trav_pos++;
-      }
+      pos = add_slot(mm, key);
     }
 
     if (pos >= 0) 
     {
-      assert(pos < mm->num_keys);
+      assert(pos < mm->end);
       // key was either already there, or successfully added
-      node = malloc(sizeof(ValueNode));
-      if (NULL != node)
-     {
-        node->value.num = value_num;
-        node->value.data = value_data;
-        result = insert_value_by_num(mm,&mm->keys[pos], node);
-      }
+      value.num = value_num;
+      value.data = value_data;
+      result = vl_insert(&mm->keys[pos].values, mm->pool, mm->compare_values, value);
       assert (result > 0);
     }
   }
@@ -174,10 +250,10 @@ int mm_count_values(Multimap *mm, void *key)
   
   if (NULL != mm && NULL != key) {
     count = 0;
-    pos = find_key_pos(mm, key, mm->keys, mm->num_keys);
+    pos = find_key_pos(mm, key);
     if (pos >= 0) {
-      assert(pos < mm->num_keys);
-      count = mm->keys[pos].num_values;
+      assert(pos < mm->end);
+      count = mm->keys[pos].values.num_values;
     }
   }
   
@@ -194,19 +270,13 @@ int mm_get_values(Multimap *mm, void *key, Value values[], int max_values)
   
   int count = -1;
   int pos;
-  ValueNode *node;
   
   if (NULL != mm && NULL != key && NULL != values && max_values >= 0) {
     count = 0;
-    pos = find_key_pos(mm, key, mm->keys, mm->num_keys);
+    pos = find_key_pos(mm, key);
     if (pos >= 0) {
-      assert(pos < mm->num_keys);
-      node = mm->keys[pos].head;
-      while (NULL != node && count < max_values) {
-        values[count] = node->value;
-        count++;
-        node = node->next;
-      }
+      assert(pos < mm->end);
+      count = vl_get(&mm->keys[pos].values, values, max_values);
     }
   }
   
@@ -215,6 +285,29 @@ int mm_get_values(Multimap *mm, void *key, Value values[], int max_values)
   return count;
 }
 
+int mm_for_each_value(Multimap *mm, void *key, MMValueVisit visit, void *arg)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+  assert(NULL != visit);
+
+  int count = -1;
+  int pos;
+
+  if (NULL != mm && NULL != key && NULL != visit) {
+    count = 0;
+    pos = find_key_pos(mm, key);
+    if (pos >= 0) {
+      assert(pos < mm->end);
+      count = vl_for_each(&mm->keys[pos].values, visit, arg);
+    }
+  }
+
+  assert(validate_multimap(mm));
+  assert(count >= -1);
+  return count;
+}
+
 int mm_remove_key(Multimap *mm, void *key)
 {
   assert(validate_multimap(mm));
@@ -222,35 +315,16 @@ int mm_remove_key(Multimap *mm, void *key)
   
   int count = -1;
   int pos;
-  ValueNode *curr, *next;
   
   if (NULL != mm && NULL != key) {
     count = 0;
-    pos = find_key_pos(mm,key, mm->keys, mm->num_keys);
+    pos = find_key_pos(mm, key);
     if (pos >= 0) {
-      assert(pos < mm->num_keys);
+      assert(pos < mm->end);
       
-      count = 0;
-      
-      // free the list
-      curr = mm->keys[pos].head;
-      while (NULL != curr) {
-        next = curr->next;
-        free(curr);
-        curr = next;
-        count++;
-      }
-
-      // move values up by one
-      for (int i = pos + 1; i < mm->num_keys; i++) {
-        mm->keys[i - 1] = mm->keys[i];
-      }
-      mm->num_keys--;
-
-      // NEW
-      if (pos+1 <= mm->trav_pos && mm->trav_pos > 0) {
-        mm->trav_pos--;
-      }
+      // free the list, the slot stays as a tombstone
+      count = vl_clear(&mm->keys[pos].values, mm->pool);
+      take_slot(mm, pos);
     }
   }
   
@@ -263,16 +337,10 @@ void mm_print(Multimap *mm)
 {
   assert(validate_multimap(mm));
 
-  ValueNode *node;
-
   if (NULL != mm) {
-    for (int i = 0; i < mm->num_keys; i++) {
-      printf("[%3d] '%p' (%d):\n", i, mm->keys[i].key, mm->keys[i].num_values); 
-      node = mm->keys[i].head;
-      while (NULL != node) {
-        printf(" %9d '%p'\n", node->value.num, node->value.data); 
-        node = node->next;
-      }
+    for (int i = next_live(mm, 0); i < mm->end; i = next_live(mm, i + 1)) {
+      printf("[%3d] '%p' (%d):\n", i, mm->keys[i].key, mm->keys[i].values.num_values); 
+      vl_print(&mm->keys[i].values);
     }
   }  
 
@@ -284,26 +352,24 @@ int mm_destroy(Multimap *mm)
   int count = -1;
 
   assert(validate_multimap(mm));
-  
-  ValueNode *node, *next;
 
   if (NULL != mm) {
     count = mm->num_keys;
-    for (int i = 0; i < mm->num_keys; i++) {
-      node = mm->keys[i].head;
-      while (NULL != node) {
-        next = node->next;
-        free(node);
-        count++;
-        node = next;
-      }
+    for (int i = mm->first; i < mm->end; i++) {
+      count += mm->keys[i].values.num_values;
     }
     free(mm->keys);
+    free(mm->prints);
+    free(mm->print_slots);
+    // the value nodes all go with their slabs
+    vp_destroy(mm->pool);
     
     // set everything to zero, to help catch a dangling pointer error
     mm->num_keys = 0;
     mm->max_keys = 0;
+    mm->capacity = 0;
     mm->keys = NULL;
+    mm->pool = NULL;
     
     free(mm);
   }  
@@ -311,8 +377,63 @@ int mm_destroy(Multimap *mm)
   return count;
 }
 
+int mm_pool_stats(Multimap *mm, MMPoolStats *stats)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != stats);
+
+  if (NULL == mm || NULL == stats) {
+    return -1;
+  }
+  vp_stats(mm->pool, stats);
+  return 0;
+}
+
 /*** NEW ***/
 
+int mm_rekey(Multimap *mm, void *key, void *new_key)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+  assert(NULL != new_key);
+
+  int count = -1;
+  int pos, dest;
+
+  if (NULL != mm && NULL != key && NULL != new_key) {
+    count = 0;
+    pos = find_key_pos(mm, key);
+    if (pos >= 0) {
+      count = mm->keys[pos].values.num_values;
+      if (mm->compare_keys(key, new_key) == 0) {
+        // same place, only the key changes, in the tombstones after it too
+        for (int i = pos; i < mm->end && (i == pos || 0 == mm->keys[i].values.num_values); i++) {
+          mm->keys[i].key = new_key;
+        }
+      } else if (find_key_pos(mm, new_key) >= 0) {
+        count = -1; // it would be there twice
+      } else {
+        // the traversal moves as if the key was removed and new_key added, and
+        // adding new_key first is the only step that can fail. It can move
+        // the slots, so the key is looked for again.
+        dest = add_slot(mm, new_key);
+        if (dest < 0) {
+          count = -1;
+        } else {
+          pos = find_key_pos(mm, key);
+          mm->keys[dest].values = mm->keys[pos].values;
+          vl_init(&mm->keys[pos].values);
+          take_slot(mm, pos);
+        }
+      }
+    }
+  }
+
+  assert(validate_multimap(mm));
+  assert(count >= -1);
+  return count;
+}
+
 int mm_get_first_key(Multimap *mm, void **key)
 {
   assert(validate_multimap(mm));
@@ -326,9 +447,9 @@ int mm_get_first_key(Multimap *mm, void **key)
   }
   
   if (mm->num_keys > 0) {
-    *key = mm->keys[0].key;
+    *key = mm->keys[mm->first].key;
     result = 1;
-    mm->trav_pos = 1;
+    mm->trav_pos = mm->first + 1;
   } else {
     mm->trav_pos = -1;
   }
@@ -350,7 +471,8 @@ int mm_get_next_key(Multimap *mm, void **key)
     return -1;
   }
 
-  if (mm->trav_pos < mm->num_keys && mm->trav_pos >= 0) {
+  if (mm->trav_pos >= 0 && next_live(mm, mm->trav_pos) < mm->end) {
+    mm->trav_pos = next_live(mm, mm->trav_pos);
     *key = mm->keys[mm->trav_pos].key;
     result = 1;
     mm->trav_pos++;
@@ -367,75 +489,437 @@ int mm_get_next_key(Multimap *mm, void **key)
   return result;
 }
 
-static int find_key_pos(Multimap *mm, void *key, KeyAndValues *keys, int num_keys)
+// The cursor keeps the slot to look for the next key from, and -1 once the
+// keys have run out, like trav_pos. Nothing here validates the whole multimap, since
+// that's O(n) for every key.
+
+int mm_cursor_first(Multimap *mm, MMCursor *cursor, void **key)
 {
+  assert(NULL != mm);
+  assert(NULL != cursor);
   assert(NULL != key);
-  assert(NULL != keys);
-  assert(num_keys >= 0);
-  
-  int start = 0, end = num_keys - 1;
-  int mid, comp;
-  int pos = -1;
-  
-  while (start <= end && pos < 0) {
+
+  if (NULL == mm || NULL == cursor || NULL == key) {
+    return -1;
+  }
+
+  cursor->node = NULL;
+  cursor->index = -1;
+  if (mm->num_keys > 0) {
+    *key = mm->keys[mm->first].key;
+    cursor->index = mm->first + 1;
+    return 1;
+  }
+  return 0;
+}
+
+int mm_cursor_next(Multimap *mm, MMCursor *cursor, void **key)
+{
+  assert(NULL != mm);
+  assert(NULL != cursor);
+  assert(NULL != key);
+
+  int result = 0;
+
+  if (NULL == mm || NULL == cursor || NULL == key) {
+    return -1;
+  }
+
+  if (cursor->index >= 0 && next_live(mm, cursor->index) < mm->end) {
+    cursor->index = next_live(mm, cursor->index);
+    *key = mm->keys[cursor->index].key;
+    cursor->index++;
+    result = 1;
+  } else {
+    if (cursor->index < 0) {
+      // the previous call already ran out of keys
+      result = -1;
+    }
+    cursor->index = -1;
+  }
+  return result;
+}
+
+int mm_lower_bound(Multimap *mm, MMCursor *cursor, void *key, void **found)
+{
+  assert(NULL != mm);
+  assert(NULL != cursor);
+  assert(NULL != key);
+  assert(NULL != found);
+
+  int pos;
+
+  if (NULL == mm || NULL == cursor || NULL == key || NULL == found) {
+    return -1;
+  }
+
+  cursor->node = NULL;
+  cursor->index = -1;
+  pos = lower_bound_pos(mm, key);
+  if (pos < mm->end) {
+    *found = mm->keys[pos].key;
+    cursor->index = pos + 1;
+    return 1;
+  }
+  return 0;
+}
+
+int mm_foreach(Multimap *mm, MMVisit visit, void *arg)
+{
+  assert(NULL != mm);
+  assert(NULL != visit);
+
+  int count = 0;
+
+  if (NULL == mm || NULL == visit) {
+    return -1;
+  }
+
+  for (int i = next_live(mm, 0); i < mm->end; i = next_live(mm, i + 1)) {
+    count++;
+    if (visit(mm->keys[i].key, mm->keys[i].values.num_values, arg) != 0) {
+      break;
+    }
+  }
+  return count;
+}
+
+int mm_freeze(Multimap *mm, MMFingerprint fingerprint)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != fingerprint);
+
+  uint64_t *prints;
+  int *print_slots;
+
+  if (NULL == mm || NULL == fingerprint) {
+    return -1;
+  }
+  if (mm->frozen && mm->fingerprint == fingerprint) {
+    return 0;
+  }
+
+  mm->frozen = 0;
+  mm->fingerprint = fingerprint;
+  if (mm->num_keys != mm->num_prints || NULL == mm->prints) {
+    prints = realloc(mm->prints, (mm->num_keys + 1) * sizeof(uint64_t));
+    if (NULL == prints) {
+      return -1;
+    }
+    mm->prints = prints;
+    print_slots = realloc(mm->print_slots, (mm->num_keys + 1) * sizeof(int));
+    if (NULL == print_slots) {
+      return -1;
+    }
+    mm->print_slots = print_slots;
+    mm->num_prints = mm->num_keys;
+  }
+  fill_prints(mm, next_live(mm, 0), 1);
+  mm->frozen = 1;
+
+  assert(validate_multimap(mm));
+  return 0;
+}
+
+int mm_frozen(Multimap *mm)
+{
+  assert(NULL != mm);
+
+  if (NULL == mm) {
+    return -1;
+  }
+  return (NULL == mm->fingerprint || mm->frozen) ? 1 : 0;
+}
+
+int mm_reclaim(Multimap *mm)
+{
+  assert(NULL != mm);
+
+  if (NULL == mm) {
+    return -1;
+  }
+  // the values of a removed key went back to the pool as it was removed
+  return 0;
+}
+
+// the slot with the key, or -1.
+static int find_key_pos(Multimap *mm, void *key)
+{
+  assert(NULL != key);
+
+  int pos = lower_bound_pos(mm, key);
+
+  return (pos < mm->end && mm->compare_keys(key, mm->keys[pos].key) == 0) ? pos : -1;
+}
+
+// the slot of the first key not less than key, end if there's none. A
+// tombstone has the same key as the slot before it, so the first slot with
+// any key is never one.
+static int lower_bound_pos(Multimap *mm, void *key)
+{
+  uint64_t print;
+  int start, end;
+
+  if (!mm->frozen) {
+    return lower_bound_between(mm, key, mm->first, mm->end);
+  }
+
+  // the keys with a smaller fingerprint are smaller and the ones with a
+  // bigger one are bigger, so only the ones with the same fingerprint (most
+  // often none or one) are compared.
+  print = mm->fingerprint(key);
+  start = print_lower_bound(mm, print);
+  end = (UINT64_MAX == print) ? mm->end : print_lower_bound(mm, print + 1);
+  return lower_bound_between(mm, key, start, end);
+}
+
+// the same, for keys between the slots start and end.
+static int lower_bound_between(Multimap *mm, void *key, int start, int end)
+{
+  int mid;
+
+  while (start < end) {
     mid = (end - start) / 2 + start;
-    comp = mm->compare_keys(key, keys[mid].key);
-    if (comp < 0) {
-      end = mid - 1;
-    } else if (comp > 0) {
+    if (mm->compare_keys(mm->keys[mid].key, key) < 0) {
       start = mid + 1;
     } else {
-      pos = mid;
+      end = mid;
     }
   }
-  
-  return pos;
+  return start;
 }
 
-static int insert_key_alphabetically(Multimap *mm,KeyAndValues *keys, int keys_length, void *key) {
-  assert(NULL != keys);
-  assert(keys_length >= 0);
-  assert(NULL != key);
+// the slot of the first key whose fingerprint is not less than print, end
+// if there's none. It goes down the Eytzinger tree without branching on the
+// comparison, fetching the nodes four levels down (16 fingerprints, two cache
+// lines) ahead of time; the last node it went right from is the answer.
+static int print_lower_bound(Multimap *mm, uint64_t print)
+{
+  int k = 1;
 
-  int pos = 0;
-  
-  while (pos < keys_length && mm->compare_keys(key, keys[pos].key) >= 0) {
-    pos++;
+  while (k <= mm->num_prints) {
+    __builtin_prefetch(mm->prints + 16 * (long)k);
+    k = 2 * k + (mm->prints[k] < print);
   }
-  
-  if (pos < keys_length) {
+  k >>= __builtin_ffs(~k);
+
+  return (0 == k) ? mm->end : mm->print_slots[k];
+}
+
+// lays out the keys from "slot" on under node k of the Eytzinger tree, in
+// order. Return the slot of the key after them.
+static int fill_prints(Multimap *mm, int slot, int k)
+{
+  if (k <= mm->num_prints) {
+    slot = fill_prints(mm, slot, 2 * k);
+    mm->prints[k] = mm->fingerprint(mm->keys[slot].key);
+    mm->print_slots[k] = slot;
+    slot = fill_prints(mm, next_live(mm, slot + 1), 2 * k + 1);
+  }
+  return slot;
+}
+
+// the first slot from "slot" on that has a key, end if there's none.
+static int next_live(Multimap *mm, int slot)
+{
+  if (slot < mm->first) {
+    slot = mm->first;
+  }
+  while (slot < mm->end && 0 == mm->keys[slot].values.num_values) {
+    slot++;
+  }
+  return slot;
+}
+
+// adds a key that isn't there, with no values, keeping the traversal where
+// it was. A tombstone right before its place is used again, otherwise the
+// slots after it shift over. Return its slot, or -1 if memory runs out.
+// max_keys is up to the caller.
+static int add_slot(Multimap *mm, void *key)
+{
+  int pos = lower_bound_pos(mm, key);
+  int capacity;
+
+  if ((pos > mm->first && 0 == mm->keys[pos - 1].values.num_values) ||
+      (pos == mm->first && pos > 0)) {
+    pos--;
+    if (pos < mm->first) {
+      mm->first--;
+    } else {
+      mm->num_dead--;
+    }
+    // a key added right before the traversal position is visited next
+    if (mm->trav_pos == pos + 1) {
+      mm->trav_pos = pos;
+    }
+  } else {
+    if (mm->end == mm->capacity) {
+      // make room by dropping the tombstones, growing too unless that frees
+      // a quarter of the room
+      capacity = mm->capacity;
+      if (mm->num_keys >= capacity - capacity / 4) {
+        capacity = (capacity < mm->max_keys / 2) ? 2 * capacity : mm->max_keys;
+        if (capacity <= mm->num_keys) {
+          capacity = mm->num_keys + 1; // a full multimap rekeying
+        }
+      }
+      if (compact(mm, capacity) != 0) {
+        return -1;
+      }
+      pos = lower_bound_pos(mm, key);
+    }
     // shift everything over: a for loop is ok but this is more efficient
-    memmove(&keys[pos+1], &keys[pos], (keys_length - pos) * sizeof(KeyAndValues));
+    memmove(&mm->keys[pos+1], &mm->keys[pos], (mm->end - pos) * sizeof(KeyAndValues));
+    mm->end++;
+    if (pos < mm->trav_pos) {
+      mm->trav_pos++;
+    }
   }
-  
-  keys[pos].key = key;
-  keys[pos].num_values = 0;
-  keys[pos].head = NULL;
-  
+
+  mm->keys[pos].key = key;
+  vl_init(&mm->keys[pos].values);
+  mm->num_keys++;
+  mm->frozen = 0;
+
   return pos;
 }
 
-static int insert_value_by_num(Multimap *mm, KeyAndValues *key, ValueNode *node) {
-  assert(NULL != key);
-  assert(NULL != node);
+// turns the key's slot (whose values are gone) into a tombstone. The
+// tombstones after it had its key, they get the one before it. When there
+// is no key before or after, the slots just stop being used. Removing keys
+// backwards makes that run longer every time, so once it's longer than the
+// square root of the slots on the shorter side, the run is dropped by
+// shifting that side over it instead: either way a removal costs about the
+// square root of the keys at worst.
+static void take_slot(Multimap *mm, int pos)
+{
+  int run_end = pos + 1;
+  int run, shift;
 
-  ValueNode *curr = key->head;
-  ValueNode *prev = NULL;
-  
-  while (NULL != curr && mm->compare_values(&node->value, &curr->value) > 0){ 
-    prev = curr;
-    curr = curr->next;
+  assert(0 == mm->keys[pos].values.num_values);
+  mm->num_keys--;
+  mm->num_dead++;
+  mm->frozen = 0;
+
+  while (run_end < mm->end && 0 == mm->keys[run_end].values.num_values) {
+    run_end++;
   }
-  
-  if (NULL == prev) {
-    node->next = key->head;
-    key->head = node;
+  run = run_end - pos - 1;
+  shift = (pos - mm->first < mm->end - run_end) ? pos - mm->first : mm->end - run_end;
+  if (pos == mm->first || run_end == mm->end) {
+    mm->num_dead -= run_end - pos;
+    if (pos == mm->first) {
+      mm->first = run_end;
+    } else {
+      // the tombstones before it are at the end now too
+      while (0 == mm->keys[pos - 1].values.num_values) {
+        pos--;
+        mm->num_dead--;
+      }
+      mm->end = pos;
+    }
+    if (mm->first == mm->end) {
+      mm->first = 0;
+      mm->end = 0;
+    }
+    // a traversal past the last key stays right after it
+    if (mm->trav_pos > mm->end) {
+      mm->trav_pos = mm->end;
+    }
+  } else if (run > FIRST_CAPACITY && (long)run * run > shift) {
+    drop_run(mm, pos, run_end);
   } else {
-    node->next = curr;
-    prev->next = node;
+    for (int i = pos; i < run_end; i++) {
+      mm->keys[i].key = mm->keys[pos - 1].key;
+    }
   }
-  
-  key->num_values++;
 
-  return key->num_values;
+  // give back room once most of it is unused, and drop the tombstones once
+  // there are more than half as many as keys; it's fine if that fails
+  if (mm->capacity > FIRST_CAPACITY && mm->num_keys < mm->capacity / 4) {
+    compact(mm, mm->capacity / 2);
+  } else if (mm->num_dead >= FIRST_CAPACITY && mm->num_dead > mm->num_keys / 2) {
+    compact(mm, mm->capacity);
+  }
+}
+
+// drops the tombstones in [pos, run_end), which has keys on both sides, by
+// moving the slots on its shorter side over it. The traversal stays on the
+// same key.
+static void drop_run(Multimap *mm, int pos, int run_end)
+{
+  int gap = run_end - pos;
+
+  if (pos - mm->first < mm->end - run_end) {
+    memmove(&mm->keys[mm->first + gap], &mm->keys[mm->first], (pos - mm->first) * sizeof(KeyAndValues));
+    mm->first += gap;
+    if (mm->trav_pos >= mm->first - gap && mm->trav_pos <= pos) {
+      mm->trav_pos += gap;
+    } else if (mm->trav_pos > pos && mm->trav_pos < run_end) {
+      mm->trav_pos = run_end;
+    }
+  } else {
+    memmove(&mm->keys[pos], &mm->keys[run_end], (mm->end - run_end) * sizeof(KeyAndValues));
+    mm->end -= gap;
+    if (mm->trav_pos >= run_end) {
+      mm->trav_pos -= gap;
+    } else if (mm->trav_pos > pos) {
+      mm->trav_pos = pos;
+    }
+  }
+  mm->num_dead -= gap;
+}
+
+// moves the keys to the front without the tombstones, in one pass, then
+// changes the room to "capacity" slots (which must hold the keys). The
+// traversal stays on the same key. Return 0 if there's room for one more
+// key after, -1 if not (memory ran out growing).
+static int compact(Multimap *mm, int capacity)
+{
+  int to = 0;
+  int trav = 0;
+
+  for (int i = mm->first; i < mm->end; i++) {
+    if (mm->keys[i].values.num_values > 0) {
+      if (i < mm->trav_pos) {
+        trav++;
+      }
+      mm->keys[to] = mm->keys[i];
+      to++;
+    }
+  }
+  assert(to == mm->num_keys);
+  if (mm->trav_pos >= 0) {
+    mm->trav_pos = trav;
+  }
+  mm->first = 0;
+  mm->end = mm->num_keys;
+  mm->num_dead = 0;
+  mm->frozen = 0;
+
+  if (capacity != mm->capacity) {
+    resize_keys(mm, capacity);
+  }
+  return (mm->end < mm->capacity) ? 0 : -1;
+}
+
+// changes the room for keys to "capacity" keys, which must hold the keys there are.
+// Return 0 on success, -1 if memory runs out (the keys are left as they were).
+static int resize_keys(Multimap *mm, int capacity) {
+  assert(capacity >= mm->end);
+
+  KeyAndValues *keys;
+
+  if (capacity < FIRST_CAPACITY) {
+    capacity = FIRST_CAPACITY;
+  }
+
+  keys = realloc(mm->keys, capacity * sizeof(KeyAndValues));
+  if (NULL == keys) {
+    return -1;
+  }
+  mm->keys = keys;
+  mm->capacity = capacity;
+
+  return 0;
 }
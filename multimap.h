@@ -1,6 +1,8 @@
 #ifndef _A5_MULTIMAP
 #define _A5_MULTIMAP
 
+#include <stdint.h>
+
 // NEW: instead of storing string in the multimap, both the keys and values
 //      are void pointers to data allocated elsewhere in the program
 
@@ -10,9 +12,14 @@ typedef struct MULTIMAP Multimap; // you need to define this yourself
 // We can use this typedef to make the function headers more readable:
 typedef int (*Compare)(void *a, void *b);
 
+// Pass this as max_keys for a multimap that holds as many keys as memory allows.
+#define MM_NO_MAX_KEYS 0x7fffffff
+
 // Create a new multimap with at most "max_keys" keys. Keys will be ordered
 //  and compared using the "compare_keys" function. Values will be ordered
 //  and compared using the "compare_values" function.
+// The room for the keys starts small and grows (and shrinks) as keys come
+//  and go, so a large max_keys costs nothing until the keys are there.
 // NEW: the first function pointer determines key comparison/ordering
 //      and the second function pointer determines value ordering.
 //      The compare_keys function is passed the key pointer.
@@ -23,6 +30,22 @@ Multimap *mm_create(int max_keys, Compare compare_keys, Compare compare_values);
 // or, without the typedef:
 // Multimap *mm_create(int max_keys, int (*compare_keys)(void *key1, void *key2), int (*compare_values)(void *value1, void *value2));
 
+// One key and its values, for mm_bulk_load.
+typedef struct MM_ENTRY {
+  void *key;
+  int num_values;
+  Value *values;
+} MMEntry;
+
+// Create a multimap holding the given keys and values all at once, in
+//  O(n log n) instead of one insert at a time. The entries are sorted by key
+//  first (in place) unless "sorted" is non-zero, in which case they must
+//  already be in key order. A key given in more than one entry gets all of
+//  their values. The values are copied, the entries array can be freed after.
+// Return NULL on error, including when there are more than max_keys keys.
+Multimap *mm_bulk_load(int max_keys, Compare compare_keys, Compare compare_values,
+                       MMEntry entries[], int num_entries, int sorted);
+
 // Insert a new value into the multimap for the given key.
 // If the key already exists in the multimap, the value is added to that key.
 // Return the number of values associated with this key after insertion.
@@ -42,11 +65,45 @@ int mm_count_values(Multimap *mm, void *key);
 // Return the number of values copied, at most max_values.
 int mm_get_values(Multimap *mm, void *key, Value values[], int max_values);
 
+// Called by mm_for_each_value with each value of the key, in order, and the
+// argument given to mm_for_each_value. The value is the multimap's own, not a
+// copy: read it but don't keep the pointer. Return 0 to go on, anything else
+// to stop.
+typedef int (*MMValueVisit)(const Value *value, void *arg);
+
+// Call visit on the values of the key, in order, without copying them out,
+// so it needs no array however many values there are. The multimap must not
+// be changed until it returns.
+// Return the number of values visited (zero if the key is not found), or -1
+// on error.
+int mm_for_each_value(Multimap *mm, void *key, MMValueVisit visit, void *arg);
+
 // Remove the key and all its corresponding values from the multimap.
 // Return the number of values that were removed with the key.
 // Zero means the key is not found in the multimap.
 int mm_remove_key(Multimap *mm, void *key);
 
+// Replace the key with new_key, keeping its values: the key's place moves to
+//  where new_key goes in the order, and its values go with it without being
+//  copied or added again. The multimap holds new_key from then on (key is
+//  only used to find the place, and can be freed after).
+// Return the number of values the key has, zero if the key is not found, or
+//  -1 on error, including when new_key is already a different key.
+int mm_rekey(Multimap *mm, void *key, void *new_key);
+
+// How the multimap's value nodes are used. Values after the first of a key
+// are kept in nodes that are allocated in slabs and reused after removals
+// (after mm_reclaim, in the skiplist).
+typedef struct MM_POOL_STATS {
+  int slabs;         // slabs allocated, they are only freed by mm_destroy
+  int nodes_in_use;  // nodes holding a value
+  int nodes_free;    // nodes waiting to be reused
+} MMPoolStats;
+
+// Fill in the stats of the multimap's node pool.
+// Return 0 on success, -1 on error.
+int mm_pool_stats(Multimap *mm, MMPoolStats *stats);
+
 // Print the contents of the multimap, neatly.
 // Keys and values must be in the correct order.
 // This will be helpful for debugging and manual testing.
@@ -71,6 +128,8 @@ int mm_destroy(Multimap *mm);
 // Consider what happens if mm_remove_key() is called (possibly more than
 // once) as part of processing a key.
 // NEW: it is safe to free() the key after removing it from the multimap
+// The traversal stays between the keys it was between: after the key last
+// returned is removed, a key added where it was is the next one returned.
 
 // Copy the first key pointer in the multimap into the pointer **key.
 // Returns -1 on error, 0 if there were no more keys, or 1 on success.
@@ -81,4 +140,67 @@ int mm_get_first_key(Multimap *mm, void **key);
 // mm_get_first_key or mm_get_next_key.
 int mm_get_next_key(Multimap *mm, void **key);
 
+
+// A cursor is a traversal position kept by the caller instead of inside the
+// multimap, so any number of them can go through the keys at the same time,
+// and going through the keys doesn't change the multimap (readers can share
+// it). A cursor must not be used after the multimap has been changed; use
+// mm_get_first_key/mm_get_next_key to remove keys as you go.
+// The fields belong to the multimap implementation.
+typedef struct MM_CURSOR {
+  void *node;
+  int index;
+} MMCursor;
+
+// Point the cursor at the first key and copy that key into **key.
+// Returns -1 on error, 0 if there are no keys, or 1 on success.
+int mm_cursor_first(Multimap *mm, MMCursor *cursor, void **key);
+
+// Move the cursor to the next key and copy it into **key.
+// Returns -1 on error, 0 if there are no more keys, or 1 on success.
+int mm_cursor_next(Multimap *mm, MMCursor *cursor, void **key);
+
+// Point the cursor at the first key that is not less than "key" (by the
+// multimap's compare_keys) and copy it into **found; mm_cursor_next then goes
+// on from there, so reading a range of keys is O(log n) plus its size.
+// Returns -1 on error, 0 if all the keys are less than "key", or 1 on success.
+int mm_lower_bound(Multimap *mm, MMCursor *cursor, void *key, void **found);
+
+// Called by mm_foreach with each key, its number of values and the
+// argument given to mm_foreach. Return 0 to go on, anything else to stop.
+typedef int (*MMVisit)(void *key, int num_values, void *arg);
+
+// Call visit on every key, in order, without changing the multimap.
+// Return the number of keys visited, or -1 on error.
+int mm_foreach(Multimap *mm, MMVisit visit, void *arg);
+
+// A key's fingerprint for mm_freeze: a number that orders keys the way
+// compare_keys does as far as it goes (a key less than another never has a
+// bigger fingerprint), like the first few bytes of a string.
+typedef uint64_t (*MMFingerprint)(void *key);
+
+// For multimaps that are read much more than they change: keep the keys'
+// fingerprints in a compact array in Eytzinger order (the order of a binary
+// heap, so the next few steps of a search are close together and can be
+// prefetched), and find keys through it instead of through the keys
+// themselves. Any new or removed key makes the layout stale, and searches go
+// back to the keys until mm_freeze is called again, which rebuilds it (and
+// does nothing if it's up to date).
+// The B+tree's nodes are already one cache line each, so there it does nothing
+// (nor in the skiplist, which is changed by many threads at once).
+// Return 0 on success, -1 on error (if memory runs out searches just use the keys).
+int mm_freeze(Multimap *mm, MMFingerprint fingerprint);
+
+// Return 0 if mm_freeze has been called and the layout is stale, 1 if not,
+// or -1 on error.
+int mm_frozen(Multimap *mm);
+
+// Free the removed keys' memory that the multimap still keeps because other
+// threads may be reading it. Only the skiplist keeps any (the others free it
+// as keys are removed), until this or mm_destroy. Only call it while no other
+// thread is using the multimap. A traversal goes on where it was, but cursors
+// left on removed keys can't be used after.
+// Return the number of nodes freed, or -1 on error.
+int mm_reclaim(Multimap *mm);
+
 #endif
@@ -0,0 +1,1229 @@
+/**
+ * multimap_bptree.c
+ *
+ * PURPOSE: To implement the multimap data structure on a B+tree, so adding
+ *          and removing keys costs O(log n) instead of shifting an array.
+ *          It is a drop-in replacement for multimap.c: link one or the other.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "a5_multimap.h"
+#include "a5_valuelist.h"
+
+// the keys of a node fill one cache line, so a search reads one line per level.
+#define NODE_KEYS ((int)(64 / sizeof(void *)))
+// nodes other than the root never have fewer keys than this.
+#define MIN_KEYS (NODE_KEYS / 2)
+// deeper than any tree that fits in memory: every inner node below the root
+// has at least MIN_KEYS + 1 children.
+#define MAX_DEPTH 48
+
+typedef struct NODE {
+  int is_leaf;
+  int num_keys;
+  void *keys[NODE_KEYS];
+} Node;
+
+// keys[i] is the smallest key under children[i+1], everything under
+// children[i] is smaller.
+typedef struct INNER {
+  Node node;
+  Node *children[NODE_KEYS + 1];
+} Inner;
+
+typedef struct LEAF {
+  Node node;
+  ValueList values[NODE_KEYS];
+  struct LEAF *next; // the leaves are linked in key order for traversal
+} Leaf;
+
+// The new nodes an insert can need, made before the tree is changed so
+// running out of memory leaves it as it was: a leaf if the leaf splits, and
+// an inner node for each full node above it that splits in turn (the last
+// one the new root, when the root splits), used from the bottom up.
+typedef struct SPARES {
+  Leaf *leaf;
+  Inner *inners[MAX_DEPTH + 1];
+  int num_inners;
+  int used;
+} Spares;
+
+struct MULTIMAP
+{
+  int num_keys;
+  int max_keys;
+  Node *root;
+  Compare compare_keys;
+  Compare compare_values;
+  ValuePool *pool; // where the value nodes come from
+  // traversal position: the key the next mm_get_next_key returns, NULL
+  // leaf at the end. trav_on is 0 when there is no traversal going.
+  int trav_on;
+  Leaf *trav_leaf;
+  int trav_index;
+};
+
+// Helper functions
+static Leaf *new_leaf(void);
+static Inner *new_inner(void);
+static int child_index(Multimap *mm, Node *node, void *key);
+static Leaf *find_leaf(Multimap *mm, void *key);
+static Leaf *first_leaf(Multimap *mm);
+static int leaf_index(Multimap *mm, Leaf *leaf, void *key);
+static void *subtree_min(Node *node);
+static Leaf *add_key(Multimap *mm, void *key, int *pos);
+static int take_key(Multimap *mm, void *key, ValueList *values);
+static int make_spares(Multimap *mm, void *key, Spares *spares);
+static Node *insert_key(Multimap *mm, Node *node, void *key, Spares *spares);
+static int remove_key(Multimap *mm, Node *node, void *key, ValueList *values);
+static void fix_child(Inner *inner, int index);
+static int free_node(Node *node);
+static void trav_locate(Multimap *mm, void *key);
+static int build_leaves(Multimap *mm, Node **leaves, int num_leaves, int num_keys, MMEntry entries[], int num_entries);
+static int build_parents(Node **nodes, int count, Node **parents, int num_parents);
+
+#ifndef NDEBUG
+static int validate_node(Multimap *mm, Node *node, int depth, int *leaf_depth)
+{
+  assert(node->num_keys <= NODE_KEYS);
+  assert(node == mm->root || node->num_keys >= MIN_KEYS);
+
+  for (int i = 1; i < node->num_keys; i++) {
+    assert(mm->compare_keys(node->keys[i-1], node->keys[i]) < 0);
+  }
+
+  if (node->is_leaf) {
+    if (*leaf_depth < 0) {
+      *leaf_depth = depth;
+    }
+    assert(*leaf_depth == depth); // all leaves on the same level
+    for (int i = 0; i < node->num_keys; i++) {
+      assert(((Leaf *)node)->values[i].num_values > 0); // can't have a key with no values
+      assert(vl_validate(&((Leaf *)node)->values[i]));
+    }
+  } else {
+    assert(node == mm->root ? node->num_keys > 0 : 1);
+    for (int i = 0; i <= node->num_keys; i++) {
+      validate_node(mm, ((Inner *)node)->children[i], depth + 1, leaf_depth);
+      if (i > 0) {
+        // the separators are keys still in the tree, never ones removed (and maybe freed)
+        assert(node->keys[i-1] == subtree_min(((Inner *)node)->children[i]));
+      }
+    }
+  }
+
+  return 1;
+}
+
+static int validate_multimap(Multimap *mm)
+{
+  assert(NULL != mm);
+  assert(NULL != mm->root);
+  assert(mm->max_keys >= 0);
+  assert(mm->num_keys >= 0 && mm->num_keys <= mm->max_keys);
+  assert(mm->trav_on || NULL == mm->trav_leaf);
+
+  int leaf_depth = -1;
+  int count = 0;
+  Node *node = mm->root;
+  Leaf *leaf;
+
+  validate_node(mm, mm->root, 0, &leaf_depth);
+
+  // the leaf list holds every key, in order
+  while (!node->is_leaf) {
+    node = ((Inner *)node)->children[0];
+  }
+  for (leaf = (Leaf *)node; NULL != leaf; leaf = leaf->next) {
+    count += leaf->node.num_keys;
+    if (NULL != leaf->next) {
+      assert(mm->compare_keys(leaf->node.keys[leaf->node.num_keys - 1], leaf->next->node.keys[0]) < 0);
+    }
+  }
+  assert(count == mm->num_keys);
+
+  return 1; // always return TRUE
+}
+#endif
+
+Multimap *mm_create(int max_keys, Compare compare_keys, Compare compare_values)
+{
+  assert(max_keys >= 0);
+  assert(NULL != compare_keys);
+  assert(NULL != compare_values);
+  Multimap *mm = NULL;
+
+  if (max_keys >= 0 && NULL != compare_keys && NULL != compare_values) {
+    mm = malloc(sizeof(Multimap));
+    if (NULL != mm) {
+      mm->root = (Node *)new_leaf();
+      mm->pool = vp_create();
+      if (NULL == mm->root || NULL == mm->pool) {
+        free(mm->root);
+        vp_destroy(mm->pool);
+        free(mm);
+        mm = NULL;
+      } else {
+        mm->max_keys = max_keys;
+        mm->num_keys = 0;
+        mm->compare_keys = compare_keys;
+        mm->compare_values = compare_values;
+        mm->trav_on = 0;
+        mm->trav_leaf = NULL;
+        mm->trav_index = 0;
+      }
+    }
+  }
+  assert(validate_multimap(mm));
+  return mm;
+}
+
+Multimap *mm_bulk_load(int max_keys, Compare compare_keys, Compare compare_values,
+                       MMEntry entries[], int num_entries, int sorted)
+{
+  assert(num_entries >= 0);
+  assert(NULL != entries || 0 == num_entries);
+
+  Multimap *mm = NULL;
+  int num_keys = 0;
+  int valid = (num_entries >= 0 && (NULL != entries || 0 == num_entries));
+
+  for (int i = 0; valid && i < num_entries; i++) {
+    // can't have a key with no values
+    valid = (NULL != entries[i].key && entries[i].num_values > 0 && NULL != entries[i].values);
+  }
+  if (valid && !sorted) {
+    valid = (mm_sort_entries(entries, num_entries, compare_keys) == 0);
+  }
+  for (int i = 0; valid && i < num_entries; i++) {
+    if (0 == i || compare_keys(entries[i-1].key, entries[i].key) != 0) {
+      num_keys++;
+    }
+  }
+  if (valid && num_keys <= max_keys) {
+    mm = mm_create(max_keys, compare_keys, compare_values);
+  }
+
+
+  // build the tree bottom up: full leaves first, then each level of inner nodes over the one below
+  if (NULL != mm && num_keys > 0) {
+    int count = (num_keys + NODE_KEYS - 1) / NODE_KEYS;
+    int num_parents, made;
+    Node **level = malloc(count * sizeof(Node *));
+    Node **parents;
+    int built = (NULL != level) ? build_leaves(mm, level, count, num_keys, entries, num_entries) : 0;
+    int ok = (built == count);
+
+    while (ok && count > 1) {
+      num_parents = (count + NODE_KEYS) / (NODE_KEYS + 1);
+      parents = malloc(num_parents * sizeof(Node *));
+      made = (NULL != parents) ? build_parents(level, count, parents, num_parents) : 0;
+      ok = (made == num_parents);
+      if (ok) {
+        free(level);
+        level = parents;
+        count = built = num_parents;
+      } else {
+        // the nodes made at this level only hold pointers to the level below
+        for (int i = 0; i < made; i++) {
+          free(parents[i]);
+        }
+        free(parents);
+      }
+    }
+
+    if (ok) {
+      free(mm->root);
+      mm->root = level[0];
+      mm->num_keys = num_keys;
+      free(level);
+    } else {
+      for (int i = 0; NULL != level && i < built; i++) {
+        free_node(level[i]);
+      }
+      free(level);
+      mm_destroy(mm);
+      mm = NULL;
+    }
+  }
+
+  assert(NULL == mm || validate_multimap(mm));
+  return mm;
+}
+
+int mm_insert_value(Multimap *mm, void *key, int value_num, void *value_data)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+  assert(NULL != value_data);
+
+  int result = -1;
+  int pos;
+  Leaf *leaf;
+  Value value;
+
+  if (NULL != mm && NULL != key && NULL != value_data) {
+    leaf = find_leaf(mm, key);
+    pos = leaf_index(mm, leaf, key);
+
+    if (pos < 0 && mm->num_keys < mm->max_keys) {
+      leaf = add_key(mm, key, &pos);
+    }
+
+    if (pos >= 0)
+    {
+      // key was either already there, or successfully added
+      value.num = value_num;
+      value.data = value_data;
+      result = vl_insert(&leaf->values[pos], mm->pool, mm->compare_values, value);
+      assert (result > 0);
+    }
+  }
+
+  assert(validate_multimap(mm));
+  return result;
+}
+
+int mm_count_keys(Multimap *mm)
+{
+  assert(validate_multimap(mm));
+
+  int count = -1;
+
+  if (NULL != mm) {
+    count = mm->num_keys;
+  }
+
+  assert(count >= -1 && count <= mm->max_keys);
+  return count;
+}
+
+int mm_count_values(Multimap *mm, void *key)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+
+  int count = -1;
+  int pos;
+  Leaf *leaf;
+
+  if (NULL != mm && NULL != key) {
+    count = 0;
+    leaf = find_leaf(mm, key);
+    pos = leaf_index(mm, leaf, key);
+    if (pos >= 0) {
+      count = leaf->values[pos].num_values;
+    }
+  }
+
+  assert(count >= -1);
+  return count;
+}
+
+int mm_get_values(Multimap *mm, void *key, Value values[], int max_values)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+  assert(NULL != values);
+  assert(max_values >= 0);
+
+  int count = -1;
+  int pos;
+  Leaf *leaf;
+
+  if (NULL != mm && NULL != key && NULL != values && max_values >= 0) {
+    count = 0;
+    leaf = find_leaf(mm, key);
+    pos = leaf_index(mm, leaf, key);
+    if (pos >= 0) {
+      count = vl_get(&leaf->values[pos], values, max_values);
+    }
+  }
+
+  assert(validate_multimap(mm));
+  assert(count >= -1);
+  return count;
+}
+
+int mm_for_each_value(Multimap *mm, void *key, MMValueVisit visit, void *arg)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+  assert(NULL != visit);
+
+  int count = -1;
+  int pos;
+  Leaf *leaf;
+
+  if (NULL != mm && NULL != key && NULL != visit) {
+    count = 0;
+    leaf = find_leaf(mm, key);
+    pos = leaf_index(mm, leaf, key);
+    if (pos >= 0) {
+      count = vl_for_each(&leaf->values[pos], visit, arg);
+    }
+  }
+
+  assert(validate_multimap(mm));
+  assert(count >= -1);
+  return count;
+}
+
+int mm_remove_key(Multimap *mm, void *key)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+
+  int count = -1;
+
+  if (NULL != mm && NULL != key) {
+    count = take_key(mm, key, NULL);
+  }
+
+  assert(validate_multimap(mm));
+  assert(count >= -1);
+  return count;
+}
+
+int mm_rekey(Multimap *mm, void *key, void *new_key)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+  assert(NULL != new_key);
+
+  int count = -1;
+  int pos, new_pos;
+  Leaf *leaf, *new_leaf;
+  Node *node;
+  ValueList values;
+
+  if (NULL != mm && NULL != key && NULL != new_key) {
+    count = 0;
+    leaf = find_leaf(mm, key);
+    pos = leaf_index(mm, leaf, key);
+    if (pos >= 0) {
+      count = leaf->values[pos].num_values;
+      if (0 == mm->compare_keys(key, new_key) ||
+          (pos > 0 && mm->compare_keys(leaf->node.keys[pos - 1], new_key) < 0 &&
+           (pos + 1 < leaf->node.num_keys ? mm->compare_keys(new_key, leaf->node.keys[pos + 1]) < 0 :
+            NULL == leaf->next || mm->compare_keys(new_key, leaf->next->node.keys[0]) < 0))) {
+        // new_key goes in the same place: swap it in, along with any separators
+        // on the way down that are the key (they are always on its path)
+        for (node = mm->root; !node->is_leaf; node = ((Inner *)node)->children[child_index(mm, node, key)]) {
+          for (int i = 0; i < node->num_keys; i++) {
+            if (node->keys[i] == key) {
+              node->keys[i] = new_key;
+            }
+          }
+        }
+        leaf->node.keys[pos] = new_key;
+      } else {
+        new_leaf = find_leaf(mm, new_key);
+        if (leaf_index(mm, new_leaf, new_key) >= 0) {
+          count = -1; // it would be there twice
+        } else {
+          // add new_key first, the only step that can fail, then move the
+          // values over from the key as it comes out.
+          new_leaf = add_key(mm, new_key, &new_pos);
+          if (NULL == new_leaf) {
+            count = -1;
+          } else {
+            take_key(mm, key, &values);
+            new_leaf = find_leaf(mm, new_key);
+            new_pos = leaf_index(mm, new_leaf, new_key);
+            new_leaf->values[new_pos] = values;
+          }
+        }
+      }
+    }
+  }
+
+  assert(validate_multimap(mm));
+  assert(count >= -1);
+  return count;
+}
+
+void mm_print(Multimap *mm)
+{
+  assert(validate_multimap(mm));
+
+  Node *node;
+  int i = 0;
+
+  if (NULL != mm) {
+    node = mm->root;
+    while (!node->is_leaf) {
+      node = ((Inner *)node)->children[0];
+    }
+    for (Leaf *leaf = (Leaf *)node; NULL != leaf; leaf = leaf->next) {
+      for (int j = 0; j < leaf->node.num_keys; j++, i++) {
+        printf("[%3d] '%p' (%d):\n", i, leaf->node.keys[j], leaf->values[j].num_values);
+        vl_print(&leaf->values[j]);
+      }
+    }
+  }
+
+  assert(validate_multimap(mm));
+}
+
+int mm_destroy(Multimap *mm)
+{
+  int count = -1;
+
+  assert(validate_multimap(mm));
+
+  if (NULL != mm) {
+    count = free_node(mm->root);
+    // the value nodes all go with their slabs
+    vp_destroy(mm->pool);
+
+    // set everything to zero, to help catch a dangling pointer error
+    mm->num_keys = 0;
+    mm->max_keys = 0;
+    mm->root = NULL;
+    mm->pool = NULL;
+
+    free(mm);
+  }
+
+  return count;
+}
+
+int mm_pool_stats(Multimap *mm, MMPoolStats *stats)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != stats);
+
+  if (NULL == mm || NULL == stats) {
+    return -1;
+  }
+  vp_stats(mm->pool, stats);
+  return 0;
+}
+
+int mm_get_first_key(Multimap *mm, void **key)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+
+  int result = 0;
+  Node *node;
+
+  if (NULL == mm || NULL == key) {
+    // If we get here, assertions are off, so there are no postconditions to skip
+    return -1;
+  }
+
+  if (mm->num_keys > 0) {
+    node = &first_leaf(mm)->node;
+    *key = node->keys[0];
+    result = 1;
+
+    mm->trav_on = 1;
+    mm->trav_leaf = (Leaf *)node;
+    mm->trav_index = 1;
+    if (mm->trav_index == node->num_keys) {
+      mm->trav_leaf = mm->trav_leaf->next;
+      mm->trav_index = 0;
+    }
+  } else {
+    mm->trav_on = 0;
+    mm->trav_leaf = NULL;
+  }
+  assert(result >= -1 && result <= 1);
+  assert(validate_multimap(mm));
+
+  return result;
+}
+
+int mm_get_next_key(Multimap *mm, void **key)
+{
+  assert(validate_multimap(mm));
+  assert(NULL != key);
+
+  int result = 0;
+
+  if (NULL == mm || NULL == key) {
+    return -1;
+  }
+
+  if (mm->trav_on && NULL != mm->trav_leaf) {
+    *key = mm->trav_leaf->node.keys[mm->trav_index];
+    result = 1;
+    mm->trav_index++;
+    if (mm->trav_index == mm->trav_leaf->node.num_keys) {
+      mm->trav_leaf = mm->trav_leaf->next;
+      mm->trav_index = 0;
+    }
+  } else {
+    if (!mm->trav_on) {
+      // Attempted to call get_next when the previous call would have failed
+      result = -1;
+    }
+    mm->trav_on = 0;
+    mm->trav_leaf = NULL;
+  }
+  assert(result >= -1 && result <= 1);
+  assert(validate_multimap(mm));
+
+  return result;
+}
+
+// The cursor keeps the leaf and index of the next key (a NULL leaf at the
+// end) and an index of -1 once the keys have run out. Nothing here validates
+// the whole tree, since that's O(n) for every key.
+
+int mm_cursor_first(Multimap *mm, MMCursor *cursor, void **key)
+{
+  assert(NULL != mm);
+  assert(NULL != cursor);
+  assert(NULL != key);
+
+  Leaf *leaf;
+
+  if (NULL == mm || NULL == cursor || NULL == key) {
+    return -1;
+  }
+
+  cursor->node = NULL;
+  cursor->index = -1;
+  if (mm->num_keys == 0) {
+    return 0;
+  }
+
+  leaf = first_leaf(mm);
+  *key = leaf->node.keys[0];
+  cursor->node = leaf;
+  cursor->index = 1;
+  if (cursor->index == leaf->node.num_keys) {
+    cursor->node = leaf->next;
+    cursor->index = 0;
+  }
+  return 1;
+}
+
+int mm_cursor_next(Multimap *mm, MMCursor *cursor, void **key)
+{
+  assert(NULL != mm);
+  assert(NULL != cursor);
+  assert(NULL != key);
+
+  Leaf *leaf;
+
+  if (NULL == mm || NULL == cursor || NULL == key) {
+    return -1;
+  }
+
+  if (cursor->index < 0) {
+    // the previous call already ran out of keys
+    return -1;
+  }
+  leaf = cursor->node;
+  if (NULL == leaf) {
+    cursor->index = -1;
+    return 0;
+  }
+
+  *key = leaf->node.keys[cursor->index];
+  cursor->index++;
+  if (cursor->index == leaf->node.num_keys) {
+    cursor->node = leaf->next;
+    cursor->index = 0;
+  }
+  return 1;
+}
+
+int mm_lower_bound(Multimap *mm, MMCursor *cursor, void *key, void **found)
+{
+  assert(NULL != mm);
+  assert(NULL != cursor);
+  assert(NULL != key);
+  assert(NULL != found);
+
+  Leaf *leaf;
+  int index = 0;
+
+  if (NULL == mm || NULL == cursor || NULL == key || NULL == found) {
+    return -1;
+  }
+
+  cursor->node = NULL;
+  cursor->index = -1;
+  if (mm->num_keys == 0) {
+    return 0;
+  }
+
+  // the separators are the smallest keys on their right, so when every key
+  // in this leaf is less, the answer is the first key of the next one.
+  leaf = find_leaf(mm, key);
+  while (index < leaf->node.num_keys && mm->compare_keys(leaf->node.keys[index], key) < 0) {
+    index++;
+  }
+  if (index == leaf->node.num_keys) {
+    leaf = leaf->next;
+    index = 0;
+  }
+  if (NULL == leaf) {
+    return 0;
+  }
+
+  *found = leaf->node.keys[index];
+  cursor->node = leaf;
+  cursor->index = index + 1;
+  if (cursor->index == leaf->node.num_keys) {
+    cursor->node = leaf->next;
+    cursor->index = 0;
+  }
+  return 1;
+}
+
+int mm_foreach(Multimap *mm, MMVisit visit, void *arg)
+{
+  assert(NULL != mm);
+  assert(NULL != visit);
+
+  Leaf *leaf;
+  int count = 0;
+
+  if (NULL == mm || NULL == visit) {
+    return -1;
+  }
+  if (mm->num_keys == 0) {
+    return 0;
+  }
+
+  for (leaf = first_leaf(mm); NULL != leaf; leaf = leaf->next) {
+    for (int i = 0; i < leaf->node.num_keys; i++) {
+      count++;
+      if (visit(leaf->node.keys[i], leaf->values[i].num_values, arg) != 0) {
+        return count;
+      }
+    }
+  }
+  return count;
+}
+
+int mm_freeze(Multimap *mm, MMFingerprint fingerprint)
+{
+  assert(NULL != mm);
+  assert(NULL != fingerprint);
+
+  return (NULL == mm || NULL == fingerprint) ? -1 : 0;
+}
+
+int mm_frozen(Multimap *mm)
+{
+  assert(NULL != mm);
+
+  return (NULL == mm) ? -1 : 1;
+}
+
+int mm_reclaim(Multimap *mm)
+{
+  assert(NULL != mm);
+
+  return (NULL == mm) ? -1 : 0;
+}
+
+static Leaf *new_leaf(void)
+{
+  Leaf *leaf = malloc(sizeof(Leaf));
+
+  if (NULL != leaf) {
+    leaf->node.is_leaf = 1;
+    leaf->node.num_keys = 0;
+    leaf->next = NULL;
+  }
+  return leaf;
+}
+
+static Inner *new_inner(void)
+{
+  Inner *inner = malloc(sizeof(Inner));
+
+  if (NULL != inner) {
+    inner->node.is_leaf = 0;
+    inner->node.num_keys = 0;
+  }
+  return inner;
+}
+
+// the child of an inner node whose keys range holds key.
+static int child_index(Multimap *mm, Node *node, void *key)
+{
+  int i = 0;
+
+  while (i < node->num_keys && mm->compare_keys(key, node->keys[i]) >= 0) {
+    i++;
+  }
+  return i;
+}
+
+static Leaf *find_leaf(Multimap *mm, void *key)
+{
+  Node *node = mm->root;
+
+  while (!node->is_leaf) {
+    node = ((Inner *)node)->children[child_index(mm, node, key)];
+  }
+  return (Leaf *)node;
+}
+
+// the leftmost leaf; the tree must not be empty.
+static Leaf *first_leaf(Multimap *mm)
+{
+  Node *node = mm->root;
+
+  while (!node->is_leaf) {
+    node = ((Inner *)node)->children[0];
+  }
+  return (Leaf *)node;
+}
+
+// where the key is in the leaf, or -1.
+static int leaf_index(Multimap *mm, Leaf *leaf, void *key)
+{
+  int start = 0, end = leaf->node.num_keys - 1;
+  int mid, comp;
+
+  while (start <= end) {
+    mid = (end - start) / 2 + start;
+    comp = mm->compare_keys(key, leaf->node.keys[mid]);
+    if (comp < 0) {
+      end = mid - 1;
+    } else if (comp > 0) {
+      start = mid + 1;
+    } else {
+      return mid;
+    }
+  }
+  return -1;
+}
+
+static void *subtree_min(Node *node)
+{
+  while (!node->is_leaf) {
+    node = ((Inner *)node)->children[0];
+  }
+  return node->keys[0];
+}
+
+// adds a key that isn't there, with no values, keeping the traversal where it
+// was. Return its leaf and its place there in *pos, or NULL (and -1) if memory
+// runs out. max_keys is up to the caller.
+static Leaf *add_key(Multimap *mm, void *key, int *pos)
+{
+  Leaf *leaf;
+  Node *split;
+  Inner *root;
+  Spares spares;
+  void *trav_key = NULL;
+
+  // splitting nodes moves keys around, so remember the traversal by its key
+  if (mm->trav_on && NULL != mm->trav_leaf) {
+    trav_key = mm->trav_leaf->node.keys[mm->trav_index];
+  }
+
+  if (make_spares(mm, key, &spares) != 0) {
+    return NULL;
+  }
+  split = insert_key(mm, mm->root, key, &spares);
+  if (NULL != split) {
+    // the root split, and the tree gets a level taller
+    assert(spares.used == spares.num_inners - 1);
+    root = spares.inners[spares.used++];
+    root->node.num_keys = 1;
+    root->node.keys[0] = subtree_min(split);
+    root->children[0] = mm->root;
+    root->children[1] = split;
+    mm->root = (Node *)root;
+  }
+  assert(NULL == spares.leaf && spares.used == spares.num_inners);
+
+  leaf = find_leaf(mm, key);
+  *pos = leaf_index(mm, leaf, key);
+  if (*pos < 0) {
+    return NULL;
+  }
+  mm->num_keys++;
+
+  if (mm->trav_on) {
+    // same as the array version: a key added right before the traversal
+    // position (or at the end, when the traversal is there) is visited next
+    void *after = (*pos + 1 < leaf->node.num_keys) ? leaf->node.keys[*pos + 1] :
+                  (NULL != leaf->next) ? leaf->next->node.keys[0] : NULL;
+    trav_locate(mm, (after == trav_key) ? key : trav_key);
+  }
+  return leaf;
+}
+
+// removes the key, keeping the traversal on the key after it. Its values are
+// moved to *values, or given back to the pool when values is NULL. Return the
+// number of values it had, 0 if it wasn't there.
+static int take_key(Multimap *mm, void *key, ValueList *values)
+{
+  int count;
+  Node *old_root;
+  void *trav_key = NULL;
+
+  // merging nodes moves keys around, so remember the traversal by its key,
+  // moving past the key being removed
+  if (mm->trav_on && NULL != mm->trav_leaf) {
+    trav_key = mm->trav_leaf->node.keys[mm->trav_index];
+    if (mm->compare_keys(trav_key, key) == 0) {
+      mm->trav_index++;
+      if (mm->trav_index == mm->trav_leaf->node.num_keys) {
+        mm->trav_leaf = mm->trav_leaf->next;
+        mm->trav_index = 0;
+      }
+      trav_key = (NULL != mm->trav_leaf) ? mm->trav_leaf->node.keys[mm->trav_index] : NULL;
+    }
+  }
+
+  count = remove_key(mm, mm->root, key, values);
+  if (count > 0) {
+    mm->num_keys--;
+
+    // an inner root left with one child is not needed
+    if (!mm->root->is_leaf && 0 == mm->root->num_keys) {
+      old_root = mm->root;
+      mm->root = ((Inner *)old_root)->children[0];
+      free(old_root);
+    }
+
+    if (mm->trav_on) {
+      trav_locate(mm, trav_key);
+    }
+  }
+  return count;
+}
+
+// makes the spare nodes adding key will use, going down to its leaf: a node
+// splits only if it's full and the one below it split. Return 0 on success,
+// -1 if memory ran out (with nothing made).
+static int make_spares(Multimap *mm, void *key, Spares *spares)
+{
+  Node *path[MAX_DEPTH];
+  Node *node = mm->root;
+  int depth = 0;
+  int ok = 1;
+
+  spares->leaf = NULL;
+  spares->num_inners = 0;
+  spares->used = 0;
+  while (!node->is_leaf) {
+    path[depth++] = node;
+    node = ((Inner *)node)->children[child_index(mm, node, key)];
+  }
+
+  if (node->num_keys == NODE_KEYS) {
+    spares->leaf = new_leaf();
+    ok = (NULL != spares->leaf);
+    for (int i = depth - 1; ok && i >= -1 && (i < 0 || path[i]->num_keys == NODE_KEYS); i--) {
+      // i == -1 is the new root over a root that split
+      spares->inners[spares->num_inners] = new_inner();
+      ok = (NULL != spares->inners[spares->num_inners]);
+      spares->num_inners += ok;
+    }
+  }
+
+  if (!ok) {
+    free(spares->leaf);
+    for (int i = 0; i < spares->num_inners; i++) {
+      free(spares->inners[i]);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+// adds a key (that isn't there) under node, splitting with the spare nodes
+// from make_spares. If node had to split, the new node holding its upper
+// half is returned, else NULL.
+static Node *insert_key(Multimap *mm, Node *node, void *key, Spares *spares)
+{
+  int pos = child_index(mm, node, key);
+  int half = (NODE_KEYS + 1) / 2;
+  Node *split = NULL;
+  Node *child_split;
+  Leaf *leaf, *right_leaf;
+  Inner *inner, *right_inner;
+
+
+  if (node->is_leaf) {
+    leaf = (Leaf *)node;
+    if (node->num_keys == NODE_KEYS) {
+      // move the upper half to a new leaf, then add to whichever half the key goes
+      assert(NULL != spares->leaf);
+      right_leaf = spares->leaf;
+      spares->leaf = NULL;
+      right_leaf->node.num_keys = NODE_KEYS - half;
+      memcpy(right_leaf->node.keys, &node->keys[half], (NODE_KEYS - half) * sizeof(void *));
+      memcpy(right_leaf->values, &leaf->values[half], (NODE_KEYS - half) * sizeof(ValueList));
+      node->num_keys = half;
+      right_leaf->next = leaf->next;
+      leaf->next = right_leaf;
+      split = (Node *)right_leaf;
+
+      if (pos > half) {
+        leaf = right_leaf;
+        pos -= half;
+      }
+    }
+
+    memmove(&leaf->node.keys[pos+1], &leaf->node.keys[pos], (leaf->node.num_keys - pos) * sizeof(void *));
+    memmove(&leaf->values[pos+1], &leaf->values[pos], (leaf->node.num_keys - pos) * sizeof(ValueList));
+    leaf->node.keys[pos] = key;
+    vl_init(&leaf->values[pos]);
+    leaf->node.num_keys++;
+  } else {
+    inner = (Inner *)node;
+    child_split = insert_key(mm, inner->children[pos], key, spares);
+    if (NULL != child_split && node->num_keys < NODE_KEYS) {
+      memmove(&inner->children[pos+2], &inner->children[pos+1], (node->num_keys - pos) * sizeof(Node *));
+      memmove(&node->keys[pos+1], &node->keys[pos], (node->num_keys - pos) * sizeof(void *));
+      inner->children[pos+1] = child_split;
+      node->keys[pos] = subtree_min(child_split);
+      node->num_keys++;
+    } else if (NULL != child_split) {
+      // lay the keys and children out with the new child in place, then the
+      // lower half stays, the key in the middle moves up and the rest go right
+      void *keys[NODE_KEYS + 1];
+      Node *children[NODE_KEYS + 2];
+
+      assert(spares->used < spares->num_inners);
+      right_inner = spares->inners[spares->used++];
+      memcpy(keys, node->keys, pos * sizeof(void *));
+      keys[pos] = subtree_min(child_split);
+      memcpy(&keys[pos+1], &node->keys[pos], (NODE_KEYS - pos) * sizeof(void *));
+      memcpy(children, inner->children, (pos + 1) * sizeof(Node *));
+      children[pos+1] = child_split;
+      memcpy(&children[pos+2], &inner->children[pos+1], (NODE_KEYS - pos) * sizeof(Node *));
+
+      node->num_keys = half;
+      memcpy(node->keys, keys, half * sizeof(void *));
+      memcpy(inner->children, children, (half + 1) * sizeof(Node *));
+      right_inner->node.num_keys = NODE_KEYS - half;
+      memcpy(right_inner->node.keys, &keys[half+1], (NODE_KEYS - half) * sizeof(void *));
+      memcpy(right_inner->children, &children[half+1], (NODE_KEYS - half + 1) * sizeof(Node *));
+      split = (Node *)right_inner;
+    }
+  }
+
+  return split;
+}
+
+// removes the key from under node, moving its values to *values (or freeing
+// them when values is NULL). Return the number of values it had, 0 if it wasn't there.
+static int remove_key(Multimap *mm, Node *node, void *key, ValueList *values)
+{
+  int pos, count;
+  Leaf *leaf;
+  Inner *inner;
+
+  if (node->is_leaf) {
+    leaf = (Leaf *)node;
+    pos = leaf_index(mm, leaf, key);
+    if (pos < 0) {
+      return 0;
+    }
+    if (NULL != values) {
+      *values = leaf->values[pos];
+      count = values->num_values;
+    } else {
+      count = vl_clear(&leaf->values[pos], mm->pool);
+    }
+    memmove(&leaf->node.keys[pos], &leaf->node.keys[pos+1], (leaf->node.num_keys - pos - 1) * sizeof(void *));
+    memmove(&leaf->values[pos], &leaf->values[pos+1], (leaf->node.num_keys - pos - 1) * sizeof(ValueList));
+    leaf->node.num_keys--;
+    return count;
+  }
+
+  inner = (Inner *)node;
+  pos = child_index(mm, node, key);
+  count = remove_key(mm, inner->children[pos], key, values);
+  if (count > 0) {
+    fix_child(inner, pos);
+  }
+  return count;
+}
+
+// after a removal under children[index]: refill it if it got too small, and
+// point the separators around it at keys that are still in the tree.
+static void fix_child(Inner *inner, int index)
+{
+  Node *child = inner->children[index];
+  Node *left, *right;
+  int at, n;
+
+  if (child->num_keys < MIN_KEYS) {
+    // take from a sibling that has keys to spare, otherwise merge with one
+    if (index > 0 && inner->children[index-1]->num_keys > MIN_KEYS) {
+      left = inner->children[index-1];
+      n = left->num_keys;
+      if (child->is_leaf) {
+        memmove(&child->keys[1], &child->keys[0], child->num_keys * sizeof(void *));
+        memmove(&((Leaf *)child)->values[1], &((Leaf *)child)->values[0], child->num_keys * sizeof(ValueList));
+        child->keys[0] = left->keys[n-1];
+        ((Leaf *)child)->values[0] = ((Leaf *)left)->values[n-1];
+      } else {
+        memmove(&child->keys[1], &child->keys[0], child->num_keys * sizeof(void *));
+        memmove(&((Inner *)child)->children[1], &((Inner *)child)->children[0], (child->num_keys + 1) * sizeof(Node *));
+        ((Inner *)child)->children[0] = ((Inner *)left)->children[n];
+        child->keys[0] = subtree_min(((Inner *)child)->children[1]);
+      }
+      child->num_keys++;
+      left->num_keys--;
+    } else if (index < inner->node.num_keys && inner->children[index+1]->num_keys > MIN_KEYS) {
+      right = inner->children[index+1];
+      n = child->num_keys;
+      if (child->is_leaf) {
+        child->keys[n] = right->keys[0];
+        ((Leaf *)child)->values[n] = ((Leaf *)right)->values[0];
+        memmove(&right->keys[0], &right->keys[1], (right->num_keys - 1) * sizeof(void *));
+        memmove(&((Leaf *)right)->values[0], &((Leaf *)right)->values[1], (right->num_keys - 1) * sizeof(ValueList));
+      } else {
+        ((Inner *)child)->children[n+1] = ((Inner *)right)->children[0];
+        child->keys[n] = subtree_min(((Inner *)right)->children[0]);
+        memmove(&right->keys[0], &right->keys[1], (right->num_keys - 1) * sizeof(void *));
+        memmove(&((Inner *)right)->children[0], &((Inner *)right)->children[1], right->num_keys * sizeof(Node *));
+      }
+      child->num_keys++;
+      right->num_keys--;
+    } else {
+      // merge children[at] and children[at+1] into the left one
+      at = (index > 0) ? index - 1 : index;
+      left = inner->children[at];
+      right = inner->children[at+1];
+      n = left->num_keys;
+      if (left->is_leaf) {
+        memcpy(&left->keys[n], right->keys, right->num_keys * sizeof(void *));
+        memcpy(&((Leaf *)left)->values[n], ((Leaf *)right)->values, right->num_keys * sizeof(ValueList));
+        left->num_keys += right->num_keys;
+        ((Leaf *)left)->next = ((Leaf *)right)->next;
+      } else {
+        left->keys[n] = subtree_min(((Inner *)right)->children[0]);
+        memcpy(&left->keys[n+1], right->keys, right->num_keys * sizeof(void *));
+        memcpy(&((Inner *)left)->children[n+1], ((Inner *)right)->children, (right->num_keys + 1) * sizeof(Node *));
+        left->num_keys += right->num_keys + 1;
+      }
+      free(right);
+
+      memmove(&inner->node.keys[at], &inner->node.keys[at+1], (inner->node.num_keys - at - 1) * sizeof(void *));
+      memmove(&inner->children[at+1], &inner->children[at+2], (inner->node.num_keys - at - 1) * sizeof(Node *));
+      inner->node.num_keys--;
+      index = at;
+    }
+  }
+
+  // the removed key may have been the smallest under a child, and keys moved between children
+  for (at = index - 1; at <= index + 1; at++) {
+    if (at >= 0 && at < inner->node.num_keys) {
+      inner->node.keys[at] = subtree_min(inner->children[at+1]);
+    }
+  }
+}
+
+// frees the nodes of a subtree, returning the number of keys and values in it.
+// The value nodes are left to the pool.
+static int free_node(Node *node)
+{
+  int count = 0;
+
+  if (node->is_leaf) {
+    count = node->num_keys;
+    for (int i = 0; i < node->num_keys; i++) {
+      count += ((Leaf *)node)->values[i].num_values;
+    }
+  } else {
+    for (int i = 0; i <= node->num_keys; i++) {
+      count += free_node(((Inner *)node)->children[i]);
+    }
+  }
+  free(node);
+
+  return count;
+}
+
+// fills num_leaves linked leaves with the (sorted) entries, spreading the
+// keys evenly so none has fewer than MIN_KEYS. Return the number of leaves
+// made, which is less than num_leaves if memory ran out.
+static int build_leaves(Multimap *mm, Node **leaves, int num_leaves, int num_keys, MMEntry entries[], int num_entries)
+{
+  Leaf *leaf;
+  int fill, e = 0;
+  int ok = 1;
+
+  for (int l = 0; l < num_leaves; l++) {
+    leaf = new_leaf();
+    if (NULL == leaf) {
+      return l;
+    }
+    leaves[l] = (Node *)leaf;
+    if (l > 0) {
+      ((Leaf *)leaves[l-1])->next = leaf;
+    }
+
+    fill = num_keys / num_leaves + (l < num_keys % num_leaves ? 1 : 0);
+    for (int k = 0; k < fill; k++) {
+      leaf->node.keys[k] = entries[e].key;
+      vl_init(&leaf->values[k]);
+      leaf->node.num_keys++;
+      // a key can be in more than one entry in a row
+      do {
+        ok = ok && vl_insert_entry(&leaf->values[k], mm->pool, mm->compare_values, &entries[e]) == 0;
+        e++;
+      } while (e < num_entries && mm->compare_keys(entries[e-1].key, entries[e].key) == 0);
+    }
+    if (!ok) {
+      free_node(leaves[l]);
+      return l;
+    }
+  }
+
+  return num_leaves;
+}
+
+// puts num_parents inner nodes over the nodes of a level, spreading the
+// children evenly. Return the number of inner nodes made.
+static int build_parents(Node **nodes, int count, Node **parents, int num_parents)
+{
+  Inner *inner;
+  int children, c = 0;
+
+  for (int p = 0; p < num_parents; p++) {
+    inner = new_inner();
+    if (NULL == inner) {
+      return p;
+    }
+    parents[p] = (Node *)inner;
+
+    children = count / num_parents + (p < count % num_parents ? 1 : 0);
+    for (int j = 0; j < children; j++) {
+      inner->children[j] = nodes[c++];
+      if (j > 0) {
+        inner->node.keys[j-1] = subtree_min(inner->children[j]);
+      }
+    }
+    inner->node.num_keys = children - 1;
+  }
+
+  return num_parents;
+}
+
+// points the traversal at the key (which is in the tree), or at the end for NULL.
+static void trav_locate(Multimap *mm, void *key)
+{
+  if (NULL == key) {
+    mm->trav_leaf = NULL;
+    mm->trav_index = 0;
+  } else {
+    mm->trav_leaf = find_leaf(mm, key);
+    mm->trav_index = leaf_index(mm, mm->trav_leaf, key);
+    assert(mm->trav_index >= 0);
+  }
+}
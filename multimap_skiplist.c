@@ -0,0 +1,1176 @@
+/**
+ * multimap_skiplist.c
+ *
+ * PURPOSE: To implement the multimap data structure on a lock-free skiplist,
+ *          so many threads can look up, insert and remove keys at the same
+ *          time without a lock. It is a drop-in replacement for multimap.c
+ *          and multimap_bptree.c: link one of the three.
+ *
+ * The keys are in a skiplist whose next pointers carry a mark in their low
+ * bit: a key is removed by marking its pointers, after which any thread that
+ * comes past takes it out of the list with a compare and swap (Harris's
+ * list, one per level). The values of a key are a chain that is only ever
+ * added to, in value order, with a compare and swap too.
+ *
+ * Removed keys are not freed right away, since another thread may still be
+ * reading them: the multimap keeps them on a list until mm_reclaim (or
+ * mm_destroy) is called at a time no other thread is using it. For
+ * the same reason, with other threads using the multimap, a removed key
+ * (the caller's memory) must not be freed until they are done with it.
+ *
+ * mm_get_first_key/mm_get_next_key keep their place in the multimap, so only
+ * one thread can use them at a time; cursors can be used by any number.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include "a5_multimap.h"
+#include "a5_valuelist.h"
+
+// enough levels for a few million keys to be found in O(log n).
+#define MAX_LEVEL 24
+
+// the number of value cells allocated at once.
+#define SLAB_CELLS 64
+
+// the low bit of a next pointer: the node it's in is being removed.
+#define MARK ((uintptr_t)1)
+
+// num_values of a node that is being (or has been) removed.
+#define DEAD -1
+// num_values of the node mm_rekey is moving a key's values to, until they're there.
+#define MOVING -2
+// num_values of the node a key's values were moved from, with the number of
+// values it had (MOVED of that gives the number back).
+#define MOVED(count) (-2 - (count))
+
+typedef struct VALUE_CELL {
+  Value value;
+  _Atomic(struct VALUE_CELL *) next;
+} ValueCell;
+
+// The values of a key, in order. Cells are only added, so any cell is a safe
+// place to start from for a value that goes after it.
+typedef struct VALUE_CHAIN {
+  _Atomic(ValueCell *) first;
+  _Atomic(ValueCell *) last; // a recent cell at the end, to start from when a value goes after it
+  ValueCell own; // for the key's first value, so a key with one value needs no cell from the slabs
+} ValueChain;
+
+typedef struct CELL_SLAB {
+  struct CELL_SLAB *next;
+  atomic_int used; // the cells handed out, counting the tries past the end
+  ValueCell cells[SLAB_CELLS];
+} CellSlab;
+
+typedef struct SKIP_NODE {
+  _Atomic(void *) key;
+  // above 0 while the key is there: its number of values, counted before
+  // they're added. DEAD, MOVING or MOVED otherwise.
+  atomic_int num_values;
+  ValueChain *values;
+  struct SKIP_NODE *from; // while MOVING: the node the values are moved from
+  _Atomic(struct SKIP_NODE *) moved_to; // the one node its values may be moved to
+  int owns_values; // 0 once mm_rekey has given the values to another node
+  int top_level;
+  struct SKIP_NODE *retired_next; // on the multimap's list of removed nodes
+  _Atomic(uintptr_t) next[];      // a node pointer and MARK, one per level
+} SkipNode;
+
+struct MULTIMAP
+{
+  atomic_int num_keys;
+  int max_keys;
+  Compare compare_keys;
+  Compare compare_values;
+  SkipNode *head; // has no key, and every level
+  atomic_int values_in_use;
+  _Atomic(SkipNode *) retired; // removed nodes, freed by mm_reclaim
+  // the value cells: the newest slab is handed out from first, then the cells
+  // mm_reclaim got back from removed keys. Cells taken for a value that didn't
+  // go in wait on the spare list until mm_reclaim too.
+  _Atomic(CellSlab *) slabs;
+  atomic_int num_slabs;
+  _Atomic(ValueCell *) free_cells;
+  atomic_int num_free;
+  _Atomic(ValueCell *) spare_cells;
+  // traversal position for mm_get_first_key/mm_get_next_key: the node of the
+  // key last returned, or of the key before it once that's removed (by any
+  // thread, see unlink_node). trav_on is 0 when there is no traversal going.
+  int trav_on;
+  _Atomic(SkipNode *) trav_node;
+};
+
+// Helper functions
+static SkipNode *new_node(void *key, int top_level);
+static void free_node(SkipNode *node);
+static int random_level(void);
+static int find(Multimap *mm, void *key, SkipNode **preds, SkipNode **succs);
+static SkipNode *search(Multimap *mm, void *key);
+static SkipNode *next_live(SkipNode *node);
+static SkipNode *find_live(Multimap *mm, void *key);
+static int link_node(Multimap *mm, SkipNode *node, SkipNode **preds, SkipNode **succs);
+static void link_upper(Multimap *mm, SkipNode *node, SkipNode **preds, SkipNode **succs);
+static void mark_node(SkipNode *node);
+static void unlink_node(Multimap *mm, SkipNode *node);
+static int finish_move(Multimap *mm, SkipNode *moved);
+static void add_value(Multimap *mm, ValueChain *values, ValueCell *cell);
+static ValueCell *new_cell(Multimap *mm);
+static int free_values(Multimap *mm, ValueChain *values);
+
+static inline SkipNode *node_of(uintptr_t link)
+{
+  return (SkipNode *)(link & ~MARK);
+}
+
+static inline int is_marked(uintptr_t link)
+{
+  return (link & MARK) != 0;
+}
+
+#ifndef NDEBUG
+// Only called when no other thread can be using the multimap: after it's
+// made and before it's destroyed.
+static int validate_multimap(Multimap *mm)
+{
+  if (NULL != mm) {
+    int count = 0;
+    void *last = NULL;
+
+    assert(NULL != mm->head);
+    assert(mm->num_keys >= 0 && mm->num_keys <= mm->max_keys);
+    for (SkipNode *node = next_live(node_of(mm->head->next[0])); NULL != node;
+         node = next_live(node_of(node->next[0]))) {
+      assert(NULL == last || mm->compare_keys(last, node->key) < 0);
+      assert(NULL != node->values && NULL != node->values->first);
+      last = node->key;
+      count++;
+    }
+    assert(count == mm->num_keys);
+  }
+
+  return 1;
+}
+#endif
+
+Multimap *mm_create(int max_keys, Compare compare_keys, Compare compare_values)
+{
+  assert(max_keys >= 0);
+  assert(NULL != compare_keys);
+  assert(NULL != compare_values);
+  Multimap *mm = NULL;
+
+  if (max_keys >= 0 && NULL != compare_keys && NULL != compare_values) {
+    mm = malloc(sizeof(Multimap));
+    if (NULL != mm) {
+      mm->head = new_node(NULL, MAX_LEVEL);
+      if (NULL == mm->head) {
+        free(mm);
+        mm = NULL;
+      } else {
+        atomic_init(&mm->num_keys, 0);
+        mm->max_keys = max_keys;
+        mm->compare_keys = compare_keys;
+        mm->compare_values = compare_values;
+        atomic_init(&mm->values_in_use, 0);
+        atomic_init(&mm->retired, NULL);
+        atomic_init(&mm->slabs, NULL);
+        atomic_init(&mm->num_slabs, 0);
+        atomic_init(&mm->free_cells, NULL);
+        atomic_init(&mm->num_free, 0);
+        atomic_init(&mm->spare_cells, NULL);
+        mm->trav_on = 0;
+        atomic_init(&mm->trav_node, NULL);
+      }
+    }
+  }
+  assert(NULL == mm || validate_multimap(mm));
+  return mm;
+}
+
+Multimap *mm_bulk_load(int max_keys, Compare compare_keys, Compare compare_values,
+                       MMEntry entries[], int num_entries, int sorted)
+{
+  assert(num_entries >= 0);
+  assert(NULL != entries || 0 == num_entries);
+
+  Multimap *mm = NULL;
+  int num_keys = 0;
+  int valid = (num_entries >= 0 && (NULL != entries || 0 == num_entries));
+
+  for (int i = 0; valid && i < num_entries; i++) {
+    // can't have a key with no values
+    valid = (NULL != entries[i].key && entries[i].num_values > 0 && NULL != entries[i].values);
+  }
+  if (valid && !sorted) {
+    valid = (mm_sort_entries(entries, num_entries, compare_keys) == 0);
+  }
+  for (int i = 0; valid && i < num_entries; i++) {
+    if (0 == i || compare_keys(entries[i-1].key, entries[i].key) != 0) {
+      num_keys++;
+    }
+  }
+  if (valid && num_keys <= max_keys) {
+    mm = mm_create(max_keys, compare_keys, compare_values);
+  }
+
+  // the keys come in order, so each one goes in at the end of the list:
+  // there's nothing to gain from building the levels by hand.
+  for (int i = 0; NULL != mm && i < num_entries; i++) {
+    for (int j = 0; NULL != mm && j < entries[i].num_values; j++) {
+      if (mm_insert_value(mm, entries[i].key, entries[i].values[j].num, entries[i].values[j].data) < 0) {
+        mm_destroy(mm);
+        mm = NULL;
+      }
+    }
+  }
+
+  assert(NULL == mm || validate_multimap(mm));
+  return mm;
+}
+
+int mm_insert_value(Multimap *mm, void *key, int value_num, void *value_data)
+{
+  assert(NULL != mm);
+  assert(NULL != key);
+  assert(NULL != value_data);
+
+  int result = -1;
+  int count;
+  int reserved = 0;
+  SkipNode *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+  SkipNode *node = NULL, *found;
+  ValueCell *cell = NULL, *first, *spare;
+
+  if (NULL == mm || NULL == key || NULL == value_data) {
+    return -1;
+  }
+
+  while (-1 == result) {
+    if (find(mm, key, preds, succs)) {
+      found = succs[0];
+      count = atomic_load(&found->num_values);
+      if (count > 0) {
+        if (NULL == cell) {
+          cell = new_cell(mm);
+          if (NULL == cell) {
+            break;
+          }
+          cell->value.num = value_num;
+          cell->value.data = value_data;
+        }
+        // count the value first, so a remove that comes between counts it too
+        if (atomic_compare_exchange_weak(&found->num_values, &count, count + 1)) {
+          add_value(mm, found->values, cell);
+          atomic_fetch_add(&mm->values_in_use, 1);
+          result = count + 1;
+        }
+      } else if (MOVING == count) {
+        // a rekey is moving values to this key: finish the move, then add to it
+        finish_move(mm, found);
+      } else {
+        // removed or moved: help it along, the next find takes it out of the list
+        mark_node(found);
+      }
+    } else {
+      if (NULL == node) {
+        if (atomic_fetch_add(&mm->num_keys, 1) >= mm->max_keys) {
+          atomic_fetch_sub(&mm->num_keys, 1);
+          break;
+        }
+        reserved = 1;
+        node = new_node(key, random_level());
+        if (NULL == node) {
+          break;
+        }
+        node->values = malloc(sizeof(ValueChain));
+        if (NULL == node->values) {
+          break;
+        }
+        node->owns_values = 1;
+        atomic_init(&node->num_values, 1);
+      }
+      // a cell taken for the key before it was removed is used up here
+      first = (NULL != cell) ? cell : &node->values->own;
+      first->value.num = value_num;
+      first->value.data = value_data;
+      atomic_init(&first->next, NULL);
+      atomic_init(&node->values->first, first);
+      atomic_init(&node->values->last, first);
+      if (link_node(mm, node, preds, succs)) {
+        atomic_fetch_add(&mm->values_in_use, 1);
+        result = 1;
+      }
+    }
+  }
+
+  if (1 != result && NULL != node) {
+    // made for a key that turned out to be there already, or couldn't be made
+    free(node->values);
+    free(node);
+  }
+  if (1 != result && reserved) {
+    atomic_fetch_sub(&mm->num_keys, 1);
+  }
+  if (-1 == result && NULL != cell) {
+    // other threads may be taking cells off the free list, so it waits
+    spare = atomic_load(&mm->spare_cells);
+    do {
+      atomic_store(&cell->next, spare);
+    } while (!atomic_compare_exchange_weak(&mm->spare_cells, &spare, cell));
+  }
+
+  assert(result >= -1);
+  return result;
+}
+
+int mm_count_keys(Multimap *mm)
+{
+  assert(NULL != mm);
+
+  int count = -1;
+
+  if (NULL != mm) {
+    count = atomic_load(&mm->num_keys);
+  }
+
+  assert(count >= -1);
+  return count;
+}
+
+int mm_count_values(Multimap *mm, void *key)
+{
+  assert(NULL != mm);
+  assert(NULL != key);
+
+  int count = -1;
+  SkipNode *node;
+
+  if (NULL != mm && NULL != key) {
+    count = 0;
+    node = find_live(mm, key);
+    if (NULL != node) {
+      count = atomic_load(&node->num_values);
+      if (count < 0) {
+        // removed since it was found
+        count = 0;
+      }
+    }
+  }
+
+  assert(count >= -1);
+  return count;
+}
+
+int mm_get_values(Multimap *mm, void *key, Value values[], int max_values)
+{
+  assert(NULL != mm);
+  assert(NULL != key);
+  assert(NULL != values);
+  assert(max_values >= 0);
+
+  int count = -1;
+  SkipNode *node;
+
+  if (NULL != mm && NULL != key && NULL != values && max_values >= 0) {
+    count = 0;
+    node = find_live(mm, key);
+    if (NULL != node) {
+      // values still being added by other threads may not be in the chain yet
+      for (ValueCell *cell = atomic_load(&node->values->first); NULL != cell && count < max_values;
+           cell = atomic_load(&cell->next)) {
+        values[count] = cell->value;
+        count++;
+      }
+    }
+  }
+
+  assert(count >= -1);
+  return count;
+}
+
+int mm_for_each_value(Multimap *mm, void *key, MMValueVisit visit, void *arg)
+{
+  assert(NULL != mm);
+  assert(NULL != key);
+  assert(NULL != visit);
+
+  int count = -1;
+  SkipNode *node;
+
+  if (NULL != mm && NULL != key && NULL != visit) {
+    count = 0;
+    node = find_live(mm, key);
+    if (NULL != node) {
+      for (ValueCell *cell = atomic_load(&node->values->first); NULL != cell;
+           cell = atomic_load(&cell->next)) {
+        count++;
+        if (visit(&cell->value, arg) != 0) {
+          break;
+        }
+      }
+    }
+  }
+
+  assert(count >= -1);
+  return count;
+}
+
+int mm_remove_key(Multimap *mm, void *key)
+{
+  assert(NULL != mm);
+  assert(NULL != key);
+
+  int count = -1;
+  SkipNode *node;
+
+  if (NULL != mm && NULL != key) {
+    count = 0;
+    node = find_live(mm, key);
+    while (NULL != node) {
+      count = atomic_load(&node->num_values);
+      if (count <= 0) {
+        // another thread removed it first
+        count = 0;
+        node = NULL;
+      } else if (atomic_compare_exchange_weak(&node->num_values, &count, DEAD)) {
+        // this thread removed it: no one can add to it any more
+        atomic_fetch_sub(&mm->num_keys, 1);
+        atomic_fetch_sub(&mm->values_in_use, count);
+        unlink_node(mm, node);
+        node = NULL;
+      }
+    }
+  }
+
+  assert(count >= -1);
+  return count;
+}
+
+int mm_rekey(Multimap *mm, void *key, void *new_key)
+{
+  assert(NULL != mm);
+  assert(NULL != key);
+  assert(NULL != new_key);
+
+  int count = -1;
+  SkipNode *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+  SkipNode *node, *moved, *found;
+  int linked = 0;
+
+  if (NULL == mm || NULL == key || NULL == new_key) {
+    return -1;
+  }
+
+  node = find_live(mm, key);
+  if (NULL == node) {
+    return 0;
+  }
+
+  if (0 == mm->compare_keys(key, new_key)) {
+    // same place: readers see one key or the other, both compare the same
+    atomic_store(&node->key, new_key);
+    count = atomic_load(&node->num_values);
+    return (count > 0) ? count : 0;
+  }
+
+  // new_key goes in first, hidden from readers, so there's never a moment
+  // the key is there twice. It has the values from the start, so whichever
+  // thread comes past it next can take the key out and hand them over,
+  // values still being added to it included: nothing waits for this thread.
+  moved = new_node(new_key, random_level());
+  if (NULL == moved) {
+    return -1;
+  }
+  moved->values = node->values;
+  moved->from = node;
+  atomic_init(&moved->num_values, MOVING);
+  while (!linked && NULL != moved) {
+    if (find(mm, new_key, preds, succs)) {
+      found = succs[0];
+      count = atomic_load(&found->num_values);
+      if (DEAD == count || count <= MOVED(1)) {
+        mark_node(found);
+      } else {
+        // it would be there twice
+        free(moved);
+        moved = NULL;
+      }
+    } else {
+      linked = link_node(mm, moved, preds, succs);
+    }
+  }
+  if (NULL == moved) {
+    return -1;
+  }
+
+  count = finish_move(mm, moved);
+
+  assert(count >= 0);
+  return count;
+}
+
+void mm_print(Multimap *mm)
+{
+  assert(NULL != mm);
+
+  int i = 0;
+
+  if (NULL != mm) {
+    for (SkipNode *node = next_live(node_of(atomic_load(&mm->head->next[0]))); NULL != node;
+         node = next_live(node_of(atomic_load(&node->next[0]))), i++) {
+      printf("[%3d] '%p' (%d):\n", i, atomic_load(&node->key), atomic_load(&node->num_values));
+      for (ValueCell *cell = atomic_load(&node->values->first); NULL != cell; cell = atomic_load(&cell->next)) {
+        printf(" %9d '%p'\n", cell->value.num, cell->value.data);
+      }
+    }
+  }
+}
+
+int mm_destroy(Multimap *mm)
+{
+  int count = -1;
+  SkipNode *node, *next;
+  CellSlab *slab, *next_slab;
+
+  assert(NULL == mm || validate_multimap(mm));
+
+  if (NULL != mm) {
+    count = 0;
+    // after that, the nodes in the list are the keys that are there
+    mm_reclaim(mm);
+    node = node_of(atomic_load(&mm->head->next[0]));
+    while (NULL != node) {
+      next = node_of(atomic_load(&node->next[0]));
+      count += 1 + free_values(mm, node->values);
+      free_node(node);
+      node = next;
+    }
+    free_node(mm->head);
+    // the cells all go with their slabs
+    slab = atomic_load(&mm->slabs);
+    while (NULL != slab) {
+      next_slab = slab->next;
+      free(slab);
+      slab = next_slab;
+    }
+
+    // set everything to zero, to help catch a dangling pointer error
+    mm->num_keys = 0;
+    mm->max_keys = 0;
+    mm->head = NULL;
+    mm->retired = NULL;
+    mm->slabs = NULL;
+
+    free(mm);
+  }
+
+  return count;
+}
+
+int mm_reclaim(Multimap *mm)
+{
+  assert(NULL != mm);
+
+  int count = 0;
+  SkipNode *pred, *node, *next, *trav, *resume = NULL;
+  ValueCell *cell, *next_cell;
+  uintptr_t link;
+  int stranded;
+
+  if (NULL == mm) {
+    return -1;
+  }
+
+  // a traversal on a removed key goes on from the first key after it
+  trav = atomic_load(&mm->trav_node);
+  stranded = mm->trav_on && is_marked(atomic_load(&trav->next[0]));
+  if (stranded) {
+    resume = trav;
+    while (NULL != resume && is_marked(atomic_load(&resume->next[0]))) {
+      resume = node_of(atomic_load(&resume->next[0]));
+    }
+  }
+
+  // take the removed nodes out of every level they may still be on: one whose
+  // upper levels were being linked as it was removed can be left on them.
+  for (int level = 0; level < MAX_LEVEL; level++) {
+    pred = mm->head;
+    node = node_of(atomic_load(&pred->next[level]));
+    while (NULL != node) {
+      link = atomic_load(&node->next[level]);
+      if (is_marked(link)) {
+        atomic_store(&pred->next[level], link & ~MARK);
+      } else {
+        if (0 == level && node == resume) {
+          atomic_store(&mm->trav_node, pred);
+        }
+        pred = node;
+      }
+      node = node_of(link);
+    }
+    if (0 == level && stranded && NULL == resume) {
+      // there's no key after it
+      atomic_store(&mm->trav_node, pred);
+    }
+  }
+
+  node = atomic_exchange(&mm->retired, NULL);
+  while (NULL != node) {
+    next = node->retired_next;
+    if (node->owns_values) {
+      free_values(mm, node->values);
+    }
+    free_node(node);
+    count++;
+    node = next;
+  }
+
+  cell = atomic_exchange(&mm->spare_cells, NULL);
+  while (NULL != cell) {
+    next_cell = atomic_load(&cell->next);
+    atomic_store(&cell->next, atomic_load(&mm->free_cells));
+    atomic_store(&mm->free_cells, cell);
+    atomic_fetch_add(&mm->num_free, 1);
+    cell = next_cell;
+  }
+
+  return count;
+}
+
+// The cells come from slabs, like the nodes of valuelist.c, but are handed
+// out with an atomic counter, and only go back to be used again in
+// mm_reclaim. A key's first value needs no cell, so nodes_in_use is the
+// values after each key's first.
+int mm_pool_stats(Multimap *mm, MMPoolStats *stats)
+{
+  assert(NULL != mm);
+  assert(NULL != stats);
+
+  CellSlab *slab;
+  int left = 0;
+
+  if (NULL == mm || NULL == stats) {
+    return -1;
+  }
+  slab = atomic_load(&mm->slabs);
+  if (NULL != slab && atomic_load(&slab->used) < SLAB_CELLS) {
+    left = SLAB_CELLS - atomic_load(&slab->used);
+  }
+  stats->slabs = atomic_load(&mm->num_slabs);
+  stats->nodes_in_use = atomic_load(&mm->values_in_use) - atomic_load(&mm->num_keys);
+  stats->nodes_free = atomic_load(&mm->num_free) + left;
+  return 0;
+}
+
+int mm_get_first_key(Multimap *mm, void **key)
+{
+  assert(NULL != mm);
+  assert(NULL != key);
+
+  int result = 0;
+  SkipNode *node;
+
+  if (NULL == mm || NULL == key) {
+    // If we get here, assertions are off, so there are no postconditions to skip
+    return -1;
+  }
+
+  node = next_live(node_of(atomic_load(&mm->head->next[0])));
+  if (NULL != node) {
+    *key = atomic_load(&node->key);
+    result = 1;
+  }
+  mm->trav_on = (NULL != node);
+  atomic_store(&mm->trav_node, node);
+
+  assert(result >= -1 && result <= 1);
+  return result;
+}
+
+int mm_get_next_key(Multimap *mm, void **key)
+{
+  assert(NULL != mm);
+  assert(NULL != key);
+
+  int result = 0;
+  SkipNode *node;
+
+  if (NULL == mm || NULL == key) {
+    return -1;
+  }
+
+  if (!mm->trav_on) {
+    // Attempted to call get_next when the previous call would have failed
+    return -1;
+  }
+
+  // removing the last key returned moves the traversal back to the key before
+  // it, so a key added in its place is returned next, as in the other multimaps.
+  node = next_live(node_of(atomic_load(&atomic_load(&mm->trav_node)->next[0])));
+  if (NULL != node) {
+    *key = atomic_load(&node->key);
+    result = 1;
+  }
+  mm->trav_on = (NULL != node);
+  atomic_store(&mm->trav_node, node);
+
+  assert(result >= -1 && result <= 1);
+  return result;
+}
+
+// The cursor keeps the node of the key last returned, and an index of -1
+// once the keys have run out.
+
+int mm_cursor_first(Multimap *mm, MMCursor *cursor, void **key)
+{
+  assert(NULL != mm);
+  assert(NULL != cursor);
+  assert(NULL != key);
+
+  SkipNode *node;
+
+  if (NULL == mm || NULL == cursor || NULL == key) {
+    return -1;
+  }
+
+  node = next_live(node_of(atomic_load(&mm->head->next[0])));
+  cursor->node = node;
+  cursor->index = (NULL != node) ? 0 : -1;
+  if (NULL == node) {
+    return 0;
+  }
+  *key = atomic_load(&node->key);
+  return 1;
+}
+
+int mm_cursor_next(Multimap *mm, MMCursor *cursor, void **key)
+{
+  assert(NULL != mm);
+  assert(NULL != cursor);
+  assert(NULL != key);
+
+  SkipNode *node;
+
+  if (NULL == mm || NULL == cursor || NULL == key) {
+    return -1;
+  }
+
+  if (cursor->index < 0) {
+    // the previous call already ran out of keys
+    return -1;
+  }
+
+  node = next_live(node_of(atomic_load(&((SkipNode *)cursor->node)->next[0])));
+  cursor->node = node;
+  if (NULL == node) {
+    cursor->index = -1;
+    return 0;
+  }
+  *key = atomic_load(&node->key);
+  return 1;
+}
+
+int mm_lower_bound(Multimap *mm, MMCursor *cursor, void *key, void **found)
+{
+  assert(NULL != mm);
+  assert(NULL != cursor);
+  assert(NULL != key);
+  assert(NULL != found);
+
+  SkipNode *node;
+
+  if (NULL == mm || NULL == cursor || NULL == key || NULL == found) {
+    return -1;
+  }
+
+  node = next_live(search(mm, key));
+  cursor->node = node;
+  cursor->index = (NULL != node) ? 0 : -1;
+  if (NULL == node) {
+    return 0;
+  }
+  *found = atomic_load(&node->key);
+  return 1;
+}
+
+int mm_foreach(Multimap *mm, MMVisit visit, void *arg)
+{
+  assert(NULL != mm);
+  assert(NULL != visit);
+
+  int count = 0;
+  int num_values;
+
+  if (NULL == mm || NULL == visit) {
+    return -1;
+  }
+
+  for (SkipNode *node = next_live(node_of(atomic_load(&mm->head->next[0]))); NULL != node;
+       node = next_live(node_of(atomic_load(&node->next[0])))) {
+    num_values = atomic_load(&node->num_values);
+    if (num_values > 0) {
+      count++;
+      if (visit(atomic_load(&node->key), num_values, arg) != 0) {
+        break;
+      }
+    }
+  }
+  return count;
+}
+
+int mm_freeze(Multimap *mm, MMFingerprint fingerprint)
+{
+  assert(NULL != mm);
+  assert(NULL != fingerprint);
+
+  return (NULL == mm || NULL == fingerprint) ? -1 : 0;
+}
+
+int mm_frozen(Multimap *mm)
+{
+  assert(NULL != mm);
+
+  return (NULL == mm) ? -1 : 1;
+}
+
+// A node with the given number of levels, not in the list and with no values.
+static SkipNode *new_node(void *key, int top_level)
+{
+  SkipNode *node = malloc(sizeof(SkipNode) + top_level * sizeof(_Atomic(uintptr_t)));
+
+  if (NULL != node) {
+    atomic_init(&node->key, key);
+    atomic_init(&node->num_values, 0);
+    node->values = NULL;
+    node->owns_values = 0;
+    node->from = NULL;
+    atomic_init(&node->moved_to, NULL);
+    node->top_level = top_level;
+    node->retired_next = NULL;
+    for (int i = 0; i < top_level; i++) {
+      atomic_init(&node->next[i], 0);
+    }
+  }
+  return node;
+}
+
+static void free_node(SkipNode *node)
+{
+  free(node);
+}
+
+// 1 level half the time, 2 a quarter of the time, and so on. Each thread has
+// its own generator, so making nodes needs nothing shared.
+static int random_level(void)
+{
+  static _Thread_local uint32_t seed = 0;
+
+  if (0 == seed) {
+    seed = (uint32_t)(uintptr_t)&seed | 1;
+  }
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return 1 + __builtin_ctz(seed | (1u << (MAX_LEVEL - 1)));
+}
+
+// Fill in, for each level, the last node before key and the first one not
+// before it, taking the removed nodes met on the way out of the list.
+// Return 1 if succs[0] is the key, 0 if it isn't there.
+static int find(Multimap *mm, void *key, SkipNode **preds, SkipNode **succs)
+{
+  SkipNode *pred, *curr;
+  uintptr_t link, expected;
+  int done = 0;
+
+  while (!done) {
+    done = 1;
+    pred = mm->head;
+    for (int level = MAX_LEVEL - 1; done && level >= 0; level--) {
+      curr = node_of(atomic_load(&pred->next[level]));
+      while (done && NULL != curr) {
+        link = atomic_load(&curr->next[level]);
+        if (is_marked(link)) {
+          expected = (uintptr_t)curr;
+          if (atomic_compare_exchange_strong(&pred->next[level], &expected, link & ~MARK)) {
+            curr = node_of(link);
+          } else {
+            // pred changed (or is being removed itself): start again from the top
+            done = 0;
+          }
+        } else if (mm->compare_keys(atomic_load(&curr->key), key) < 0) {
+          pred = curr;
+          curr = node_of(link);
+        } else {
+          break;
+        }
+      }
+      preds[level] = pred;
+      succs[level] = curr;
+    }
+  }
+
+  return NULL != succs[0] && 0 == mm->compare_keys(atomic_load(&succs[0]->key), key);
+}
+
+// The first node at the bottom level not before key (NULL if there's none),
+// changing nothing on the way, so any number of threads can search at once.
+// It may be a node that's being removed or moved to: see next_live.
+static SkipNode *search(Multimap *mm, void *key)
+{
+  SkipNode *pred = mm->head, *curr = NULL;
+  uintptr_t link;
+
+  for (int level = MAX_LEVEL - 1; level >= 0; level--) {
+    curr = node_of(atomic_load(&pred->next[level]));
+    while (NULL != curr) {
+      link = atomic_load(&curr->next[level]);
+      if (is_marked(link)) {
+        curr = node_of(link);
+      } else if (mm->compare_keys(atomic_load(&curr->key), key) < 0) {
+        pred = curr;
+        curr = node_of(link);
+      } else {
+        break;
+      }
+    }
+  }
+  return curr;
+}
+
+// The node itself if its key is there, or the first one after it that is.
+static SkipNode *next_live(SkipNode *node)
+{
+  while (NULL != node && atomic_load(&node->num_values) <= 0) {
+    node = node_of(atomic_load(&node->next[0]));
+  }
+  return node;
+}
+
+// The node of the key, or NULL if it's not there.
+static SkipNode *find_live(Multimap *mm, void *key)
+{
+  SkipNode *node = search(mm, key);
+
+  if (NULL == node || 0 != mm->compare_keys(atomic_load(&node->key), key) ||
+      atomic_load(&node->num_values) <= 0) {
+    node = NULL;
+  }
+  return node;
+}
+
+// Put the node in the bottom level between preds[0] and succs[0], as found by
+// find, then in the levels above. Return 1 if it went in, 0 if the list
+// changed there first (find again and retry).
+static int link_node(Multimap *mm, SkipNode *node, SkipNode **preds, SkipNode **succs)
+{
+  uintptr_t expected = (uintptr_t)succs[0];
+
+  for (int level = 0; level < node->top_level; level++) {
+    atomic_store(&node->next[level], (uintptr_t)succs[level]);
+  }
+  if (!atomic_compare_exchange_strong(&preds[0]->next[0], &expected, (uintptr_t)node)) {
+    return 0;
+  }
+  // it's in the multimap from here: the levels above only make it faster to find
+  link_upper(mm, node, preds, succs);
+  return 1;
+}
+
+static void link_upper(Multimap *mm, SkipNode *node, SkipNode **preds, SkipNode **succs)
+{
+  uintptr_t link, expected;
+  void *key = atomic_load(&node->key);
+
+  for (int level = 1; level < node->top_level; level++) {
+    for (;;) {
+      link = atomic_load(&node->next[level]);
+      if (is_marked(link)) {
+        // being removed already, so there's no point going higher
+        return;
+      }
+      if (node_of(link) != succs[level] &&
+          !atomic_compare_exchange_strong(&node->next[level], &link, (uintptr_t)succs[level])) {
+        return;
+      }
+      expected = (uintptr_t)succs[level];
+      if (atomic_compare_exchange_strong(&preds[level]->next[level], &expected, (uintptr_t)node)) {
+        break;
+      }
+      find(mm, key, preds, succs);
+      if (succs[0] != node) {
+        // removed in the meantime
+        return;
+      }
+    }
+  }
+}
+
+// Mark every next pointer of the node, top level first, so every thread
+// that meets it skips it. Any thread can do it once the node is DEAD.
+static void mark_node(SkipNode *node)
+{
+  for (int level = node->top_level - 1; level >= 0; level--) {
+    atomic_fetch_or(&node->next[level], MARK);
+  }
+}
+
+// Take a node this thread made DEAD (or MOVED) out of the list, and keep it
+// until mm_reclaim. A traversal on it goes back to the key before it.
+static void unlink_node(Multimap *mm, SkipNode *node)
+{
+  SkipNode *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+  SkipNode *retired, *trav = node;
+
+  mark_node(node);
+  find(mm, atomic_load(&node->key), preds, succs);
+  atomic_compare_exchange_strong(&mm->trav_node, &trav, preds[0]);
+
+  retired = atomic_load(&mm->retired);
+  do {
+    node->retired_next = retired;
+  } while (!atomic_compare_exchange_weak(&mm->retired, &retired, node));
+}
+
+// Hand the values of moved->from over to moved, which mm_rekey linked in
+// MOVING. Any thread that meets the node can do it: the old node is claimed
+// for one moved node first, so when two rekeys of the key race, only one gets
+// the values. Then the one that changes the old node's count takes that node
+// out of the list, and the first to change the new one's count settles it.
+// Return the number of values handed over, 0 if the key was removed or moved
+// elsewhere first (and moved goes too).
+static int finish_move(Multimap *mm, SkipNode *moved)
+{
+  SkipNode *from = moved->from;
+  SkipNode *claimed = NULL;
+  int count = 0;
+  int expected = MOVING;
+  int took = 0;
+
+  if (atomic_compare_exchange_strong(&from->moved_to, &claimed, moved) || claimed == moved) {
+    count = atomic_load(&from->num_values);
+    // a failed exchange reloads count, so this stops once it's moved either way
+    while (count > 0 && !atomic_compare_exchange_weak(&from->num_values, &count, MOVED(count))) {
+      continue;
+    }
+    took = (count > 0);
+    if (took) {
+      from->owns_values = 0;
+      moved->owns_values = 1;
+    } else if (count <= MOVED(1)) {
+      count = MOVED(count); // another thread moved them here
+    } else {
+      count = 0; // removed by another thread in the meantime
+    }
+  }
+
+  if (atomic_compare_exchange_strong(&moved->num_values, &expected, (count > 0) ? count : DEAD) &&
+      0 == count) {
+    unlink_node(mm, moved);
+  }
+  if (took) {
+    unlink_node(mm, from);
+  }
+  return count;
+}
+
+// Add the cell to the chain in value order, after the values that come
+// before it and before the ones it's equal to, like vl_insert.
+static void add_value(Multimap *mm, ValueChain *values, ValueCell *cell)
+{
+  _Atomic(ValueCell *) *link = &values->first;
+  ValueCell *last = atomic_load(&values->last);
+  ValueCell *next;
+
+  // values added in order go after the last one, without walking the chain
+  if (NULL != last && mm->compare_values(&cell->value, &last->value) > 0) {
+    link = &last->next;
+  }
+
+  next = atomic_load(link);
+  for (;;) {
+    if (NULL != next && mm->compare_values(&cell->value, &next->value) > 0) {
+      link = &next->next;
+      next = atomic_load(link);
+    } else {
+      atomic_store(&cell->next, next);
+      // on failure next is what's there now, and the search goes on from it
+      if (atomic_compare_exchange_weak(link, &next, cell)) {
+        break;
+      }
+    }
+  }
+  if (NULL == atomic_load(&cell->next)) {
+    atomic_store(&values->last, cell);
+  }
+}
+
+// A cell from the free list if there's one there, otherwise the next one in
+// the newest slab, or NULL if memory runs out. Cells only go on the free list
+// in mm_reclaim, with no other thread about, so one taken off it can't be
+// back on it while another thread is still trying to take it.
+static ValueCell *new_cell(Multimap *mm)
+{
+  ValueCell *cell = atomic_load(&mm->free_cells);
+  CellSlab *slab, *made;
+  int i;
+
+  while (NULL != cell && !atomic_compare_exchange_weak(&mm->free_cells, &cell, atomic_load(&cell->next))) {
+    continue;
+  }
+  if (NULL != cell) {
+    atomic_fetch_sub(&mm->num_free, 1);
+  }
+
+  while (NULL == cell) {
+    slab = atomic_load(&mm->slabs);
+    if (NULL != slab && (i = atomic_fetch_add(&slab->used, 1)) < SLAB_CELLS) {
+      cell = &slab->cells[i];
+    } else {
+      // it's full: start another, unless another thread got there first
+      made = malloc(sizeof(CellSlab));
+      if (NULL == made) {
+        return NULL;
+      }
+      made->next = slab;
+      atomic_init(&made->used, 1);
+      if (atomic_compare_exchange_strong(&mm->slabs, &slab, made)) {
+        atomic_fetch_add(&mm->num_slabs, 1);
+        cell = &made->cells[0];
+      } else {
+        free(made);
+      }
+    }
+  }
+  return cell;
+}
+
+// Free the chain, and put its cells on the free list: only with no other
+// thread about. Return the number of values it had.
+static int free_values(Multimap *mm, ValueChain *values)
+{
+  int count = 0;
+  ValueCell *cell, *next;
+
+  if (NULL != values) {
+    cell = atomic_load(&values->first);
+    while (NULL != cell) {
+      next = atomic_load(&cell->next);
+      if (cell != &values->own) {
+        atomic_store(&cell->next, atomic_load(&mm->free_cells));
+        atomic_store(&mm->free_cells, cell);
+        atomic_fetch_add(&mm->num_free, 1);
+      }
+      count++;
+      cell = next;
+    }
+    free(values);
+  }
+  return count;
+}
@@ -0,0 +1,250 @@
+#ifndef _A5_MULTIMAP_TYPED
+#define _A5_MULTIMAP_TYPED
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// A multimap made for one key type and one value type at compile time,
+// next to the generic one in multimap.h. It is a sorted array like
+// multimap.c, but the keys are stored by value, in an array of their own so
+// the binary search only reads keys, and the comparisons are macros or
+// inline functions the compiler can inline instead of calls through
+// function pointers.
+//
+//   DEFINE_MULTIMAP(IntMap, int, double, MM_COMPARE_NUMBERS)
+//
+// defines the type IntMap and the functions IntMap_create, IntMap_insert...
+// in the file it's used in (they are all static). cmp(a, b) is called with
+// two keys and returns less than, equal to or greater than 0. The values of
+// a key are kept in the order they were inserted;
+// DEFINE_MULTIMAP_ORDERED(name, KeyT, ValT, cmp, value_cmp) keeps them in
+// value_cmp order instead (equal values in insertion order).
+//
+// The functions mean the same as the mm_ ones, with keys and values passed
+// by value:
+//   name *name_create(int max_keys);
+//   int name_insert(name *mm, KeyT key, ValT value);
+//   int name_count_keys(name *mm);
+//   int name_count_values(name *mm, KeyT key);
+//   int name_get_values(name *mm, KeyT key, ValT values[], int max_values);
+//   int name_remove_key(name *mm, KeyT key);
+//   int name_destroy(name *mm);
+// and the keys are read in order by position (valid until the next change):
+//   int name_lower_bound(name *mm, KeyT key); // first position not less than key
+//   KeyT name_key_at(name *mm, int pos);
+//   int name_values_at(name *mm, int pos); // the number of values there
+
+// Compares any two numbers of the same type.
+#define MM_COMPARE_NUMBERS(a, b) (((a) > (b)) - ((a) < (b)))
+
+// For value_cmp: every value goes after the ones already there.
+#define MM_INSERTION_ORDER(a, b) 1
+
+#define DEFINE_MULTIMAP(name, KeyT, ValT, cmp) \
+  DEFINE_MULTIMAP_ORDERED(name, KeyT, ValT, cmp, MM_INSERTION_ORDER)
+
+#define DEFINE_MULTIMAP_ORDERED(name, KeyT, ValT, cmp, value_cmp) \
+  \
+  /* the first value is kept in place, so a key with one value needs no allocation */ \
+  typedef struct { \
+    int num_values; \
+    int capacity; /* of more */ \
+    ValT first; \
+    ValT *more; \
+  } name##_Values; \
+  \
+  typedef struct { \
+    int num_keys; \
+    int max_keys; \
+    int capacity; /* of keys and values, doubles when full and halves when a quarter full */ \
+    KeyT *keys; \
+    name##_Values *values; \
+  } name; \
+  \
+  static inline ValT *name##_value_at(name##_Values *v, int i) { \
+    return (0 == i) ? &v->first : &v->more[i - 1]; \
+  } \
+  \
+  static inline int name##_resize(name *mm, int capacity) { \
+    KeyT *keys = realloc(mm->keys, capacity * sizeof(KeyT)); \
+    if (NULL == keys) { \
+      return -1; \
+    } \
+    mm->keys = keys; \
+    name##_Values *values = realloc(mm->values, capacity * sizeof(name##_Values)); \
+    if (NULL == values) { \
+      /* keys is only bigger than it needs to be */ \
+      return -1; \
+    } \
+    mm->values = values; \
+    mm->capacity = capacity; \
+    return 0; \
+  } \
+  \
+  static inline int name##_lower_bound(name *mm, KeyT key) { \
+    assert(NULL != mm); \
+    int start = 0, end = mm->num_keys, mid; \
+    while (start < end) { \
+      mid = (end - start) / 2 + start; \
+      if (cmp(mm->keys[mid], key) < 0) { \
+        start = mid + 1; \
+      } else { \
+        end = mid; \
+      } \
+    } \
+    return start; \
+  } \
+  \
+  /* where the key is, or -1 */ \
+  static inline int name##_find(name *mm, KeyT key) { \
+    int pos = name##_lower_bound(mm, key); \
+    return (pos < mm->num_keys && cmp(mm->keys[pos], key) == 0) ? pos : -1; \
+  } \
+  \
+  static inline name *name##_create(int max_keys) { \
+    assert(max_keys >= 0); \
+    name *mm = NULL; \
+    if (max_keys >= 0) { \
+      mm = malloc(sizeof(name)); \
+      if (NULL != mm) { \
+        mm->num_keys = 0; \
+        mm->max_keys = max_keys; \
+        mm->capacity = 0; \
+        mm->keys = NULL; \
+        mm->values = NULL; \
+        if (name##_resize(mm, 16) != 0) { \
+          free(mm->keys); \
+          free(mm); \
+          mm = NULL; \
+        } \
+      } \
+    } \
+    return mm; \
+  } \
+  \
+  static inline int name##_insert(name *mm, KeyT key, ValT value) { \
+    assert(NULL != mm); \
+    if (NULL == mm) { \
+      return -1; \
+    } \
+    int pos = name##_lower_bound(mm, key); \
+    name##_Values *v; \
+    if (pos == mm->num_keys || cmp(mm->keys[pos], key) != 0) { \
+      if (mm->num_keys == mm->max_keys) { \
+        return -1; \
+      } \
+      if (mm->num_keys == mm->capacity && \
+          name##_resize(mm, (mm->capacity > mm->max_keys / 2) ? mm->max_keys : 2 * mm->capacity) != 0) { \
+        return -1; \
+      } \
+      memmove(&mm->keys[pos + 1], &mm->keys[pos], (mm->num_keys - pos) * sizeof(KeyT)); \
+      memmove(&mm->values[pos + 1], &mm->values[pos], (mm->num_keys - pos) * sizeof(name##_Values)); \
+      mm->num_keys++; \
+      mm->keys[pos] = key; \
+      v = &mm->values[pos]; \
+      v->num_values = 1; \
+      v->capacity = 0; \
+      v->more = NULL; \
+      v->first = value; \
+      return 1; \
+    } \
+    v = &mm->values[pos]; \
+    if (v->num_values - 1 == v->capacity) { \
+      int capacity = (0 == v->capacity) ? 1 : 2 * v->capacity; \
+      ValT *more = realloc(v->more, capacity * sizeof(ValT)); \
+      if (NULL == more) { \
+        return -1; \
+      } \
+      v->more = more; \
+      v->capacity = capacity; \
+    } \
+    /* goes at the end, then moves down past the values that sort after it */ \
+    int i = v->num_values; \
+    while (i > 0 && value_cmp(value, *name##_value_at(v, i - 1)) < 0) { \
+      *name##_value_at(v, i) = *name##_value_at(v, i - 1); \
+      i--; \
+    } \
+    *name##_value_at(v, i) = value; \
+    v->num_values++; \
+    return v->num_values; \
+  } \
+  \
+  static inline int name##_count_keys(name *mm) { \
+    assert(NULL != mm); \
+    return (NULL == mm) ? -1 : mm->num_keys; \
+  } \
+  \
+  static inline int name##_count_values(name *mm, KeyT key) { \
+    assert(NULL != mm); \
+    if (NULL == mm) { \
+      return -1; \
+    } \
+    int pos = name##_find(mm, key); \
+    return (pos < 0) ? 0 : mm->values[pos].num_values; \
+  } \
+  \
+  static inline int name##_get_values(name *mm, KeyT key, ValT values[], int max_values) { \
+    assert(NULL != mm); \
+    assert(NULL != values); \
+    if (NULL == mm || NULL == values) { \
+      return -1; \
+    } \
+    int pos = name##_find(mm, key), count = 0; \
+    if (pos >= 0) { \
+      name##_Values *v = &mm->values[pos]; \
+      for (; count < v->num_values && count < max_values; count++) { \
+        values[count] = *name##_value_at(v, count); \
+      } \
+    } \
+    return count; \
+  } \
+  \
+  static inline int name##_remove_key(name *mm, KeyT key) { \
+    assert(NULL != mm); \
+    if (NULL == mm) { \
+      return -1; \
+    } \
+    int pos = name##_find(mm, key), count = 0; \
+    if (pos >= 0) { \
+      count = mm->values[pos].num_values; \
+      free(mm->values[pos].more); \
+      memmove(&mm->keys[pos], &mm->keys[pos + 1], (mm->num_keys - pos - 1) * sizeof(KeyT)); \
+      memmove(&mm->values[pos], &mm->values[pos + 1], (mm->num_keys - pos - 1) * sizeof(name##_Values)); \
+      mm->num_keys--; \
+      /* if shrinking fails the room is only bigger than it needs to be */ \
+      if (mm->capacity > 16 && mm->num_keys < mm->capacity / 4) { \
+        name##_resize(mm, mm->capacity / 2); \
+      } \
+    } \
+    return count; \
+  } \
+  \
+  static inline KeyT name##_key_at(name *mm, int pos) { \
+    assert(NULL != mm); \
+    assert(pos >= 0 && pos < mm->num_keys); \
+    return mm->keys[pos]; \
+  } \
+  \
+  static inline int name##_values_at(name *mm, int pos) { \
+    assert(NULL != mm); \
+    assert(pos >= 0 && pos < mm->num_keys); \
+    return mm->values[pos].num_values; \
+  } \
+  \
+  /* returns the number of keys and values there were, like mm_destroy */ \
+  static inline int name##_destroy(name *mm) { \
+    int count = 0; \
+    if (NULL != mm) { \
+      for (int i = 0; i < mm->num_keys; i++) { \
+        count += 1 + mm->values[i].num_values; \
+        free(mm->values[i].more); \
+      } \
+      free(mm->keys); \
+      free(mm->values); \
+      free(mm); \
+    } \
+    return count; \
+  }
+
+#endif
@@ -0,0 +1,218 @@
+/**
+ * namehash.c
+ *
+ * PURPOSE: To look up files by name without walking the whole index, using
+ *          an open addressing hash table on the case-folded name.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "a5_namehash.h"
+#include "a5_keyname.h"
+
+#define FIRST_CAPACITY 16
+
+typedef struct NAME_ENTRY {
+    const KeyName *name; //NULL when the slot is empty.
+    void *key;
+    uint64_t hash; //the name's, here so probing doesn't read the names.
+} NameEntry;
+
+struct NAME_HASH {
+    NameEntry *slots;
+    int capacity; //always a power of two.
+    int count;
+};
+
+static int find_slot(NameHash *nh, const KeyName *name);
+static int find_string_slot(NameHash *nh, const char *name);
+static int free_slot(NameHash *nh, uint64_t hash);
+static int grow(NameHash *nh);
+
+NameHash *nh_create(void)
+{
+    NameHash *nh = malloc(sizeof(NameHash));
+
+    if(NULL != nh)
+    {
+        nh->capacity = FIRST_CAPACITY;
+        nh->count = 0;
+        nh->slots = calloc(nh->capacity, sizeof(NameEntry));
+        if(NULL == nh->slots)
+        {
+            free(nh);
+            nh = NULL;
+        }
+    }
+    return nh;
+}
+
+void nh_destroy(NameHash *nh)
+{
+    if(NULL != nh)
+    {
+        free(nh->slots);
+        free(nh);
+    }
+}
+
+int nh_insert(NameHash *nh, const KeyName *name, void *key)
+{
+    assert(NULL != nh);
+    assert(NULL != name);
+    assert(NULL == nh_find(nh, kn_name(name)));
+
+    if(NULL == nh || NULL == name)
+    {
+        return -1;
+    }
+
+    //keep the table at most 3/4 full so the probes stay short.
+    if(4 * (nh->count + 1) > 3 * nh->capacity && grow(nh) != 0)
+    {
+        return -1;
+    }
+
+    int slot = free_slot(nh, name->hash);
+
+    nh->slots[slot].name = name;
+    nh->slots[slot].key = key;
+    nh->slots[slot].hash = name->hash;
+    nh->count++;
+
+    return 0;
+}
+
+void *nh_find(NameHash *nh, const char *name)
+{
+    assert(NULL != nh);
+    assert(NULL != name);
+
+    if(NULL == nh || NULL == name)
+    {
+        return NULL;
+    }
+
+    int slot = find_string_slot(nh, name);
+
+    return nh->slots[slot].key;
+}
+
+int nh_remove(NameHash *nh, const KeyName *name)
+{
+    assert(NULL != nh);
+    assert(NULL != name);
+
+    if(NULL == nh || NULL == name)
+    {
+        return -1;
+    }
+
+    int mask = nh->capacity - 1;
+    int hole = find_slot(nh, name);
+    int next, home;
+
+    if(NULL == nh->slots[hole].name)
+    {
+        return -1;
+    }
+
+    //move back every entry of the run after the hole that would not end up before its home slot.
+    for(next = (hole + 1) & mask; NULL != nh->slots[next].name; next = (next + 1) & mask)
+    {
+        home = nh->slots[next].hash & mask;
+        if(((next - home) & mask) >= ((next - hole) & mask))
+        {
+            nh->slots[hole] = nh->slots[next];
+            hole = next;
+        }
+    }
+    nh->slots[hole].name = NULL;
+    nh->slots[hole].key = NULL;
+    nh->count--;
+
+    return 0;
+}
+
+int nh_count(NameHash *nh)
+{
+    assert(NULL != nh);
+    return nh->count;
+}
+
+//the slot holding "name", or the empty slot where it would go.
+static int find_slot(NameHash *nh, const KeyName *name)
+{
+    int mask = nh->capacity - 1;
+    int slot = name->hash & mask;
+
+    //kn_equal checks the hash, length and prefix before the bytes.
+    while(NULL != nh->slots[slot].name &&
+          (nh->slots[slot].hash != name->hash || !kn_equal(nh->slots[slot].name, name)))
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+//the same for a plain string, hashed the way key names are.
+static int find_string_slot(NameHash *nh, const char *name)
+{
+    uint64_t hash = kn_hash(name);
+    int length = strlen(name);
+    int mask = nh->capacity - 1;
+    int slot = hash & mask;
+
+    while(NULL != nh->slots[slot].name &&
+          (nh->slots[slot].hash != hash || nh->slots[slot].name->length != length ||
+           kn_casecmp(kn_folded(nh->slots[slot].name), name, length) != 0))
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+//the first empty slot from the hash's home slot on.
+static int free_slot(NameHash *nh, uint64_t hash)
+{
+    int mask = nh->capacity - 1;
+    int slot = hash & mask;
+
+    while(NULL != nh->slots[slot].name)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int grow(NameHash *nh)
+{
+    NameEntry *old = nh->slots;
+    int old_capacity = nh->capacity;
+    NameEntry *slots = calloc(2 * old_capacity, sizeof(NameEntry));
+    int slot;
+
+    if(NULL == slots)
+    {
+        return -1;
+    }
+
+    nh->slots = slots;
+    nh->capacity = 2 * old_capacity;
+    for(int i=0; i < old_capacity; i++)
+    {
+        if(NULL != old[i].name)
+        {
+            //the names are all different, so each goes in the first empty slot.
+            slot = free_slot(nh, old[i].hash);
+            nh->slots[slot] = old[i];
+        }
+    }
+    free(old);
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef _A5_NAMEHASH
+#define _A5_NAMEHASH
+
+#include "a5_keyname.h"
+
+// The name hash finds a file's key by its name in O(1), ignoring case like
+// the rest of IMFFS does. It is an open addressing table with linear
+// probing; removing an entry moves the ones after it back, so there are no
+// tombstones. Names are key names, so their hash is already worked out, and
+// two names are only compared byte by byte when their hash, length and
+// first 8 bytes are the same. The table only keeps pointers: the name must
+// stay valid (and unchanged) for as long as its entry is in the table.
+
+typedef struct NAME_HASH NameHash;
+
+// Create an empty table. Return NULL on error.
+NameHash *nh_create(void);
+
+// Destroy the table, freeing all memory (but not the names or keys).
+void nh_destroy(NameHash *nh);
+
+// Add the key under "name". The name must not be in the table already.
+// Return 0 on success, -1 on error (out of memory).
+int nh_insert(NameHash *nh, const KeyName *name, void *key);
+
+// Return the key saved under "name" (in any case), or NULL. The name is a
+// plain string, as the user typed it: it is hashed once, and compared with
+// the names that have the same hash and length.
+void *nh_find(NameHash *nh, const char *name);
+
+// Remove "name" from the table. Return 0 on success, -1 if it wasn't there.
+int nh_remove(NameHash *nh, const KeyName *name);
+
+// Number of names in the table.
+int nh_count(NameHash *nh);
+
+#endif
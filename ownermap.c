@@ -0,0 +1,197 @@
+/**
+ * ownermap.c
+ *
+ * PURPOSE: To know which file each block of the device belongs to, kept up
+ *          to date as files come and go instead of worked out from the index.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "a5_ownermap.h"
+
+#define FIRST_FILES 16
+
+struct OWNER_MAP {
+    uint32_t *owners; //the id of the file each block belongs to, 0 for none.
+    int *orders; //which block of its file each block is.
+    int block_count;
+    void **files; //what each id was given to; files[0] is never used.
+    uint32_t *free_ids; //ids given back, handed out again first.
+    int num_free;
+    uint32_t next_id; //the first id never handed out.
+    uint32_t capacity; //of files and free_ids.
+};
+
+static int grow_files(OwnerMap *om);
+
+OwnerMap *om_create(int block_count)
+{
+    assert(block_count >= 0);
+    OwnerMap *om = malloc(sizeof(OwnerMap));
+
+    if(NULL != om)
+    {
+        om->block_count = block_count;
+        om->owners = calloc(block_count + 1, sizeof(uint32_t));
+        om->orders = malloc((block_count + 1) * sizeof(int));
+        om->capacity = FIRST_FILES;
+        om->files = calloc(om->capacity, sizeof(void *));
+        om->free_ids = malloc(om->capacity * sizeof(uint32_t));
+        om->num_free = 0;
+        om->next_id = 1;
+
+        if(NULL == om->owners || NULL == om->orders || NULL == om->files || NULL == om->free_ids)
+        {
+            om_destroy(om);
+            om = NULL;
+        }
+        else
+        {
+            om_clear(om, 0, block_count);
+        }
+    }
+    return om;
+}
+
+void om_destroy(OwnerMap *om)
+{
+    if(NULL != om)
+    {
+        free(om->owners);
+        free(om->orders);
+        free(om->files);
+        free(om->free_ids);
+        free(om);
+    }
+}
+
+uint32_t om_add_file(OwnerMap *om, void *file)
+{
+    assert(NULL != om);
+    assert(NULL != file);
+    uint32_t id;
+
+    if(om->num_free > 0)
+    {
+        om->num_free--;
+        id = om->free_ids[om->num_free];
+    }
+    else
+    {
+        if(om->next_id == om->capacity && grow_files(om) != 0)
+        {
+            return 0;
+        }
+        id = om->next_id;
+        om->next_id++;
+    }
+    om->files[id] = file;
+
+    return id;
+}
+
+void om_remove_file(OwnerMap *om, uint32_t id)
+{
+    assert(NULL != om);
+    assert(id > 0 && id < om->next_id);
+    assert(NULL != om->files[id]);
+
+    om->files[id] = NULL;
+    //there is room: every id handed out has a place in free_ids.
+    om->free_ids[om->num_free] = id;
+    om->num_free++;
+}
+
+void om_replace_file(OwnerMap *om, uint32_t id, void *file)
+{
+    assert(NULL != om);
+    assert(NULL != file);
+    assert(NULL != om_file(om, id));
+
+    om->files[id] = file;
+}
+
+void *om_file(OwnerMap *om, uint32_t id)
+{
+    assert(NULL != om);
+    return (id < om->next_id) ? om->files[id] : NULL;
+}
+
+void om_set(OwnerMap *om, int start, int blocks, uint32_t id, int first_order)
+{
+    assert(NULL != om);
+    assert(start >= 0 && blocks >= 0 && start + blocks <= om->block_count);
+    assert(NULL != om_file(om, id));
+
+    for(int i=0; i < blocks; i++)
+    {
+        om->owners[start + i] = id;
+        om->orders[start + i] = first_order + i;
+    }
+}
+
+void om_clear(OwnerMap *om, int start, int blocks)
+{
+    assert(NULL != om);
+    assert(start >= 0 && blocks >= 0 && start + blocks <= om->block_count);
+
+    for(int i=start; i < start + blocks; i++)
+    {
+        om->owners[i] = 0;
+        om->orders[i] = -1;
+    }
+}
+
+uint32_t om_owner(OwnerMap *om, int block)
+{
+    assert(NULL != om);
+    return (block >= 0 && block < om->block_count) ? om->owners[block] : 0;
+}
+
+int om_order(OwnerMap *om, int block)
+{
+    assert(NULL != om);
+    return (block >= 0 && block < om->block_count) ? om->orders[block] : -1;
+}
+
+uint32_t *om_owners(OwnerMap *om)
+{
+    assert(NULL != om);
+    return om->owners;
+}
+
+int *om_orders(OwnerMap *om)
+{
+    assert(NULL != om);
+    return om->orders;
+}
+
+static int grow_files(OwnerMap *om)
+{
+    uint32_t capacity = 2 * om->capacity;
+    void **files = realloc(om->files, capacity * sizeof(void *));
+
+    if(NULL == files)
+    {
+        return -1;
+    }
+    om->files = files;
+
+    uint32_t *free_ids = realloc(om->free_ids, capacity * sizeof(uint32_t));
+    if(NULL == free_ids)
+    {
+        //files is only bigger than it needs to be, which is fine.
+        return -1;
+    }
+    om->free_ids = free_ids;
+
+    for(uint32_t i=om->capacity; i < capacity; i++)
+    {
+        om->files[i] = NULL;
+    }
+    om->capacity = capacity;
+
+    return 0;
+}
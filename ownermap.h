@@ -0,0 +1,52 @@
+#ifndef _A5_OWNERMAP
+#define _A5_OWNERMAP
+
+#include <stdint.h>
+
+// The owner map answers "which file has block b" without going through the
+// index. Files are known by small ids handed out by the map (reused once a
+// file is gone, 0 is never one), and every block keeps the id of its file,
+// or 0 when no file has it, and which of the file's blocks it is.
+// The map doesn't lock: the caller does.
+
+typedef struct OWNER_MAP OwnerMap;
+
+// Create a map for block_count blocks, all of them without a file.
+// Return NULL on error.
+OwnerMap *om_create(int block_count);
+
+// Destroy the map, freeing all memory (but not the files).
+void om_destroy(OwnerMap *om);
+
+// Give the file an id. Return the id, or 0 if memory runs out.
+uint32_t om_add_file(OwnerMap *om, void *file);
+
+// Take the id back so it can be given out again. Its blocks must have been
+// cleared already.
+void om_remove_file(OwnerMap *om, uint32_t id);
+
+// Give the id (and so its blocks) to a new file in place of the one it has,
+// for when a file is moved to new memory.
+void om_replace_file(OwnerMap *om, uint32_t id, void *file);
+
+// What the id was given to, or NULL.
+void *om_file(OwnerMap *om, uint32_t id);
+
+// Give the run [start, start+blocks) to the file with the id, as its blocks
+// first_order, first_order+1...
+void om_set(OwnerMap *om, int start, int blocks, uint32_t id, int first_order);
+
+// Mark the run [start, start+blocks) as having no file.
+void om_clear(OwnerMap *om, int start, int blocks);
+
+// The id of the file that has the block (0 if none), and which of its blocks
+// it is (-1 if none, or if the block doesn't exist).
+uint32_t om_owner(OwnerMap *om, int block);
+int om_order(OwnerMap *om, int block);
+
+// The arrays behind om_owner and om_order, one entry per block, for going
+// through (or moving) many blocks at once, like defrag does.
+uint32_t *om_owners(OwnerMap *om);
+int *om_orders(OwnerMap *om);
+
+#endif
@@ -5,6 +5,7 @@
 
 #include "a5_tests.h"
 #include "a5_multimap.h"
+#include "a5_multimap_typed.h"
 
 /*** Comparison functions for keys and values ***/
 
@@ -49,6 +50,31 @@ static int compare_always_less(void *a, void *b) {
   return -1;
 }
 
+// For mm_freeze: in key order, negative keys first, and sixteen keys in a
+// row share a fingerprint, so the search has to finish on the keys.
+static uint64_t coarse_print(void *key) {
+  return ((uint64_t)*(int *)key + 0x80000000u) >> 4;
+}
+
+/*** Running out of memory ***/
+
+// The multimap tests are linked with -Wl,--wrap=malloc, so every malloc in
+// the multimap comes here first: Allocs_Left of them succeed, then they all
+// fail. -1 means none fail.
+static int Allocs_Left = -1;
+
+void *__real_malloc(size_t size);
+
+void *__wrap_malloc(size_t size) {
+  if (0 == Allocs_Left) {
+    return NULL;
+  }
+  if (Allocs_Left > 0) {
+    Allocs_Left--;
+  }
+  return __real_malloc(size);
+}
+
 /*** Example tests based on assignment 3 ***/
 
 void test_example() {
@@ -478,6 +504,7 @@ void test_invalid()
   VERIFY_INT(-1, mm_remove_key(mm, NULL));
 
   VERIFY_INT(-1, mm_destroy(NULL));
+  VERIFY_INT(-1, mm_reclaim(NULL));
 
   // make sure none of this put us in a bad state
   VERIFY_INT(1, mm_count_keys(mm));
@@ -609,6 +636,68 @@ void test_get_move() {
   VERIFY_INT(0, mm_get_next_key(mm, &key));
 
   VERIFY_INT(10, mm_destroy(mm));
+
+  // a key added where the last one returned was removed comes next
+  VERIFY_NOT_NULL(mm = mm_create(10, void_strcasecmp, compare_values_num_part));
+  VERIFY_INT(1, mm_insert_value(mm, "abc", 0, ""));
+  VERIFY_INT(1, mm_insert_value(mm, "def", 0, ""));
+  VERIFY_INT(1, mm_insert_value(mm, "ghi", 0, ""));
+  VERIFY_INT(1, mm_get_first_key(mm, &key));
+  VERIFY_INT(1, mm_get_next_key(mm, &key));
+  VERIFY_STR("def", key);
+  VERIFY_INT(1, mm_remove_key(mm, "def"));
+  VERIFY_INT(1, mm_insert_value(mm, "aaa", 0, ""));
+  VERIFY_INT(1, mm_insert_value(mm, "deb", 0, ""));
+  VERIFY_INT(1, mm_get_next_key(mm, &key));
+  VERIFY_STR("deb", key);
+  VERIFY_INT(1, mm_remove_key(mm, "abc"));
+  VERIFY_INT(1, mm_remove_key(mm, "deb"));
+  VERIFY_INT(1, mm_insert_value(mm, "abd", 0, ""));
+  VERIFY_INT(1, mm_get_next_key(mm, &key));
+  VERIFY_STR("abd", key);
+  VERIFY_INT(1, mm_get_next_key(mm, &key));
+  VERIFY_STR("ghi", key);
+  VERIFY_INT(0, mm_get_next_key(mm, &key));
+
+  VERIFY_INT(6, mm_destroy(mm));
+}
+
+void test_reclaim() {
+  Multimap *mm;
+  static int numbers[10];
+  void *key;
+
+  printf("\n*** Reclaiming removed keys during get:\n\n");
+
+  VERIFY_NOT_NULL(mm = mm_create(10, compare_ints, compare_values_num_part));
+  for (int i = 0; i < 10; i++) {
+    numbers[i] = i;
+    mm_insert_value(mm, &numbers[i], i, "x");
+  }
+  mm_get_first_key(mm, &key);
+  for (int i = 0; i < 3; i++) {
+    mm_get_next_key(mm, &key);
+  }
+  VERIFY_INT(3, *(int *)key);
+
+  // the traversal goes on after the key it was on is removed and freed
+  for (int i = 3; i < 6; i++) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  VERIFY_INT(1, mm_reclaim(mm) >= 0);
+  VERIFY_INT(1, mm_get_next_key(mm, &key));
+  VERIFY_INT(6, *(int *)key);
+
+  // and ends if there are no keys after it
+  for (int i = 6; i < 10; i++) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  VERIFY_INT(1, mm_reclaim(mm) >= 0);
+  VERIFY_INT(0, mm_get_next_key(mm, &key));
+  VERIFY_INT(3, mm_count_keys(mm));
+  VERIFY_INT(1, mm_count_values(mm, &numbers[2]));
+  VERIFY_INT(0, mm_reclaim(mm));
+  VERIFY_INT(6, mm_destroy(mm));
 }
 
 void test_get_multiple() {
@@ -642,9 +731,247 @@ void test_get_multiple() {
   VERIFY_INT(6, mm_destroy(mm2));
 }
 
+// adds up the keys and values, and stops after *arg keys when *arg isn't 0.
+static int sum_keys[2];
+static int visit_sum(void *key, int num_values, void *arg) {
+  sum_keys[0] += *(int *)key;
+  sum_keys[1] += num_values;
+  return (*(int *)arg != 0 && *(int *)key + 1 >= *(int *)arg);
+}
+
+// adds up the values and the pointers to them, and stops at the value numbered *arg.
+static long sum_values[2];
+static int visit_value(const Value *value, void *arg) {
+  sum_values[0] += value->num;
+  sum_values[1] += *(int *)value->data;
+  return value->num == *(int *)arg;
+}
+
+void test_for_each_value() {
+  Multimap *mm;
+  static int numbers[100];
+  int key = 7, missing = 8;
+  int stop = -1;
+  Value values[100];
+  int same = 1;
+
+  printf("\n*** Visiting values in place:\n\n");
+
+  VERIFY_NOT_NULL(mm = mm_create(10, compare_ints, compare_values_num_part));
+  for (int i = 99; i >= 0; i--) {
+    numbers[i] = 2 * i;
+    VERIFY_INT(100 - i, mm_insert_value(mm, &key, i, &numbers[i]));
+  }
+
+  // every value, in order, is the multimap's own.
+  VERIFY_INT(100, mm_for_each_value(mm, &key, visit_value, &stop));
+  VERIFY_INT(4950, sum_values[0]);
+  VERIFY_INT(9900, sum_values[1]);
+  VERIFY_INT(100, mm_get_values(mm, &key, values, 100));
+  for (int i = 0; i < 100; i++) {
+    if (values[i].num != i || values[i].data != &numbers[i]) {
+      same = 0;
+    }
+  }
+  VERIFY_INT(1, same);
+
+  // stopping early, on the first (inline) value and further down the list.
+  stop = 0;
+  sum_values[0] = 0;
+  VERIFY_INT(1, mm_for_each_value(mm, &key, visit_value, &stop));
+  VERIFY_INT(0, sum_values[0]);
+  stop = 9;
+  VERIFY_INT(10, mm_for_each_value(mm, &key, visit_value, &stop));
+  VERIFY_INT(45, sum_values[0]);
+
+  VERIFY_INT(0, mm_for_each_value(mm, &missing, visit_value, &stop));
+  VERIFY_INT(101, mm_destroy(mm));
+}
+
+void test_rekey() {
+  Multimap *mm;
+  static int numbers[300], renamed[300];
+  int same, missing = -1;
+  MMCursor cursor;
+  void *key;
+  Value values[2];
+  int in_order = 1, ours = 1, kept = 1;
+  int last = -1;
+
+  printf("\n*** Rekeying:\n\n");
+
+  // even keys become odd ones all over the order, and keep their values.
+  VERIFY_NOT_NULL(mm = mm_create(300, compare_ints, compare_values_num_part));
+  for (int i = 0; i < 300; i++) {
+    numbers[i] = 2 * i;
+    mm_insert_value(mm, &numbers[i], i, "x");
+    if (i % 3 == 0) {
+      mm_insert_value(mm, &numbers[i], i + 1000, "y");
+    }
+  }
+  VERIFY_INT(1, mm_get_first_key(mm, &key));
+  for (int i = 0; i < 300; i++) {
+    renamed[i] = 2 * ((i * 7) % 300) + 1;
+    if (mm_rekey(mm, &numbers[i], &renamed[i]) != ((i % 3 == 0) ? 2 : 1)) {
+      kept = 0;
+    }
+  }
+  VERIFY_INT(1, kept);
+  VERIFY_INT(300, mm_count_keys(mm));
+  VERIFY_INT(0, mm_count_values(mm, &numbers[5]));
+  if (mm_get_first_key(mm, &key) > 0) {
+    do {
+      if (*(int *)key <= last) {
+        in_order = 0;
+      }
+      if ((int *)key < renamed || (int *)key >= renamed + 300) {
+        ours = 0;
+      }
+      last = *(int *)key;
+    } while (mm_get_next_key(mm, &key) > 0);
+  }
+  VERIFY_INT(1, in_order);
+  VERIFY_INT(1, ours);
+  for (int i = 0; i < 300; i++) {
+    int count = mm_get_values(mm, &renamed[i], values, 2);
+    if (count != ((i % 3 == 0) ? 2 : 1) || values[0].num != i || (count == 2 && values[1].num != i + 1000)) {
+      kept = 0;
+    }
+  }
+  VERIFY_INT(1, kept);
+
+  // to an equal key: it stays, but the multimap now holds the new one.
+  same = renamed[10];
+  VERIFY_INT(1, mm_rekey(mm, &renamed[10], &same));
+  VERIFY_INT(1, mm_lower_bound(mm, &cursor, &renamed[10], &key));
+  VERIFY_INT(1, key == &same);
+
+  // not there, or already there.
+  VERIFY_INT(0, mm_rekey(mm, &missing, &numbers[0]));
+  VERIFY_INT(-1, mm_rekey(mm, &renamed[0], &renamed[1]));
+  VERIFY_INT(2, mm_count_values(mm, &renamed[0]));
+
+  // a full multimap can still rekey.
+  VERIFY_INT(300, mm_count_keys(mm));
+  VERIFY_INT(2, mm_rekey(mm, &renamed[0], &missing));
+  VERIFY_INT(2, mm_count_values(mm, &missing));
+  VERIFY_INT(700, mm_destroy(mm));
+}
+
+void test_cursor() {
+  Multimap *mm;
+  MMCursor c1, c2;
+  void *key1, *key2, *key;
+  static int numbers[300];
+  int stop = 0;
+  int in_order = 1;
+
+  printf("\n*** Cursors and foreach:\n\n");
+
+  VERIFY_NOT_NULL(mm = mm_create(300, compare_ints, compare_values_num_part));
+  VERIFY_INT(0, mm_cursor_first(mm, &c1, &key1));
+  VERIFY_INT(-1, mm_cursor_next(mm, &c1, &key1));
+  VERIFY_INT(0, mm_foreach(mm, visit_sum, &stop));
+
+  for (int i = 0; i < 300; i++) {
+    numbers[i] = i;
+    mm_insert_value(mm, &numbers[i], 0, "x");
+    if (i % 3 == 0) {
+      mm_insert_value(mm, &numbers[i], 1, "y");
+    }
+  }
+
+  // two cursors go through the keys at their own pace
+  VERIFY_INT(1, mm_cursor_first(mm, &c1, &key1));
+  VERIFY_INT(1, mm_cursor_first(mm, &c2, &key2));
+  VERIFY_INT(0, *(int *)key1);
+  for (int i = 1; i < 300; i++) {
+    in_order = in_order && mm_cursor_next(mm, &c1, &key1) == 1 && *(int *)key1 == i;
+    if (i % 2 == 0) {
+      in_order = in_order && mm_cursor_next(mm, &c2, &key2) == 1 && *(int *)key2 == i / 2;
+    }
+  }
+  VERIFY_INT(1, in_order);
+  VERIFY_INT(0, mm_cursor_next(mm, &c1, &key1));
+  VERIFY_INT(-1, mm_cursor_next(mm, &c1, &key1));
+  VERIFY_INT(1, mm_cursor_next(mm, &c2, &key2));
+  VERIFY_INT(150, *(int *)key2);
+
+  // and they don't move the mm_get_next_key traversal
+  VERIFY_INT(1, mm_get_first_key(mm, &key));
+  VERIFY_INT(1, mm_cursor_first(mm, &c1, &key1));
+  VERIFY_INT(1, mm_cursor_next(mm, &c1, &key1));
+  VERIFY_INT(1, mm_get_next_key(mm, &key));
+  VERIFY_INT(1, *(int *)key);
+
+  sum_keys[0] = sum_keys[1] = 0;
+  VERIFY_INT(300, mm_foreach(mm, visit_sum, &stop));
+  VERIFY_INT(299 * 300 / 2, sum_keys[0]);
+  VERIFY_INT(400, sum_keys[1]);
+
+  // a callback returning non-zero stops the walk
+  sum_keys[0] = sum_keys[1] = 0;
+  stop = 10;
+  VERIFY_INT(10, mm_foreach(mm, visit_sum, &stop));
+  VERIFY_INT(45, sum_keys[0]);
+  VERIFY_INT(14, sum_keys[1]);
+
+  VERIFY_INT(700, mm_destroy(mm));
+}
+
+void test_lower_bound() {
+  Multimap *mm;
+  MMCursor cursor;
+  void *key;
+  static int numbers[300];
+  int probe;
+  int right = 0;
+
+  printf("\n*** Lower bound:\n\n");
+
+  VERIFY_NOT_NULL(mm = mm_create(300, compare_ints, compare_values_num_part));
+  probe = 5;
+  VERIFY_INT(0, mm_lower_bound(mm, &cursor, &probe, &key));
+  VERIFY_INT(-1, mm_cursor_next(mm, &cursor, &key));
+
+  // the even numbers, so every odd one falls between two keys
+  for (int i = 0; i < 300; i++) {
+    numbers[i] = 2 * i;
+    mm_insert_value(mm, &numbers[i], 0, "x");
+  }
+
+  for (probe = -1; probe < 599; probe++) {
+    if (mm_lower_bound(mm, &cursor, &probe, &key) == 1 && *(int *)key == (probe + 1) / 2 * 2) {
+      // and the cursor goes on from there
+      if (probe >= 597 ? mm_cursor_next(mm, &cursor, &key) == 0
+                       : mm_cursor_next(mm, &cursor, &key) == 1 && *(int *)key == (probe + 1) / 2 * 2 + 2) {
+        right++;
+      }
+    }
+  }
+  VERIFY_INT(600, right);
+
+  probe = 599;
+  VERIFY_INT(0, mm_lower_bound(mm, &cursor, &probe, &key));
+  VERIFY_INT(-1, mm_cursor_next(mm, &cursor, &key));
+
+  // a range: the keys from 100 up to (not including) 120
+  right = 0;
+  probe = 100;
+  for (int more = mm_lower_bound(mm, &cursor, &probe, &key); more > 0 && *(int *)key < 120;
+       more = mm_cursor_next(mm, &cursor, &key)) {
+    right++;
+  }
+  VERIFY_INT(10, right);
+
+  VERIFY_INT(600, mm_destroy(mm));
+}
+
 void test_get_invalid() {
   Multimap *mm;
   void *key;
+  MMPoolStats stats;
+  MMCursor cursor;
 
   printf("\n*** Invalid case tests for get:\n\n");
 
@@ -658,6 +985,30 @@ void test_get_invalid() {
   VERIFY_INT(1, mm_get_first_key(mm, &key));
   VERIFY_INT(-1, mm_get_next_key(NULL, &key));
   VERIFY_INT(-1, mm_get_next_key(mm, NULL));
+  VERIFY_INT(-1, mm_pool_stats(NULL, &stats));
+  VERIFY_INT(-1, mm_pool_stats(mm, NULL));
+  VERIFY_INT(-1, mm_cursor_first(NULL, &cursor, &key));
+  VERIFY_INT(-1, mm_cursor_first(mm, NULL, &key));
+  VERIFY_INT(-1, mm_cursor_first(mm, &cursor, NULL));
+  VERIFY_INT(1, mm_cursor_first(mm, &cursor, &key));
+  VERIFY_INT(-1, mm_cursor_next(NULL, &cursor, &key));
+  VERIFY_INT(-1, mm_cursor_next(mm, NULL, &key));
+  VERIFY_INT(-1, mm_cursor_next(mm, &cursor, NULL));
+  VERIFY_INT(-1, mm_lower_bound(NULL, &cursor, "", &key));
+  VERIFY_INT(-1, mm_lower_bound(mm, NULL, "", &key));
+  VERIFY_INT(-1, mm_lower_bound(mm, &cursor, NULL, &key));
+  VERIFY_INT(-1, mm_lower_bound(mm, &cursor, "", NULL));
+  VERIFY_INT(-1, mm_foreach(NULL, visit_sum, &cursor));
+  VERIFY_INT(-1, mm_foreach(mm, NULL, NULL));
+  VERIFY_INT(-1, mm_for_each_value(NULL, "", visit_value, &cursor));
+  VERIFY_INT(-1, mm_for_each_value(mm, NULL, visit_value, &cursor));
+  VERIFY_INT(-1, mm_for_each_value(mm, "", NULL, NULL));
+  VERIFY_INT(-1, mm_rekey(NULL, "", " "));
+  VERIFY_INT(-1, mm_rekey(mm, NULL, " "));
+  VERIFY_INT(-1, mm_rekey(mm, "", NULL));
+  VERIFY_INT(-1, mm_freeze(NULL, coarse_print));
+  VERIFY_INT(-1, mm_freeze(mm, NULL));
+  VERIFY_INT(-1, mm_frozen(NULL));
   VERIFY_INT(1, mm_get_next_key(mm, &key));
   VERIFY_INT(0, mm_get_next_key(mm, &key));
   VERIFY_INT(-1, mm_get_next_key(mm, &key));
@@ -665,6 +1016,565 @@ void test_get_invalid() {
   VERIFY_INT(4, mm_destroy(mm));
 }
 
+void test_value_order()
+{
+  Multimap *mm;
+  Value arr[8];
+  int nums[] = {5, 9, 1, 7, 3, 10, 0};
+  int sorted = 1;
+
+  printf("\n*** Values added at the front, middle and end:\n\n");
+
+  VERIFY_NOT_NULL(mm = mm_create(1, void_strcasecmp, compare_values_num_part));
+  for (int i = 0; i < 7; i++) {
+    VERIFY_INT(i + 1, mm_insert_value(mm, "k", nums[i], "v"));
+  }
+  VERIFY_INT(7, mm_get_values(mm, "k", arr, 8));
+  for (int i = 1; i < 7; i++) {
+    if (arr[i - 1].num >= arr[i].num) {
+      sorted = 0;
+    }
+  }
+  VERIFY_INT(1, sorted);
+  VERIFY_INT(0, arr[0].num);
+  VERIFY_INT(10, arr[6].num);
+
+  // after removing the key it starts over with a single inline value.
+  VERIFY_INT(7, mm_remove_key(mm, "k"));
+  VERIFY_INT(1, mm_insert_value(mm, "k", 4, "v"));
+  VERIFY_INT(2, mm_insert_value(mm, "k", 8, "v"));
+  VERIFY_INT(3, mm_destroy(mm));
+}
+
+void test_pool()
+{
+  Multimap *mm;
+  MMPoolStats stats;
+  static int numbers[100];
+
+  printf("\n*** Value node slabs:\n\n");
+
+  VERIFY_NOT_NULL(mm = mm_create(100, compare_ints, compare_values_num_part));
+  VERIFY_INT(0, mm_pool_stats(mm, &stats));
+  VERIFY_INT(0, stats.slabs);
+
+  // the first value of a key needs no node
+  for (int i = 0; i < 100; i++) {
+    numbers[i] = i;
+    mm_insert_value(mm, &numbers[i], 0, "x");
+  }
+  mm_pool_stats(mm, &stats);
+  VERIFY_INT(0, stats.slabs);
+  VERIFY_INT(0, stats.nodes_in_use);
+
+  // the others share slabs
+  for (int i = 0; i < 100; i++) {
+    mm_insert_value(mm, &numbers[i], 1, "x");
+    mm_insert_value(mm, &numbers[i], 2, "x");
+  }
+  mm_pool_stats(mm, &stats);
+  VERIFY_INT(200, stats.nodes_in_use);
+  VERIFY_INT(1, stats.slabs > 1 && stats.slabs < 10);
+  int slabs = stats.slabs;
+
+  // removed nodes are reused before any new slab is made
+  for (int i = 0; i < 50; i++) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  // (the skiplist takes them back here, the others as the keys go)
+  mm_reclaim(mm);
+  mm_pool_stats(mm, &stats);
+  VERIFY_INT(100, stats.nodes_in_use);
+  VERIFY_INT(slabs, stats.slabs);
+  for (int i = 0; i < 50; i++) {
+    mm_insert_value(mm, &numbers[i], 0, "x");
+    mm_insert_value(mm, &numbers[i], 1, "x");
+    mm_insert_value(mm, &numbers[i], 2, "x");
+  }
+  mm_pool_stats(mm, &stats);
+  VERIFY_INT(200, stats.nodes_in_use);
+  VERIFY_INT(slabs, stats.slabs);
+
+  VERIFY_INT(400, mm_destroy(mm));
+}
+
+void test_bulk_load()
+{
+  Multimap *mm;
+  static int numbers[1000];
+  static MMEntry entries[1000];
+  Value values[3] = {{2, "b"}, {1, "a"}, {3, "c"}};
+  Value arr[4];
+  void *key;
+  int in_order = 1;
+  int last = -1;
+
+  printf("\n*** Bulk loading:\n\n");
+
+  // out of order, and "two" given twice
+  MMEntry few[] = {{"two", 1, &values[0]}, {"one", 1, &values[1]}, {"three", 1, &values[2]}, {"TWO", 2, &values[1]}};
+  VERIFY_NOT_NULL(mm = mm_bulk_load(3, void_strcasecmp, compare_values_num_part, few, 4, 0));
+  VERIFY_INT(3, mm_count_keys(mm));
+  VERIFY_INT(3, mm_get_values(mm, "two", arr, 4));
+  VERIFY_INT(1, arr[0].num);
+  VERIFY_INT(2, arr[1].num);
+  VERIFY_INT(3, arr[2].num);
+  VERIFY_INT(1, mm_get_first_key(mm, &key));
+  VERIFY_STR("one", key);
+  // the map works as usual after
+  VERIFY_INT(-1, mm_insert_value(mm, "four", 4, "d")); // full
+  VERIFY_INT(3, mm_remove_key(mm, "two"));
+  VERIFY_INT(1, mm_insert_value(mm, "four", 4, "d"));
+  VERIFY_INT(6, mm_destroy(mm));
+
+  // too many keys for max_keys
+  VERIFY_NULL(mm_bulk_load(2, void_strcasecmp, compare_values_num_part, few, 4, 0));
+
+  VERIFY_NOT_NULL(mm = mm_bulk_load(5, void_strcasecmp, compare_values_num_part, few, 0, 1));
+  VERIFY_INT(0, mm_count_keys(mm));
+  VERIFY_INT(0, mm_destroy(mm));
+
+  // enough keys for several levels, given in a scrambled order
+  for (int i = 0; i < 1000; i++) {
+    numbers[i] = (i * 7) % 1000;
+    entries[i].key = &numbers[i];
+    entries[i].num_values = 1;
+    entries[i].values = &values[i % 3];
+  }
+  VERIFY_NOT_NULL(mm = mm_bulk_load(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part, entries, 1000, 0));
+  VERIFY_INT(1000, mm_count_keys(mm));
+  if (mm_get_first_key(mm, &key) > 0) {
+    do {
+      if (*(int *)key != last + 1) {
+        in_order = 0;
+      }
+      last = *(int *)key;
+    } while (mm_get_next_key(mm, &key) > 0);
+  }
+  VERIFY_INT(1, in_order);
+  VERIFY_INT(999, last);
+  for (int i = 0; i < 1000; i += 2) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  VERIFY_INT(500, mm_count_keys(mm));
+  VERIFY_INT(1000, mm_destroy(mm));
+}
+
+void test_grow()
+{
+  Multimap *mm;
+  static int numbers[1000];
+  void *key;
+  int in_order = 1;
+  int last = -1;
+
+  printf("\n*** Growing and shrinking:\n\n");
+
+  // a cap bigger than the first room still holds, after growing.
+  VERIFY_NOT_NULL(mm = mm_create(20, compare_ints, compare_values_num_part));
+  for (int i = 0; i < 20; i++) {
+    numbers[i] = i;
+    VERIFY_INT(1, mm_insert_value(mm, &numbers[i], i, "x"));
+  }
+  numbers[20] = 20;
+  VERIFY_INT(-1, mm_insert_value(mm, &numbers[20], 20, "x")); // full
+  VERIFY_INT(20, mm_count_keys(mm));
+  VERIFY_INT(40, mm_destroy(mm));
+
+  // no cap, keys added backwards so each goes in front.
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  for (int i = 999; i >= 0; i--) {
+    numbers[i] = i;
+    mm_insert_value(mm, &numbers[i], i, "x");
+  }
+  VERIFY_INT(1000, mm_count_keys(mm));
+
+  // removing most of them shrinks the room, the rest stay in order.
+  for (int i = 0; i < 1000; i++) {
+    if (i % 100 != 0) {
+      mm_remove_key(mm, &numbers[i]);
+    }
+  }
+  VERIFY_INT(10, mm_count_keys(mm));
+  if (mm_get_first_key(mm, &key) > 0) {
+    do {
+      if (*(int *)key <= last) {
+        in_order = 0;
+      }
+      last = *(int *)key;
+    } while (mm_get_next_key(mm, &key) > 0);
+  }
+  VERIFY_INT(1, in_order);
+  VERIFY_INT(900, last);
+  VERIFY_INT(1, mm_count_values(mm, &numbers[500]));
+  VERIFY_INT(20, mm_destroy(mm));
+}
+
+/*** The typed multimap ***/
+
+typedef struct NAME { char text[12]; } Name;
+
+static inline int compare_names(Name a, Name b) {
+  return strcmp(a.text, b.text);
+}
+
+DEFINE_MULTIMAP_ORDERED(IntMap, int, int, MM_COMPARE_NUMBERS, MM_COMPARE_NUMBERS)
+DEFINE_MULTIMAP(NameMap, Name, double, compare_names)
+
+void test_typed()
+{
+  Multimap *mm;
+  IntMap *im;
+  NameMap *nm;
+  static int keys[4000];
+  Value generic[20];
+  int typed[20];
+  Name name;
+  double sizes[4];
+  int same = 1;
+  int in_order = 1;
+
+  printf("\n*** Typed multimap:\n\n");
+
+  // the same random inserts and removes on both, which should agree all along.
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  VERIFY_NOT_NULL(im = IntMap_create(MM_NO_MAX_KEYS));
+  srand(20);
+  for (int i = 0; i < 4000; i++) {
+    keys[i] = rand() % 500;
+    if (i % 7 == 6) {
+      if (mm_remove_key(mm, &keys[i]) != IntMap_remove_key(im, keys[i])) {
+        same = 0;
+      }
+    } else if (mm_insert_value(mm, &keys[i], i, "x") != IntMap_insert(im, keys[i], i)) {
+      same = 0;
+    }
+  }
+  VERIFY_INT(1, same);
+  VERIFY_INT(mm_count_keys(mm), IntMap_count_keys(im));
+  for (int k = 0; k < 500; k++) {
+    int count = mm_get_values(mm, &k, generic, 20);
+    if (count != IntMap_get_values(im, k, typed, 20) || count != IntMap_count_values(im, k)) {
+      same = 0;
+    }
+    for (int j = 0; j < count; j++) {
+      if (generic[j].num != typed[j]) {
+        same = 0;
+      }
+    }
+  }
+  VERIFY_INT(1, same);
+  for (int pos = 1; pos < IntMap_count_keys(im); pos++) {
+    if (IntMap_key_at(im, pos - 1) >= IntMap_key_at(im, pos)) {
+      in_order = 0;
+    }
+  }
+  VERIFY_INT(1, in_order);
+  VERIFY_INT(0, IntMap_lower_bound(im, -1));
+  VERIFY_INT(IntMap_count_keys(im), IntMap_lower_bound(im, 500));
+  VERIFY_INT(mm_destroy(mm), IntMap_destroy(im));
+
+  // keys by value: the map has its own copy of the name.
+  VERIFY_NOT_NULL(nm = NameMap_create(2));
+  strcpy(name.text, "b.txt");
+  VERIFY_INT(1, NameMap_insert(nm, name, 3.5));
+  VERIFY_INT(2, NameMap_insert(nm, name, 1.5)); // insertion order, not value order
+  strcpy(name.text, "a.txt");
+  VERIFY_INT(1, NameMap_insert(nm, name, 2.0));
+  strcpy(name.text, "c.txt");
+  VERIFY_INT(-1, NameMap_insert(nm, name, 2.0)); // full
+  VERIFY_INT(0, strcmp("a.txt", NameMap_key_at(nm, 0).text));
+  strcpy(name.text, "b.txt");
+  VERIFY_INT(1, NameMap_lower_bound(nm, name));
+  VERIFY_INT(2, NameMap_get_values(nm, name, sizes, 4));
+  VERIFY_INT(1, 3.5 == sizes[0] && 1.5 == sizes[1]);
+  VERIFY_INT(2, NameMap_remove_key(nm, name));
+  VERIFY_INT(0, NameMap_count_values(nm, name));
+  VERIFY_INT(1, NameMap_count_keys(nm));
+  VERIFY_INT(2, NameMap_destroy(nm));
+}
+
+// checks the keys are in order, and counts them, with a cursor and with the traversal.
+static int keys_in_order(Multimap *mm, int *count) {
+  MMCursor cursor;
+  void *key, *key2;
+  int in_order = 1, last = -1;
+
+  *count = 0;
+  if (mm_cursor_first(mm, &cursor, &key) > 0 && mm_get_first_key(mm, &key2) > 0) {
+    do {
+      if (*(int *)key <= last || key != key2) {
+        in_order = 0;
+      }
+      last = *(int *)key;
+      (*count)++;
+    } while (mm_cursor_next(mm, &cursor, &key) > 0 && mm_get_next_key(mm, &key2) > 0);
+  }
+  return in_order;
+}
+
+void test_tombstones()
+{
+  Multimap *mm;
+  static int numbers[1000];
+  void *key;
+  MMCursor cursor;
+  int count, visited = 0, right = 1;
+
+  printf("\n*** Removing in runs, and adding back:\n\n");
+
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  for (int i = 0; i < 1000; i++) {
+    numbers[i] = i;
+    mm_insert_value(mm, &numbers[i], i, "x");
+  }
+
+  // a run removed backwards, one forwards, and every third key of the rest.
+  for (int i = 600; i > 400; i--) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  for (int i = 200; i <= 400; i++) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  for (int i = 0; i < 1000; i += 3) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  VERIFY_INT(1, keys_in_order(mm, &count));
+  VERIFY_INT(mm_count_keys(mm), count);
+  VERIFY_INT(0, mm_count_values(mm, &numbers[300]));
+  VERIFY_INT(0, mm_count_values(mm, &numbers[999]));
+  VERIFY_INT(1, mm_count_values(mm, &numbers[998]));
+  VERIFY_INT(1, mm_lower_bound(mm, &cursor, &numbers[200], &key));
+  VERIFY_INT(601, *(int *)key);
+  VERIFY_INT(1, mm_cursor_next(mm, &cursor, &key));
+  VERIFY_INT(602, *(int *)key);
+
+  // all of them back, in an order that mixes the runs.
+  for (int i = 0; i < 1000; i++) {
+    int k = (i * 7) % 1000;
+    if (mm_count_values(mm, &numbers[k]) == 0 && mm_insert_value(mm, &numbers[k], k, "x") != 1) {
+      right = 0;
+    }
+  }
+  VERIFY_INT(1, right);
+  VERIFY_INT(1, keys_in_order(mm, &count));
+  VERIFY_INT(1000, count);
+
+  // removing keys as the traversal goes still visits every key once.
+  if (mm_get_first_key(mm, &key) > 0) {
+    do {
+      if (*(int *)key != visited) {
+        right = 0;
+      }
+      visited++;
+      if (*(int *)key % 2 == 0 || *(int *)key > 500) {
+        mm_remove_key(mm, key);
+      }
+    } while (mm_get_next_key(mm, &key) > 0);
+  }
+  VERIFY_INT(1, right);
+  VERIFY_INT(1000, visited);
+  VERIFY_INT(1, keys_in_order(mm, &count));
+  VERIFY_INT(250, count);
+
+  // and from the front, until there are none.
+  while (mm_get_first_key(mm, &key) > 0) {
+    mm_remove_key(mm, key);
+  }
+  VERIFY_INT(0, mm_count_keys(mm));
+  VERIFY_INT(1, mm_insert_value(mm, &numbers[5], 5, "x"));
+  VERIFY_INT(2, mm_destroy(mm));
+}
+
+void test_remove_backwards()
+{
+  Multimap *mm;
+  static int numbers[4000];
+  void *key;
+  MMCursor cursor;
+  int count, right = 1;
+
+  printf("\n*** Removing the middle keys backwards:\n\n");
+
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  for (int i = 0; i < 4000; i++) {
+    numbers[i] = i;
+    mm_insert_value(mm, &numbers[i], i, "x");
+  }
+
+  // half of them from the middle, last first, with a traversal in them, and
+  // the keys on both sides still found as it goes.
+  mm_get_first_key(mm, &key);
+  for (int i = 0; i < 2000; i++) {
+    mm_get_next_key(mm, &key);
+  }
+  for (int i = 2999; i >= 1000; i--) {
+    if (mm_remove_key(mm, &numbers[i]) != 1 || mm_count_values(mm, &numbers[i - 1]) != 1 ||
+        mm_count_values(mm, &numbers[3000]) != 1) {
+      right = 0;
+    }
+  }
+  VERIFY_INT(1, right);
+  VERIFY_INT(1, mm_get_next_key(mm, &key));
+  VERIFY_INT(3000, *(int *)key);
+  VERIFY_INT(1, keys_in_order(mm, &count));
+  VERIFY_INT(2000, count);
+  VERIFY_INT(0, mm_count_values(mm, &numbers[2000]));
+  VERIFY_INT(1, mm_lower_bound(mm, &cursor, &numbers[1000], &key));
+  VERIFY_INT(3000, *(int *)key);
+
+  // the same from the other end, the rest of the way to the front.
+  for (int i = 999; i >= 1; i--) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  VERIFY_INT(1, keys_in_order(mm, &count));
+  VERIFY_INT(1001, count);
+  VERIFY_INT(1, mm_count_values(mm, &numbers[0]));
+  VERIFY_INT(1, mm_lower_bound(mm, &cursor, &numbers[1], &key));
+  VERIFY_INT(3000, *(int *)key);
+  VERIFY_INT(2 * 1001, mm_destroy(mm));
+}
+
+// every key is found, the keys in between aren't, and lower_bound agrees.
+static int finds_all(Multimap *mm, int numbers[], int n) {
+  MMCursor cursor;
+  void *key;
+  int right = 1;
+
+  for (int i = 0; i < n; i++) {
+    int between = numbers[i] + 1;
+    int present = mm_count_values(mm, &numbers[i]) > 0;
+    int found = mm_lower_bound(mm, &cursor, &between, &key);
+    if (present && (mm_count_values(mm, &between) != 0 ||
+                    (found > 0 && *(int *)key <= between))) {
+      right = 0;
+    }
+  }
+  return right;
+}
+
+void test_freeze()
+{
+  Multimap *mm;
+  static int numbers[2000];
+  MMCursor cursor;
+  void *key;
+  int count, missing = -7, big = 100000, right = 1;
+
+  printf("\n*** Freezing:\n\n");
+
+  // even keys, so every odd one falls in between.
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  VERIFY_INT(1, mm_frozen(mm));
+  VERIFY_INT(0, mm_freeze(mm, coarse_print));
+  VERIFY_INT(1, mm_frozen(mm));
+  VERIFY_INT(0, mm_lower_bound(mm, &cursor, &missing, &key));
+  for (int i = 0; i < 2000; i++) {
+    numbers[i] = 2 * i;
+    mm_insert_value(mm, &numbers[i], i, "x");
+  }
+  VERIFY_INT(0, mm_freeze(mm, coarse_print));
+  VERIFY_INT(1, mm_frozen(mm));
+  VERIFY_INT(0, mm_freeze(mm, coarse_print));
+  for (int i = 0; i < 2000; i++) {
+    if (mm_count_values(mm, &numbers[i]) != 1) {
+      right = 0;
+    }
+  }
+  VERIFY_INT(1, right);
+  VERIFY_INT(1, finds_all(mm, numbers, 2000));
+  VERIFY_INT(0, mm_count_values(mm, &missing));
+  VERIFY_INT(1, mm_lower_bound(mm, &cursor, &missing, &key));
+  VERIFY_INT(0, *(int *)key);
+  VERIFY_INT(0, mm_lower_bound(mm, &cursor, &big, &key));
+
+  // changes are still found while the layout is stale, and after freezing again.
+  for (int i = 0; i < 2000; i += 3) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  VERIFY_INT(1, keys_in_order(mm, &count));
+  VERIFY_INT(1333, count);
+  VERIFY_INT(0, mm_count_values(mm, &numbers[300]));
+  VERIFY_INT(1, finds_all(mm, numbers, 2000));
+  VERIFY_INT(0, mm_freeze(mm, coarse_print));
+  VERIFY_INT(1, mm_frozen(mm));
+  VERIFY_INT(0, mm_count_values(mm, &numbers[300]));
+  VERIFY_INT(1, mm_count_values(mm, &numbers[301]));
+  VERIFY_INT(1, finds_all(mm, numbers, 2000));
+  VERIFY_INT(1, mm_lower_bound(mm, &cursor, &numbers[0], &key));
+  VERIFY_INT(2, *(int *)key);
+  VERIFY_INT(1, mm_insert_value(mm, &numbers[300], 300, "x"));
+  VERIFY_INT(2, mm_insert_value(mm, &numbers[301], 301, "x"));
+  VERIFY_INT(1, mm_count_values(mm, &numbers[300]));
+  VERIFY_INT(2, mm_count_values(mm, &numbers[301]));
+  VERIFY_INT(0, mm_freeze(mm, coarse_print));
+  VERIFY_INT(1, mm_count_values(mm, &numbers[300]));
+  VERIFY_INT(1, finds_all(mm, numbers, 2000));
+
+  // emptied, then frozen with nothing in it.
+  for (int i = 0; i < 2000; i++) {
+    mm_remove_key(mm, &numbers[i]);
+  }
+  VERIFY_INT(0, mm_freeze(mm, coarse_print));
+  VERIFY_INT(0, mm_count_values(mm, &numbers[2]));
+  VERIFY_INT(0, mm_lower_bound(mm, &cursor, &missing, &key));
+  VERIFY_INT(1, mm_insert_value(mm, &numbers[2], 1, "x"));
+  VERIFY_INT(1, mm_count_values(mm, &numbers[2]));
+  VERIFY_INT(2, mm_destroy(mm));
+}
+
+// Adding keys when memory runs out part way: each add either works or
+// leaves the multimap as it was, whichever allocation fails.
+void test_out_of_memory()
+{
+  Multimap *mm;
+  static int numbers[6000];
+  static int added[6000];
+  int count, result, expected, right = 1;
+
+  printf("\n*** Running out of memory:\n\n");
+
+  // even keys in a mixed order, so the nodes are all different sizes
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  for (int i = 0; i < 6000; i++) {
+    numbers[i] = i;
+    added[i] = 0;
+  }
+  for (int i = 0; i < 3000; i++) {
+    int k = 2 * ((i * 7919) % 3000);
+    mm_insert_value(mm, &numbers[k], k, "x");
+    added[k] = 1;
+  }
+
+  // then the odd keys, with the first, second or third allocation failing
+  expected = 3000;
+  for (int i = 1; i < 6000; i += 2) {
+    Allocs_Left = i % 3;
+    result = mm_insert_value(mm, &numbers[i], i, "x");
+    Allocs_Left = -1;
+    if (1 == result) {
+      added[i] = 1;
+      expected++;
+    } else if (-1 != result) {
+      right = 0;
+    }
+    if (mm_count_keys(mm) != expected || mm_count_values(mm, &numbers[i]) != added[i]) {
+      right = 0;
+    }
+  }
+  VERIFY_INT(1, right);
+
+  for (int i = 0; i < 6000; i++) {
+    if (mm_count_values(mm, &numbers[i]) != added[i]) {
+      right = 0;
+    }
+  }
+  VERIFY_INT(1, right);
+  VERIFY_INT(1, keys_in_order(mm, &count));
+  VERIFY_INT(expected, count);
+  VERIFY_INT(2 * expected, mm_destroy(mm));
+}
+
 int main() {
   printf("*** Starting tests...\n");
   
@@ -675,6 +1585,15 @@ int main() {
   test_empty();
   test_edge();
   test_multiple();
+  test_value_order();
+  test_grow();
+  test_tombstones();
+  test_remove_backwards();
+  test_freeze();
+  test_out_of_memory();
+  test_pool();
+  test_bulk_load();
+  test_typed();
 #ifdef NDEBUG
   test_invalid();
 #endif
@@ -683,7 +1602,12 @@ int main() {
   test_get_simple();
   test_get_edge();
   test_get_move();
+  test_reclaim();
   test_get_multiple();
+  test_cursor();
+  test_for_each_value();
+  test_rekey();
+  test_lower_bound();
 #ifdef NDEBUG
   test_get_invalid();
 #endif
@@ -0,0 +1,543 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "a5_tests.h"
+#include "a5_multimap.h"
+
+// Stress tests for a multimap shared by many threads at once, for the
+// lock-free skiplist (multimap_skiplist.c). Each test starts the threads,
+// waits for them all, then checks what's left with one thread.
+
+#define THREADS 8
+#define KEYS_PER_THREAD 2000
+#define SHARED_KEYS 64
+#define VALUES_PER_THREAD 50
+
+/*** Comparison functions for keys and values ***/
+
+static int compare_ints(void *a, void *b) {
+  assert(NULL != a && NULL != b);
+  int *ia = a, *ib = b;
+  return *ia - *ib;
+}
+
+static int compare_values_num_part(void *a, void *b) {
+  assert(NULL != a && NULL != b);
+  Value *va = a, *vb = b;
+  return va->num - vb->num;
+}
+
+/*** Running threads ***/
+
+typedef struct WORK {
+  Multimap *mm;
+  int thread;
+  int *keys;
+  int problems; // what the thread saw go wrong, checked after it's joined
+  long done;    // operations that worked, for tests that count them
+} Work;
+
+static Work Works[THREADS + THREADS];
+static atomic_int Writers_Running;
+
+// Start count threads on run, each with its own Work, then wait for them all.
+static void run_threads(int count, void *(*run)(void *), Multimap *mm, int *keys) {
+  pthread_t threads[THREADS + THREADS];
+
+  assert(count <= THREADS + THREADS);
+  for (int i = 0; i < count; i++) {
+    Works[i].mm = mm;
+    Works[i].thread = i;
+    Works[i].keys = keys;
+    Works[i].problems = 0;
+    Works[i].done = 0;
+    pthread_create(&threads[i], NULL, run, &Works[i]);
+  }
+  for (int i = 0; i < count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+static int all_problems(int count) {
+  int problems = 0;
+  for (int i = 0; i < count; i++) {
+    problems += Works[i].problems;
+  }
+  return problems;
+}
+
+static long all_done(int count) {
+  long done = 0;
+  for (int i = 0; i < count; i++) {
+    done += Works[i].done;
+  }
+  return done;
+}
+
+// 1 if the keys are in order and each has its values in order; the number of
+// keys goes in *keys and of values in *values.
+static int in_order(Multimap *mm, int *keys, int *values) {
+  MMCursor cursor;
+  void *key;
+  int last = 0, first = 1, right = 1;
+  Value found[THREADS * VALUES_PER_THREAD];
+  int n;
+
+  *keys = 0;
+  *values = 0;
+  if (mm_cursor_first(mm, &cursor, &key) > 0) {
+    do {
+      if (!first && *(int *)key <= last) {
+        right = 0;
+      }
+      n = mm_get_values(mm, key, found, THREADS * VALUES_PER_THREAD);
+      if (n != mm_count_values(mm, key) || n <= 0) {
+        right = 0;
+      }
+      for (int i = 1; i < n; i++) {
+        if (found[i - 1].num > found[i].num) {
+          right = 0;
+        }
+      }
+      first = 0;
+      last = *(int *)key;
+      (*keys)++;
+      *values += n;
+    } while (mm_cursor_next(mm, &cursor, &key) > 0);
+  }
+  return right;
+}
+
+/*** Threads inserting their own keys ***/
+
+// each thread's keys are every THREADS-th number, so they're mixed together
+// all through the list, and their values go in backwards.
+static void *insert_own_keys(void *arg) {
+  Work *work = arg;
+
+  for (int i = 0; i < KEYS_PER_THREAD; i++) {
+    int *key = &work->keys[i * THREADS + work->thread];
+    for (int v = 2; v >= 0; v--) {
+      if (mm_insert_value(work->mm, key, v, "x") != 3 - v) {
+        work->problems++;
+      }
+    }
+  }
+  return NULL;
+}
+
+void test_own_keys() {
+  Multimap *mm;
+  static int keys[THREADS * KEYS_PER_THREAD];
+  int num_keys, num_values;
+
+  printf("\n*** Threads inserting their own keys:\n\n");
+
+  for (int i = 0; i < THREADS * KEYS_PER_THREAD; i++) {
+    keys[i] = i;
+  }
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  run_threads(THREADS, insert_own_keys, mm, keys);
+  VERIFY_INT(0, all_problems(THREADS));
+  VERIFY_INT(THREADS * KEYS_PER_THREAD, mm_count_keys(mm));
+  VERIFY_INT(1, in_order(mm, &num_keys, &num_values));
+  VERIFY_INT(THREADS * KEYS_PER_THREAD, num_keys);
+  VERIFY_INT(3 * THREADS * KEYS_PER_THREAD, num_values);
+  VERIFY_INT(4 * THREADS * KEYS_PER_THREAD, mm_destroy(mm));
+}
+
+/*** Threads adding values to the same keys ***/
+
+static void *insert_shared_keys(void *arg) {
+  Work *work = arg;
+
+  for (int v = 0; v < VALUES_PER_THREAD; v++) {
+    for (int i = 0; i < SHARED_KEYS; i++) {
+      // the values of all the threads interleave, so they go all over each chain
+      if (mm_insert_value(work->mm, &work->keys[i], v * THREADS + work->thread, "x") <= 0) {
+        work->problems++;
+      }
+    }
+  }
+  return NULL;
+}
+
+void test_shared_keys() {
+  Multimap *mm;
+  static int keys[SHARED_KEYS];
+  static Value values[THREADS * VALUES_PER_THREAD];
+  int num_keys, num_values, right = 1;
+  int extra = SHARED_KEYS;
+
+  printf("\n*** Threads adding values to the same keys:\n\n");
+
+  for (int i = 0; i < SHARED_KEYS; i++) {
+    keys[i] = i;
+  }
+  VERIFY_NOT_NULL(mm = mm_create(SHARED_KEYS, compare_ints, compare_values_num_part));
+  run_threads(THREADS, insert_shared_keys, mm, keys);
+  VERIFY_INT(0, all_problems(THREADS));
+  VERIFY_INT(SHARED_KEYS, mm_count_keys(mm));
+  VERIFY_INT(1, in_order(mm, &num_keys, &num_values));
+  VERIFY_INT(SHARED_KEYS * THREADS * VALUES_PER_THREAD, num_values);
+
+  // every value once, in order
+  for (int i = 0; i < SHARED_KEYS; i++) {
+    if (mm_get_values(mm, &keys[i], values, THREADS * VALUES_PER_THREAD) != THREADS * VALUES_PER_THREAD) {
+      right = 0;
+    }
+    for (int v = 0; v < THREADS * VALUES_PER_THREAD; v++) {
+      if (values[v].num != v) {
+        right = 0;
+      }
+    }
+  }
+  VERIFY_INT(1, right);
+
+  // a key too many
+  VERIFY_INT(-1, mm_insert_value(mm, &extra, 0, "x"));
+  VERIFY_INT(SHARED_KEYS * (1 + THREADS * VALUES_PER_THREAD), mm_destroy(mm));
+}
+
+/*** Readers going through the keys while writers change them ***/
+
+// each writer keeps adding and removing its own keys, ending with the odd
+// ones there, with two values each.
+static void *churn_keys(void *arg) {
+  Work *work = arg;
+
+  for (int round = 0; round < 5; round++) {
+    for (int i = 0; i < KEYS_PER_THREAD; i++) {
+      int *key = &work->keys[i * THREADS + work->thread];
+      mm_insert_value(work->mm, key, 1, "x");
+      mm_insert_value(work->mm, key, 0, "x");
+    }
+    for (int i = 0; i < KEYS_PER_THREAD; i += (round < 4) ? 1 : 2) {
+      if (mm_remove_key(work->mm, &work->keys[i * THREADS + work->thread]) != 2) {
+        work->problems++;
+      }
+    }
+  }
+  atomic_fetch_sub(&Writers_Running, 1);
+  return NULL;
+}
+
+// the keys a reader sees are always in order, and each one it looks up
+// either isn't there or has the values the writers give it.
+static void *read_keys(void *arg) {
+  Work *work = arg;
+  MMCursor cursor;
+  void *key;
+  Value values[2];
+  int last, count, from;
+
+  while (atomic_load(&Writers_Running) > 0) {
+    if (mm_cursor_first(work->mm, &cursor, &key) > 0) {
+      last = *(int *)key;
+      while (mm_cursor_next(work->mm, &cursor, &key) > 0) {
+        if (*(int *)key <= last) {
+          work->problems++;
+        }
+        last = *(int *)key;
+      }
+    }
+
+    from = (work->thread * 997) % (THREADS * KEYS_PER_THREAD);
+    if (mm_lower_bound(work->mm, &cursor, &work->keys[from], &key) > 0 && *(int *)key < from) {
+      work->problems++;
+    }
+    count = mm_get_values(work->mm, &work->keys[from], values, 2);
+    if (count < 0 || count > 2 || (count == 2 && values[0].num > values[1].num)) {
+      work->problems++;
+    }
+    count = mm_count_values(work->mm, &work->keys[from]);
+    if (count < 0 || count > 2) {
+      work->problems++;
+    }
+    work->done++;
+  }
+  return NULL;
+}
+
+static void *churn_or_read(void *arg) {
+  Work *work = arg;
+
+  if (work->thread < THREADS) {
+    return churn_keys(arg);
+  }
+  work->thread -= THREADS;
+  return read_keys(arg);
+}
+
+void test_readers_and_writers() {
+  Multimap *mm;
+  static int keys[THREADS * KEYS_PER_THREAD];
+  MMPoolStats stats;
+  int num_keys, num_values, right = 1;
+
+  printf("\n*** Readers going through the keys while writers change them:\n\n");
+
+  for (int i = 0; i < THREADS * KEYS_PER_THREAD; i++) {
+    keys[i] = i;
+  }
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  atomic_store(&Writers_Running, THREADS);
+  run_threads(THREADS + THREADS, churn_or_read, mm, keys);
+  VERIFY_INT(0, all_problems(THREADS + THREADS));
+  VERIFY_INT(1, all_done(THREADS + THREADS) > 0);
+
+  VERIFY_INT(THREADS * KEYS_PER_THREAD / 2, mm_count_keys(mm));
+  VERIFY_INT(1, in_order(mm, &num_keys, &num_values));
+  VERIFY_INT(THREADS * KEYS_PER_THREAD / 2, num_keys);
+  VERIFY_INT(THREADS * KEYS_PER_THREAD, num_values);
+  for (int i = 0; i < THREADS * KEYS_PER_THREAD; i++) {
+    // key i belongs to writer i % THREADS as its (i / THREADS)th key
+    if (mm_count_values(mm, &keys[i]) != (((i / THREADS) % 2 == 1) ? 2 : 0)) {
+      right = 0;
+    }
+  }
+  VERIFY_INT(1, right);
+
+  // with the threads done, the removed keys can be freed; the rest stay
+  VERIFY_INT(1, mm_reclaim(mm) > 0);
+  VERIFY_INT(0, mm_reclaim(mm));
+  // every key has one value past its first, and the removed keys' cells are free
+  VERIFY_INT(0, mm_pool_stats(mm, &stats));
+  VERIFY_INT(THREADS * KEYS_PER_THREAD / 2, stats.nodes_in_use);
+  VERIFY_INT(1, stats.nodes_free > 0);
+  VERIFY_INT(1, in_order(mm, &num_keys, &num_values));
+  VERIFY_INT(THREADS * KEYS_PER_THREAD / 2, num_keys);
+  VERIFY_INT(THREADS * KEYS_PER_THREAD, num_values);
+  VERIFY_INT(3 * THREADS * KEYS_PER_THREAD / 2, mm_destroy(mm));
+}
+
+/*** Threads removing and rekeying the same keys ***/
+
+// every thread tries to remove every key: only one gets its values.
+static void *remove_all(void *arg) {
+  Work *work = arg;
+  int count;
+
+  for (int i = 0; i < KEYS_PER_THREAD; i++) {
+    count = mm_remove_key(work->mm, &work->keys[(i + work->thread * 101) % KEYS_PER_THREAD]);
+    if (count < 0) {
+      work->problems++;
+    } else {
+      work->done += count;
+    }
+  }
+  return NULL;
+}
+
+// every thread tries to move every key k to k + KEYS_PER_THREAD: only one
+// moves it, the others find it gone (or find the new key already there).
+static void *rekey_all(void *arg) {
+  Work *work = arg;
+  int count;
+
+  for (int i = 0; i < KEYS_PER_THREAD; i++) {
+    int k = (i + work->thread * 101) % KEYS_PER_THREAD;
+    count = mm_rekey(work->mm, &work->keys[k], &work->keys[k + KEYS_PER_THREAD]);
+    if (count > 0) {
+      work->done += count;
+    }
+    if (count > 3 || mm_count_values(work->mm, &work->keys[k + KEYS_PER_THREAD]) < 0) {
+      work->problems++;
+    }
+  }
+  return NULL;
+}
+
+void test_same_keys() {
+  Multimap *mm;
+  static int keys[2 * KEYS_PER_THREAD];
+  int num_keys, num_values, right = 1;
+
+  printf("\n*** Threads removing and rekeying the same keys:\n\n");
+
+  for (int i = 0; i < 2 * KEYS_PER_THREAD; i++) {
+    keys[i] = i;
+  }
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  for (int i = 0; i < KEYS_PER_THREAD; i++) {
+    for (int v = 0; v < 3; v++) {
+      mm_insert_value(mm, &keys[i], v, "x");
+    }
+  }
+  run_threads(THREADS, rekey_all, mm, keys);
+  VERIFY_INT(0, all_problems(THREADS));
+  VERIFY_INT(3 * KEYS_PER_THREAD, all_done(THREADS));
+  VERIFY_INT(KEYS_PER_THREAD, mm_count_keys(mm));
+  VERIFY_INT(1, in_order(mm, &num_keys, &num_values));
+  VERIFY_INT(3 * KEYS_PER_THREAD, num_values);
+  for (int i = 0; i < KEYS_PER_THREAD; i++) {
+    if (mm_count_values(mm, &keys[i]) != 0 || mm_count_values(mm, &keys[i + KEYS_PER_THREAD]) != 3) {
+      right = 0;
+    }
+  }
+  VERIFY_INT(1, right);
+
+  run_threads(THREADS, remove_all, mm, keys + KEYS_PER_THREAD);
+  VERIFY_INT(0, all_problems(THREADS));
+  VERIFY_INT(3 * KEYS_PER_THREAD, all_done(THREADS));
+  VERIFY_INT(0, mm_count_keys(mm));
+  VERIFY_INT(0, mm_destroy(mm));
+}
+
+/*** Threads adding values to keys as they are rekeyed ***/
+
+static int Rekeyed[KEYS_PER_THREAD];
+
+// the first half of the threads move their keys k to k + KEYS_PER_THREAD,
+// while the other half add a value to k + KEYS_PER_THREAD: an insert that
+// meets the key halfway there finishes the move itself and adds to it.
+static void *rekey_or_insert(void *arg) {
+  Work *work = arg;
+  int half = work->thread % (THREADS / 2);
+
+  for (int k = half; k < KEYS_PER_THREAD; k += THREADS / 2) {
+    if (work->thread < THREADS / 2) {
+      Rekeyed[k] = mm_rekey(work->mm, &work->keys[k], &work->keys[k + KEYS_PER_THREAD]);
+    } else if (mm_insert_value(work->mm, &work->keys[k + KEYS_PER_THREAD], 3, "x") <= 0) {
+      work->problems++;
+    }
+  }
+  return NULL;
+}
+
+void test_insert_while_rekeying() {
+  Multimap *mm;
+  static int keys[2 * KEYS_PER_THREAD];
+  int num_keys, num_values, moved = 0, right = 1;
+
+  printf("\n*** Threads adding values to keys as they are rekeyed:\n\n");
+
+  for (int i = 0; i < 2 * KEYS_PER_THREAD; i++) {
+    keys[i] = i;
+  }
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints, compare_values_num_part));
+  for (int i = 0; i < KEYS_PER_THREAD; i++) {
+    for (int v = 0; v < 3; v++) {
+      mm_insert_value(mm, &keys[i], v, "x");
+    }
+  }
+  run_threads(THREADS, rekey_or_insert, mm, keys);
+  VERIFY_INT(0, all_problems(THREADS));
+
+  // either the value went to the key after it moved, or it made the new key
+  // first and the rekey failed.
+  for (int k = 0; k < KEYS_PER_THREAD; k++) {
+    if (3 == Rekeyed[k]) {
+      moved++;
+      right = right && 0 == mm_count_values(mm, &keys[k]) &&
+              4 == mm_count_values(mm, &keys[k + KEYS_PER_THREAD]);
+    } else {
+      right = right && -1 == Rekeyed[k] && 3 == mm_count_values(mm, &keys[k]) &&
+              1 == mm_count_values(mm, &keys[k + KEYS_PER_THREAD]);
+    }
+  }
+  VERIFY_INT(1, right);
+  VERIFY_INT(2 * KEYS_PER_THREAD - moved, mm_count_keys(mm));
+  VERIFY_INT(1, in_order(mm, &num_keys, &num_values));
+  VERIFY_INT(2 * KEYS_PER_THREAD - moved, num_keys);
+  VERIFY_INT(4 * KEYS_PER_THREAD, num_values);
+  VERIFY_INT(6 * KEYS_PER_THREAD - moved, mm_destroy(mm));
+}
+
+/*** Two rekeys of the same key, one overtaking the other ***/
+
+// the thread that sets Pausing stops the first time it compares a key with
+// Pause_Key, until Gate opens: that's inside mm_rekey, after it found the
+// key and before its new key goes in.
+static _Thread_local int Pausing;
+static void *Pause_Key;
+static atomic_int Paused;
+static atomic_int Gate;
+
+static int compare_ints_pausing(void *a, void *b) {
+  if (Pausing && (a == Pause_Key || b == Pause_Key)) {
+    Pausing = 0;
+    atomic_store(&Paused, 1);
+    while (!atomic_load(&Gate)) {
+      sched_yield();
+    }
+  }
+  return compare_ints(a, b);
+}
+
+static int Slow_Rekeyed;
+
+static void *rekey_slowly(void *arg) {
+  Work *work = arg;
+
+  Pausing = 1;
+  Slow_Rekeyed = mm_rekey(work->mm, &work->keys[0], &work->keys[1]);
+  return NULL;
+}
+
+void test_rekey_overtaken() {
+  Multimap *mm;
+  static int keys[3] = {10, 20, 30};
+  pthread_t thread;
+  int num_keys, num_values;
+
+  printf("\n*** Two rekeys of the same key, one overtaking the other:\n\n");
+
+  VERIFY_NOT_NULL(mm = mm_create(MM_NO_MAX_KEYS, compare_ints_pausing, compare_values_num_part));
+  mm_insert_value(mm, &keys[0], 0, "x");
+  mm_insert_value(mm, &keys[0], 1, "x");
+  Works[0].mm = mm;
+  Works[0].keys = keys;
+  Pause_Key = &keys[1];
+  atomic_store(&Paused, 0);
+  atomic_store(&Gate, 0);
+
+  // 10 -> 20 stops halfway, 10 -> 30 goes all the way, then 10 -> 20 goes on:
+  // 10 isn't there any more, so it must not get the values too.
+  pthread_create(&thread, NULL, rekey_slowly, &Works[0]);
+  while (!atomic_load(&Paused)) {
+    sched_yield();
+  }
+  VERIFY_INT(2, mm_rekey(mm, &keys[0], &keys[2]));
+  atomic_store(&Gate, 1);
+  pthread_join(thread, NULL);
+  VERIFY_INT(0, Slow_Rekeyed);
+
+  VERIFY_INT(1, mm_count_keys(mm));
+  VERIFY_INT(1, in_order(mm, &num_keys, &num_values));
+  VERIFY_INT(1, num_keys);
+  VERIFY_INT(2, num_values);
+  VERIFY_INT(0, mm_count_values(mm, &keys[0]));
+  VERIFY_INT(0, mm_count_values(mm, &keys[1]));
+  VERIFY_INT(2, mm_count_values(mm, &keys[2]));
+  // the values aren't shared with a key that's gone
+  VERIFY_INT(1, mm_insert_value(mm, &keys[1], 2, "x"));
+  VERIFY_INT(2, mm_count_values(mm, &keys[2]));
+  VERIFY_INT(1, mm_reclaim(mm) > 0);
+  VERIFY_INT(5, mm_destroy(mm));
+}
+
+int main() {
+  printf("*** Starting tests...\n");
+
+  test_own_keys();
+  test_shared_keys();
+  test_readers_and_writers();
+  test_same_keys();
+  test_insert_while_rekeying();
+  test_rekey_overtaken();
+
+  if (0 == Tests_Failed) {
+    printf("\nAll %d tests passed.\n", Tests_Passed);
+  } else {
+    printf("\nFAILED %d of %d tests.\n", Tests_Failed, Tests_Failed + Tests_Passed);
+  }
+
+  printf("\n*** Tests complete.\n");
+  return 0;
+}
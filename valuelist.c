@@ -0,0 +1,341 @@
+/**
+ * valuelist.c
+ *
+ * PURPOSE: To keep the ordered values of a multimap key
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "a5_valuelist.h"
+
+// the number of nodes allocated at once.
+#define SLAB_NODES 64
+
+struct VALUE_NODE {
+  Value value;
+  struct VALUE_NODE *next; // the next value, or the next free node when it's in the free list
+};
+
+typedef struct SLAB {
+  struct SLAB *next;
+  ValueNode nodes[SLAB_NODES];
+} Slab;
+
+struct VALUE_POOL {
+  Slab *slabs;
+  ValueNode *free_nodes;
+  int num_slabs;
+  int nodes_in_use;
+  int nodes_free;
+};
+
+static ValueNode *take_node(ValuePool *pool);
+static void merge_sort(MMEntry entries[], MMEntry spare[], int count, Compare compare_keys);
+
+ValuePool *vp_create(void)
+{
+  ValuePool *pool = malloc(sizeof(ValuePool));
+
+  if (NULL != pool) {
+    pool->slabs = NULL;
+    pool->free_nodes = NULL;
+    pool->num_slabs = 0;
+    pool->nodes_in_use = 0;
+    pool->nodes_free = 0;
+  }
+  return pool;
+}
+
+void vp_destroy(ValuePool *pool)
+{
+  Slab *slab, *next;
+
+  if (NULL != pool) {
+    for (slab = pool->slabs; NULL != slab; slab = next) {
+      next = slab->next;
+      free(slab);
+    }
+    free(pool);
+  }
+}
+
+void vp_stats(ValuePool *pool, MMPoolStats *stats)
+{
+  assert(NULL != pool);
+  assert(NULL != stats);
+
+  stats->slabs = pool->num_slabs;
+  stats->nodes_in_use = pool->nodes_in_use;
+  stats->nodes_free = pool->nodes_free;
+}
+
+void vl_init(ValueList *list)
+{
+  assert(NULL != list);
+
+  list->num_values = 0;
+  list->rest = NULL;
+  list->tail = NULL;
+}
+
+int vl_insert(ValueList *list, ValuePool *pool, Compare compare_values, Value value)
+{
+  assert(NULL != list);
+  assert(NULL != pool);
+  assert(NULL != compare_values);
+
+  ValueNode *node, *curr, *prev;
+  Value *last;
+
+  if (0 == list->num_values) {
+    list->first = value;
+    list->num_values++;
+    return list->num_values;
+  }
+
+  node = take_node(pool);
+  if (NULL == node) {
+    return -1;
+  }
+  node->value = value;
+
+  last = (NULL != list->tail) ? &list->tail->value : &list->first;
+
+  if (compare_values(&value, last) > 0) {
+    // goes after all the others, the usual case for chunks added in order
+    node->next = NULL;
+    if (NULL == list->tail) {
+      list->rest = node;
+    } else {
+      list->tail->next = node;
+    }
+    list->tail = node;
+  } else if (compare_values(&value, &list->first) <= 0) {
+    // goes first, so the old first value moves into the list
+    node->value = list->first;
+    list->first = value;
+    node->next = list->rest;
+    list->rest = node;
+    if (NULL == list->tail) {
+      list->tail = node;
+    }
+  } else {
+    // somewhere in the list, but never after the tail
+    curr = list->rest;
+    prev = NULL;
+    while (NULL != curr && compare_values(&value, &curr->value) > 0) {
+      prev = curr;
+      curr = curr->next;
+    }
+    assert(NULL != curr);
+
+    node->next = curr;
+    if (NULL == prev) {
+      list->rest = node;
+    } else {
+      prev->next = node;
+    }
+  }
+
+  list->num_values++;
+
+  return list->num_values;
+}
+
+int vl_get(ValueList *list, Value values[], int max_values)
+{
+  assert(NULL != list);
+  assert(NULL != values);
+
+  int count = 0;
+  ValueNode *node = list->rest;
+
+  if (list->num_values > 0 && count < max_values) {
+    values[count] = list->first;
+    count++;
+  }
+  while (NULL != node && count < max_values) {
+    values[count] = node->value;
+    count++;
+    node = node->next;
+  }
+
+  return count;
+}
+
+int vl_for_each(ValueList *list, MMValueVisit visit, void *arg)
+{
+  assert(NULL != list);
+  assert(NULL != visit);
+
+  int count = 0;
+  ValueNode *node = list->rest;
+
+  if (list->num_values > 0) {
+    count++;
+    if (visit(&list->first, arg) != 0) {
+      return count;
+    }
+  }
+  while (NULL != node) {
+    count++;
+    if (visit(&node->value, arg) != 0) {
+      break;
+    }
+    node = node->next;
+  }
+
+  return count;
+}
+
+int vl_clear(ValueList *list, ValuePool *pool)
+{
+  assert(NULL != list);
+  assert(NULL != pool);
+
+  int count = list->num_values;
+
+  // the whole list goes on the front of the free list at once
+  if (NULL != list->rest) {
+    list->tail->next = pool->free_nodes;
+    pool->free_nodes = list->rest;
+    pool->nodes_in_use -= count - 1;
+    pool->nodes_free += count - 1;
+  }
+  vl_init(list);
+
+  return count;
+}
+
+void vl_print(ValueList *list)
+{
+  assert(NULL != list);
+
+  ValueNode *node = list->rest;
+
+  if (list->num_values > 0) {
+    printf(" %9d '%p'\n", list->first.num, list->first.data);
+  }
+  while (NULL != node) {
+    printf(" %9d '%p'\n", node->value.num, node->value.data);
+    node = node->next;
+  }
+}
+
+int vl_insert_entry(ValueList *list, ValuePool *pool, Compare compare_values, MMEntry *entry)
+{
+  assert(NULL != entry);
+
+  for (int i = 0; i < entry->num_values; i++) {
+    if (vl_insert(list, pool, compare_values, entry->values[i]) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int mm_sort_entries(MMEntry entries[], int num_entries, Compare compare_keys)
+{
+  assert(NULL != entries || 0 == num_entries);
+
+  MMEntry *spare;
+  int sorted = 1;
+
+  for (int i = 1; i < num_entries && sorted; i++) {
+    sorted = compare_keys(entries[i-1].key, entries[i].key) <= 0;
+  }
+  if (sorted) {
+    return 0;
+  }
+
+  spare = malloc(num_entries * sizeof(MMEntry));
+  if (NULL == spare) {
+    return -1;
+  }
+  merge_sort(entries, spare, num_entries, compare_keys);
+  free(spare);
+
+  return 0;
+}
+
+// qsort can't pass compare_keys along, so the entries are merge sorted.
+static void merge_sort(MMEntry entries[], MMEntry spare[], int count, Compare compare_keys)
+{
+  int half = count / 2;
+  int i = 0, j = half, k = 0;
+
+  if (count < 2) {
+    return;
+  }
+  merge_sort(entries, spare, half, compare_keys);
+  merge_sort(&entries[half], spare, count - half, compare_keys);
+
+  while (i < half && j < count) {
+    if (compare_keys(entries[j].key, entries[i].key) < 0) {
+      spare[k++] = entries[j++];
+    } else {
+      spare[k++] = entries[i++];
+    }
+  }
+  while (i < half) {
+    spare[k++] = entries[i++];
+  }
+  while (j < count) {
+    spare[k++] = entries[j++];
+  }
+  memcpy(entries, spare, count * sizeof(MMEntry));
+}
+
+// a node off the free list, allocating a new slab when it's empty.
+static ValueNode *take_node(ValuePool *pool)
+{
+  ValueNode *node;
+  Slab *slab;
+
+  if (NULL == pool->free_nodes) {
+    slab = malloc(sizeof(Slab));
+    if (NULL == slab) {
+      return NULL;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->num_slabs++;
+    for (int i = 0; i < SLAB_NODES; i++) {
+      slab->nodes[i].next = (i + 1 < SLAB_NODES) ? &slab->nodes[i + 1] : NULL;
+    }
+    pool->free_nodes = &slab->nodes[0];
+    pool->nodes_free += SLAB_NODES;
+  }
+
+  node = pool->free_nodes;
+  pool->free_nodes = node->next;
+  pool->nodes_free--;
+  pool->nodes_in_use++;
+
+  return node;
+}
+
+#ifndef NDEBUG
+int vl_validate(ValueList *list)
+{
+  assert(NULL != list);
+  assert(list->num_values >= 0);
+  assert((list->num_values > 1) == (NULL != list->rest));
+
+  ValueNode *curr = list->rest, *prev = NULL;
+  int count = (list->num_values > 0) ? 1 : 0;
+
+  while (NULL != curr) {
+    count++;
+    prev = curr;
+    curr = curr->next;
+  }
+  assert(count == list->num_values);
+  assert(prev == list->tail);
+
+  return 1;
+}
+#endif
@@ -0,0 +1,71 @@
+#ifndef _A5_VALUELIST
+#define _A5_VALUELIST
+
+#include "a5_multimap.h"
+
+// The values of one multimap key, shared by the multimap implementations.
+// The first value is kept in place, so a key with one value needs no node,
+// and the others are in a list with a tail pointer, so values coming in
+// order are added without walking the list.
+
+typedef struct VALUE_NODE ValueNode;
+
+// The nodes come from a pool owned by the multimap: they are allocated a
+// slab at a time, go back to the pool's free list when a key is removed,
+// and are only freed, slab by slab, when the pool is destroyed.
+typedef struct VALUE_POOL ValuePool;
+
+typedef struct VALUE_LIST {
+  int num_values;
+  Value first;
+  ValueNode *rest;
+  ValueNode *tail;
+} ValueList;
+
+// Create an empty pool. Return NULL on error.
+ValuePool *vp_create(void);
+
+// Free every slab of the pool at once, and with them the nodes of every list
+// that used it.
+void vp_destroy(ValuePool *pool);
+
+// Fill in the number of slabs allocated, the nodes holding values and the
+// nodes on the free list.
+void vp_stats(ValuePool *pool, MMPoolStats *stats);
+
+// Make the list empty, without freeing anything.
+void vl_init(ValueList *list);
+
+// Add a value in the order given by compare_values (which is passed the
+// Value structs). Return the number of values after adding it, or -1 if
+// memory runs out.
+int vl_insert(ValueList *list, ValuePool *pool, Compare compare_values, Value value);
+
+// Copy up to max_values values, in order. Return the number copied.
+int vl_get(ValueList *list, Value values[], int max_values);
+
+// Call visit on each value, in order, until it returns non-zero. Return the
+// number of values visited.
+int vl_for_each(ValueList *list, MMValueVisit visit, void *arg);
+
+// Give the list's nodes back to the pool and make it empty. Return the number
+// of values it had.
+int vl_clear(ValueList *list, ValuePool *pool);
+
+// Print the values, one per line.
+void vl_print(ValueList *list);
+
+// Sort bulk load entries by key (stable, so a repeated key keeps its values
+// in the order given). Return 0 on success, -1 if memory runs out.
+int mm_sort_entries(MMEntry entries[], int num_entries, Compare compare_keys);
+
+// Add all the values of an entry to the list. Return 0 on success, -1 if
+// memory runs out.
+int vl_insert_entry(ValueList *list, ValuePool *pool, Compare compare_values, MMEntry *entry);
+
+#ifndef NDEBUG
+// Check the list is put together right (for use in asserts), always returns 1.
+int vl_validate(ValueList *list);
+#endif
+
+#endif